@@ -27,6 +27,16 @@ public:
     const TCHAR* GetAuthToken() const;
     int GetSyncIntervalSeconds() const;
     bool IsOfflineModeEnabled() const;
+    int GetSyncBatchMaxOperations() const;
+    int GetSyncBatchMaxKB() const;
+    int GetSyncPipelineDepth() const;
+    int GetJournalCommitWindowMs() const;
+    int GetJournalCommitMaxRecords() const;
+    int GetJournalCompactGarbagePercent() const;
+    int GetJournalCompactSliceMs() const;
+    int GetJournalRetentionMaxKB() const;
+    int GetJournalRetentionMaxAgeHours() const;
+    int GetJournalRetentionPendingFloorKB() const;
 
     // Configuration mutators
     void SetApiBaseUrl(const TCHAR* url);
@@ -34,6 +44,16 @@ public:
     void SetAuthToken(const TCHAR* token);
     void SetSyncIntervalSeconds(int seconds);
     void SetOfflineModeEnabled(bool enabled);
+    void SetSyncBatchMaxOperations(int operations);
+    void SetSyncBatchMaxKB(int kilobytes);
+    void SetSyncPipelineDepth(int depth);
+    void SetJournalCommitWindowMs(int milliseconds);
+    void SetJournalCommitMaxRecords(int records);
+    void SetJournalCompactGarbagePercent(int percent);
+    void SetJournalCompactSliceMs(int milliseconds);
+    void SetJournalRetentionMaxKB(int kilobytes);
+    void SetJournalRetentionMaxAgeHours(int hours);
+    void SetJournalRetentionPendingFloorKB(int kilobytes);
 
 private:
     TCHAR* m_apiBaseUrl;
@@ -41,6 +61,16 @@ private:
     TCHAR* m_authToken;
     int m_syncIntervalSeconds;
     bool m_offlineModeEnabled;
+    int m_syncBatchMaxOperations;
+    int m_syncBatchMaxKB;
+    int m_syncPipelineDepth;
+    int m_journalCommitWindowMs;
+    int m_journalCommitMaxRecords;
+    int m_journalCompactGarbagePercent;
+    int m_journalCompactSliceMs;
+    int m_journalRetentionMaxKB;
+    int m_journalRetentionMaxAgeHours;
+    int m_journalRetentionPendingFloorKB;
 
     // Helper methods
     void InitDefaults();
@@ -0,0 +1,94 @@
+#ifndef CONNECTIVITYMONITOR_HPP
+#define CONNECTIVITYMONITOR_HPP
+
+#include <windows.h>
+#include <winsock.h>
+
+namespace HBX {
+
+class HbClient;
+
+/**
+ * Cached view of whether the HomeBox server can be reached
+ * A probe resolves the server's host name. Its result is kept for a
+ * while, so asking is cheap; a stale answer is refreshed by a probe
+ * thread rather than by the caller. Failed requests feed a circuit
+ * breaker: once it opens, callers are told the server is unreachable
+ * without trying, and only probes, backed off exponentially with jitter,
+ * go out until one succeeds. After that, the next request decides
+ * whether the circuit closes or opens again with a longer backoff.
+ */
+class ConnectivityMonitor {
+public:
+    enum {
+        ONLINE_TTL_MS = 30000,      // How long a good result is trusted
+        PROBE_MIN_MS = 5000,        // First probe after the circuit opens
+        PROBE_MAX_MS = 120000,      // Longest wait between probes
+        FAILURE_THRESHOLD = 3       // Failed requests in a row that open it
+    };
+
+    enum CircuitState {
+        CIRCUIT_CLOSED,             // Requests go out
+        CIRCUIT_OPEN,               // Only probes go out
+        CIRCUIT_HALF_OPEN           // A probe succeeded; one request decides
+    };
+
+    // Runs on the thread that saw the change, when requests may go out
+    // again (true) or the circuit has opened (false)
+    typedef void (*ChangeCallback)(bool available, void* userData);
+
+    explicit ConnectivityMonitor(HbClient* hbClient);
+    ~ConnectivityMonitor();
+
+    // Without the probe thread, stale results are refreshed by the caller
+    bool Start(ChangeCallback callback, void* userData);
+    void Stop();
+
+    // Last known state, assumed up until the first probe; with the probe
+    // thread running this never waits for the network
+    bool IsOnline();
+    // For threads that may block: false at once while the circuit is open
+    // and no probe is due, otherwise probes if the last result is stale
+    bool Check();
+    // Probes soon, even while backing off
+    void Refresh();
+
+    // Outcome of requests to the server
+    void ReportSuccess();
+    void ReportFailure();
+
+    CircuitState GetCircuitState() const;
+
+private:
+    HbClient* m_hbClient;
+    CRITICAL_SECTION m_lock;
+    CircuitState m_state;
+    bool m_online;
+    bool m_checked;             // m_checkTime is set
+    DWORD m_checkTime;
+    DWORD m_failures;           // Failed requests in a row
+    DWORD m_openCount;          // Openings since the last success
+    DWORD m_nextProbeTime;      // While open
+    bool m_probeRequested;
+    bool m_probing;             // Only one probe at a time
+    DWORD m_random;
+    ChangeCallback m_callback;
+    void* m_userData;
+    HANDLE m_probeThread;
+    HANDLE m_wakeEvent;
+    HANDLE m_stopEvent;
+    bool m_winsockStarted;
+
+    bool Probe();
+    void OnProbed(bool reachable);
+    void Open(DWORD now);
+    DWORD GetBackoffMs();
+    DWORD GetProbeWaitMs(DWORD now) const;
+    bool IsFresh(DWORD now) const;
+    void Notify(bool available);
+    static DWORD WINAPI ProbeThread(LPVOID param);
+};
+
+} // namespace HBX
+
+#endif // CONNECTIVITYMONITOR_HPP
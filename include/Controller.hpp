@@ -10,6 +10,15 @@
 
 namespace HBX {
 
+// Posted to the main window when queued transactions reach flash
+// (wParam: last ticket, lParam: nonzero on success)
+const UINT WM_JOURNAL_COMMITTED = WM_APP + 1;
+
+// Posted to the main window by the background sync
+// (wParam: SyncEngine::SyncEvent, lParam: transactions handled so far,
+// or still pending once finished)
+const UINT WM_SYNC_STATUS = WM_APP + 2;
+
 /**
  * Main application controller
  * Orchestrates the application flow and coordinates between components
@@ -47,11 +56,14 @@ public:
     void OnScanReceived(const TCHAR* barcode);
     void OnSyncRequested();
     void OnConfigChanged();
+    void OnJournalCommitted(DWORD ticket, bool success);
+    void OnSyncStatus(SyncEngine::SyncEvent event, DWORD value);
 
 private:
     HINSTANCE m_hInstance;
     HWND m_mainWindow;
     AppState m_state;
+    DWORD m_syncProgress;
 
     // Core components
     Config* m_config;
@@ -67,6 +79,12 @@ private:
 
     // Window procedure
     static LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+
+    // Journal writer callback (runs on the writer thread)
+    static void JournalCommitted(DWORD ticket, bool success, void* userData);
+
+    // Background sync callback (runs on the sync worker)
+    static void SyncStatusChanged(SyncEngine::SyncEvent event, DWORD value, void* userData);
 };
 
 } // namespace HBX
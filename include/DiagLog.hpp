@@ -0,0 +1,55 @@
+#ifndef DIAGLOG_HPP
+#define DIAGLOG_HPP
+
+#include <windows.h>
+#include "JournalFormat.hpp"
+
+namespace HBX {
+
+/**
+ * Fixed-size diagnostic log for INFO and ERROR messages
+ * Kept apart from the transaction journal so diagnostics never grow the
+ * queue or slow down its scans. The file is a ring of fixed slots (see
+ * JournalFormat) that overwrites its oldest entries. Entries are buffered
+ * in memory and written when the buffer fills; an ERROR is written and
+ * flushed at once, taking the buffered entries with it.
+ * Not thread-safe; Journal serialises access.
+ */
+class DiagLog {
+public:
+    enum {
+        SLOT_COUNT = 256,       // 64 KB on flash
+        BUFFER_SLOTS = 16
+    };
+
+    DiagLog();
+    ~DiagLog();
+
+    bool Open(const TCHAR* path);
+    void Close();
+
+    // The payload is UTF-8; it is cut at a character boundary to fit a slot
+    bool Write(WORD recordType, ULONGLONG timestamp, const BYTE* payload, DWORD length);
+    bool Flush();
+
+    // Clears entries older than cutoff (ms since 1970-01-01 UTC), oldest
+    // first, stopping at the first newer one
+    bool Expire(ULONGLONG cutoff);
+
+private:
+    HANDLE m_file;
+    BYTE* m_buffer;
+    DWORD m_bufferedSlots;
+    DWORD m_firstSlot;          // Slot of the first buffered entry
+    DWORD m_nextSlot;
+    ULONGLONG m_nextSequence;
+
+    bool FindNewest();
+    bool ExpireRange(DWORD first, DWORD end, ULONGLONG cutoff, bool* done);
+    bool WriteSlots();
+    bool WriteAt(DWORD slot, const BYTE* data, DWORD count);
+};
+
+} // namespace HBX
+
+#endif // DIAGLOG_HPP
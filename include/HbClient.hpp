@@ -3,6 +3,7 @@
 
 #include <windows.h>
 #include "HttpClient.hpp"
+#include "SyncBatch.hpp"
 #include "Models/Item.hpp"
 #include "Models/Location.hpp"
 
@@ -14,6 +15,10 @@ namespace HBX {
  */
 class HbClient {
 public:
+    enum {
+        MAX_CONNECTIONS = 8
+    };
+
     HbClient();
     ~HbClient();
 
@@ -23,31 +28,57 @@ public:
     void Logout();
 
     // Item operations
-    bool GetItem(const TCHAR* barcode, Models::Item* item);
-    bool UpdateItemLocation(const TCHAR* barcode, const TCHAR* locationId);
-    bool CreateItem(const Models::Item* item);
-    bool UpdateItem(const Models::Item* item);
+    // A change sent with a request key goes out with an Idempotency-Key
+    // header made of the device ID and the key, so the server applies it
+    // once however often it is sent. The same key must always carry the
+    // same change. status, when given, receives the HTTP status, 0 if
+    // the request got no response; it is left alone if nothing was sent.
+    // GetItem reads the item's version with it. UpdateItem sends the item
+    // on condition the server is still at that version (If-Match) and
+    // fails with status 412 if it has moved on; an item with no version
+    // is sent unconditionally
+    bool GetItem(const TCHAR* barcode, Models::Item* item, int* status = NULL);
+    bool UpdateItemLocation(const TCHAR* barcode, const TCHAR* locationId, const TCHAR* requestKey = NULL, int* status = NULL);
+    bool CreateItem(const Models::Item* item, const TCHAR* requestKey = NULL, int* status = NULL);
+    bool UpdateItem(const Models::Item* item, const TCHAR* requestKey = NULL, int* status = NULL);
 
     // Location operations
     bool GetLocation(const TCHAR* locationId, Models::Location* location);
     bool GetAllLocations(Models::Location** locations, int* count);
 
     // Sync operations
-    bool SyncPendingTransactions();
+    // Posts a batch to /api/v1/sync under the authenticated device ID and
+    // records the per-operation results in it; false if the request failed.
+    // The server skips transactions it applied before, so a batch can be
+    // sent again as it is. status as for the item operations
+    bool SyncPendingTransactions(SyncBatch* batch, int* status = NULL);
 
     // Configuration
     void SetBaseUrl(const TCHAR* baseUrl);
     const TCHAR* GetBaseUrl() const;
 
+    // Requests from different threads run side by side on up to count
+    // connections (default 1); further ones wait for a connection
+    void SetMaxConnections(int count);
+
 private:
-    HttpClient* m_httpClient;
+    HttpClient* m_connections[MAX_CONNECTIONS];
+    bool m_connectionBusy[MAX_CONNECTIONS];
+    int m_connectionCount;
+    CRITICAL_SECTION m_connectionLock;
+    HANDLE m_connectionFreeEvent;
     TCHAR* m_baseUrl;
     TCHAR* m_authToken;
+    TCHAR* m_deviceId;
     bool m_authenticated;
 
     // Helper methods
-    bool MakeApiRequest(const TCHAR* method, const TCHAR* endpoint, const TCHAR* body, TCHAR* response, DWORD maxResponseLen);
-    void SetAuthHeaders();
+    bool MakeApiRequest(const TCHAR* method, const TCHAR* endpoint, const TCHAR* body, TCHAR* response, DWORD maxResponseLen,
+                        const TCHAR* requestKey = NULL, int* status = NULL,
+                        const TCHAR* ifMatch = NULL, TCHAR* etag = NULL);
+    HttpClient* AcquireConnection();
+    void ReleaseConnection(HttpClient* connection);
+    void SetAuthHeaders(HttpClient* connection);
 };
 
 } // namespace HBX
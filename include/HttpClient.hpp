@@ -8,10 +8,19 @@ namespace HBX {
 
 /**
  * HTTP client for Windows Mobile
- * Provides low-level HTTP communication using WinSock
+ * Provides low-level HTTP communication using WinSock. The connection
+ * is kept open between requests to the same server and reused until it
+ * has been idle too long, or the server closes it; a request that finds
+ * it closed goes out again on a new one.
  */
 class HttpClient {
 public:
+    enum {
+        RECV_BUFFER_SIZE = 32768,   // Largest response read, headers included
+        ETAG_CHARS = 64,            // Longest version kept from an ETag
+        KEEP_ALIVE_IDLE_MS = 30000  // Longest a connection is reused after; less if the server says so
+    };
+
     HttpClient();
     ~HttpClient();
 
@@ -24,10 +33,15 @@ public:
     // Configuration
     void SetTimeout(DWORD timeoutMs);
     void SetHeader(const TCHAR* key, const TCHAR* value);
+    void ClearHeaders();
 
-    // Status
+    // Status; 0 when the last request got no response
     int GetLastHttpStatusCode() const;
     const TCHAR* GetLastError() const;
+    // The last response's ETag, unquoted; empty if it had none
+    const TCHAR* GetLastETag() const;
+    // Connections opened so far, for diagnostics
+    DWORD GetConnectionCount() const;
 
 private:
     // Header storage structure
@@ -42,15 +56,26 @@ private:
     int m_lastStatusCode;
     TCHAR* m_lastError;
     HttpHeader* m_headers;
+    TCHAR m_lastETag[ETAG_CHARS];
+
+    // The open connection's server, and when it last finished a request
+    TCHAR m_connectedHost[256];
+    int m_connectedPort;
+    DWORD m_lastUsed;
+    DWORD m_idleLimitMs;
+    DWORD m_connectionCount;
 
     // Internal request handling
     bool SendRequest(const TCHAR* method, const TCHAR* url, const TCHAR* body, TCHAR* response, DWORD maxResponseLen);
+    bool SendAll(const char* data, int length);
+    bool SendBody(const TCHAR* body, int bodyLen);
+    bool ReceiveResponse(char* buffer, int size, int* received, int* bodyStart, int* bodyLength, bool* keepAlive);
+    bool IsReusable(const TCHAR* host, int port);
     bool Connect(const TCHAR* host, int port);
     void Disconnect();
     bool ParseUrl(const TCHAR* url, TCHAR* host, int* port, TCHAR* path);
 
     // Header management
-    void ClearHeaders();
     void BuildHeaderString(char* buffer, int maxLen);
 };
 
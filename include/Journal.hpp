@@ -2,43 +2,380 @@
 #define JOURNAL_HPP
 
 #include <windows.h>
+#include "JournalFormat.hpp"
+#include "JournalIndex.hpp"
+#include "JournalManifest.hpp"
+#include "DiagLog.hpp"
+#include "TransactionRing.hpp"
 
 namespace HBX {
 
 /**
  * Transaction journal for audit trail and recovery
- * Logs all operations to persistent storage
+ * Logs all operations to persistent storage as length-prefixed,
+ * CRC-checked binary records (see JournalFormat). Records go to rolling
+ * segment files listed in a manifest (see JournalManifest). Unsynced
+ * transactions are tracked in memory (see JournalIndex) so sync reads
+ * only those; QueryCursor looks transactions up by type, item and time.
+ * INFO and ERROR messages go to a separate fixed-size log (see DiagLog)
+ * and never into the segments.
  */
 class Journal {
 public:
+    // Called on the writer thread once the queued transactions up to
+    // ticket have been written and flushed (or failed to be)
+    typedef void (*CommitCallback)(DWORD ticket, bool success, void* userData);
+
+    // Forward-only walk over the pending transactions in sequence order.
+    // Each text points into the cursor's own buffer and is valid until the
+    // next call, so memory does not grow with the backlog. Transactions
+    // may be marked synced while the cursor is open.
+    class PendingCursor {
+    public:
+        enum {
+            MAX_FILTER_TYPES = 4
+        };
+
+        explicit PendingCursor(Journal* journal);
+        // Only transactions of the given types (a NULL-terminated list), or
+        // with exclude set, of any other type. Types are matched by the
+        // hash of their tag in the index, so the rest are skipped without
+        // being read; untagged transactions from older builds only match
+        // an exclude filter.
+        PendingCursor(Journal* journal, const TCHAR* const* types, bool exclude);
+        ~PendingCursor();
+
+        // NULL once there are no more pending transactions
+        const TCHAR* Next();
+
+        // ID and time (ms since 1970) of the transaction last returned by Next
+        ULONGLONG GetId() const;
+        ULONGLONG GetTimestamp() const;
+        // Its JournalFormat::TransactionOpcode; 0 for older transactions
+        BYTE GetOpcode() const;
+
+        // Pending transactions after the last one returned; counted in
+        // the index, without reading them
+        int GetRemaining() const;
+
+    private:
+        friend class Journal;
+        Journal* m_journal;
+        ULONGLONG m_sequence;   // Last sequence returned
+        ULONGLONG m_timestamp;
+        BYTE m_opcode;
+        TCHAR* m_text;
+        DWORD m_typeKeys[MAX_FILTER_TYPES];
+        int m_typeCount;        // -1 for any type
+        bool m_exclude;
+
+        bool Matches(DWORD typeKey) const;
+    };
+    friend class PendingCursor;
+
+    // What a QueryCursor returns. NULL or empty strings match any type or
+    // item id; times are ms since 1970-01-01 UTC, toTime is exclusive and
+    // 0 means no limit.
+    struct QueryFilter {
+        const TCHAR* transactionType;
+        const TCHAR* itemId;
+        ULONGLONG fromTime;
+        ULONGLONG toTime;
+    };
+
+    // Forward walk over the transactions still held in the journal
+    // (pending or synced) that match a filter, in sequence order. Lookups
+    // go through in-memory indexes by item id and time, so only matching
+    // records are read. Results are valid until the next call.
+    class QueryCursor {
+    public:
+        QueryCursor(Journal* journal, const QueryFilter& filter);
+        ~QueryCursor();
+
+        // Text of the next matching transaction, NULL once there are none
+        const TCHAR* Next();
+
+        // Details of the transaction last returned by Next
+        ULONGLONG GetId() const;
+        ULONGLONG GetTimestamp() const;
+        const TCHAR* GetTransactionType() const;
+        const TCHAR* GetItemId() const;
+
+    private:
+        friend class Journal;
+
+        Journal* m_journal;
+        ULONGLONG m_sequence;   // Last sequence returned
+        ULONGLONG m_timestamp;
+        TCHAR* m_text;
+        TCHAR m_type[JournalFormat::MAX_TAG_SIZE + 1];
+        TCHAR m_item[JournalFormat::MAX_TAG_SIZE + 1];
+
+        // Filter, with the tags encoded as stored (length -1 for any)
+        BYTE m_filterType[JournalFormat::MAX_TAG_SIZE];
+        BYTE m_filterItem[JournalFormat::MAX_TAG_SIZE];
+        int m_filterTypeLength;
+        int m_filterItemLength;
+        ULONGLONG m_fromTime;
+        ULONGLONG m_toTime;
+    };
+    friend class QueryCursor;
+
+    // Progress of a sync session. A session lasts from the sync that opens
+    // it until one gets through the backlog; a sync that is cut off leaves
+    // it open for the next one to resume.
+    struct SyncSession {
+        ULONGLONG id;               // Unique within the journal
+        ULONGLONG highWater;        // Highest transaction ID acknowledged in it
+        DWORD acknowledged;         // Transactions acknowledged in it
+    };
+
+    struct CompactionStats {
+        ULONGLONG bytesReclaimed;
+        DWORD timeSpentMs;
+        DWORD slicesRun;
+        DWORD segmentsDropped;
+        DWORD segmentsRewritten;
+    };
+
+    struct RetentionStats {
+        ULONGLONG bytesUsed;            // Segment files, batched records included
+        ULONGLONG bytesLimit;           // 0 when unlimited
+        ULONGLONG pendingBytes;         // Estimated share of unsynced transactions
+        DWORD secondsToLimit;           // At the recent append rate; INFINITE if unknown
+        ULONGLONG lastEnforced;         // ms since 1970-01-01 UTC, 0 if never
+        DWORD transactionsDropped;      // Unsynced transactions removed over budget
+    };
+
     Journal();
     ~Journal();
 
     // Initialize journal with storage path
+    // State is restored from the last checkpoint (the manifest) plus the
+    // records appended after it. Single-file journals from older builds
+    // are converted on first open.
     bool Initialize(const TCHAR* journalPath);
 
     // Logging operations
-    bool LogTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details);
+    // A durable transaction is on flash when LogTransaction returns; other
+    // records may wait for the next group commit. The opcode (a
+    // JournalFormat::TransactionOpcode) is stored with the transaction.
+    // LogError and LogInfo write to the diagnostic log; an error is stored
+    // as "[errorCode] errorMessage".
+    bool LogTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details, bool durable = true,
+                        BYTE opcode = 0);
     bool LogError(const TCHAR* errorCode, const TCHAR* errorMessage);
     bool LogInfo(const TCHAR* message);
 
+    // Asynchronous transactions: queued for the writer thread, which
+    // makes them durable and then calls the commit callback. Only one
+    // thread may enqueue. Without a writer this is a durable LogTransaction.
+    bool StartWriter(CommitCallback callback, void* userData);
+    void StopWriter();
+    bool IsWriterRunning() const;
+    bool EnqueueTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details, DWORD* ticket,
+                            BYTE opcode = 0);
+
     // Query operations
+    // The count includes transactions still queued for the writer.
+    // GetPendingTransactions copies the whole backlog; prefer PendingCursor.
     bool GetPendingTransactions(TCHAR*** transactions, int* count);
-    bool MarkTransactionSynced(const TCHAR* transactionId);
+    // Transactions are identified by their 64-bit journal sequence number;
+    // marking by text looks the transaction up by its content first
+    bool MarkTransactionSynced(ULONGLONG transactionId);
+    bool MarkTransactionSynced(const TCHAR* transactionText);
     int GetTransactionCount() const;
+    // Transaction IDs start over when the journal is deleted and created
+    // again; the epoch, picked when it is created, tells the two apart
+    DWORD GetEpoch() const;
+    // The wall clock in the unit of the timestamps, ms since 1970-01-01
+    // UTC. Record timestamps never go back; this can
+    static ULONGLONG GetWallClockMs();
+
+    // Sync sessions. BeginSyncSession resumes the open session, if there
+    // is one, or opens a new one. AcknowledgeSynced marks transactions
+    // synced and records the session's progress with a single flush, so
+    // both are on flash when it returns; without an open session it only
+    // marks them. EndSyncSession closes the session.
+    bool BeginSyncSession(SyncSession* session, bool* resumed);
+    bool AcknowledgeSynced(const ULONGLONG* transactionIds, int count);
+    bool EndSyncSession();
+    // False when no session is open
+    bool GetSyncSession(SyncSession* session) const;
 
     // Maintenance
+    // Compact drops sealed segments whose transactions are all synced and
+    // rewrites mostly-synced ones down to their pending records
     bool Compact();
     bool Clear();
 
+    // Background compaction: while no records are being appended, a
+    // low-priority thread compacts in slices of about sliceMs once the
+    // estimated garbage reaches garbagePercent of the journal
+    bool StartBackgroundCompaction(DWORD garbagePercent, DWORD sliceMs);
+    void StopBackgroundCompaction();
+    void GetCompactionStats(CompactionStats* stats) const;
+
+    // Retention, enforced a step at a time as records are appended; 0
+    // turns a limit off. Past maxBytes, synced records are removed
+    // oldest first. Synced records and diagnostics older than maxAgeSeconds
+    // are removed regardless. Unsynced transactions are only removed, oldest
+    // first, while at least pendingFloorBytes of them remain.
+    void SetRetention(DWORD maxBytes, DWORD maxAgeSeconds, DWORD pendingFloorBytes);
+    void GetRetentionStats(RetentionStats* stats) const;
+
+    // Group commit: records are batched in memory and written with a
+    // single flush once windowMs has passed or maxRecords are batched.
+    // A window of 0 flushes every entry (the default).
+    bool SetGroupCommit(DWORD windowMs, DWORD maxRecords);
+    bool Flush();
+
+    // Write a checkpoint now; one is also written automatically as
+    // records accumulate and on shutdown
+    bool Checkpoint();
+
 private:
+    // Segment rewrite in progress, carried across compaction slices
+    struct CompactionJob {
+        DWORD sourceId;         // 0 when no rewrite is in progress
+        DWORD targetId;
+        HANDLE source;
+        HANDLE target;
+        DWORD readOffset;
+        DWORD targetEnd;
+        ULONGLONG* sequences;   // Copied transactions and their new offsets
+        DWORD* offsets;
+        int moved;
+        int capacity;
+    };
+
     HANDLE m_fileHandle;
     TCHAR* m_journalPath;
-    DWORD m_transactionCount;
+    JournalManifest m_manifest;
+    JournalIndex m_pendingIndex;
+    JournalIndex m_historyIndex;    // All transactions, keyed by item id
+    bool m_historyReady;
+    DiagLog m_diagLog;
+    ULONGLONG m_nextSequence;
+    ULONGLONG m_lastTimestamp;
+    BYTE* m_recordBuffer;
+    BYTE* m_readBuffer;
+    DWORD m_fileEnd;
+    HANDLE m_readHandle;
+    DWORD m_readSegment;
+    mutable CRITICAL_SECTION m_lock;
+
+    // Group commit state
+    BYTE* m_batchBuffer;
+    DWORD m_batchLength;
+    DWORD m_batchRecords;
+    bool m_flushPending;
+    DWORD m_commitWindowMs;
+    DWORD m_commitMaxRecords;
+    ULONGLONG m_batchSequence;      // First sequence in the batch
+    JournalFormat::SessionState m_batchSession;     // As before the batch
+    JournalIndex::Entry* m_batchAcked;  // Pending entries its ACKs removed
+    int m_batchAckedCount;
+    HANDLE m_commitThread;
+    HANDLE m_commitEvent;
+    HANDLE m_stopEvent;
+
+    // Writer thread state
+    TransactionRing m_ring;
+    DWORD m_lastTicket;
+    CommitCallback m_commitCallback;
+    void* m_commitUserData;
+    HANDLE m_writerThread;
+    HANDLE m_writerEvent;
+    HANDLE m_writerStopEvent;
+    HANDLE m_ringSpaceEvent;        // The writer has freed slots
+
+    // Compaction state
+    CompactionJob m_compactJob;
+    CompactionStats m_compactStats;
+    DWORD m_lastAppendTick;
+    DWORD m_compactGarbagePercent;
+    DWORD m_compactSliceMs;
+    HANDLE m_compactThread;
+    HANDLE m_compactStopEvent;
+
+    // Retention state
+    DWORD m_retentionMaxBytes;
+    DWORD m_retentionMaxAgeSeconds;
+    DWORD m_retentionFloorBytes;
+    DWORD m_retentionAppended;      // Bytes appended since the last check
+    DWORD m_retentionTick;
+    DWORD m_appendRate;             // Bytes per second, smoothed
+    bool m_retentionBehind;         // The last step left work to do
+    ULONGLONG m_lastRetention;
+    DWORD m_retentionDropped;
 
     // Helper methods
-    bool WriteEntry(const TCHAR* level, const TCHAR* message);
-    TCHAR* FormatTimestamp();
+    bool WriteEntry(WORD recordType, const TCHAR* message);
+    int EncodePayload(const TCHAR* message);
+    int EncodeTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details);
+    bool AppendRecord(WORD recordType, WORD flags, ULONGLONG timestamp, DWORD length, DWORD* recordOffset);
+    bool AppendTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details, BYTE opcode);
+    void DropLastRecord(DWORD recordSize);
+    bool ReadRecordAt(DWORD segmentId, DWORD offset, ULONGLONG sequence, JournalFormat::RecordHeader* header);
+    int FindPending(const BYTE* payload, DWORD length);
+    bool WriteAck(int position);
+    bool AppendAck(ULONGLONG sequence);
+    void RemoveAcked(ULONGLONG sequence);
+    bool AppendSession(const JournalFormat::SessionState& session);
+    bool ReadPending(PendingCursor* cursor);
+    int CountPendingAfter(const PendingCursor* cursor) const;
+    bool BuildHistory();
+    bool AddHistory(ULONGLONG sequence, ULONGLONG timestamp, DWORD segmentId, DWORD offset,
+                    const BYTE* payload, DWORD length, WORD flags);
+    void DropHistory(DWORD segmentId);
+    bool ReadMatch(QueryCursor* cursor);
+    bool FinishAppend(bool durable);
+    void CheckpointIfDue();
+    void RetainIfDue();
+    bool EnforceRetention(DWORD budgetMs);
+    int FindRetentionCandidate(ULONGLONG cutoff, bool overBudget, bool* drop);
+    ULONGLONG GetSegmentEndTime(int position);
+    ULONGLONG GetJournalBytes() const;
+    ULONGLONG EstimatePendingBytes(int position) const;
+    bool DropPendingSegment(int position);
+    bool WriteBatch();
+    void RollBackBatch();
+    void StopCommitThread();
+    static DWORD WINAPI CommitThread(LPVOID param);
+    void DrainQueue();
+    static DWORD WINAPI WriterThread(LPVOID param);
+    bool OpenJournalFile();
+    bool OpenActiveSegment();
+    bool RecoverActiveSegment(DWORD startOffset, DWORD* recovered, DWORD* discarded);
+    void RetagPending();
+    bool CreateJournal();
+    bool ConvertSingleFile();
+    bool RecoverSegments();
+    bool CreateSegmentFile(DWORD segmentId, ULONGLONG baseSequence, HANDLE* file);
+    HANDLE OpenSegmentForRead(DWORD segmentId);
+    void CloseReadHandle();
+    bool RollSegment();
+    bool SaveManifest();
+    // The pending index, with each segment's pending count kept alongside
+    bool AddPending(ULONGLONG sequence, DWORD segmentId, DWORD offset, DWORD key, DWORD tag, ULONGLONG timestamp);
+    void RemovePending(int position);
+    void ChangePendingCount(DWORD segmentId, int delta);
+    void RecountPending();
+    DWORD GetGarbagePercent();
+    bool CompactSlice(DWORD budgetMs, bool* finished);
+    int FindCompactionCandidate(bool* drop);
+    bool DropSegment(int position);
+    bool BeginRewrite(int position);
+    bool CopyRewrite(DWORD startTick, DWORD budgetMs, bool* copied);
+    bool FinishRewrite();
+    void AbortRewrite();
+    static DWORD WINAPI CompactionThread(LPVOID param);
+    bool WriteFileHeader(HANDLE file, ULONGLONG baseSequence);
+    bool ImportLegacyJournal();
+    bool ImportLegacyLine(const char* line, int length);
+    bool ScanRecords(HANDLE file, DWORD segmentId, DWORD startOffset, DWORD* endOffset);
+    ULONGLONG GetJournalTime();
     bool FlushToDisk();
 };
 
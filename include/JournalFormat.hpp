@@ -0,0 +1,251 @@
+#ifndef JOURNALFORMAT_HPP
+#define JOURNALFORMAT_HPP
+
+namespace HBX {
+
+#if defined(_MSC_VER)
+typedef unsigned __int64 JournalU64;
+#else
+typedef unsigned long long JournalU64;
+#endif
+
+/**
+ * Binary journal record format
+ * Shared by the device Journal and the host-side tools, so this class
+ * must not depend on Win32 headers.
+ *
+ * File layout:
+ *   [file header, 16 bytes][record][record]...
+ *
+ * Record layout (little-endian):
+ *   0  u32  magic 'HBXR'
+ *   4  u16  record type
+ *   6  u16  flags (transactions: FLAG_TAGGED, and the opcode in bits 8-15)
+ *   8  u64  sequence number
+ *   16 u64  timestamp (ms since 1970-01-01 UTC, never decreasing)
+ *   24 u32  payload length
+ *   28 u32  CRC32 of bytes 0-27 and the payload
+ *   32 ...  UTF-8 payload (ACK: u64 sequence number of the transaction;
+ *           SESSION: see below)
+ *
+ * Transactions with FLAG_TAGGED carry their type and item id ahead of
+ * the text, so they can be queried without parsing it:
+ *   0  u8   type length
+ *   1  u8   item id length
+ *   2  ...  UTF-8 type, then item id, then the transaction text
+ *
+ * SESSION records track the progress of a sync session; the last one
+ * written is the session's state:
+ *   0  u64  session id (sequence number of the record that opened it)
+ *   8  u64  highest transaction sequence acknowledged in the session
+ *   16 u32  transactions acknowledged in the session
+ *   20 u32  session flags
+ *
+ * A journal is a list of segment files plus a manifest naming them (see
+ * JournalManifest). Manifest layout (little-endian):
+ *   0  u32  magic 'HBXM'
+ *   4  u16  version
+ *   6  u16  header size
+ *   8  u64  generation (the higher valid slot wins)
+ *   16 u64  next sequence number
+ *   24 u64  last timestamp
+ *   32 u32  next segment id
+ *   36 u32  segment count
+ *   40 u32  pending transaction count
+ *   44 u32  active segment offset the pending list is complete up to
+ *   48 u32  CRC32 of bytes 0-47, the epoch and the body
+ *   52 u32  journal epoch, chosen when the journal is created
+ *   56 ...  segments (id, size, records), then pending transactions
+ *           (sequence, segment id, offset, key, type key, timestamp),
+ *           oldest first, then optionally the sync session (SESSION
+ *           payload and its own u32 CRC32, so readers that stop at the
+ *           pending list still accept the manifest)
+ * Version 1 manifests have no type key or timestamp in the pending list;
+ * before version 3 the epoch was reserved and outside the CRC.
+ *
+ * INFO and ERROR records go to a separate diagnostic log (see DiagLog):
+ *   [file header, 16 bytes][slot]...[slot]
+ * Each 256-byte slot holds one record (payload cut to fit, zero padded).
+ * Slots are reused in a ring; the record with the highest sequence
+ * number is the newest.
+ */
+class JournalFormat {
+public:
+    enum {
+        FILE_HEADER_SIZE = 16,
+        RECORD_HEADER_SIZE = 32,
+        MAX_PAYLOAD_SIZE = 8192,
+        MAX_RECORD_SIZE = RECORD_HEADER_SIZE + MAX_PAYLOAD_SIZE,
+        FORMAT_VERSION = 1,
+        MANIFEST_VERSION = 3,
+        MANIFEST_HEADER_SIZE = 56,
+        MANIFEST_SEGMENT_SIZE = 12,
+        MANIFEST_PENDING_SIZE = 32,
+        MANIFEST_PENDING_V1_SIZE = 20,
+        DIAG_SLOT_SIZE = 256,
+        DIAG_MAX_PAYLOAD = DIAG_SLOT_SIZE - RECORD_HEADER_SIZE,
+        ACK_PAYLOAD_SIZE = 8,
+        SESSION_PAYLOAD_SIZE = 24,
+        MANIFEST_SESSION_SIZE = SESSION_PAYLOAD_SIZE + 4,
+        TAG_HEADER_SIZE = 2,
+        MAX_TAG_SIZE = 64
+    };
+
+    enum RecordType {
+        REC_INFO = 1,
+        REC_ERROR = 2,
+        REC_TRANS = 3,
+        REC_SYNCED = 4,         // Older builds: payload repeats the transaction
+        REC_ACK = 5,            // Transaction synced, named by sequence number
+        REC_SESSION = 6         // Sync session progress
+    };
+
+    enum RecordFlags {
+        FLAG_TAGGED = 0x0001,       // Payload starts with type and item tags
+        FLAG_OPCODE_MASK = 0xFF00   // Transaction opcode, 0 if none
+    };
+
+    // What a transaction does, stored with it so it can be dispatched
+    // without parsing its type. The values are on flash and must not
+    // change; builds before opcodes wrote 0, and readers that do not know
+    // them ignore the bits.
+    enum TransactionOpcode {
+        OP_NONE = 0,
+        OP_ITEM_SCAN = 1,
+        OP_ITEM_MOVE = 2,
+        OP_ITEM_CREATE = 3,
+        OP_ITEM_UPDATE = 4,
+        OP_COUNT
+    };
+
+    enum SessionFlags {
+        SESSION_CLOSED = 0x0001 // The session got through the backlog
+    };
+
+    enum DecodeResult {
+        DECODE_OK,
+        DECODE_NEED_MORE,
+        DECODE_BAD_MAGIC,
+        DECODE_BAD_LENGTH,
+        DECODE_BAD_CRC
+    };
+
+    struct RecordHeader {
+        JournalU64 sequence;
+        JournalU64 timestamp;
+        unsigned short type;
+        unsigned short flags;
+        unsigned int length;
+        unsigned int crc;
+    };
+
+    // Byte ranges within a transaction payload
+    struct PayloadTags {
+        unsigned int typeOffset;
+        unsigned int typeLength;
+        unsigned int itemOffset;
+        unsigned int itemLength;
+        unsigned int textOffset;
+    };
+
+    struct ManifestHeader {
+        unsigned short version;     // As read; always written as MANIFEST_VERSION
+        JournalU64 generation;
+        JournalU64 nextSequence;
+        JournalU64 lastTimestamp;
+        unsigned int nextSegmentId;
+        unsigned int segmentCount;
+        unsigned int pendingCount;
+        unsigned int scanOffset;
+        unsigned int crc;
+        unsigned int epoch;         // 0 before version 3
+    };
+
+    struct SessionState {
+        JournalU64 id;          // 0 when there has been no session
+        JournalU64 highWater;
+        unsigned int acknowledged;
+        unsigned int flags;
+    };
+
+    struct ManifestSegment {
+        unsigned int id;
+        unsigned int size;
+        unsigned int records;
+        unsigned int pending;   // Not stored; unsynced transactions, kept by Journal
+    };
+
+    struct ManifestPending {
+        JournalU64 sequence;
+        unsigned int segment;
+        unsigned int offset;
+        unsigned int key;
+        unsigned int tag;       // Key of the type tag; 0 in version 1
+        JournalU64 timestamp;   // 0 in version 1
+    };
+
+    // File header
+    static void EncodeFileHeader(unsigned char* out, JournalU64 baseSequence);
+    static bool DecodeFileHeader(const unsigned char* in, unsigned int avail, JournalU64* baseSequence);
+    static bool IsLegacyText(const unsigned char* in, unsigned int avail);
+
+    // Records. EncodeRecord expects header->length payload bytes already
+    // placed at out + RECORD_HEADER_SIZE and fills in header->crc.
+    static void EncodeRecord(unsigned char* out, RecordHeader* header);
+    static DecodeResult DecodeRecord(const unsigned char* in, unsigned int avail, RecordHeader* header);
+
+    // ACK payload
+    static void EncodeAckPayload(unsigned char* out, JournalU64 sequence);
+    static bool DecodeAckPayload(const unsigned char* in, unsigned int len, JournalU64* sequence);
+
+    // SESSION payload
+    static void EncodeSessionPayload(unsigned char* out, const SessionState* session);
+    static bool DecodeSessionPayload(const unsigned char* in, unsigned int len, SessionState* session);
+
+    // Transaction tags. EncodeTags writes the tag header and both tags
+    // (each at most MAX_TAG_SIZE bytes) and returns where the text goes.
+    // DecodeTags treats untagged or malformed payloads as all text.
+    static unsigned int EncodeTags(unsigned char* out, const unsigned char* type, unsigned int typeLen,
+                                   const unsigned char* item, unsigned int itemLen);
+    static bool DecodeTags(const unsigned char* in, unsigned int len, unsigned short flags, PayloadTags* tags);
+
+    // Transaction opcode to and from record flags
+    static unsigned short OpcodeFlags(unsigned int opcode);
+    static unsigned int GetOpcode(unsigned short flags);
+
+    // Manifest. EncodeManifestHeader writes header->crc as given; the CRC
+    // starts from GetManifestHeaderCrc and runs on over the body.
+    static void EncodeManifestHeader(unsigned char* out, const ManifestHeader* header);
+    static bool DecodeManifestHeader(const unsigned char* in, unsigned int avail, ManifestHeader* header);
+    static unsigned int GetManifestHeaderCrc(const unsigned char* in, unsigned short version);
+    static void EncodeManifestSegment(unsigned char* out, const ManifestSegment* segment);
+    static void DecodeManifestSegment(const unsigned char* in, ManifestSegment* segment);
+    // Pending entries are read in the layout of the manifest's version
+    static unsigned int GetManifestPendingSize(unsigned short version);
+    static void EncodeManifestPending(unsigned char* out, const ManifestPending* pending);
+    static void DecodeManifestPending(const unsigned char* in, unsigned short version, ManifestPending* pending);
+    static void EncodeManifestSession(unsigned char* out, const SessionState* session);
+    static bool DecodeManifestSession(const unsigned char* in, unsigned int avail, SessionState* session);
+
+    // Legacy text journal lines: "[YYYY-MM-DD HH:MM:SS] LEVEL: message"
+    static bool ParseLegacyLine(const char* line, int len, unsigned short* type,
+                                JournalU64* timestamp, int* messageOffset);
+
+    // Helpers
+    static unsigned int Crc32(const unsigned char* data, unsigned int len, unsigned int crc);
+    static const char* RecordTypeName(unsigned short type);
+    static void FormatTimestamp(JournalU64 ms, char* buffer, int maxLen);
+    static JournalU64 MakeTimestamp(int year, int month, int day, int hour, int minute, int second, int millis);
+
+private:
+    static void PutU16(unsigned char* out, unsigned short value);
+    static void PutU32(unsigned char* out, unsigned int value);
+    static void PutU64(unsigned char* out, JournalU64 value);
+    static unsigned short GetU16(const unsigned char* in);
+    static unsigned int GetU32(const unsigned char* in);
+    static JournalU64 GetU64(const unsigned char* in);
+};
+
+} // namespace HBX
+
+#endif // JOURNALFORMAT_HPP
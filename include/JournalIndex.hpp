@@ -0,0 +1,72 @@
+#ifndef JOURNALINDEX_HPP
+#define JOURNALINDEX_HPP
+
+#include <windows.h>
+
+namespace HBX {
+
+/**
+ * In-memory index of journal transactions
+ * Entries are kept in sequence order with their segment and file offset
+ * so records can be read directly, plus a hash chain on a 32-bit lookup
+ * key. Used for the unsynced transactions and for the query history.
+ */
+class JournalIndex {
+public:
+    struct Entry {
+        ULONGLONG sequence;
+        DWORD segment;
+        DWORD offset;
+        DWORD key;
+        DWORD tag;              // Second key, checked but not hashed
+        ULONGLONG timestamp;    // Never decreases with the sequence
+        int next;       // Next entry in the same hash bucket, -1 at end
+        bool live;
+    };
+
+    JournalIndex();
+    ~JournalIndex();
+
+    // Entries must be added in increasing sequence order; tag and
+    // timestamp are 0 where they are not tracked
+    bool Add(ULONGLONG sequence, DWORD segment, DWORD offset, DWORD key,
+             DWORD tag = 0, ULONGLONG timestamp = 0);
+    bool Remove(int position);
+    // Puts back an entry removed earlier, in sequence order
+    bool Restore(const Entry& entry);
+    void Clear();
+
+    // Lookup; positions stay valid until the next Add or Clear
+    int FindKey(DWORD key) const;
+    int FindNextKey(int position) const;
+    int FindKeyAfter(DWORD key, ULONGLONG sequence) const;
+    int FindSequence(ULONGLONG sequence) const;
+    int FindAfter(ULONGLONG sequence) const;
+    int FindTime(ULONGLONG timestamp) const;
+
+    // Iteration over live entries in sequence order (-1 at end)
+    int First() const;
+    int Next(int position) const;
+
+    const Entry& GetEntry(int position) const;
+    void SetLocation(int position, DWORD segment, DWORD offset);
+    void SetTag(int position, DWORD tag, ULONGLONG timestamp);
+    int GetCount() const;
+
+private:
+    Entry* m_entries;
+    int m_used;
+    int m_capacity;
+    int m_liveCount;
+    int* m_buckets;
+    int m_bucketCount;
+
+    bool Grow();
+    void Pack();
+    void RebuildBuckets();
+    int BucketFor(DWORD key) const;
+};
+
+} // namespace HBX
+
+#endif // JOURNALINDEX_HPP
@@ -0,0 +1,88 @@
+#ifndef JOURNALMANIFEST_HPP
+#define JOURNALMANIFEST_HPP
+
+#include <windows.h>
+#include "JournalFormat.hpp"
+#include "JournalIndex.hpp"
+
+namespace HBX {
+
+/**
+ * Segment list of a journal, persisted as a small manifest file
+ * The journal is split into segment files named "<path>.<id>"; the
+ * manifest lists them oldest first (the last one is the active segment)
+ * together with the pending transactions known when it was written.
+ * Two manifest slots ("<path>.mf0" and "<path>.mf1") are written in turn,
+ * so a crash during Save leaves the previous manifest intact. The state
+ * of the last sync session rides along, since the SESSION record that
+ * set it may be in a segment that is no longer replayed.
+ */
+class JournalManifest {
+public:
+    typedef JournalFormat::ManifestSegment Segment;
+
+    JournalManifest();
+    ~JournalManifest();
+
+    // Load the newest valid slot; the pending list is added to the index
+    bool Load(const TCHAR* basePath, JournalIndex* pending);
+
+    // Write the other slot; every indexed transaction must be in a
+    // segment file before scanOffset of the active segment, and the
+    // records from scanOffset on are replayed after the next Load
+    bool Save(const TCHAR* basePath, const JournalIndex& pending,
+              ULONGLONG nextSequence, ULONGLONG lastTimestamp, DWORD scanOffset);
+
+    // Remove both slots
+    static void Delete(const TCHAR* basePath);
+    static void GetSegmentPath(const TCHAR* basePath, DWORD segmentId, TCHAR* path);
+
+    // Segment list
+    void Reset();
+    DWORD AllocateSegmentId();
+    bool AddSegment(DWORD segmentId);
+    bool InsertSegment(int position, const Segment& segment);
+    void RemoveSegment(int position);
+    int FindSegment(DWORD segmentId) const;
+    int GetSegmentCount() const;
+    Segment& GetSegment(int position);
+    const Segment& GetSegment(int position) const;
+    Segment& GetActiveSegment();
+
+    // State restored by Load
+    ULONGLONG GetNextSequence() const;
+    ULONGLONG GetLastTimestamp() const;
+    DWORD GetScanOffset() const;
+    // Format version of the loaded manifest; Save writes the current one
+    WORD GetVersion() const;
+    // Set when the journal is created and saved with every manifest; 0
+    // for a manifest written before there was one
+    DWORD GetEpoch() const;
+    void SetEpoch(DWORD epoch);
+
+    // Sync session, kept up to date by the journal and saved with the
+    // next manifest
+    const JournalFormat::SessionState& GetSession() const;
+    void SetSession(const JournalFormat::SessionState& session);
+
+private:
+    Segment* m_segments;
+    int m_segmentCount;
+    int m_capacity;
+    DWORD m_nextSegmentId;
+    ULONGLONG m_generation;
+    int m_currentSlot;
+    ULONGLONG m_nextSequence;
+    ULONGLONG m_lastTimestamp;
+    DWORD m_scanOffset;
+    WORD m_version;
+    DWORD m_epoch;
+    JournalFormat::SessionState m_session;
+
+    bool LoadSlot(const TCHAR* basePath, int slot, JournalIndex* pending);
+    static void GetSlotPath(const TCHAR* basePath, int slot, TCHAR* path);
+};
+
+} // namespace HBX
+
+#endif // JOURNALMANIFEST_HPP
@@ -8,10 +8,23 @@ namespace Models {
 
 /**
  * Item data model
- * Represents an inventory item in the HomeBox system
+ * Represents an inventory item in the HomeBox system. An item fetched
+ * from the server carries its version, so an offline edit of it can be
+ * sent on condition that nobody else has changed it since, and merged
+ * field by field with the server's copy when somebody has.
  */
 class Item {
 public:
+    // Fields an edit can change
+    enum Field {
+        FIELD_NAME = 0x0001,
+        FIELD_DESCRIPTION = 0x0002,
+        FIELD_LOCATION = 0x0004,
+        FIELD_QUANTITY = 0x0008,
+        FIELD_CATEGORY = 0x0010,
+        FIELD_ALL = 0x001F
+    };
+
     Item();
     ~Item();
 
@@ -23,6 +36,8 @@ public:
     const TCHAR* GetLocationId() const;
     int GetQuantity() const;
     const TCHAR* GetCategory() const;
+    // Server version (its ETag) the item was read at; NULL if unknown
+    const TCHAR* GetVersion() const;
 
     // Mutators
     void SetId(const TCHAR* id);
@@ -32,10 +47,31 @@ public:
     void SetLocationId(const TCHAR* locationId);
     void SetQuantity(int quantity);
     void SetCategory(const TCHAR* category);
+    void SetVersion(const TCHAR* version);
+
+    // Edits. TrackChanges records the item as read from the server that
+    // this copy was edited from: its version and the original value of
+    // each field that differs now. KeepChangesOf carries an earlier
+    // edit's originals into a later edit of the same item.
+    void TrackChanges(const Item& original);
+    void KeepChangesOf(const Item& earlier);
+    DWORD GetChangedFields() const;
+
+    // Three-way merge of the edit onto the server's current copy: fields
+    // changed only there are taken, fields changed only here are kept,
+    // and one changed on both sides to different values is a conflict.
+    // Returns the conflicting fields; unless there are none, the item is
+    // left as it was, or with keepLocal they keep the edit's values.
+    // Merged, the item is an edit of current.
+    DWORD Rebase(const Item& current, bool keepLocal);
 
     // Serialization
+    // ToJson is the item as the server takes it; ToChangeJson adds the
+    // version and the originals of the changed fields, for a queued edit
+    // ("base.name" and so on). FromJson reads either.
     bool FromJson(const TCHAR* json);
     TCHAR* ToJson() const;
+    TCHAR* ToChangeJson() const;
 
     // Validation
     bool IsValid() const;
@@ -48,8 +84,19 @@ private:
     TCHAR* m_locationId;
     int m_quantity;
     TCHAR* m_category;
+    TCHAR* m_version;
+    DWORD m_changed;
+    Item* m_original;       // Originals of the changed fields; NULL if untracked
 
     void Cleanup();
+    const TCHAR* GetText(DWORD field) const;
+    void SetText(DWORD field, const TCHAR* text);
+    bool SameField(const Item& other, DWORD field) const;
+    void CopyField(const Item& from, DWORD field);
+
+    // Not copyable
+    Item(const Item&);
+    Item& operator=(const Item&);
 };
 
 } // namespace Models
@@ -0,0 +1,66 @@
+#ifndef REPLAYCACHE_HPP
+#define REPLAYCACHE_HPP
+
+#include <windows.h>
+
+namespace HBX {
+
+/**
+ * Outcomes of the changes sync has sent, by idempotency key
+ * A request for queued work is keyed by the journal IDs of the first and
+ * last transactions behind it, after the journal's epoch (IDs start over
+ * in a recreated journal), so sending the same change again carries the
+ * same key and the server answers it from its record instead of
+ * applying it twice. That makes retries safe to send at once and side by
+ * side. The cache remembers which keys the server confirmed, so they are
+ * not sent again while only their acknowledgement is missing, and which
+ * are in doubt (sent without an answer), so that later changes are not
+ * folded into them: a retry under the same key must be the same request.
+ * Entries are kept in memory, the oldest overwritten first. Any thread.
+ */
+class ReplayCache {
+public:
+    enum {
+        CAPACITY = 256,
+        KEY_CHARS = 64          // "<epoch>-<first>-<last>" and its terminator
+    };
+
+    enum Outcome {
+        OUTCOME_NONE,           // Not sent, or answered as failed
+        OUTCOME_IN_DOUBT,       // No answer; may have been applied
+        OUTCOME_APPLIED
+    };
+
+    ReplayCache();
+    ~ReplayCache();
+
+    // OUTCOME_NONE forgets the request
+    void Record(ULONGLONG firstId, ULONGLONG lastId, Outcome outcome);
+    // OUTCOME_NONE unless the same request was recorded
+    Outcome Lookup(ULONGLONG firstId, ULONGLONG lastId) const;
+    // Key IDs of the requests in doubt, at most maxCount; returns how
+    // many there are in all
+    int GetInDoubt(ULONGLONG* firstIds, ULONGLONG* lastIds, int maxCount) const;
+    void Clear();
+
+    // The epoch is Journal::GetEpoch, as 8 hex digits
+    static void FormatKey(DWORD epoch, ULONGLONG firstId, ULONGLONG lastId, TCHAR* key);
+
+private:
+    struct Entry {
+        ULONGLONG firstId;
+        ULONGLONG lastId;
+        Outcome outcome;
+    };
+
+    Entry m_entries[CAPACITY];
+    int m_count;
+    int m_next;                 // Slot overwritten when full
+    mutable CRITICAL_SECTION m_lock;
+
+    int Find(ULONGLONG firstId) const;
+};
+
+} // namespace HBX
+
+#endif // REPLAYCACHE_HPP
@@ -0,0 +1,85 @@
+#ifndef SYNCBATCH_HPP
+#define SYNCBATCH_HPP
+
+#include <windows.h>
+#include "TransactionCoalescer.hpp"
+
+namespace HBX {
+
+/**
+ * One POST /api/v1/sync request, filled with coalesced operations
+ * Operations are appended until the batch reaches its operation count or
+ * size limit. Each goes out under the journal ID of its first transaction,
+ * which is how the per-operation results in the response are matched
+ * back. An item appears at most once per batch, so a failed change can
+ * never be overtaken by a later one to the same item. Journal IDs survive
+ * a restart, so they double as idempotency keys: a batch sent again after
+ * its acknowledgement was lost carries the same IDs, and the server can
+ * discard what it has already applied.
+ */
+class SyncBatch {
+public:
+    enum {
+        DEFAULT_MAX_OPERATIONS = 64,
+        DEFAULT_MAX_BYTES = 32768,
+        MAX_OPERATIONS = 256
+    };
+
+    SyncBatch();
+    ~SyncBatch();
+
+    // maxBytes bounds the transactions written into the request body; a
+    // single operation larger than that is still sent, on its own
+    void SetLimits(int maxOperations, DWORD maxBytes);
+    // Sync session the batches are sent in (see Journal::SyncSession); 0
+    // leaves it out of the request. Kept by Clear
+    void SetSessionId(ULONGLONG sessionId);
+    void Clear();
+
+    // Whether the sync endpoint takes an operation: one whose handler
+    // batches (scans, moves and creates) and whose payload parsed
+    static bool CanBatch(const TransactionCoalescer::Operation& operation);
+
+    // Appends an operation, tagged with its position in the coalescer
+    // window; false when it does not fit or its item is already in the batch
+    bool Add(int tag, const TransactionCoalescer::Operation& operation, ULONGLONG transactionId);
+
+    // Whether the batch already holds an operation on the item
+    bool HoldsItem(const TransactionCoalescer::Operation& operation) const;
+
+    int GetCount() const;
+    int GetTag(int index) const;
+
+    // Request body for the device; the caller deletes it
+    TCHAR* BuildRequest(const TCHAR* deviceId) const;
+
+    // Reads the per-operation results; operations the response does not
+    // report as successful stay failed
+    void ParseResponse(const TCHAR* response);
+    bool Succeeded(int index) const;
+
+private:
+    struct Entry {
+        int tag;
+        ULONGLONG transactionId;
+        const TCHAR* item;      // Owned by the coalescer window
+        DWORD itemKey;
+        bool succeeded;
+    };
+
+    Entry m_entries[MAX_OPERATIONS];
+    int m_count;
+    int m_maxOperations;
+    DWORD m_maxBytes;
+    ULONGLONG m_sessionId;
+    TCHAR* m_body;              // Transaction objects, comma separated
+    DWORD m_length;
+    DWORD m_capacity;
+
+    static int FormatEntry(TCHAR* out, const TransactionCoalescer::Operation& operation, ULONGLONG transactionId);
+    void SetResult(ULONGLONG transactionId, bool succeeded, int* next);
+};
+
+} // namespace HBX
+
+#endif // SYNCBATCH_HPP
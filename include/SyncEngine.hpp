@@ -4,6 +4,11 @@
 #include <windows.h>
 #include "HbClient.hpp"
 #include "Journal.hpp"
+#include "TransactionCoalescer.hpp"
+#include "SyncBatch.hpp"
+#include "SyncScheduler.hpp"
+#include "ConnectivityMonitor.hpp"
+#include "ReplayCache.hpp"
 
 namespace HBX {
 
@@ -13,18 +18,62 @@ namespace HBX {
  */
 class SyncEngine {
 public:
+    enum {
+        MAX_PIPELINE_DEPTH = 8,
+        BULK_WINDOW_SHARE = 4,      // Bulk work gets at least 1/4 of a window
+        MAX_SEND_ATTEMPTS = 3,      // Per request and sync, while unanswered
+        MAX_CONFLICTS = 32
+    };
+
+    // Priority classes of queued work. Edits and moves change items, so
+    // they go out together in journal order, ahead of bulk scans; scans
+    // only read, so they may fall behind but keep at least their share
+    // of each sync window. Interactive edits also skip the settle time.
+    enum SyncPriority {
+        SYNC_PRIORITY_INTERACTIVE,  // ITEM_CREATE, ITEM_UPDATE
+        SYNC_PRIORITY_MOVE,         // ITEM_MOVE
+        SYNC_PRIORITY_BULK,         // ITEM_SCAN and anything else
+        SYNC_PRIORITY_COUNT
+    };
+
+    // Per class: transactions pending now, and how long those synced so
+    // far waited from being queued to being acknowledged. Percentiles
+    // are upper bounds of histogram buckets (1 s, 2 s, 5 s, ... 1 day)
+    struct PriorityStats {
+        DWORD pending;
+        DWORD synced;
+        DWORD waitP50Ms;
+        DWORD waitP90Ms;
+        DWORD waitP99Ms;
+        DWORD waitMaxMs;
+    };
+
     SyncEngine(HbClient* hbClient, Journal* journal);
     ~SyncEngine();
 
     // Queue management
-    bool QueueTransaction(const TCHAR* transactionType, const TCHAR* data);
+    // The item id is journaled alongside so queued work can be queried by item.
+    // Transaction types and their data (see TransactionHandlers):
+    //   ITEM_SCAN    SCAN:<barcode>
+    //   ITEM_MOVE    MOVE:<barcode>:<locationId>
+    //   ITEM_CREATE  item JSON (Item::ToJson)
+    //   ITEM_UPDATE  Item::ToChangeJson of an edit (Item::TrackChanges);
+    //                acknowledged without a request if it has no id
+    bool QueueTransaction(const TCHAR* transactionType, const TCHAR* data, const TCHAR* itemId = NULL);
     int GetQueuedTransactionCount() const;
     bool ClearQueue();
 
     // Sync operations
+    // Each sync runs in a session (see Journal::SyncSession) that is
+    // acknowledged batch by batch; one cut off before it got through the
+    // backlog is resumed by the next, without resending what was applied.
+    // Every change carries a key made of the journal IDs behind it, so a
+    // request that got no answer, or a server error, is sent again at
+    // once; one still unanswered is sent as it was by the next sync
     bool Sync();
     bool SyncItem(const TCHAR* transactionId);
-    bool IsOnline() const;
+    // Cached; see ConnectivityMonitor
+    bool IsOnline();
 
     // Sync status
     enum SyncStatus {
@@ -34,14 +83,84 @@ public:
         SYNC_FAILED
     };
 
+    // Counts from the last Sync: queued transactions handled, the
+    // operations they were coalesced into, the sends those took (a batch
+    // is one), and transactions left pending
+    struct SyncStats {
+        DWORD transactions;
+        DWORD operations;
+        DWORD requests;
+        DWORD failed;
+    };
+
+    // Edits the server refused because the item changed there since, and
+    // that could not be merged with its copy (see Item::Rebase). They stay
+    // queued, and their item blocked, until resolved: by sending the edit
+    // over the server's changes, or by dropping it
+    enum ConflictResolution {
+        RESOLVE_PENDING,
+        RESOLVE_KEEP_LOCAL,
+        RESOLVE_KEEP_SERVER
+    };
+
+    struct SyncConflict {
+        ULONGLONG transactionId;    // First transaction of the edit
+        TCHAR barcode[64];
+        DWORD fields;               // Changed on both sides (Item::Field)
+    };
+
+    // Copies up to max unresolved conflicts; returns how many
+    int GetConflicts(SyncConflict* conflicts, int max);
+    // Applied by the next sync, which it requests; false if unknown
+    bool ResolveConflict(ULONGLONG transactionId, ConflictResolution resolution);
+
     SyncStatus GetSyncStatus() const;
     const TCHAR* GetLastSyncError() const;
     DWORD GetLastSyncTime() const;
+    SyncStats GetLastSyncStats() const;
+    void GetPriorityStats(SyncPriority priority, PriorityStats* stats);
+    static SyncPriority GetPriority(const TCHAR* transactionType);
+    static SyncPriority GetPriority(const TransactionHandler* handler);
+
+    // Background sync
+    enum SyncEvent {
+        SYNC_EVENT_STARTED,
+        SYNC_EVENT_PROGRESS,    // value: transactions handled so far
+        SYNC_EVENT_FINISHED     // value: transactions still pending
+    };
+
+    typedef void (*SyncCallback)(SyncEvent event, DWORD value, void* userData);
+
+    // Runs Sync on a worker thread, as SyncScheduler decides: shortly after
+    // work is queued, at the interval while work is pending, when the
+    // network returns, and on request. Calling it again while running
+    // only changes the interval. The callback runs on the thread Sync runs on.
+    // Connectivity is probed in the background while it runs
+    bool StartAutoSync(DWORD intervalSeconds, SyncCallback callback, void* userData);
+    void StopAutoSync();
+    bool IsAutoSyncRunning() const;
+    void RequestSync();
+    // Queued work is on flash and can be synced; QueueTransaction calls
+    // this itself unless the journal writer will report it. Any thread
+    void NotifyQueued();
+    // A request reached the server
+    void NotifyNetworkAvailable();
 
     // Configuration
+    // Without auto sync the worker only runs requested syncs
     void SetAutoSyncEnabled(bool enabled);
     bool IsAutoSyncEnabled() const;
 
+    // Scans, moves and creates go to /api/v1/sync in batches of up to
+    // maxOperations or about maxBytes of request body; 0 operations sends
+    // each on its own
+    void SetBatchLimits(int maxOperations, DWORD maxBytes);
+
+    // Sends of a sync are spread over depth lanes that run side by side,
+    // each on a connection of its own; an item's operations always share
+    // a lane, so they still go out in order. 1 sends one at a time
+    void SetPipelineDepth(int depth);
+
 private:
     HbClient* m_hbClient;
     Journal* m_journal;
@@ -49,10 +168,99 @@ private:
     TCHAR* m_lastSyncError;
     DWORD m_lastSyncTime;
     bool m_autoSyncEnabled;
+    TransactionCoalescer m_coalescer;
+    bool m_batchingEnabled;
+    int m_batchMaxOperations;
+    DWORD m_batchMaxBytes;
+    SyncStats m_lastSyncStats;
+    CRITICAL_SECTION m_syncLock;        // One Sync at a time
+
+    // One lane of the pipeline: its share of the window's operations, in
+    // window order, and the batch it is filling. Lanes after the first
+    // have a thread for the length of a sync, parked between windows
+    struct SyncLane {
+        SyncEngine* engine;
+        int* positions;
+        int count;
+        SyncBatch batch;
+        ULONGLONG* acks;                // Transaction IDs being acknowledged
+        int successCount;
+        int failCount;
+        DWORD operations;
+        DWORD requests;
+        HANDLE thread;
+        HANDLE startEvent;              // Its share of a window is ready
+        HANDLE doneEvent;               // That share has been sent
+        bool exiting;
+    };
+
+    SyncLane* m_lanes;
+    int m_laneCount;
+    CRITICAL_SECTION m_blockLock;       // The coalescer's blocked items
+    LONG m_progress;
+
+    // Wait times per priority class, for GetPriorityStats
+    enum {
+        WAIT_BUCKET_COUNT = 12
+    };
+    CRITICAL_SECTION m_statsLock;
+    DWORD m_waitCounts[SYNC_PRIORITY_COUNT][WAIT_BUCKET_COUNT];
+    DWORD m_waitMaxMs[SYNC_PRIORITY_COUNT];
+    DWORD m_loggedWaitP90Ms[SYNC_PRIORITY_COUNT];  // As last written to the diagnostic log
+    LONG m_interactiveQueued;           // Since the last NotifyQueued
+
+    // Conflicts, including those resolved but not yet synced
+    struct ConflictEntry {
+        SyncConflict conflict;
+        ConflictResolution resolution;
+    };
+    CRITICAL_SECTION m_conflictLock;
+    ConflictEntry m_conflicts[MAX_CONFLICTS];
+    int m_conflictCount;
+
+    // Worker state; the scheduler is shared with the threads that queue
+    SyncScheduler m_scheduler;
+    CRITICAL_SECTION m_scheduleLock;
+    DWORD m_autoSyncIntervalMs;
+    SyncCallback m_syncCallback;
+    void* m_syncUserData;
+    HANDLE m_workerThread;
+    HANDLE m_workerWakeEvent;
+    HANDLE m_workerStopEvent;
+    ConnectivityMonitor m_connectivity;
+    ReplayCache m_replayCache;
 
     // Helper methods
-    bool CheckConnectivity();
+    bool RunSync();
+    void RunScheduledSync();
+    bool IsStopping() const;
+    void ReportSync(SyncEvent event, DWORD value);
+    void UpdateSchedule();
+    static DWORD WINAPI WorkerThread(LPVOID param);
+    void ScheduleForNetwork();
+    static void ConnectivityChanged(bool available, void* userData);
     bool ProcessQueuedTransaction(const TCHAR* transaction);
+    void RunLanes();
+    void RunLane(SyncLane* lane);
+    bool SendOperation(SyncLane* lane, int position);
+    bool SendWithRetry(SyncLane* lane, const TransactionCoalescer::Operation& operation, const TCHAR* key, int* status);
+    bool FindConflict(ULONGLONG transactionId, ConflictResolution* resolution);
+    void AddConflict(ULONGLONG transactionId, const TCHAR* barcode, DWORD fields);
+    void RemoveConflict(ULONGLONG transactionId);
+    void SendBatch(SyncLane* lane);
+    bool IsApplied(int position) const;
+    void RecordOutcome(int position, bool applied, bool inDoubt);
+    static bool IsRetryable(int status);
+    bool IsItemBlocked(int position);
+    void BlockItem(int position);
+    void AddProgress(int transactions);
+    void AcknowledgeOperations(SyncLane* lane, const int* positions, int count);
+    void RecordWait(SyncPriority priority, ULONGLONG queuedTime, ULONGLONG now);
+    void CreateLanes(int count);
+    void DeleteLanes();
+    void StartLaneThreads();
+    void StopLaneThreads();
+    static DWORD WINAPI LaneThread(LPVOID param);
 };
 
 } // namespace HBX
@@ -0,0 +1,68 @@
+#ifndef SYNCSCHEDULER_HPP
+#define SYNCSCHEDULER_HPP
+
+#include <windows.h>
+
+namespace HBX {
+
+/**
+ * Decides when the background sync runs next
+ * Newly queued work waits a short settle time so more can join its
+ * batch, or runs at once when there is already a full batch of it or it
+ * is urgent.
+ * Pending work is otherwise retried at the configured interval. After a
+ * failed sync, retries back off exponentially up to the interval; while
+ * offline they stop at the probe interval, so a returning network is
+ * noticed within that. Settling is stretched as the recent share of
+ * failed transactions grows. Times are GetTickCount() values passed in
+ * by the caller, so the schedule can be driven by any clock.
+ */
+class SyncScheduler {
+public:
+    enum {
+        DEFAULT_INTERVAL_MS = 300000,
+        SETTLE_MS = 5000,           // Queued work waits this long for more
+        RETRY_MIN_MS = 5000,        // First retry after a failed sync
+        OFFLINE_PROBE_MS = 30000,   // Longest retry while offline
+        MAX_SETTLE_FACTOR = 5       // Settle time at a 100% failure rate
+    };
+
+    SyncScheduler();
+
+    // 0 disables the periodic and queue-driven syncs; requested ones
+    // still run
+    void SetInterval(DWORD intervalMs);
+    // Backlog that makes a full batch
+    void SetBatchSize(DWORD transactions);
+
+    void OnQueued(DWORD now, DWORD backlog, bool urgent = false);
+    void OnSyncRequested(DWORD now);
+    void OnNetworkAvailable(DWORD now);
+    void OnSyncStarted();
+    void OnSyncFinished(DWORD now, bool connected, DWORD transactions, DWORD failed, DWORD backlog);
+
+    // Milliseconds until the next sync is due; 0 if it is due now and
+    // INFINITE if nothing is scheduled
+    DWORD GetWaitMs(DWORD now) const;
+
+    // Recent share of failed transactions, in percent
+    DWORD GetFailureRate() const;
+    DWORD GetConsecutiveFailures() const;
+
+private:
+    DWORD m_intervalMs;
+    DWORD m_batchSize;
+    bool m_due;                 // m_dueTime is set
+    DWORD m_dueTime;
+    DWORD m_backlog;
+    bool m_backingOff;          // The last sync failed; m_dueTime is its retry
+    DWORD m_failures;
+    DWORD m_failureRate;
+
+    void ScheduleAt(DWORD now, DWORD delayMs);
+    DWORD GetSettleMs() const;
+};
+
+} // namespace HBX
+
+#endif // SYNCSCHEDULER_HPP
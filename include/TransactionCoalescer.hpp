@@ -0,0 +1,105 @@
+#ifndef TRANSACTIONCOALESCER_HPP
+#define TRANSACTIONCOALESCER_HPP
+
+#include <windows.h>
+#include "TransactionHandlers.hpp"
+
+namespace HBX {
+
+/**
+ * Collapses pending transactions per item to their net effect
+ * Transactions are added in journal order, a window at a time, and
+ * parsed once by the handler for their opcode. Each one is merged into
+ * the latest operation for the same item when that operation's handler
+ * allows it (repeated scans are counted, the last location or item
+ * update wins, an update or move of an item not yet created is folded
+ * into the create); otherwise it starts a new operation. Transactions
+ * without a handler are never merged, and operations on one item stay
+ * in order.
+ * An operation carries the IDs of all transactions merged into it, which
+ * are acknowledged together once it has been sent.
+ * An operation sent without an answer can be sealed: until the next pass
+ * it takes no transactions past the last one it held, so it is sent
+ * again exactly as before.
+ */
+class TransactionCoalescer {
+public:
+    enum {
+        WINDOW_SIZE = 1024,     // Transactions per window
+        BUCKET_COUNT = 256,     // Must be a power of two
+        TYPE_CHARS = 32,
+        BLOCKED_LIMIT = 64,     // Failed items remembered across windows
+        SEALED_LIMIT = 256
+    };
+
+    struct Operation {
+        const TransactionHandler* handler;  // NULL if unknown or unparsed; never sent
+        TransactionPayload payload;         // Net payload; no barcode if never merged
+        int count;              // Transactions merged into this operation
+        ULONGLONG timestamp;    // Of the latest of them, ms since 1970
+        int firstMember;
+        int lastMember;
+        int nextInBucket;
+        DWORD itemKey;
+    };
+
+    TransactionCoalescer();
+    ~TransactionCoalescer();
+
+    // Reset starts a sync pass; ClearWindow only drops the operations, so
+    // items blocked in an earlier window stay blocked
+    void Reset();
+    void ClearWindow();
+    bool IsFull() const;
+
+    // Adds a queued transaction ("[ticks] TYPE: DATA") with its journal
+    // ID, time and opcode (0 to look the type up, as for transactions
+    // queued by older builds); fails when the window is full
+    bool Add(ULONGLONG id, ULONGLONG timestamp, unsigned int opcode, const TCHAR* transaction);
+
+    int GetOperationCount() const;
+    const Operation& GetOperation(int position) const;
+    // For the lane that sends it, which may rebase its payload
+    Operation& GetOperation(int position);
+    int GetTransactionCount() const;
+
+    // IDs and times of the transactions merged into an operation (-1 at
+    // end); members are numbered in the order they were added
+    int GetNextMember(int member) const;
+    ULONGLONG GetMemberId(int member) const;
+    ULONGLONG GetMemberTimestamp(int member) const;
+
+    // After a change to an item fails, later operations on the item must
+    // wait for the next sync pass
+    void Block(int position);
+    bool IsBlocked(int position) const;
+
+    // For the pass: the operation beginning with transaction firstId ends
+    // with lastId. Reset unseals everything
+    void Seal(ULONGLONG firstId, ULONGLONG lastId);
+
+    // Splits a queued transaction into its type and data
+    static bool ParseTransaction(const TCHAR* transaction, TCHAR* type, int maxType, const TCHAR** data);
+
+private:
+    Operation* m_operations;
+    int m_operationCount;
+    ULONGLONG* m_memberIds;
+    ULONGLONG* m_memberTimes;
+    int* m_memberNext;
+    int m_memberCount;
+    int m_buckets[BUCKET_COUNT];
+    DWORD m_blocked[BLOCKED_LIMIT];
+    int m_blockedCount;
+    bool m_blockAll;
+    ULONGLONG m_sealedFirst[SEALED_LIMIT];
+    ULONGLONG m_sealedLast[SEALED_LIMIT];
+    int m_sealedCount;
+
+    bool IsSealedBefore(const Operation& target, ULONGLONG id) const;
+    void AddMember(Operation& operation, ULONGLONG id, ULONGLONG timestamp);
+};
+
+} // namespace HBX
+
+#endif // TRANSACTIONCOALESCER_HPP
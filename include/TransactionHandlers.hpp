@@ -0,0 +1,68 @@
+#ifndef TRANSACTIONHANDLERS_HPP
+#define TRANSACTIONHANDLERS_HPP
+
+#include <windows.h>
+#include "JournalFormat.hpp"
+#include "Models/Item.hpp"
+
+namespace HBX {
+
+class HbClient;
+
+// A queued transaction's data, parsed once when it is read from the
+// journal. Which fields are set depends on the handler; all are owned.
+struct TransactionPayload {
+    TCHAR* barcode;             // Item the transaction applies to
+    TCHAR* locationId;          // ITEM_MOVE
+    Models::Item* item;         // ITEM_CREATE, ITEM_UPDATE
+    TCHAR* itemJson;            // The item as a batch sends it
+};
+
+// How one type of transaction is merged and sent. Handlers are looked up
+// by the opcode stored with the transaction, so sync compares no type
+// names; a new type is one more entry in the table.
+struct TransactionHandler {
+    enum Flags {
+        HANDLER_BATCH = 0x0001,     // May go out in a batch sync request
+        HANDLER_WRITE = 0x0002,     // Changes the server; an item's writes keep their order
+        HANDLER_EDIT = 0x0004       // Made by the operator, who waits for it
+    };
+
+    JournalFormat::TransactionOpcode opcode;
+    const TCHAR* type;              // As queued, "ITEM_SCAN"
+    const TCHAR* batchType;         // In a batch request; NULL unless HANDLER_BATCH
+    DWORD flags;
+
+    // Fills a cleared payload from the queued data ("SCAN:<barcode>");
+    // false if it does not parse
+    bool (*parse)(const TCHAR* data, TransactionPayload* payload);
+
+    // Folds a later transaction on the same item into the payload, taking
+    // what it needs from the later one; false if the two must stay apart
+    bool (*merge)(TransactionPayload* target, const TransactionHandler* later, TransactionPayload* laterPayload);
+
+    // One request for the payload; the key and status as HbClient takes them
+    bool (*send)(HbClient* client, const TransactionPayload& payload, const TCHAR* requestKey, int* status);
+
+    // After the server refused the payload as stale (412), merges it onto
+    // the server's current copy so it can be sent again. conflicts gets
+    // the fields both sides changed (Item::Field); unless keepLocal, the
+    // payload is left as it was when there are any. False if the current
+    // copy could not be read. NULL for types the server takes unconditionally
+    bool (*rebase)(HbClient* client, TransactionPayload* payload, bool keepLocal, DWORD* conflicts);
+};
+
+class TransactionHandlers {
+public:
+    // NULL for opcodes without a handler
+    static const TransactionHandler* Find(unsigned int opcode);
+    // For transactions queued without an opcode; NULL for unknown types
+    static const TransactionHandler* FindByType(const TCHAR* type);
+
+    static void ClearPayload(TransactionPayload* payload);
+    static void FreePayload(TransactionPayload* payload);
+};
+
+} // namespace HBX
+
+#endif // TRANSACTIONHANDLERS_HPP
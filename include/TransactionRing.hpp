@@ -0,0 +1,59 @@
+#ifndef TRANSACTIONRING_HPP
+#define TRANSACTIONRING_HPP
+
+#include <windows.h>
+
+namespace HBX {
+
+/**
+ * Single-producer/single-consumer queue of transaction texts
+ * A fixed ring of fixed-size slots with no locks: the producer only
+ * advances the head and the consumer only advances the tail. Indexes are
+ * read and written with interlocked operations (full barriers), so a
+ * slot's contents are visible before the index that covers it. Exactly
+ * one thread may push and one other thread may pop. A text too long for
+ * its slot, such as an item's JSON, is copied to the heap and freed when
+ * the slot is popped.
+ */
+class TransactionRing {
+public:
+    enum {
+        SLOT_COUNT = 64,        // Must be a power of two
+        SLOT_CHARS = 256,       // Kept in the slot, including the terminator
+        TAG_CHARS = 65          // Longer tags are cut; the journal keeps 64 bytes
+    };
+
+    struct Slot {
+        DWORD ticket;
+        BYTE opcode;
+        TCHAR type[TAG_CHARS];
+        TCHAR item[TAG_CHARS];
+        TCHAR* text;            // The buffer, or a heap copy of a longer text
+        TCHAR buffer[SLOT_CHARS];
+    };
+
+    TransactionRing();
+    ~TransactionRing();
+
+    // Producer side; fails when the ring is full. Type and item may be NULL.
+    bool Push(const TCHAR* type, const TCHAR* item, const TCHAR* text, BYTE opcode, DWORD ticket);
+
+    // Consumer side; Peek returns NULL when the ring is empty and the
+    // slot, with its text, stays valid until Pop
+    const Slot* Peek() const;
+    void Pop();
+
+    // Either side; only a snapshot while the other side is running
+    int GetCount() const;
+
+private:
+    Slot* m_slots;
+    LONG m_head;            // Slots pushed so far (producer writes)
+    LONG m_tail;            // Slots popped so far (consumer writes)
+
+    static void FreeText(Slot& slot);
+};
+
+} // namespace HBX
+
+#endif // TRANSACTIONRING_HPP
@@ -9,7 +9,9 @@ namespace Views {
 
 /**
  * Offline queue management view
- * Displays pending transactions and sync status
+ * Displays pending transactions and sync status. Edits that conflict
+ * with changes made on the server are listed first, for the operator
+ * to resolve.
  */
 class QueueView {
 public:
@@ -48,6 +50,8 @@ private:
     SyncEngine* m_syncEngine;
     SyncCallback m_syncCallback;
     void* m_callbackUserData;
+    ULONGLONG m_conflictIds[SyncEngine::MAX_CONFLICTS];    // The first rows
+    int m_conflictCount;
 
     // Window procedure
     static LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
@@ -56,6 +60,7 @@ private:
     void OnSyncClick();
     void OnClearClick();
     void OnItemSelected(int index);
+    void AddConflictItem(const SyncEngine::SyncConflict& conflict);
 
     // UI layout
     void LayoutControls();
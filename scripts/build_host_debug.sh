@@ -5,11 +5,56 @@ echo "========================================"
 echo " HomeBox Client - Host Debug Build"
 echo "========================================"
 
-# This is a placeholder for host-side debug builds
-# Actual cross-compilation would require appropriate toolchain
+# The device application itself needs the Windows Mobile toolchain.
+# For actual Windows Mobile builds, use build_winmobile.bat on Windows
+# with Visual Studio 2008 installed.
+#
+# What does build on the host are the portable tools in tools/, which
+# share the journal record format with the device code. journal_dump
+# also opens journals with the device's own Journal, and journal_replay
+# syncs them with the device's coalescer and batches, on the Win32
+# stand-in in tests/host.
 
-echo "NOTE: This script is a placeholder"
-echo "For actual Windows Mobile builds, use build_winmobile.bat on Windows"
-echo "with Visual Studio 2008 installed"
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+ROOT_DIR="$(dirname "$SCRIPT_DIR")"
+OUT_DIR="$ROOT_DIR/bin/host"
+CXX="${CXX:-g++}"
+CXXFLAGS="${CXXFLAGS:--g -O1 -Wall -Wno-long-long}"
 
+mkdir -p "$OUT_DIR"
+
+echo "Building journal_dump..."
+$CXX $CXXFLAGS -I"$ROOT_DIR/include" -I"$ROOT_DIR/tests/host" \
+    "$ROOT_DIR/tools/journal_dump.cpp" \
+    "$ROOT_DIR/src/Journal.cpp" \
+    "$ROOT_DIR/src/JournalFormat.cpp" \
+    "$ROOT_DIR/src/JournalIndex.cpp" \
+    "$ROOT_DIR/src/JournalManifest.cpp" \
+    "$ROOT_DIR/src/DiagLog.cpp" \
+    "$ROOT_DIR/src/TransactionRing.cpp" \
+    "$ROOT_DIR/tests/host/win32_host.cpp" \
+    -lpthread -o "$OUT_DIR/journal_dump" || exit 1
+
+echo "Building journal_replay..."
+$CXX $CXXFLAGS -I"$ROOT_DIR/include" -I"$ROOT_DIR/tests/host" \
+    "$ROOT_DIR/tools/journal_replay.cpp" \
+    "$ROOT_DIR/src/Journal.cpp" \
+    "$ROOT_DIR/src/JournalFormat.cpp" \
+    "$ROOT_DIR/src/JournalIndex.cpp" \
+    "$ROOT_DIR/src/JournalManifest.cpp" \
+    "$ROOT_DIR/src/DiagLog.cpp" \
+    "$ROOT_DIR/src/TransactionRing.cpp" \
+    "$ROOT_DIR/src/TransactionCoalescer.cpp" \
+    "$ROOT_DIR/src/TransactionHandlers.cpp" \
+    "$ROOT_DIR/src/SyncBatch.cpp" \
+    "$ROOT_DIR/src/ReplayCache.cpp" \
+    "$ROOT_DIR/src/HbClient.cpp" \
+    "$ROOT_DIR/src/HttpClient.cpp" \
+    "$ROOT_DIR/src/Models/Item.cpp" \
+    "$ROOT_DIR/src/Models/Location.cpp" \
+    "$ROOT_DIR/src/Models/JsonLite.cpp" \
+    "$ROOT_DIR/tests/host/win32_host.cpp" \
+    -lpthread -o "$OUT_DIR/journal_replay" || exit 1
+
+echo "Host tools written to $OUT_DIR"
 exit 0
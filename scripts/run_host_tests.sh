@@ -0,0 +1,70 @@
+#!/bin/bash
+# Host test run: builds the journal and sync code against the POSIX
+# stand-in for Win32 in tests/host, together with the tools, and runs the
+# tests in tests/unit and tests/integration.
+#
+# Usage: run_host_tests.sh [--bench]
+#   --bench   also run the benchmarks in tests/bench (slow)
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+ROOT_DIR="$(dirname "$SCRIPT_DIR")"
+OUT_DIR="$ROOT_DIR/bin/host/tests"
+CXX="${CXX:-g++}"
+CXXFLAGS="${CXXFLAGS:--g -O1 -Wall -Wno-long-long}"
+
+RUN_BENCH=0
+if [ "$1" = "--bench" ]; then
+    RUN_BENCH=1
+fi
+
+"$SCRIPT_DIR/build_host_debug.sh" > /dev/null || exit 1
+mkdir -p "$OUT_DIR"
+
+# Device sources each test links, after the Win32 stand-in
+HOST_SOURCES="$ROOT_DIR/tests/host/win32_host.cpp"
+JOURNAL_SOURCES="$ROOT_DIR/src/Journal.cpp $ROOT_DIR/src/JournalFormat.cpp $ROOT_DIR/src/JournalIndex.cpp
+                 $ROOT_DIR/src/JournalManifest.cpp $ROOT_DIR/src/DiagLog.cpp $ROOT_DIR/src/TransactionRing.cpp"
+SYNC_SOURCES="$ROOT_DIR/src/HttpClient.cpp $ROOT_DIR/src/ReplayCache.cpp $ROOT_DIR/src/SyncScheduler.cpp"
+ENGINE_SOURCES="$ROOT_DIR/src/SyncEngine.cpp $ROOT_DIR/src/TransactionCoalescer.cpp $ROOT_DIR/src/SyncBatch.cpp
+                $ROOT_DIR/src/TransactionHandlers.cpp $ROOT_DIR/src/ConnectivityMonitor.cpp $ROOT_DIR/src/HbClient.cpp
+                $ROOT_DIR/src/Models/Item.cpp $ROOT_DIR/src/Models/Location.cpp $ROOT_DIR/src/Models/JsonLite.cpp
+                $JOURNAL_SOURCES $SYNC_SOURCES"
+
+build_test() {
+    local name="$1"
+    shift
+    echo "Building $name..."
+    $CXX $CXXFLAGS -I"$ROOT_DIR/tests/host" "$@" $HOST_SOURCES -lpthread -o "$OUT_DIR/$name" || exit 1
+}
+
+build_test test_journal "$ROOT_DIR/tests/unit/test_journal.cpp" $JOURNAL_SOURCES
+build_test test_transaction_ring "$ROOT_DIR/tests/unit/test_transaction_ring.cpp" $JOURNAL_SOURCES
+build_test test_sync_batch "$ROOT_DIR/tests/unit/test_sync_batch.cpp" $ENGINE_SOURCES
+build_test test_item_rebase "$ROOT_DIR/tests/unit/test_item_rebase.cpp" $ENGINE_SOURCES
+build_test test_connectivity_monitor "$ROOT_DIR/tests/unit/test_connectivity_monitor.cpp" $ENGINE_SOURCES
+build_test test_api_endpoints "$ROOT_DIR/tests/integration/test_api_endpoints.cpp" $SYNC_SOURCES
+build_test test_offline_sync "$ROOT_DIR/tests/integration/test_offline_sync.cpp" $SYNC_SOURCES
+build_test test_sync_engine "$ROOT_DIR/tests/integration/test_sync_engine.cpp" $ENGINE_SOURCES
+build_test journal_bench "$ROOT_DIR/tests/bench/journal_bench.cpp" $JOURNAL_SOURCES
+
+export HBX_HOST_BIN="$ROOT_DIR/bin/host"
+FAILED=0
+
+for test in test_journal test_transaction_ring test_sync_batch test_item_rebase test_connectivity_monitor test_api_endpoints test_offline_sync test_sync_engine; do
+    echo "== $test"
+    "$OUT_DIR/$test" || FAILED=1
+done
+
+if [ $RUN_BENCH -eq 1 ]; then
+    echo "== journal_bench"
+    "$OUT_DIR/journal_bench" || FAILED=1
+    echo "== replay_scaling"
+    "$ROOT_DIR/tests/bench/replay_scaling.sh" || FAILED=1
+fi
+
+if [ $FAILED -ne 0 ]; then
+    echo "Host tests FAILED"
+    exit 1
+fi
+echo "Host tests passed"
+exit 0
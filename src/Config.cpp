@@ -11,6 +11,16 @@ Config::Config()
     , m_authToken(NULL)
     , m_syncIntervalSeconds(300) // Default 5 minutes
     , m_offlineModeEnabled(true)
+    , m_syncBatchMaxOperations(64)
+    , m_syncBatchMaxKB(32)
+    , m_syncPipelineDepth(4)
+    , m_journalCommitWindowMs(20)
+    , m_journalCommitMaxRecords(32)
+    , m_journalCompactGarbagePercent(0)
+    , m_journalCompactSliceMs(5)
+    , m_journalRetentionMaxKB(8192)
+    , m_journalRetentionMaxAgeHours(168)
+    , m_journalRetentionPendingFloorKB(4096)
 {
     InitDefaults();
 }
@@ -28,6 +38,16 @@ void Config::InitDefaults()
     SetAuthToken(TEXT(""));
     m_syncIntervalSeconds = 300;
     m_offlineModeEnabled = true;
+    m_syncBatchMaxOperations = 64;
+    m_syncBatchMaxKB = 32;
+    m_syncPipelineDepth = 4;
+    m_journalCommitWindowMs = 20;
+    m_journalCommitMaxRecords = 32;
+    m_journalCompactGarbagePercent = 0;
+    m_journalCompactSliceMs = 5;
+    m_journalRetentionMaxKB = 8192;
+    m_journalRetentionMaxAgeHours = 168;
+    m_journalRetentionPendingFloorKB = 4096;
 }
 
 void Config::Cleanup()
@@ -125,6 +145,46 @@ bool Config::Load(const TCHAR* configPath)
         m_offlineModeEnabled = boolValue;
     }
 
+    // Parse journal group commit settings
+    if (ExtractJsonInt(jsonContent, TEXT("journalCommitWindowMs"), &intValue) && intValue >= 0) {
+        m_journalCommitWindowMs = intValue;
+    }
+    if (ExtractJsonInt(jsonContent, TEXT("journalCommitMaxRecords"), &intValue) && intValue > 0) {
+        m_journalCommitMaxRecords = intValue;
+    }
+
+    // Parse sync batch limits (0 operations sends each on its own)
+    if (ExtractJsonInt(jsonContent, TEXT("syncBatchMaxOperations"), &intValue) && intValue >= 0) {
+        m_syncBatchMaxOperations = intValue;
+    }
+    if (ExtractJsonInt(jsonContent, TEXT("syncBatchMaxKB"), &intValue) && intValue >= 1) {
+        m_syncBatchMaxKB = intValue;
+    }
+
+    // Parse sync requests in flight (1 sends one at a time)
+    if (ExtractJsonInt(jsonContent, TEXT("syncPipelineDepth"), &intValue) && intValue >= 1) {
+        m_syncPipelineDepth = intValue;
+    }
+
+    // Parse background compaction settings (0 percent leaves it off)
+    if (ExtractJsonInt(jsonContent, TEXT("journalCompactGarbagePercent"), &intValue) && intValue >= 0) {
+        m_journalCompactGarbagePercent = intValue;
+    }
+    if (ExtractJsonInt(jsonContent, TEXT("journalCompactSliceMs"), &intValue) && intValue >= 1) {
+        m_journalCompactSliceMs = intValue;
+    }
+
+    // Parse retention limits (0 turns a limit off)
+    if (ExtractJsonInt(jsonContent, TEXT("journalRetentionMaxKB"), &intValue) && intValue >= 0) {
+        m_journalRetentionMaxKB = intValue;
+    }
+    if (ExtractJsonInt(jsonContent, TEXT("journalRetentionMaxAgeHours"), &intValue) && intValue >= 0) {
+        m_journalRetentionMaxAgeHours = intValue;
+    }
+    if (ExtractJsonInt(jsonContent, TEXT("journalRetentionPendingFloorKB"), &intValue) && intValue >= 0) {
+        m_journalRetentionPendingFloorKB = intValue;
+    }
+
     delete[] jsonContent;
     return true;
 }
@@ -260,10 +320,38 @@ bool Config::Save(const TCHAR* configPath)
     pos += wsprintf(jsonBuffer + pos, TEXT("  \"syncIntervalSeconds\": %d,\n"),
                     m_syncIntervalSeconds);
 
-    // Write offlineModeEnabled (last item, no comma)
-    pos += wsprintf(jsonBuffer + pos, TEXT("  \"offlineModeEnabled\": %s\n"),
+    // Write offlineModeEnabled
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"offlineModeEnabled\": %s,\n"),
                     m_offlineModeEnabled ? TEXT("true") : TEXT("false"));
 
+    // Write sync batch limits
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"syncBatchMaxOperations\": %d,\n"),
+                    m_syncBatchMaxOperations);
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"syncBatchMaxKB\": %d,\n"),
+                    m_syncBatchMaxKB);
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"syncPipelineDepth\": %d,\n"),
+                    m_syncPipelineDepth);
+
+    // Write journal group commit settings
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"journalCommitWindowMs\": %d,\n"),
+                    m_journalCommitWindowMs);
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"journalCommitMaxRecords\": %d,\n"),
+                    m_journalCommitMaxRecords);
+
+    // Write journal compaction settings
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"journalCompactGarbagePercent\": %d,\n"),
+                    m_journalCompactGarbagePercent);
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"journalCompactSliceMs\": %d,\n"),
+                    m_journalCompactSliceMs);
+
+    // Write journal retention settings (last item, no comma)
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"journalRetentionMaxKB\": %d,\n"),
+                    m_journalRetentionMaxKB);
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"journalRetentionMaxAgeHours\": %d,\n"),
+                    m_journalRetentionMaxAgeHours);
+    pos += wsprintf(jsonBuffer + pos, TEXT("  \"journalRetentionPendingFloorKB\": %d\n"),
+                    m_journalRetentionPendingFloorKB);
+
     // End JSON object
     pos += wsprintf(jsonBuffer + pos, TEXT("}\n"));
 
@@ -324,6 +412,56 @@ bool Config::IsOfflineModeEnabled() const
     return m_offlineModeEnabled;
 }
 
+int Config::GetSyncBatchMaxOperations() const
+{
+    return m_syncBatchMaxOperations;
+}
+
+int Config::GetSyncBatchMaxKB() const
+{
+    return m_syncBatchMaxKB;
+}
+
+int Config::GetSyncPipelineDepth() const
+{
+    return m_syncPipelineDepth;
+}
+
+int Config::GetJournalCommitWindowMs() const
+{
+    return m_journalCommitWindowMs;
+}
+
+int Config::GetJournalCommitMaxRecords() const
+{
+    return m_journalCommitMaxRecords;
+}
+
+int Config::GetJournalCompactGarbagePercent() const
+{
+    return m_journalCompactGarbagePercent;
+}
+
+int Config::GetJournalCompactSliceMs() const
+{
+    return m_journalCompactSliceMs;
+}
+
+int Config::GetJournalRetentionMaxKB() const
+{
+    return m_journalRetentionMaxKB;
+}
+
+int Config::GetJournalRetentionMaxAgeHours() const
+{
+    return m_journalRetentionMaxAgeHours;
+}
+
+int Config::GetJournalRetentionPendingFloorKB() const
+{
+    return m_journalRetentionPendingFloorKB;
+}
+
 void Config::SetApiBaseUrl(const TCHAR* url)
 {
     if (m_apiBaseUrl) {
@@ -376,4 +514,54 @@ void Config::SetOfflineModeEnabled(bool enabled)
     m_offlineModeEnabled = enabled;
 }
 
+void Config::SetSyncBatchMaxOperations(int operations)
+{
+    m_syncBatchMaxOperations = operations;
+}
+
+void Config::SetSyncBatchMaxKB(int kilobytes)
+{
+    m_syncBatchMaxKB = kilobytes;
+}
+
+void Config::SetSyncPipelineDepth(int depth)
+{
+    m_syncPipelineDepth = depth;
+}
+
+void Config::SetJournalCommitWindowMs(int milliseconds)
+{
+    m_journalCommitWindowMs = milliseconds;
+}
+
+void Config::SetJournalCommitMaxRecords(int records)
+{
+    m_journalCommitMaxRecords = records;
+}
+
+void Config::SetJournalCompactGarbagePercent(int percent)
+{
+    m_journalCompactGarbagePercent = percent;
+}
+
+void Config::SetJournalCompactSliceMs(int milliseconds)
+{
+    m_journalCompactSliceMs = milliseconds;
+}
+
+void Config::SetJournalRetentionMaxKB(int kilobytes)
+{
+    m_journalRetentionMaxKB = kilobytes;
+}
+
+void Config::SetJournalRetentionMaxAgeHours(int hours)
+{
+    m_journalRetentionMaxAgeHours = hours;
+}
+
+void Config::SetJournalRetentionPendingFloorKB(int kilobytes)
+{
+    m_journalRetentionPendingFloorKB = kilobytes;
+}
+
 } // namespace HBX
@@ -0,0 +1,353 @@
+#include "../include/ConnectivityMonitor.hpp"
+#include "../include/HbClient.hpp"
+
+namespace HBX {
+
+ConnectivityMonitor::ConnectivityMonitor(HbClient* hbClient)
+    : m_hbClient(hbClient)
+    , m_state(CIRCUIT_CLOSED)
+    , m_online(true)
+    , m_checked(false)
+    , m_checkTime(0)
+    , m_failures(0)
+    , m_openCount(0)
+    , m_nextProbeTime(0)
+    , m_probeRequested(false)
+    , m_probing(false)
+    , m_random(GetTickCount() ^ (DWORD)(UINT_PTR)this)
+    , m_callback(NULL)
+    , m_userData(NULL)
+    , m_probeThread(NULL)
+    , m_wakeEvent(NULL)
+    , m_stopEvent(NULL)
+    , m_winsockStarted(false)
+{
+    InitializeCriticalSection(&m_lock);
+
+    // Once for all probes, instead of around each of them
+    WSADATA wsaData;
+    m_winsockStarted = (WSAStartup(MAKEWORD(2, 2), &wsaData) == 0);
+}
+
+ConnectivityMonitor::~ConnectivityMonitor()
+{
+    Stop();
+
+    if (m_winsockStarted) {
+        WSACleanup();
+    }
+    DeleteCriticalSection(&m_lock);
+}
+
+bool ConnectivityMonitor::Start(ChangeCallback callback, void* userData)
+{
+    if (m_probeThread) {
+        return true;
+    }
+
+    m_callback = callback;
+    m_userData = userData;
+    m_wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    // Nothing is known yet; find out before anyone asks
+    EnterCriticalSection(&m_lock);
+    if (!m_checked) {
+        m_probeRequested = true;
+    }
+    LeaveCriticalSection(&m_lock);
+
+    m_probeThread = CreateThread(NULL, 0, ProbeThread, this, 0, NULL);
+    if (!m_probeThread) {
+        CloseHandle(m_wakeEvent);
+        CloseHandle(m_stopEvent);
+        m_wakeEvent = NULL;
+        m_stopEvent = NULL;
+        return false;
+    }
+
+    SetThreadPriority(m_probeThread, THREAD_PRIORITY_BELOW_NORMAL);
+    return true;
+}
+
+void ConnectivityMonitor::Stop()
+{
+    if (!m_probeThread) {
+        return;
+    }
+
+    // A probe in progress finishes first
+    SetEvent(m_stopEvent);
+    WaitForSingleObject(m_probeThread, INFINITE);
+    CloseHandle(m_probeThread);
+    CloseHandle(m_wakeEvent);
+    CloseHandle(m_stopEvent);
+
+    m_probeThread = NULL;
+    m_wakeEvent = NULL;
+    m_stopEvent = NULL;
+}
+
+bool ConnectivityMonitor::IsOnline()
+{
+    EnterCriticalSection(&m_lock);
+    DWORD now = GetTickCount();
+    bool online = (m_state != CIRCUIT_OPEN) && m_online;
+
+    // While open the probes run on their own schedule
+    bool stale = (m_state != CIRCUIT_OPEN) && !IsFresh(now);
+    bool wake = false;
+    if (stale && m_probeThread && !m_probeRequested) {
+        m_probeRequested = true;
+        wake = true;
+    }
+    LeaveCriticalSection(&m_lock);
+
+    if (wake) {
+        SetEvent(m_wakeEvent);
+    } else if (stale && !m_probeThread) {
+        online = Check();
+    }
+    return online;
+}
+
+bool ConnectivityMonitor::Check()
+{
+    EnterCriticalSection(&m_lock);
+    DWORD now = GetTickCount();
+    bool probe;
+    if (m_state == CIRCUIT_OPEN) {
+        probe = (LONG)(m_nextProbeTime - now) <= 0;
+    } else {
+        probe = !IsFresh(now);
+    }
+
+    // Another thread is asking the network already; go by what is known
+    bool result = (m_state != CIRCUIT_OPEN) && m_online;
+    if (probe && m_probing) {
+        probe = false;
+    }
+    if (probe) {
+        m_probing = true;
+    }
+    LeaveCriticalSection(&m_lock);
+
+    if (!probe) {
+        return result;
+    }
+
+    bool reachable = Probe();
+    OnProbed(reachable);
+    return reachable;
+}
+
+void ConnectivityMonitor::Refresh()
+{
+    EnterCriticalSection(&m_lock);
+    if (m_state == CIRCUIT_OPEN) {
+        m_nextProbeTime = GetTickCount();
+    }
+    m_probeRequested = true;
+    LeaveCriticalSection(&m_lock);
+
+    if (m_probeThread) {
+        SetEvent(m_wakeEvent);
+    }
+}
+
+void ConnectivityMonitor::ReportSuccess()
+{
+    EnterCriticalSection(&m_lock);
+    bool wasOpen = (m_state == CIRCUIT_OPEN);
+    m_state = CIRCUIT_CLOSED;
+    m_online = true;
+    m_checked = true;
+    m_checkTime = GetTickCount();
+    m_failures = 0;
+    m_openCount = 0;
+    LeaveCriticalSection(&m_lock);
+
+    if (wasOpen) {
+        Notify(true);
+    }
+}
+
+void ConnectivityMonitor::ReportFailure()
+{
+    EnterCriticalSection(&m_lock);
+    bool opened = false;
+    if (m_state == CIRCUIT_HALF_OPEN) {
+        // The probe was right about the name, not about the server
+        Open(GetTickCount());
+        opened = true;
+    } else if (m_state == CIRCUIT_CLOSED && ++m_failures >= FAILURE_THRESHOLD) {
+        Open(GetTickCount());
+        opened = true;
+    }
+    LeaveCriticalSection(&m_lock);
+
+    if (opened) {
+        Notify(false);
+    }
+}
+
+ConnectivityMonitor::CircuitState ConnectivityMonitor::GetCircuitState() const
+{
+    return m_state;
+}
+
+bool ConnectivityMonitor::Probe()
+{
+    if (!m_hbClient) {
+        return false;
+    }
+
+    // Resolving the server's name is enough to tell whether the network
+    // is up, and cheaper than a request
+    const TCHAR* baseUrl = m_hbClient->GetBaseUrl();
+    if (!baseUrl || lstrlen(baseUrl) == 0) {
+        return false;
+    }
+
+    // Skip protocol
+    const TCHAR* start = baseUrl;
+    if (wcsncmp(baseUrl, TEXT("http://"), 7) == 0) {
+        start = baseUrl + 7;
+    } else if (wcsncmp(baseUrl, TEXT("https://"), 8) == 0) {
+        start = baseUrl + 8;
+    }
+
+    // Host, up to the first slash or colon
+    char asciiHost[256];
+    int i = 0;
+    while (start[i] && start[i] != '/' && start[i] != ':' && i < 255) {
+        asciiHost[i] = (char)start[i];
+        i++;
+    }
+    asciiHost[i] = '\0';
+
+    struct hostent* hostInfo = gethostbyname(asciiHost);
+    return (hostInfo != NULL);
+}
+
+void ConnectivityMonitor::OnProbed(bool reachable)
+{
+    EnterCriticalSection(&m_lock);
+    DWORD now = GetTickCount();
+    m_probing = false;
+    m_probeRequested = false;
+    m_checked = true;
+    m_checkTime = now;
+    m_online = reachable;
+
+    bool changed = false;
+    if (reachable) {
+        if (m_state == CIRCUIT_OPEN) {
+            m_state = CIRCUIT_HALF_OPEN;
+            changed = true;
+        }
+    } else {
+        // Without a name there is no network; no need to wait for failures
+        changed = (m_state != CIRCUIT_OPEN);
+        Open(now);
+    }
+    LeaveCriticalSection(&m_lock);
+
+    if (changed) {
+        Notify(reachable);
+    }
+}
+
+void ConnectivityMonitor::Open(DWORD now)
+{
+    // Each opening without a success in between waits longer
+    m_state = CIRCUIT_OPEN;
+    m_online = false;
+    m_failures = 0;
+    m_openCount++;
+    m_nextProbeTime = now + GetBackoffMs();
+
+    if (m_probeThread) {
+        SetEvent(m_wakeEvent);
+    }
+}
+
+DWORD ConnectivityMonitor::GetBackoffMs()
+{
+    DWORD shift = (m_openCount - 1 < 16) ? m_openCount - 1 : 16;
+    DWORD delay = (DWORD)PROBE_MIN_MS << shift;
+    if (delay > PROBE_MAX_MS) {
+        delay = PROBE_MAX_MS;
+    }
+
+    // Half of it is jitter, so devices that lost the same access point
+    // do not all come back at once
+    m_random = m_random * 1103515245 + 12345;
+    return delay / 2 + (m_random >> 8) % (delay / 2 + 1);
+}
+
+DWORD ConnectivityMonitor::GetProbeWaitMs(DWORD now) const
+{
+    // OnProbed wakes the thread if the probe in flight opens the circuit
+    if (m_probing) {
+        return INFINITE;
+    }
+    if (m_probeRequested && m_state != CIRCUIT_OPEN) {
+        return 0;
+    }
+    if (m_state != CIRCUIT_OPEN) {
+        return INFINITE;
+    }
+
+    LONG left = (LONG)(m_nextProbeTime - now);
+    return (left > 0) ? (DWORD)left : 0;
+}
+
+bool ConnectivityMonitor::IsFresh(DWORD now) const
+{
+    return m_checked && now - m_checkTime < ONLINE_TTL_MS;
+}
+
+void ConnectivityMonitor::Notify(bool available)
+{
+    if (m_callback) {
+        m_callback(available, m_userData);
+    }
+}
+
+DWORD WINAPI ConnectivityMonitor::ProbeThread(LPVOID param)
+{
+    ConnectivityMonitor* pThis = (ConnectivityMonitor*)param;
+    if (!pThis) {
+        return 1;
+    }
+
+    HANDLE events[2] = { pThis->m_stopEvent, pThis->m_wakeEvent };
+    for (;;) {
+        EnterCriticalSection(&pThis->m_lock);
+        DWORD wait = pThis->GetProbeWaitMs(GetTickCount());
+        LeaveCriticalSection(&pThis->m_lock);
+
+        DWORD result = WaitForMultipleObjects(2, events, FALSE, wait);
+        if (result == WAIT_OBJECT_0) {
+            break;
+        }
+
+        // A wake may only mean the schedule changed
+        EnterCriticalSection(&pThis->m_lock);
+        bool probe = pThis->GetProbeWaitMs(GetTickCount()) == 0 && !pThis->m_probing;
+        if (probe) {
+            pThis->m_probeRequested = false;
+            pThis->m_probing = true;
+        }
+        LeaveCriticalSection(&pThis->m_lock);
+
+        if (probe) {
+            pThis->OnProbed(pThis->Probe());
+        }
+    }
+
+    return 0;
+}
+
+} // namespace HBX
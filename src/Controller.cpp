@@ -7,6 +7,7 @@ Controller::Controller()
     : m_hInstance(NULL)
     , m_mainWindow(NULL)
     , m_state(STATE_INIT)
+    , m_syncProgress(0)
     , m_config(NULL)
     , m_hbClient(NULL)
     , m_syncEngine(NULL)
@@ -48,9 +49,31 @@ bool Controller::Initialize(HINSTANCE hInstance)
         return false;
     }
 
+    // Batch journal flushes; queued transactions still commit immediately
+    m_journal->SetGroupCommit(m_config->GetJournalCommitWindowMs(),
+                              m_config->GetJournalCommitMaxRecords());
+
+    // Bound the journal's flash use; unsynced scans are kept down to the floor
+    m_journal->SetRetention((DWORD)m_config->GetJournalRetentionMaxKB() * 1024,
+                            (DWORD)m_config->GetJournalRetentionMaxAgeHours() * 3600,
+                            (DWORD)m_config->GetJournalRetentionPendingFloorKB() * 1024);
+
+    // Opt-in: compact in short slices whenever the journal is idle
+    if (m_config->GetJournalCompactGarbagePercent() > 0) {
+        m_journal->StartBackgroundCompaction(m_config->GetJournalCompactGarbagePercent(),
+                                             m_config->GetJournalCompactSliceMs());
+    }
+
     // Configure API client
     m_hbClient->SetBaseUrl(m_config->GetApiBaseUrl());
 
+    // Pending work goes to the sync endpoint in bounded batches
+    m_syncEngine->SetBatchLimits(m_config->GetSyncBatchMaxOperations(),
+                                 (DWORD)m_config->GetSyncBatchMaxKB() * 1024);
+
+    // ...with several requests in flight, which is what a slow link needs
+    m_syncEngine->SetPipelineDepth(m_config->GetSyncPipelineDepth());
+
     // Initialize scanner
     if (!m_scanner->Initialize())
     {
@@ -64,6 +87,21 @@ bool Controller::Initialize(HINSTANCE hInstance)
         return false;
     }
 
+    // Queued scans are written by the journal's own thread, so the scan
+    // path does not wait for flash; the window hears when they are durable
+    if (!m_journal->StartWriter(JournalCommitted, this))
+    {
+        m_journal->LogError(TEXT("JOURNAL_WRITER"), TEXT("Failed to start journal writer; queuing synchronously"));
+    }
+
+    // Queued work is synced in the background, shortly after it is queued
+    // and at the configured interval while any is pending
+    m_syncEngine->SetAutoSyncEnabled(true);
+    if (!m_syncEngine->StartAutoSync(m_config->GetSyncIntervalSeconds(), SyncStatusChanged, this))
+    {
+        m_journal->LogError(TEXT("SYNC_WORKER"), TEXT("Failed to start sync worker; syncing on request only"));
+    }
+
     m_journal->LogInfo(TEXT("Application initialized successfully"));
     SetState(STATE_IDLE);
 
@@ -97,6 +135,16 @@ void Controller::Shutdown()
         m_scanner = NULL;
     }
 
+    // No sync may be reading the journal while it shuts down
+    if (m_syncEngine) {
+        m_syncEngine->StopAutoSync();
+    }
+
+    // Write out anything still queued before the components go away
+    if (m_journal) {
+        m_journal->StopWriter();
+    }
+
     // Cleanup components
     if (m_syncEngine) {
         delete m_syncEngine;
@@ -109,6 +157,17 @@ void Controller::Shutdown()
     }
 
     if (m_journal) {
+        m_journal->StopBackgroundCompaction();
+
+        Journal::CompactionStats stats;
+        m_journal->GetCompactionStats(&stats);
+        if (stats.slicesRun > 0) {
+            TCHAR message[160];
+            wsprintf(message, TEXT("Journal compaction: %lu KB reclaimed in %lu slices (%lu ms)"),
+                     (DWORD)(stats.bytesReclaimed / 1024), stats.slicesRun, stats.timeSpentMs);
+            m_journal->LogInfo(message);
+        }
+
         m_journal->LogInfo(TEXT("Application shutdown"));
         delete m_journal;
         m_journal = NULL;
@@ -168,13 +227,20 @@ void Controller::OnScanReceived(const TCHAR* barcode)
         return;
     }
 
-    m_journal->LogTransaction(TEXT("SCAN"), barcode, TEXT("Barcode scanned"));
+    // Audit record only; it can ride along with the next group commit
+    m_journal->LogTransaction(TEXT("SCAN"), barcode, TEXT("Barcode scanned"), false);
 
     SetState(STATE_SCANNING);
 
-    // Try to lookup item from API
+    // Try to lookup item from API; known to be offline, it would only
+    // wait for a timeout
     Models::Item item;
-    bool success = m_hbClient->GetItem(barcode, &item);
+    bool success = m_syncEngine->IsOnline() && m_hbClient->GetItem(barcode, &item);
+
+    // The server answered, so pending work can go now
+    if (success) {
+        m_syncEngine->NotifyNetworkAvailable();
+    }
 
     if (success && item.IsValid()) {
         // Item found - display it
@@ -195,7 +261,7 @@ void Controller::OnScanReceived(const TCHAR* barcode)
             TCHAR transactionData[512];
             wsprintf(transactionData, TEXT("SCAN:%s"), barcode);
 
-            if (m_syncEngine->QueueTransaction(TEXT("ITEM_SCAN"), transactionData)) {
+            if (m_syncEngine->QueueTransaction(TEXT("ITEM_SCAN"), transactionData, barcode)) {
                 MessageBox(m_mainWindow,
                           TEXT("Device is offline. Scan queued for synchronization."),
                           TEXT("Offline Mode"),
@@ -226,6 +292,13 @@ void Controller::OnScanReceived(const TCHAR* barcode)
 
 void Controller::OnSyncRequested()
 {
+    // The worker reports back through WM_SYNC_STATUS
+    if (m_syncEngine->IsAutoSyncRunning()) {
+        m_syncEngine->RequestSync();
+        return;
+    }
+
+    m_syncProgress = 0;
     SetState(STATE_SYNCING);
 
     if (m_syncEngine->Sync()) {
@@ -242,6 +315,83 @@ void Controller::OnConfigChanged()
     // Reload configuration
     m_config->Load(TEXT("\\Program Files\\HBXClient\\hb_conf.json"));
     m_hbClient->SetBaseUrl(m_config->GetApiBaseUrl());
+
+    if (m_syncEngine->IsAutoSyncRunning()) {
+        m_syncEngine->StartAutoSync(m_config->GetSyncIntervalSeconds(), SyncStatusChanged, this);
+    }
+}
+
+void Controller::OnJournalCommitted(DWORD ticket, bool success)
+{
+    if (!success) {
+        // The scan was already reported as queued; it may now be lost
+        MessageBox(m_mainWindow,
+                  TEXT("Failed to save queued scans to storage."),
+                  TEXT("Error"),
+                  MB_OK | MB_ICONERROR);
+
+        m_journal->LogError(TEXT("QUEUE_FAILED"), TEXT("Failed to write queued transactions"));
+    }
+
+    // The queue count in the title may have changed
+    if (m_state == STATE_IDLE) {
+        UpdateUI();
+    }
+}
+
+void Controller::OnSyncStatus(SyncEngine::SyncEvent event, DWORD value)
+{
+    // A scan in progress keeps its state; the sync only shows when idle
+    switch (event) {
+    case SyncEngine::SYNC_EVENT_STARTED:
+        m_syncProgress = 0;
+        if (m_state == STATE_IDLE) {
+            SetState(STATE_SYNCING);
+        }
+        break;
+
+    case SyncEngine::SYNC_EVENT_PROGRESS:
+        m_syncProgress = value;
+        if (m_state == STATE_SYNCING) {
+            UpdateUI();
+        }
+        break;
+
+    case SyncEngine::SYNC_EVENT_FINISHED:
+        if (m_state == STATE_SYNCING) {
+            SetState(STATE_IDLE);
+        } else if (m_state == STATE_IDLE) {
+            UpdateUI();
+        }
+        break;
+    }
+}
+
+void Controller::JournalCommitted(DWORD ticket, bool success, void* userData)
+{
+    Controller* pController = (Controller*)userData;
+    if (!pController || !pController->m_mainWindow) {
+        return;
+    }
+
+    // Durable now, so the sync worker may pick it up
+    if (success && pController->m_syncEngine) {
+        pController->m_syncEngine->NotifyQueued();
+    }
+
+    // Hand over to the UI thread
+    PostMessage(pController->m_mainWindow, WM_JOURNAL_COMMITTED, (WPARAM)ticket, (LPARAM)(success ? 1 : 0));
+}
+
+void Controller::SyncStatusChanged(SyncEngine::SyncEvent event, DWORD value, void* userData)
+{
+    Controller* pController = (Controller*)userData;
+    if (!pController || !pController->m_mainWindow) {
+        return;
+    }
+
+    // Posted, so the worker never waits for the UI thread
+    PostMessage(pController->m_mainWindow, WM_SYNC_STATUS, (WPARAM)event, (LPARAM)value);
 }
 
 bool Controller::InitializeUI()
@@ -273,7 +423,7 @@ void Controller::UpdateUI()
         break;
 
     case STATE_SYNCING:
-        lstrcpy(title, TEXT("HomeBox Client - Syncing..."));
+        wsprintf(title, TEXT("HomeBox Client - Syncing... [%lu]"), m_syncProgress);
         break;
 
     case STATE_ERROR:
@@ -339,6 +489,18 @@ LRESULT CALLBACK Controller::WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPA
         PostQuitMessage(0);
         return 0;
 
+    case WM_JOURNAL_COMMITTED:
+        if (pController) {
+            pController->OnJournalCommitted((DWORD)wParam, lParam != 0);
+        }
+        return 0;
+
+    case WM_SYNC_STATUS:
+        if (pController) {
+            pController->OnSyncStatus((SyncEngine::SyncEvent)wParam, (DWORD)lParam);
+        }
+        return 0;
+
     case WM_CLOSE:
         if (pController) {
             // Confirm exit
@@ -0,0 +1,266 @@
+#include "../include/DiagLog.hpp"
+#include <string.h>
+
+namespace HBX {
+
+DiagLog::DiagLog()
+    : m_file(INVALID_HANDLE_VALUE)
+    , m_buffer(new BYTE[BUFFER_SLOTS * JournalFormat::DIAG_SLOT_SIZE])
+    , m_bufferedSlots(0)
+    , m_firstSlot(0)
+    , m_nextSlot(0)
+    , m_nextSequence(1)
+{
+}
+
+DiagLog::~DiagLog()
+{
+    Close();
+    delete[] m_buffer;
+}
+
+bool DiagLog::Open(const TCHAR* path)
+{
+    Close();
+
+    m_file = CreateFile(
+        path,
+        GENERIC_WRITE | GENERIC_READ,
+        0,
+        NULL,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (m_file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    m_bufferedSlots = 0;
+    m_nextSlot = 0;
+    m_nextSequence = 1;
+
+    BYTE fileHeader[JournalFormat::FILE_HEADER_SIZE];
+    DWORD bytesRead = 0;
+    ULONGLONG baseSequence = 0;
+    if (ReadFile(m_file, fileHeader, sizeof(fileHeader), &bytesRead, NULL) &&
+        JournalFormat::DecodeFileHeader(fileHeader, bytesRead, &baseSequence)) {
+        return FindNewest();
+    }
+
+    // New or unreadable: start an empty log
+    JournalFormat::EncodeFileHeader(fileHeader, 1);
+    DWORD written = 0;
+    if (SetFilePointer(m_file, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+        !SetEndOfFile(m_file) ||
+        !WriteFile(m_file, fileHeader, sizeof(fileHeader), &written, NULL) ||
+        written != sizeof(fileHeader)) {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void DiagLog::Close()
+{
+    if (m_file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    Flush();
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+}
+
+bool DiagLog::Write(WORD recordType, ULONGLONG timestamp, const BYTE* payload, DWORD length)
+{
+    if (m_file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // Cut long messages, backing off to the start of a UTF-8 character
+    if (length > JournalFormat::DIAG_MAX_PAYLOAD) {
+        length = JournalFormat::DIAG_MAX_PAYLOAD;
+        while (length > 0 && (payload[length] & 0xC0) == 0x80) {
+            length--;
+        }
+    }
+
+    BYTE* slot = m_buffer + m_bufferedSlots * JournalFormat::DIAG_SLOT_SIZE;
+    memset(slot, 0, JournalFormat::DIAG_SLOT_SIZE);
+    if (length > 0) {
+        memcpy(slot + JournalFormat::RECORD_HEADER_SIZE, payload, length);
+    }
+
+    JournalFormat::RecordHeader header;
+    header.sequence = m_nextSequence++;
+    header.timestamp = timestamp;
+    header.type = recordType;
+    header.flags = 0;
+    header.length = length;
+    JournalFormat::EncodeRecord(slot, &header);
+
+    if (m_bufferedSlots == 0) {
+        m_firstSlot = m_nextSlot;
+    }
+    m_bufferedSlots++;
+    m_nextSlot = (m_nextSlot + 1) % SLOT_COUNT;
+
+    // Errors are what the log is for after a crash; the rest can wait
+    if (recordType == JournalFormat::REC_ERROR) {
+        return Flush();
+    }
+
+    if (m_bufferedSlots == BUFFER_SLOTS) {
+        return WriteSlots();
+    }
+    return true;
+}
+
+bool DiagLog::Flush()
+{
+    if (m_file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    if (m_bufferedSlots == 0) {
+        return true;
+    }
+
+    if (!WriteSlots()) {
+        return false;
+    }
+
+    FlushFileBuffers(m_file);
+    return true;
+}
+
+bool DiagLog::Expire(ULONGLONG cutoff)
+{
+    // Buffered entries are the newest, so they only need to be on file
+    // first; the buffer is then free for reading slots
+    if (!Flush()) {
+        return false;
+    }
+
+    // The ring is oldest first from the next slot to reuse, wrapping round
+    bool done = false;
+    if (!ExpireRange(m_nextSlot, SLOT_COUNT, cutoff, &done)) {
+        return false;
+    }
+    if (!done && !ExpireRange(0, m_nextSlot, cutoff, &done)) {
+        return false;
+    }
+
+    FlushFileBuffers(m_file);
+    return true;
+}
+
+bool DiagLog::ExpireRange(DWORD first, DWORD end, ULONGLONG cutoff, bool* done)
+{
+    for (DWORD slot = first; slot < end; slot += BUFFER_SLOTS) {
+        DWORD count = end - slot;
+        if (count > BUFFER_SLOTS) {
+            count = BUFFER_SLOTS;
+        }
+
+        DWORD offset = JournalFormat::FILE_HEADER_SIZE + slot * JournalFormat::DIAG_SLOT_SIZE;
+        DWORD bytesRead = 0;
+        if (SetFilePointer(m_file, offset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+            !ReadFile(m_file, m_buffer, count * JournalFormat::DIAG_SLOT_SIZE, &bytesRead, NULL)) {
+            return false;
+        }
+
+        // Slots past the end of the file have never been written
+        DWORD slotsRead = bytesRead / JournalFormat::DIAG_SLOT_SIZE;
+        DWORD cleared = 0;
+
+        for (DWORD i = 0; i < slotsRead; i++) {
+            BYTE* data = m_buffer + i * JournalFormat::DIAG_SLOT_SIZE;
+            JournalFormat::RecordHeader header;
+            if (JournalFormat::DecodeRecord(data, JournalFormat::DIAG_SLOT_SIZE, &header) != JournalFormat::DECODE_OK) {
+                continue;
+            }
+            if (header.timestamp >= cutoff) {
+                *done = true;
+                break;
+            }
+            memset(data, 0, JournalFormat::DIAG_SLOT_SIZE);
+            cleared = i + 1;
+        }
+
+        if (cleared > 0 && !WriteAt(slot, m_buffer, cleared)) {
+            return false;
+        }
+
+        if (*done || slotsRead < count) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool DiagLog::FindNewest()
+{
+    // The slot after the highest sequence number is the next to reuse
+    DWORD slot = 0;
+    while (slot < SLOT_COUNT) {
+        DWORD bytesRead = 0;
+        if (!ReadFile(m_file, m_buffer, BUFFER_SLOTS * JournalFormat::DIAG_SLOT_SIZE, &bytesRead, NULL)) {
+            return false;
+        }
+
+        DWORD slotsRead = bytesRead / JournalFormat::DIAG_SLOT_SIZE;
+        for (DWORD i = 0; i < slotsRead && slot < SLOT_COUNT; i++, slot++) {
+            JournalFormat::RecordHeader header;
+            if (JournalFormat::DecodeRecord(m_buffer + i * JournalFormat::DIAG_SLOT_SIZE,
+                                            JournalFormat::DIAG_SLOT_SIZE, &header) == JournalFormat::DECODE_OK &&
+                header.sequence >= m_nextSequence) {
+                m_nextSequence = header.sequence + 1;
+                m_nextSlot = (slot + 1) % SLOT_COUNT;
+            }
+        }
+
+        if (slotsRead < BUFFER_SLOTS) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool DiagLog::WriteSlots()
+{
+    // The buffered slots are contiguous in the ring, so at most two
+    // writes: up to the end of the file, then from the first slot
+    DWORD count = m_bufferedSlots;
+    DWORD firstPart = SLOT_COUNT - m_firstSlot;
+    if (firstPart > count) {
+        firstPart = count;
+    }
+
+    bool success = WriteAt(m_firstSlot, m_buffer, firstPart);
+    if (success && firstPart < count) {
+        success = WriteAt(0, m_buffer + firstPart * JournalFormat::DIAG_SLOT_SIZE, count - firstPart);
+    }
+
+    // A failed write drops the buffered entries rather than retrying forever
+    m_bufferedSlots = 0;
+    return success;
+}
+
+bool DiagLog::WriteAt(DWORD slot, const BYTE* data, DWORD count)
+{
+    DWORD offset = JournalFormat::FILE_HEADER_SIZE + slot * JournalFormat::DIAG_SLOT_SIZE;
+    DWORD size = count * JournalFormat::DIAG_SLOT_SIZE;
+    DWORD written = 0;
+
+    return (SetFilePointer(m_file, offset, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER &&
+            WriteFile(m_file, data, size, &written, NULL) &&
+            written == size);
+}
+
+} // namespace HBX
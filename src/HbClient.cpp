@@ -5,25 +5,41 @@
 namespace HBX {
 
 HbClient::HbClient()
-    : m_httpClient(NULL)
+    : m_connectionCount(1)
     , m_baseUrl(NULL)
     , m_authToken(NULL)
+    , m_deviceId(NULL)
     , m_authenticated(false)
 {
-    m_httpClient = new HttpClient();
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        m_connections[i] = NULL;
+        m_connectionBusy[i] = false;
+    }
+    m_connections[0] = new HttpClient();
+
+    InitializeCriticalSection(&m_connectionLock);
+    m_connectionFreeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
 }
 
 HbClient::~HbClient()
 {
-    if (m_httpClient) {
-        delete m_httpClient;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (m_connections[i]) {
+            delete m_connections[i];
+        }
     }
+    CloseHandle(m_connectionFreeEvent);
+    DeleteCriticalSection(&m_connectionLock);
+
     if (m_baseUrl) {
         delete[] m_baseUrl;
     }
     if (m_authToken) {
         delete[] m_authToken;
     }
+    if (m_deviceId) {
+        delete[] m_deviceId;
+    }
 }
 
 bool HbClient::Authenticate(const TCHAR* deviceId, const TCHAR* apiKey)
@@ -89,6 +105,13 @@ bool HbClient::Authenticate(const TCHAR* deviceId, const TCHAR* apiKey)
     }
     m_authToken[tokenLen] = '\0';
 
+    // Sync requests are made on behalf of the authenticated device
+    if (m_deviceId) {
+        delete[] m_deviceId;
+    }
+    m_deviceId = new TCHAR[lstrlen(deviceId) + 1];
+    lstrcpy(m_deviceId, deviceId);
+
     m_authenticated = true;
     return true;
 }
@@ -107,7 +130,7 @@ void HbClient::Logout()
     }
 }
 
-bool HbClient::GetItem(const TCHAR* barcode, Models::Item* item)
+bool HbClient::GetItem(const TCHAR* barcode, Models::Item* item, int* status)
 {
     if (!barcode || !item) {
         return false;
@@ -123,17 +146,26 @@ bool HbClient::GetItem(const TCHAR* barcode, Models::Item* item)
 
     // Make GET request
     TCHAR response[8192];
-    bool success = MakeApiRequest(TEXT("GET"), endpoint, NULL, response, sizeof(response) / sizeof(TCHAR));
+    TCHAR etag[HttpClient::ETAG_CHARS];
+    bool success = MakeApiRequest(TEXT("GET"), endpoint, NULL, response, sizeof(response) / sizeof(TCHAR),
+                                  NULL, status, NULL, etag);
 
     if (!success) {
         return false;
     }
 
-    // Parse JSON response into Item object
-    return item->FromJson(response);
+    // Parse JSON response into Item object; a server that keeps the
+    // version out of the body still sends it as the ETag
+    if (!item->FromJson(response)) {
+        return false;
+    }
+    if (!item->GetVersion() && etag[0] != '\0') {
+        item->SetVersion(etag);
+    }
+    return true;
 }
 
-bool HbClient::UpdateItemLocation(const TCHAR* barcode, const TCHAR* locationId)
+bool HbClient::UpdateItemLocation(const TCHAR* barcode, const TCHAR* locationId, const TCHAR* requestKey, int* status)
 {
     if (!barcode || !locationId) {
         return false;
@@ -153,10 +185,10 @@ bool HbClient::UpdateItemLocation(const TCHAR* barcode, const TCHAR* locationId)
 
     // Make PATCH request (using PUT as fallback)
     TCHAR response[4096];
-    return MakeApiRequest(TEXT("PUT"), endpoint, requestBody, response, sizeof(response) / sizeof(TCHAR));
+    return MakeApiRequest(TEXT("PUT"), endpoint, requestBody, response, sizeof(response) / sizeof(TCHAR), requestKey, status);
 }
 
-bool HbClient::CreateItem(const Models::Item* item)
+bool HbClient::CreateItem(const Models::Item* item, const TCHAR* requestKey, int* status)
 {
     if (!item || !item->IsValid()) {
         return false;
@@ -174,7 +206,7 @@ bool HbClient::CreateItem(const Models::Item* item)
 
     // Make POST request
     TCHAR response[4096];
-    bool success = MakeApiRequest(TEXT("POST"), TEXT("/api/v1/items"), requestBody, response, sizeof(response) / sizeof(TCHAR));
+    bool success = MakeApiRequest(TEXT("POST"), TEXT("/api/v1/items"), requestBody, response, sizeof(response) / sizeof(TCHAR), requestKey, status);
 
     // Cleanup
     delete[] requestBody;
@@ -182,7 +214,7 @@ bool HbClient::CreateItem(const Models::Item* item)
     return success;
 }
 
-bool HbClient::UpdateItem(const Models::Item* item)
+bool HbClient::UpdateItem(const Models::Item* item, const TCHAR* requestKey, int* status)
 {
     if (!item || !item->IsValid() || !item->GetId()) {
         return false;
@@ -202,9 +234,11 @@ bool HbClient::UpdateItem(const Models::Item* item)
         return false;
     }
 
-    // Make PUT request
+    // Make PUT request, on condition the server still has the version
+    // the edit was made on
     TCHAR response[4096];
-    bool success = MakeApiRequest(TEXT("PUT"), endpoint, requestBody, response, sizeof(response) / sizeof(TCHAR));
+    bool success = MakeApiRequest(TEXT("PUT"), endpoint, requestBody, response, sizeof(response) / sizeof(TCHAR), requestKey, status,
+                                  item->GetVersion());
 
     // Cleanup
     delete[] requestBody;
@@ -332,20 +366,29 @@ bool HbClient::GetAllLocations(Models::Location** locations, int* count)
     return true;
 }
 
-bool HbClient::SyncPendingTransactions()
+bool HbClient::SyncPendingTransactions(SyncBatch* batch, int* status)
 {
+    if (!batch || batch->GetCount() == 0) {
+        return false;
+    }
+
     if (!m_authenticated) {
         return false;
     }
 
-    // Make POST request to sync endpoint
-    // The backend will expect a batch of transactions
-    TCHAR requestBody[4096];
-    wsprintf(requestBody, TEXT("{\"deviceId\":\"%s\"}"), TEXT("DEVICE_ID")); // Placeholder
+    // 200 when every operation was applied, 207 when only some were; the
+    // results say which
+    TCHAR* requestBody = batch->BuildRequest(m_deviceId);
+    TCHAR* response = new TCHAR[HttpClient::RECV_BUFFER_SIZE];
+    response[0] = '\0';
 
-    TCHAR response[8192];
-    bool success = MakeApiRequest(TEXT("POST"), TEXT("/api/v1/sync"), requestBody, response, sizeof(response) / sizeof(TCHAR));
+    bool success = MakeApiRequest(TEXT("POST"), TEXT("/api/v1/sync"), requestBody, response, HttpClient::RECV_BUFFER_SIZE, NULL, status);
+    if (success) {
+        batch->ParseResponse(response);
+    }
 
+    delete[] requestBody;
+    delete[] response;
     return success;
 }
 
@@ -368,9 +411,32 @@ const TCHAR* HbClient::GetBaseUrl() const
     return m_baseUrl;
 }
 
-bool HbClient::MakeApiRequest(const TCHAR* method, const TCHAR* endpoint, const TCHAR* body, TCHAR* response, DWORD maxResponseLen)
+void HbClient::SetMaxConnections(int count)
+{
+    if (count < 1) {
+        count = 1;
+    } else if (count > MAX_CONNECTIONS) {
+        count = MAX_CONNECTIONS;
+    }
+
+    // Connections past the new count are left to close when idle; none
+    // is handed out again
+    EnterCriticalSection(&m_connectionLock);
+    for (int i = m_connectionCount; i < count; i++) {
+        if (!m_connections[i]) {
+            m_connections[i] = new HttpClient();
+        }
+    }
+    m_connectionCount = count;
+    LeaveCriticalSection(&m_connectionLock);
+
+    SetEvent(m_connectionFreeEvent);
+}
+
+bool HbClient::MakeApiRequest(const TCHAR* method, const TCHAR* endpoint, const TCHAR* body, TCHAR* response, DWORD maxResponseLen,
+                              const TCHAR* requestKey, int* status, const TCHAR* ifMatch, TCHAR* etag)
 {
-    if (!m_httpClient || !m_baseUrl || !method || !endpoint) {
+    if (!m_baseUrl || !method || !endpoint) {
         return false;
     }
 
@@ -378,73 +444,100 @@ bool HbClient::MakeApiRequest(const TCHAR* method, const TCHAR* endpoint, const
     TCHAR fullUrl[1024];
     wsprintf(fullUrl, TEXT("%s%s"), m_baseUrl, endpoint);
 
+    // Lookups on the UI thread and the sync lanes each take a connection
+    // of their own
+    HttpClient* connection = AcquireConnection();
+
     // Set authentication headers
-    SetAuthHeaders();
+    SetAuthHeaders(connection);
+
+    // Keys are only unique per device
+    if (requestKey) {
+        TCHAR keyHeader[256];
+        if (m_deviceId) {
+            wsprintf(keyHeader, TEXT("%s-%s"), m_deviceId, requestKey);
+        } else {
+            lstrcpy(keyHeader, requestKey);
+        }
+        connection->SetHeader(TEXT("Idempotency-Key"), keyHeader);
+    }
 
-    // Make HTTP request
-    HttpClient::HttpResponse httpResponse;
+    if (ifMatch) {
+        TCHAR matchHeader[HttpClient::ETAG_CHARS + 2];
+        matchHeader[0] = '"';
+        lstrcpyn(matchHeader + 1, ifMatch, HttpClient::ETAG_CHARS);
+        lstrcat(matchHeader, TEXT("\""));
+        connection->SetHeader(TEXT("If-Match"), matchHeader);
+    }
+
+    // Make HTTP request; false unless the status is 2xx
     bool success = false;
 
     if (lstrcmp(method, TEXT("GET")) == 0) {
-        success = m_httpClient->Get(fullUrl, &httpResponse);
+        success = connection->Get(fullUrl, response, maxResponseLen);
     } else if (lstrcmp(method, TEXT("POST")) == 0) {
-        success = m_httpClient->Post(fullUrl, body, &httpResponse);
+        success = connection->Post(fullUrl, body, response, maxResponseLen);
     } else if (lstrcmp(method, TEXT("PUT")) == 0) {
-        success = m_httpClient->Put(fullUrl, body, &httpResponse);
+        success = connection->Put(fullUrl, body, response, maxResponseLen);
     } else if (lstrcmp(method, TEXT("DELETE")) == 0) {
-        success = m_httpClient->Delete(fullUrl, &httpResponse);
+        success = connection->Delete(fullUrl, response, maxResponseLen);
     }
 
-    if (!success) {
-        return false;
+    if (status) {
+        *status = connection->GetLastHttpStatusCode();
     }
-
-    // Check status code (200-299 is success)
-    if (httpResponse.statusCode < 200 || httpResponse.statusCode >= 300) {
-        if (httpResponse.body) {
-            delete[] httpResponse.body;
-        }
-        return false;
+    if (etag) {
+        lstrcpy(etag, connection->GetLastETag());
     }
 
-    // Copy response body to output buffer
-    if (httpResponse.body && response && maxResponseLen > 0) {
-        int len = lstrlen(httpResponse.body);
-        if (len >= (int)maxResponseLen) {
-            len = maxResponseLen - 1;
-        }
-        for (int i = 0; i < len; i++) {
-            response[i] = httpResponse.body[i];
+    ReleaseConnection(connection);
+    return success;
+}
+
+HttpClient* HbClient::AcquireConnection()
+{
+    for (;;) {
+        EnterCriticalSection(&m_connectionLock);
+        for (int i = 0; i < m_connectionCount; i++) {
+            if (!m_connectionBusy[i]) {
+                m_connectionBusy[i] = true;
+                LeaveCriticalSection(&m_connectionLock);
+                return m_connections[i];
+            }
         }
-        response[len] = '\0';
-    }
+        LeaveCriticalSection(&m_connectionLock);
 
-    // Cleanup
-    if (httpResponse.body) {
-        delete[] httpResponse.body;
+        WaitForSingleObject(m_connectionFreeEvent, INFINITE);
     }
-
-    return true;
 }
 
-void HbClient::SetAuthHeaders()
+void HbClient::ReleaseConnection(HttpClient* connection)
 {
-    if (!m_httpClient) {
-        return;
+    EnterCriticalSection(&m_connectionLock);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (m_connections[i] == connection) {
+            m_connectionBusy[i] = false;
+            break;
+        }
     }
+    LeaveCriticalSection(&m_connectionLock);
 
+    SetEvent(m_connectionFreeEvent);
+}
+
+void HbClient::SetAuthHeaders(HttpClient* connection)
+{
     // Clear existing headers
-    m_httpClient->ClearHeaders();
+    connection->ClearHeaders();
 
-    // Set standard headers
-    m_httpClient->AddHeader(TEXT("Content-Type"), TEXT("application/json"));
-    m_httpClient->AddHeader(TEXT("Accept"), TEXT("application/json"));
+    // Set standard headers; HttpClient adds Content-Type to a body
+    connection->SetHeader(TEXT("Accept"), TEXT("application/json"));
 
     // Set authorization header if authenticated
     if (m_authToken) {
         TCHAR authHeader[512];
         wsprintf(authHeader, TEXT("Bearer %s"), m_authToken);
-        m_httpClient->AddHeader(TEXT("Authorization"), authHeader);
+        connection->SetHeader(TEXT("Authorization"), authHeader);
     }
 }
 
@@ -1,15 +1,126 @@
 #include "../include/HttpClient.hpp"
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 
 namespace HBX {
 
+namespace {
+
+// Narrows text to ASCII, cut to fit size with its terminator
+void ToAscii(const TCHAR* text, char* out, int size)
+{
+    int i = 0;
+    while (i < size - 1 && text[i] != '\0') {
+        out[i] = (char)text[i];
+        i++;
+    }
+    out[i] = '\0';
+}
+
+// Value of the named header, case aside, in the lines up to end; NULL
+// if there is none
+const char* FindHeader(const char* response, const char* end, const char* name)
+{
+    int nameLen = (int)strlen(name);
+    for (const char* line = strstr(response, "\r\n"); line && line < end; line = strstr(line, "\r\n")) {
+        line += 2;
+        int i = 0;
+        while (i < nameLen && tolower((unsigned char)line[i]) == tolower((unsigned char)name[i])) {
+            i++;
+        }
+        if (i == nameLen && line[i] == ':') {
+            const char* value = line + i + 1;
+            while (*value == ' ') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+// The CRLF at or after data, within length; NULL if none yet
+const char* FindLineEnd(const char* data, int length)
+{
+    for (int i = 0; i + 1 < length; i++) {
+        if (data[i] == '\r' && data[i + 1] == '\n') {
+            return data + i;
+        }
+    }
+    return NULL;
+}
+
+// Length of a chunked body through its last chunk and trailers; -1 until
+// all of it is in
+int FindChunkedEnd(const char* data, int available)
+{
+    int pos = 0;
+    for (;;) {
+        const char* lineEnd = FindLineEnd(data + pos, available - pos);
+        if (!lineEnd) {
+            return -1;
+        }
+        unsigned long size = strtoul(data + pos, NULL, 16);
+        pos = (int)(lineEnd + 2 - data);
+
+        if (size == 0) {
+            // Trailers, up to an empty line
+            for (;;) {
+                lineEnd = FindLineEnd(data + pos, available - pos);
+                if (!lineEnd) {
+                    return -1;
+                }
+                bool empty = (lineEnd == data + pos);
+                pos = (int)(lineEnd + 2 - data);
+                if (empty) {
+                    return pos;
+                }
+            }
+        }
+
+        if (size > (unsigned long)(available - pos) || available - pos - (int)size < 2) {
+            return -1;
+        }
+        pos += (int)size + 2;
+    }
+}
+
+// Joins the chunks of a complete chunked body in place; returns its length
+int DecodeChunked(char* data)
+{
+    char* in = data;
+    char* out = data;
+    for (;;) {
+        unsigned long size = strtoul(in, NULL, 16);
+        in = strstr(in, "\r\n") + 2;
+        if (size == 0) {
+            break;
+        }
+        memmove(out, in, size);
+        out += size;
+        in += size + 2;
+    }
+    *out = '\0';
+    return (int)(out - data);
+}
+
+} // namespace
+
 HttpClient::HttpClient()
     : m_socket(INVALID_SOCKET)
     , m_timeoutMs(30000)
     , m_lastStatusCode(0)
     , m_lastError(NULL)
     , m_headers(NULL)
+    , m_connectedPort(0)
+    , m_lastUsed(0)
+    , m_idleLimitMs(KEEP_ALIVE_IDLE_MS)
+    , m_connectionCount(0)
 {
+    m_lastETag[0] = '\0';
+    m_connectedHost[0] = '\0';
+
     // Initialize WinSock
     WSADATA wsaData;
     WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -48,6 +159,12 @@ bool HttpClient::Delete(const TCHAR* url, TCHAR* response, DWORD maxResponseLen)
 void HttpClient::SetTimeout(DWORD timeoutMs)
 {
     m_timeoutMs = timeoutMs;
+
+    // An open connection takes it for its next request too
+    if (m_socket != INVALID_SOCKET) {
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&m_timeoutMs, sizeof(m_timeoutMs));
+        setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&m_timeoutMs, sizeof(m_timeoutMs));
+    }
 }
 
 void HttpClient::SetHeader(const TCHAR* key, const TCHAR* value)
@@ -82,8 +199,23 @@ const TCHAR* HttpClient::GetLastError() const
     return m_lastError;
 }
 
+const TCHAR* HttpClient::GetLastETag() const
+{
+    return m_lastETag;
+}
+
+DWORD HttpClient::GetConnectionCount() const
+{
+    return m_connectionCount;
+}
+
 bool HttpClient::SendRequest(const TCHAR* method, const TCHAR* url, const TCHAR* body, TCHAR* response, DWORD maxResponseLen)
 {
+    // 0 until a response says otherwise; callers tell a request that got
+    // no answer from one that was refused
+    m_lastStatusCode = 0;
+    m_lastETag[0] = '\0';
+
     // Parse URL
     TCHAR host[256];
     TCHAR path[1024];
@@ -93,30 +225,12 @@ bool HttpClient::SendRequest(const TCHAR* method, const TCHAR* url, const TCHAR*
         return false;
     }
 
-    // Connect to server
-    if (!Connect(host, port)) {
-        return false;
-    }
-
     // Build HTTP request
     char request[4096];
     char asciiMethod[16], asciiPath[1024], asciiHost[256];
-
-    // Convert to ASCII
-    for (int i = 0; i < 15 && method[i] != '\0'; i++) {
-        asciiMethod[i] = (char)method[i];
-    }
-    asciiMethod[15] = '\0';
-
-    for (int i = 0; i < 1023 && path[i] != '\0'; i++) {
-        asciiPath[i] = (char)path[i];
-    }
-    asciiPath[1023] = '\0';
-
-    for (int i = 0; i < 255 && host[i] != '\0'; i++) {
-        asciiHost[i] = (char)host[i];
-    }
-    asciiHost[255] = '\0';
+    ToAscii(method, asciiMethod, sizeof(asciiMethod));
+    ToAscii(path, asciiPath, sizeof(asciiPath));
+    ToAscii(host, asciiHost, sizeof(asciiHost));
 
     // Build request line
     sprintf(request, "%s %s HTTP/1.1\r\nHost: %s\r\n", asciiMethod, asciiPath, asciiHost);
@@ -126,79 +240,241 @@ bool HttpClient::SendRequest(const TCHAR* method, const TCHAR* url, const TCHAR*
     BuildHeaderString(headerStr, 1024);
     strcat(request, headerStr);
 
-    // Add body if present
-    if (body && lstrlen(body) > 0) {
-        char asciiBody[2048];
-        int bodyLen = 0;
-        for (int i = 0; i < 2047 && body[i] != '\0'; i++) {
-            asciiBody[i] = (char)body[i];
-            bodyLen++;
-        }
-        asciiBody[bodyLen] = '\0';
+    // The connection stays open for the next request to the same server
+    strcat(request, "Connection: keep-alive\r\n");
 
+    int bodyLen = body ? lstrlen(body) : 0;
+    if (bodyLen > 0) {
         char contentLen[64];
         sprintf(contentLen, "Content-Length: %d\r\n", bodyLen);
         strcat(request, contentLen);
         strcat(request, "Content-Type: application/json\r\n");
-        strcat(request, "\r\n");
-        strcat(request, asciiBody);
-    } else {
-        strcat(request, "\r\n");
     }
+    strcat(request, "\r\n");
 
-    // Send request
-    int sent = send(m_socket, request, strlen(request), 0);
-    if (sent <= 0) {
-        Disconnect();
-        return false;
-    }
-
-    // Receive response
-    char recvBuffer[8192];
+    // A reused connection the server has closed in the meantime fails
+    // before any of the response arrives; the request then goes out once
+    // more on a new one
+    char* recvBuffer = new char[RECV_BUFFER_SIZE];
     int totalReceived = 0;
-    int received;
-
-    while ((received = recv(m_socket, recvBuffer + totalReceived, sizeof(recvBuffer) - totalReceived - 1, 0)) > 0) {
-        totalReceived += received;
-        if (totalReceived >= sizeof(recvBuffer) - 1) {
+    int bodyStart = -1;
+    int bodyLength = 0;
+    bool keepAlive = false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = (m_socket != INVALID_SOCKET && IsReusable(host, port));
+        if (!reused && !Connect(host, port)) {
             break;
         }
-        // Simple check if response is complete (look for end of headers)
-        if (strstr(recvBuffer, "\r\n\r\n")) {
+
+        // Send headers, then the body in pieces; a sync batch is far
+        // larger than the request buffer
+        if (SendAll(request, strlen(request)) && SendBody(body, bodyLen)) {
+            ReceiveResponse(recvBuffer, RECV_BUFFER_SIZE, &totalReceived, &bodyStart, &bodyLength, &keepAlive);
+        }
+        if (totalReceived > 0 || !reused) {
             break;
         }
+        Disconnect();
     }
 
-    recvBuffer[totalReceived] = '\0';
-    Disconnect();
+    if (keepAlive) {
+        m_lastUsed = GetTickCount();
+    } else {
+        Disconnect();
+    }
 
     // Parse status code
-    if (strncmp(recvBuffer, "HTTP/1.", 7) == 0) {
+    if (totalReceived > 0 && strncmp(recvBuffer, "HTTP/1.", 7) == 0) {
         m_lastStatusCode = atoi(recvBuffer + 9);
     }
 
-    // Find response body (after headers)
-    char* bodyStart = strstr(recvBuffer, "\r\n\r\n");
-    if (bodyStart) {
-        bodyStart += 4;
+    if (bodyStart >= 0) {
+        // The version the response is of, without the weak marker and quotes
+        const char* etag = FindHeader(recvBuffer, recvBuffer + bodyStart, "ETag");
+        if (etag) {
+            if (strncmp(etag, "W/", 2) == 0) {
+                etag += 2;
+            }
+            if (*etag == '"') {
+                etag++;
+            }
+            int len = 0;
+            while (len < ETAG_CHARS - 1 && etag[len] && etag[len] != '"' && etag[len] != '\r') {
+                m_lastETag[len] = (TCHAR)etag[len];
+                len++;
+            }
+            m_lastETag[len] = '\0';
+        }
 
         // Convert response to TCHAR
         if (response && maxResponseLen > 0) {
+            const char* bodyText = recvBuffer + bodyStart;
             DWORD len = 0;
-            while (*bodyStart && len < maxResponseLen - 1) {
-                response[len++] = (TCHAR)*bodyStart++;
+            while ((int)len < bodyLength && bodyText[len] && len < maxResponseLen - 1) {
+                response[len] = (TCHAR)bodyText[len];
+                len++;
             }
             response[len] = '\0';
         }
     }
 
+    delete[] recvBuffer;
     return (m_lastStatusCode >= 200 && m_lastStatusCode < 300);
 }
 
+bool HttpClient::SendBody(const TCHAR* body, int bodyLen)
+{
+    char chunk[1024];
+    for (int pos = 0; pos < bodyLen; ) {
+        int chunkLen = 0;
+        while (chunkLen < (int)sizeof(chunk) && pos < bodyLen) {
+            chunk[chunkLen++] = (char)body[pos++];
+        }
+        if (!SendAll(chunk, chunkLen)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HttpClient::ReceiveResponse(char* buffer, int size, int* received, int* bodyStart, int* bodyLength, bool* keepAlive)
+{
+    // The headers, then the body as they frame it: Content-Length bytes,
+    // chunks up to the last one, or until the server closes the
+    // connection. Only a response read to its end leaves the connection
+    // fit for the next request
+    *received = 0;
+    *bodyStart = -1;
+    *bodyLength = 0;
+    *keepAlive = false;
+
+    int expected = -1;          // Whole response, once known
+    bool chunked = false;
+    bool closed = false;
+    while (*received < size - 1) {
+        int n = recv(m_socket, buffer + *received, size - 1 - *received, 0);
+        if (n <= 0) {
+            closed = (n == 0);
+            break;
+        }
+        *received += n;
+        buffer[*received] = '\0';
+
+        while (*bodyStart < 0) {
+            char* headerEnd = strstr(buffer, "\r\n\r\n");
+            if (!headerEnd) {
+                break;
+            }
+            int headerLength = (int)(headerEnd + 4 - buffer);
+
+            // An interim response (100 Continue, 102 Processing) comes
+            // ahead of the real one: drop it and read on
+            int status = (strncmp(buffer, "HTTP/1.", 7) == 0) ? atoi(buffer + 9) : 0;
+            if (status >= 100 && status < 200) {
+                *received -= headerLength;
+                memmove(buffer, buffer + headerLength, *received + 1);
+                continue;
+            }
+            *bodyStart = headerLength;
+
+            const char* encoding = FindHeader(buffer, headerEnd, "Transfer-Encoding");
+            const char* length = FindHeader(buffer, headerEnd, "Content-Length");
+            if (status == 204 || status == 304) {
+                expected = *bodyStart;
+            } else if (encoding && strncmp(encoding, "chunked", 7) == 0) {
+                chunked = true;
+            } else if (length) {
+                expected = *bodyStart + atoi(length);
+            }
+
+            // HTTP/1.1 keeps the connection unless told otherwise, 1.0
+            // only when asked to
+            const char* connection = FindHeader(buffer, headerEnd, "Connection");
+            if (strncmp(buffer, "HTTP/1.1", 8) == 0) {
+                *keepAlive = !(connection && strncmp(connection, "close", 5) == 0);
+            } else {
+                *keepAlive = (connection && strncmp(connection, "keep-alive", 10) == 0);
+            }
+
+            // The server may say how long it keeps an idle connection
+            const char* timeout = FindHeader(buffer, headerEnd, "Keep-Alive");
+            timeout = timeout ? strstr(timeout, "timeout=") : NULL;
+            if (timeout && timeout < headerEnd) {
+                DWORD seconds = (DWORD)atoi(timeout + 8);
+                m_idleLimitMs = (seconds > 0 && seconds * 1000 < (DWORD)KEEP_ALIVE_IDLE_MS) ? seconds * 1000 - 500
+                                                                                : (DWORD)KEEP_ALIVE_IDLE_MS;
+            }
+        }
+
+        if (chunked && expected < 0) {
+            int end = FindChunkedEnd(buffer + *bodyStart, *received - *bodyStart);
+            if (end >= 0) {
+                expected = *bodyStart + end;
+            }
+        }
+        if (expected >= 0 && *received >= expected) {
+            break;
+        }
+    }
+
+    if (*bodyStart < 0) {
+        return false;
+    }
+
+    bool complete = (expected >= 0) ? (*received >= expected) : closed;
+    if (chunked && complete) {
+        *bodyLength = DecodeChunked(buffer + *bodyStart);
+    } else {
+        int end = (expected >= 0 && expected < *received) ? expected : *received;
+        *bodyLength = end - *bodyStart;
+    }
+
+    // Anything short of the framed response, or beyond it, leaves the
+    // connection out of step
+    if (expected < 0 || *received != expected) {
+        *keepAlive = false;
+    }
+    return complete;
+}
+
+bool HttpClient::IsReusable(const TCHAR* host, int port)
+{
+    if (port != m_connectedPort || lstrcmp(host, m_connectedHost) != 0) {
+        return false;
+    }
+    if (GetTickCount() - m_lastUsed > m_idleLimitMs) {
+        return false;
+    }
+
+    // Readable while idle means the server closed it, or sent what no
+    // request asked for; either way it is done
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(m_socket, &readable);
+    struct timeval poll;
+    poll.tv_sec = 0;
+    poll.tv_usec = 0;
+    return select(0, &readable, NULL, NULL, &poll) == 0;
+}
+
+bool HttpClient::SendAll(const char* data, int length)
+{
+    while (length > 0) {
+        int sent = send(m_socket, data, length, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
 bool HttpClient::Connect(const TCHAR* host, int port)
 {
     // Disconnect if already connected
     Disconnect();
+    m_connectionCount++;
 
     // Create socket
     m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -212,10 +488,7 @@ bool HttpClient::Connect(const TCHAR* host, int port)
 
     // Convert host to ASCII for gethostbyname
     char asciiHost[256];
-    for (int i = 0; i < 255 && host[i] != '\0'; i++) {
-        asciiHost[i] = (char)host[i];
-    }
-    asciiHost[255] = '\0';
+    ToAscii(host, asciiHost, sizeof(asciiHost));
 
     // Resolve hostname
     struct hostent* hostInfo = gethostbyname(asciiHost);
@@ -238,6 +511,9 @@ bool HttpClient::Connect(const TCHAR* host, int port)
         return false;
     }
 
+    lstrcpyn(m_connectedHost, host, sizeof(m_connectedHost) / sizeof(TCHAR));
+    m_connectedPort = port;
+    m_idleLimitMs = KEEP_ALIVE_IDLE_MS;
     return true;
 }
 
@@ -327,21 +603,17 @@ void HttpClient::BuildHeaderString(char* buffer, int maxLen)
     int pos = 0;
 
     HttpHeader* current = m_headers;
-    while (current && pos < maxLen - 100) {
+    while (current) {
         // Convert key and value to ASCII
         char asciiKey[128], asciiValue[512];
+        ToAscii(current->key, asciiKey, sizeof(asciiKey));
+        ToAscii(current->value, asciiValue, sizeof(asciiValue));
 
-        for (int i = 0; i < 127 && current->key[i] != '\0'; i++) {
-            asciiKey[i] = (char)current->key[i];
-        }
-        asciiKey[127] = '\0';
-
-        for (int i = 0; i < 511 && current->value[i] != '\0'; i++) {
-            asciiValue[i] = (char)current->value[i];
+        // Add header to buffer; those that do not fit are left out
+        int length = (int)(strlen(asciiKey) + strlen(asciiValue)) + 4;
+        if (pos + length >= maxLen) {
+            break;
         }
-        asciiValue[511] = '\0';
-
-        // Add header to buffer
         pos += sprintf(buffer + pos, "%s: %s\r\n", asciiKey, asciiValue);
 
         current = current->next;
@@ -1,347 +1,3107 @@
 #include "../include/Journal.hpp"
 #include <stdio.h>
+#include <string.h>
 
 namespace HBX {
 
+namespace {
+
+// Milliseconds between the FILETIME epoch (1601) and the Unix epoch (1970)
+const ULONGLONG FILETIME_UNIX_EPOCH_MS = (ULONGLONG)11644473600 * 1000;
+
+// Large enough to always hold one complete record
+const DWORD READ_BUFFER_SIZE = 16384;
+
+// Group commit batch; a record that does not fit commits the batch first
+const DWORD BATCH_BUFFER_SIZE = 32768;
+
+// ACKs that fit in one batch, so its undo list never runs out of room
+const int BATCH_MAX_ACKS = BATCH_BUFFER_SIZE / (JournalFormat::RECORD_HEADER_SIZE + JournalFormat::ACK_PAYLOAD_SIZE);
+
+// A new segment is started once the active one would grow past this
+const DWORD SEGMENT_SIZE_LIMIT = 256 * 1024;
+
+// The manifest is rewritten as a checkpoint once this much has been
+// appended since the last one (or four times the manifest size, so
+// large pending lists are not rewritten too often)
+const DWORD CHECKPOINT_MIN_BYTES = 32 * 1024;
+
+// Background compaction checks for work this often, and only runs once
+// nothing has been appended for COMPACT_IDLE_MS
+const DWORD COMPACT_CHECK_INTERVAL_MS = 1000;
+const DWORD COMPACT_IDLE_MS = 2000;
+
+// Retention is checked once this much has been appended since the last
+// check, and on every commit while a step has left work behind
+const DWORD RETENTION_CHECK_BYTES = 16 * 1024;
+
+/**
+ * Holds a critical section for the lifetime of the object
+ */
+class ScopedLock {
+public:
+    explicit ScopedLock(CRITICAL_SECTION* lock)
+        : m_lock(lock)
+    {
+        EnterCriticalSection(m_lock);
+    }
+
+    ~ScopedLock()
+    {
+        LeaveCriticalSection(m_lock);
+    }
+
+private:
+    CRITICAL_SECTION* m_lock;
+};
+
+/**
+ * Buffered forward reader over journal records
+ * Decodes record headers in place; payloads are returned as views into
+ * the read buffer and stay valid until the next call to Next()
+ */
+class RecordReader {
+public:
+    RecordReader(HANDLE file, DWORD startOffset)
+        : m_file(file)
+        , m_buffer(new BYTE[READ_BUFFER_SIZE])
+        , m_bufferOffset(startOffset)
+        , m_position(0)
+        , m_length(0)
+        , m_eof(false)
+    {
+        SetFilePointer(m_file, startOffset, NULL, FILE_BEGIN);
+    }
+
+    ~RecordReader()
+    {
+        delete[] m_buffer;
+    }
+
+    // Returns DECODE_NEED_MORE once the end of the file is reached
+    JournalFormat::DecodeResult Next(JournalFormat::RecordHeader* header, const BYTE** payload, DWORD* recordOffset)
+    {
+        for (;;) {
+            JournalFormat::DecodeResult result =
+                JournalFormat::DecodeRecord(m_buffer + m_position, m_length - m_position, header);
+
+            if (result == JournalFormat::DECODE_NEED_MORE && !m_eof) {
+                Refill();
+                continue;
+            }
+
+            if (result == JournalFormat::DECODE_OK) {
+                *payload = m_buffer + m_position + JournalFormat::RECORD_HEADER_SIZE;
+                if (recordOffset) {
+                    *recordOffset = m_bufferOffset + m_position;
+                }
+                m_position += JournalFormat::RECORD_HEADER_SIZE + header->length;
+            }
+
+            return result;
+        }
+    }
+
+    // File offset just past the last record returned
+    DWORD GetOffset() const
+    {
+        return m_bufferOffset + m_position;
+    }
+
+    // Step one byte past a record that failed to decode, to search for
+    // the next record boundary
+    void Skip()
+    {
+        if (m_position < m_length) {
+            m_position++;
+        }
+    }
+
+private:
+    HANDLE m_file;
+    BYTE* m_buffer;
+    DWORD m_bufferOffset;
+    DWORD m_position;
+    DWORD m_length;
+    bool m_eof;
+
+    void Refill()
+    {
+        DWORD remaining = m_length - m_position;
+        if (remaining > 0 && m_position > 0) {
+            memmove(m_buffer, m_buffer + m_position, remaining);
+        }
+        m_bufferOffset += m_position;
+        m_position = 0;
+        m_length = remaining;
+
+        // Other readers may have moved the file pointer in between
+        SetFilePointer(m_file, m_bufferOffset + m_length, NULL, FILE_BEGIN);
+
+        DWORD bytesRead = 0;
+        if (!ReadFile(m_file, m_buffer + m_length, READ_BUFFER_SIZE - m_length, &bytesRead, NULL) || bytesRead == 0) {
+            m_eof = true;
+            return;
+        }
+        m_length += bytesRead;
+    }
+};
+
+TCHAR* Utf8ToString(const BYTE* utf8, DWORD length)
+{
+    int len = 0;
+    if (length > 0) {
+        len = MultiByteToWideChar(CP_UTF8, 0, (const char*)utf8, (int)length, NULL, 0);
+    }
+
+    TCHAR* text = new TCHAR[len + 1];
+    if (len > 0) {
+        MultiByteToWideChar(CP_UTF8, 0, (const char*)utf8, (int)length, text, len);
+    }
+    text[len] = '\0';
+
+    return text;
+}
+
+// Decodes UTF-8 into a caller buffer of maxChars plus the terminator
+void Utf8ToBuffer(const BYTE* utf8, DWORD length, TCHAR* text, int maxChars)
+{
+    int len = 0;
+    if (length > 0) {
+        len = MultiByteToWideChar(CP_UTF8, 0, (const char*)utf8, (int)length, text, maxChars);
+    }
+    text[len] = '\0';
+}
+
+// Encodes text as UTF-8; -1 if it does not fit in capacity bytes
+int EncodeUtf8(const TCHAR* text, BYTE* out, int capacity)
+{
+    int textLen = text ? lstrlen(text) : 0;
+    if (textLen == 0) {
+        return 0;
+    }
+
+    int length = WideCharToMultiByte(CP_UTF8, 0, text, textLen, (char*)out, capacity, NULL, NULL);
+    return (length > 0) ? length : -1;
+}
+
+// Encodes a type or item tag, cutting it to MAX_TAG_SIZE bytes at a
+// character boundary. Queries encode their filter the same way.
+DWORD EncodeTag(const TCHAR* tag, BYTE* out)
+{
+    int tagLen = tag ? lstrlen(tag) : 0;
+    if (tagLen == 0) {
+        return 0;
+    }
+
+    // Every character takes at least one byte, so the rest would be cut
+    if (tagLen > JournalFormat::MAX_TAG_SIZE) {
+        tagLen = JournalFormat::MAX_TAG_SIZE;
+    }
+
+    BYTE encoded[JournalFormat::MAX_TAG_SIZE * 3];
+    int length = WideCharToMultiByte(CP_UTF8, 0, tag, tagLen, (char*)encoded, sizeof(encoded), NULL, NULL);
+    if (length <= 0) {
+        return 0;
+    }
+
+    if (length > JournalFormat::MAX_TAG_SIZE) {
+        length = JournalFormat::MAX_TAG_SIZE;
+        while (length > 0 && (encoded[length] & 0xC0) == 0x80) {
+            length--;
+        }
+    }
+
+    memcpy(out, encoded, length);
+    return (DWORD)length;
+}
+
+// Tag comparison for queries; a negative filter length matches anything
+bool TagMatches(const BYTE* tag, DWORD length, const BYTE* filter, int filterLength)
+{
+    return (filterLength < 0 ||
+            ((DWORD)filterLength == length && memcmp(tag, filter, length) == 0));
+}
+
+// Where the transaction text starts, past any type and item tags
+DWORD TextOffset(const BYTE* payload, const JournalFormat::RecordHeader& header)
+{
+    JournalFormat::PayloadTags tags;
+    JournalFormat::DecodeTags(payload, header.length, header.flags, &tags);
+    return tags.textOffset;
+}
+
+// Counts the records lost by cutting a segment at offset: the damaged
+// one plus any intact records found after it
+DWORD CountDiscarded(HANDLE file, DWORD offset)
+{
+    RecordReader reader(file, offset);
+    JournalFormat::RecordHeader header;
+    const BYTE* payload = NULL;
+    DWORD discarded = 1;
+
+    for (;;) {
+        JournalFormat::DecodeResult result = reader.Next(&header, &payload, NULL);
+        if (result == JournalFormat::DECODE_NEED_MORE) {
+            break;
+        }
+        if (result == JournalFormat::DECODE_OK) {
+            discarded++;
+        } else {
+            reader.Skip();
+        }
+    }
+
+    return discarded;
+}
+
+// Lookup key for matching SYNCED records against pending transactions,
+// and for type and item tags
+DWORD PayloadKey(const BYTE* payload, DWORD length)
+{
+    return JournalFormat::Crc32(payload, length, 0);
+}
+
+// Key of a transaction's type tag, which the pending index keeps so
+// cursors can pick types without reading records; untagged records get
+// the key of an empty tag
+DWORD TypeKey(const BYTE* payload, DWORD length, WORD flags)
+{
+    JournalFormat::PayloadTags tags;
+    JournalFormat::DecodeTags(payload, length, flags, &tags);
+    return PayloadKey(payload + tags.typeOffset, tags.typeLength);
+}
+
+// Parses the 8 hex digit id of a segment file name suffix
+bool ParseSegmentId(const TCHAR* suffix, DWORD* segmentId)
+{
+    DWORD value = 0;
+    for (int i = 0; i < 8; i++) {
+        TCHAR c = suffix[i];
+        if (c >= '0' && c <= '9') {
+            value = (value << 4) | (DWORD)(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            value = (value << 4) | (DWORD)(c - 'a' + 10);
+        } else {
+            return false;
+        }
+    }
+
+    *segmentId = value;
+    return (suffix[8] == '\0');
+}
+
+// Epoch for a new journal. It only has to differ from the epochs of the
+// journals this device had before, so the clock and the uptime will do.
+DWORD NewEpoch(ULONGLONG now)
+{
+    DWORD epoch = (DWORD)now ^ (DWORD)(now >> 32) ^ (GetTickCount() * 2654435761UL);
+    return epoch ? epoch : 1;
+}
+
+} // namespace
+
 Journal::Journal()
     : m_fileHandle(INVALID_HANDLE_VALUE)
     , m_journalPath(NULL)
-    , m_transactionCount(0)
+    , m_historyReady(false)
+    , m_nextSequence(1)
+    , m_lastTimestamp(0)
+    , m_recordBuffer(NULL)
+    , m_readBuffer(NULL)
+    , m_fileEnd(0)
+    , m_readHandle(INVALID_HANDLE_VALUE)
+    , m_readSegment(0)
+    , m_batchBuffer(NULL)
+    , m_batchLength(0)
+    , m_batchRecords(0)
+    , m_flushPending(false)
+    , m_commitWindowMs(0)
+    , m_commitMaxRecords(1)
+    , m_batchSequence(0)
+    , m_batchAcked(NULL)
+    , m_batchAckedCount(0)
+    , m_commitThread(NULL)
+    , m_commitEvent(NULL)
+    , m_stopEvent(NULL)
+    , m_lastTicket(0)
+    , m_commitCallback(NULL)
+    , m_commitUserData(NULL)
+    , m_writerThread(NULL)
+    , m_writerEvent(NULL)
+    , m_writerStopEvent(NULL)
+    , m_ringSpaceEvent(NULL)
+    , m_lastAppendTick(0)
+    , m_compactGarbagePercent(50)
+    , m_compactSliceMs(5)
+    , m_compactThread(NULL)
+    , m_compactStopEvent(NULL)
+    , m_retentionMaxBytes(0)
+    , m_retentionMaxAgeSeconds(0)
+    , m_retentionFloorBytes(0)
+    , m_retentionAppended(0)
+    , m_retentionTick(0)
+    , m_appendRate(0)
+    , m_retentionBehind(false)
+    , m_lastRetention(0)
+    , m_retentionDropped(0)
+{
+    m_recordBuffer = new BYTE[JournalFormat::MAX_RECORD_SIZE];
+    m_readBuffer = new BYTE[JournalFormat::MAX_RECORD_SIZE];
+    InitializeCriticalSection(&m_lock);
+
+    m_compactJob.sourceId = 0;
+    m_compactJob.targetId = 0;
+    m_compactJob.source = INVALID_HANDLE_VALUE;
+    m_compactJob.target = INVALID_HANDLE_VALUE;
+    m_compactJob.sequences = NULL;
+    m_compactJob.offsets = NULL;
+    m_compactJob.moved = 0;
+    m_compactJob.capacity = 0;
+
+    m_compactStats.bytesReclaimed = 0;
+    m_compactStats.timeSpentMs = 0;
+    m_compactStats.slicesRun = 0;
+    m_compactStats.segmentsDropped = 0;
+    m_compactStats.segmentsRewritten = 0;
+
+    m_batchSession.id = 0;
+    m_batchSession.highWater = 0;
+    m_batchSession.acknowledged = 0;
+    m_batchSession.flags = 0;
+}
+
+Journal::~Journal()
+{
+    StopWriter();
+    StopBackgroundCompaction();
+    StopCommitThread();
+    AbortRewrite();
+
+    if (m_fileHandle != INVALID_HANDLE_VALUE) {
+        // A clean shutdown leaves nothing to replay on the next start
+        SaveManifest();
+        CloseHandle(m_fileHandle);
+    }
+    CloseReadHandle();
+    if (m_journalPath) {
+        delete[] m_journalPath;
+    }
+    if (m_recordBuffer) {
+        delete[] m_recordBuffer;
+    }
+    if (m_readBuffer) {
+        delete[] m_readBuffer;
+    }
+    if (m_batchBuffer) {
+        delete[] m_batchBuffer;
+    }
+    if (m_batchAcked) {
+        delete[] m_batchAcked;
+    }
+    DeleteCriticalSection(&m_lock);
+}
+
+bool Journal::Initialize(const TCHAR* journalPath)
+{
+    if (!journalPath) {
+        return false;
+    }
+
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle != INVALID_HANDLE_VALUE) {
+        FlushToDisk();
+        CloseHandle(m_fileHandle);
+        m_fileHandle = INVALID_HANDLE_VALUE;
+    }
+    CloseReadHandle();
+    AbortRewrite();
+
+    if (m_journalPath) {
+        delete[] m_journalPath;
+    }
+
+    int len = lstrlen(journalPath) + 1;
+    m_journalPath = new TCHAR[len];
+    lstrcpy(m_journalPath, journalPath);
+
+    m_pendingIndex.Clear();
+    m_historyIndex.Clear();
+    m_historyReady = false;
+    m_manifest.Reset();
+    m_manifest.SetEpoch(0);
+
+    // Diagnostics live next to the journal as "<path>.diag"; opened first
+    // so recovery can report to it. The journal works without it.
+    TCHAR diagPath[MAX_PATH];
+    wsprintf(diagPath, TEXT("%s.diag"), m_journalPath);
+    m_diagLog.Open(diagPath);
+
+    if (!OpenJournalFile()) {
+        return false;
+    }
+
+    // Counted once here, and kept up as transactions come and go
+    RecountPending();
+    return true;
+}
+
+bool Journal::LogTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details, bool durable,
+                             BYTE opcode)
+{
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    if (!AppendTransaction(transactionType, itemId, details, opcode)) {
+        return false;
+    }
+
+    return FinishAppend(durable);
+}
+
+bool Journal::StartWriter(CommitCallback callback, void* userData)
+{
+    if (m_writerThread) {
+        return true;
+    }
+
+    m_commitCallback = callback;
+    m_commitUserData = userData;
+    m_writerEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_writerStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_ringSpaceEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_writerThread = CreateThread(NULL, 0, WriterThread, this, 0, NULL);
+
+    if (!m_writerThread) {
+        CloseHandle(m_writerEvent);
+        CloseHandle(m_writerStopEvent);
+        CloseHandle(m_ringSpaceEvent);
+        m_writerEvent = NULL;
+        m_writerStopEvent = NULL;
+        m_ringSpaceEvent = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void Journal::StopWriter()
+{
+    if (!m_writerThread) {
+        return;
+    }
+
+    // The thread drains the queue once more before it exits
+    SetEvent(m_writerStopEvent);
+    WaitForSingleObject(m_writerThread, INFINITE);
+    CloseHandle(m_writerThread);
+    CloseHandle(m_writerEvent);
+    CloseHandle(m_writerStopEvent);
+    CloseHandle(m_ringSpaceEvent);
+
+    m_writerThread = NULL;
+    m_writerEvent = NULL;
+    m_writerStopEvent = NULL;
+    m_ringSpaceEvent = NULL;
+}
+
+bool Journal::IsWriterRunning() const
+{
+    return m_writerThread != NULL;
+}
+
+bool Journal::EnqueueTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details, DWORD* ticket,
+                                 BYTE opcode)
+{
+    if (!m_writerThread) {
+        return LogTransaction(transactionType, itemId, details, true, opcode);
+    }
+
+    // A full queue means the writer is behind on flash; sleep until it
+    // has freed a slot
+    DWORD next = m_lastTicket + 1;
+    while (!m_ring.Push(transactionType, itemId, details, opcode, next)) {
+        SetEvent(m_writerEvent);
+        WaitForSingleObject(m_ringSpaceEvent, INFINITE);
+    }
+    m_lastTicket = next;
+    SetEvent(m_writerEvent);
+
+    if (ticket) {
+        *ticket = next;
+    }
+    return true;
+}
+
+bool Journal::LogError(const TCHAR* errorCode, const TCHAR* errorMessage)
+{
+    if (!errorCode || !errorCode[0]) {
+        return WriteEntry(JournalFormat::REC_ERROR, errorMessage);
+    }
+
+    // Stored as "[CODE] message" so the code survives in the record
+    int codeLen = lstrlen(errorCode);
+    int messageLen = errorMessage ? lstrlen(errorMessage) : 0;
+    TCHAR* text = new TCHAR[codeLen + messageLen + 4];
+    text[0] = TEXT('[');
+    lstrcpy(text + 1, errorCode);
+    lstrcpy(text + 1 + codeLen, TEXT("] "));
+    lstrcpy(text + 3 + codeLen, errorMessage ? errorMessage : TEXT(""));
+
+    bool result = WriteEntry(JournalFormat::REC_ERROR, text);
+    delete[] text;
+    return result;
+}
+
+bool Journal::LogInfo(const TCHAR* message)
+{
+    return WriteEntry(JournalFormat::REC_INFO, message);
+}
+
+bool Journal::GetPendingTransactions(TCHAR*** transactions, int* count)
+{
+    if (!transactions || !count) {
+        return false;
+    }
+
+    *transactions = NULL;
+    *count = 0;
+
+    ScopedLock lock(&m_lock);
+
+    int pendingCount = m_pendingIndex.GetCount();
+    if (m_fileHandle == INVALID_HANDLE_VALUE || pendingCount == 0) {
+        return true; // No transactions
+    }
+
+    // Allocate array for transaction pointers
+    TCHAR** transArray = new TCHAR*[pendingCount];
+    int transCount = 0;
+
+    // Read only the pending records, straight from their indexed offsets
+    JournalFormat::RecordHeader header;
+    for (int pos = m_pendingIndex.First(); pos != -1 && transCount < pendingCount; pos = m_pendingIndex.Next(pos)) {
+        const JournalIndex::Entry& entry = m_pendingIndex.GetEntry(pos);
+        if (ReadRecordAt(entry.segment, entry.offset, entry.sequence, &header)) {
+            const BYTE* payload = m_readBuffer + JournalFormat::RECORD_HEADER_SIZE;
+            DWORD textOffset = TextOffset(payload, header);
+            transArray[transCount++] = Utf8ToString(payload + textOffset, header.length - textOffset);
+        }
+    }
+
+    *transactions = transArray;
+    *count = transCount;
+
+    return true;
+}
+
+Journal::PendingCursor::PendingCursor(Journal* journal)
+    : m_journal(journal)
+    , m_sequence(0)
+    , m_timestamp(0)
+    , m_opcode(0)
+    , m_text(new TCHAR[JournalFormat::MAX_PAYLOAD_SIZE + 1])
+    , m_typeCount(-1)
+    , m_exclude(false)
+{
+}
+
+Journal::PendingCursor::PendingCursor(Journal* journal, const TCHAR* const* types, bool exclude)
+    : m_journal(journal)
+    , m_sequence(0)
+    , m_timestamp(0)
+    , m_opcode(0)
+    , m_text(new TCHAR[JournalFormat::MAX_PAYLOAD_SIZE + 1])
+    , m_typeCount(0)
+    , m_exclude(exclude)
+{
+    // Keyed the way the index keys the stored tags
+    for (; types && types[m_typeCount] && m_typeCount < MAX_FILTER_TYPES; m_typeCount++) {
+        BYTE tag[JournalFormat::MAX_TAG_SIZE];
+        DWORD length = EncodeTag(types[m_typeCount], tag);
+        m_typeKeys[m_typeCount] = PayloadKey(tag, length);
+    }
+}
+
+Journal::PendingCursor::~PendingCursor()
+{
+    delete[] m_text;
+}
+
+ULONGLONG Journal::PendingCursor::GetId() const
+{
+    return m_sequence;
+}
+
+ULONGLONG Journal::PendingCursor::GetTimestamp() const
+{
+    return m_timestamp;
+}
+
+BYTE Journal::PendingCursor::GetOpcode() const
+{
+    return m_opcode;
+}
+
+const TCHAR* Journal::PendingCursor::Next()
+{
+    if (!m_journal || !m_journal->ReadPending(this)) {
+        return NULL;
+    }
+    return m_text;
+}
+
+int Journal::PendingCursor::GetRemaining() const
+{
+    return m_journal ? m_journal->CountPendingAfter(this) : 0;
+}
+
+bool Journal::PendingCursor::Matches(DWORD typeKey) const
+{
+    if (m_typeCount < 0) {
+        return true;
+    }
+
+    for (int i = 0; i < m_typeCount; i++) {
+        if (m_typeKeys[i] == typeKey) {
+            return !m_exclude;
+        }
+    }
+    return m_exclude;
+}
+
+bool Journal::ReadPending(PendingCursor* cursor)
+{
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // Resume by sequence number: index positions move as entries are
+    // removed and packed between calls
+    JournalFormat::RecordHeader header;
+    for (int pos = m_pendingIndex.FindAfter(cursor->m_sequence); pos != -1; pos = m_pendingIndex.Next(pos)) {
+        const JournalIndex::Entry& entry = m_pendingIndex.GetEntry(pos);
+        if (!cursor->Matches(entry.tag) || !ReadRecordAt(entry.segment, entry.offset, entry.sequence, &header)) {
+            continue;
+        }
+
+        const BYTE* payload = m_readBuffer + JournalFormat::RECORD_HEADER_SIZE;
+        DWORD textOffset = TextOffset(payload, header);
+        Utf8ToBuffer(payload + textOffset, header.length - textOffset, cursor->m_text, JournalFormat::MAX_PAYLOAD_SIZE);
+
+        cursor->m_sequence = entry.sequence;
+        cursor->m_timestamp = header.timestamp;
+        cursor->m_opcode = (BYTE)JournalFormat::GetOpcode(header.flags);
+        return true;
+    }
+
+    return false;
+}
+
+int Journal::CountPendingAfter(const PendingCursor* cursor) const
+{
+    ScopedLock lock(&m_lock);
+
+    int count = 0;
+    for (int pos = m_pendingIndex.FindAfter(cursor->m_sequence); pos != -1; pos = m_pendingIndex.Next(pos)) {
+        if (cursor->Matches(m_pendingIndex.GetEntry(pos).tag)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+Journal::QueryCursor::QueryCursor(Journal* journal, const QueryFilter& filter)
+    : m_journal(journal)
+    , m_sequence(0)
+    , m_timestamp(0)
+    , m_text(new TCHAR[JournalFormat::MAX_PAYLOAD_SIZE + 1])
+    , m_filterTypeLength(-1)
+    , m_filterItemLength(-1)
+    , m_fromTime(filter.fromTime)
+    , m_toTime(filter.toTime)
+{
+    m_text[0] = '\0';
+    m_type[0] = '\0';
+    m_item[0] = '\0';
+
+    // Filters are matched against the tags as stored, cut the same way
+    if (filter.transactionType && filter.transactionType[0]) {
+        m_filterTypeLength = (int)EncodeTag(filter.transactionType, m_filterType);
+    }
+    if (filter.itemId && filter.itemId[0]) {
+        m_filterItemLength = (int)EncodeTag(filter.itemId, m_filterItem);
+    }
+}
+
+Journal::QueryCursor::~QueryCursor()
+{
+    delete[] m_text;
+}
+
+const TCHAR* Journal::QueryCursor::Next()
+{
+    if (!m_journal || !m_journal->ReadMatch(this)) {
+        return NULL;
+    }
+    return m_text;
+}
+
+ULONGLONG Journal::QueryCursor::GetId() const
+{
+    return m_sequence;
+}
+
+ULONGLONG Journal::QueryCursor::GetTimestamp() const
+{
+    return m_timestamp;
+}
+
+const TCHAR* Journal::QueryCursor::GetTransactionType() const
+{
+    return m_type;
+}
+
+const TCHAR* Journal::QueryCursor::GetItemId() const
+{
+    return m_item;
+}
+
+bool Journal::ReadMatch(QueryCursor* cursor)
+{
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    if (!m_historyReady && !BuildHistory()) {
+        return false;
+    }
+
+    bool byItem = (cursor->m_filterItemLength >= 0);
+    DWORD itemKey = byItem ? PayloadKey(cursor->m_filterItem, (DWORD)cursor->m_filterItemLength) : 0;
+    DWORD typeKey = (cursor->m_filterTypeLength >= 0) ?
+                    PayloadKey(cursor->m_filterType, (DWORD)cursor->m_filterTypeLength) : 0;
+
+    // Resume by sequence number, as positions move between calls. An item
+    // id goes straight to that item's entries; otherwise start from the
+    // first entry in the time window.
+    int pos;
+    if (byItem) {
+        pos = m_historyIndex.FindKeyAfter(itemKey, cursor->m_sequence);
+    } else {
+        pos = m_historyIndex.FindAfter(cursor->m_sequence);
+        if (pos != -1 && cursor->m_fromTime > 0) {
+            int first = m_historyIndex.FindTime(cursor->m_fromTime);
+            if (first == -1 || first > pos) {
+                pos = first;
+            }
+        }
+    }
+
+    JournalFormat::RecordHeader header;
+    while (pos != -1) {
+        const JournalIndex::Entry& entry = m_historyIndex.GetEntry(pos);
+
+        // Entries are in time order, so nothing later can match
+        if (cursor->m_toTime > 0 && entry.timestamp >= cursor->m_toTime) {
+            break;
+        }
+
+        // Keys are hashes: the record is read only when they match, and
+        // its tags are then compared exactly
+        if (entry.timestamp >= cursor->m_fromTime &&
+            (cursor->m_filterTypeLength < 0 || entry.tag == typeKey) &&
+            ReadRecordAt(entry.segment, entry.offset, entry.sequence, &header)) {
+            const BYTE* payload = m_readBuffer + JournalFormat::RECORD_HEADER_SIZE;
+            JournalFormat::PayloadTags tags;
+            JournalFormat::DecodeTags(payload, header.length, header.flags, &tags);
+
+            if (TagMatches(payload + tags.typeOffset, tags.typeLength, cursor->m_filterType, cursor->m_filterTypeLength) &&
+                TagMatches(payload + tags.itemOffset, tags.itemLength, cursor->m_filterItem, cursor->m_filterItemLength)) {
+                Utf8ToBuffer(payload + tags.typeOffset, tags.typeLength, cursor->m_type, JournalFormat::MAX_TAG_SIZE);
+                Utf8ToBuffer(payload + tags.itemOffset, tags.itemLength, cursor->m_item, JournalFormat::MAX_TAG_SIZE);
+                Utf8ToBuffer(payload + tags.textOffset, header.length - tags.textOffset,
+                             cursor->m_text, JournalFormat::MAX_PAYLOAD_SIZE);
+                cursor->m_sequence = entry.sequence;
+                cursor->m_timestamp = entry.timestamp;
+                return true;
+            }
+        }
+
+        pos = byItem ? m_historyIndex.FindKeyAfter(itemKey, entry.sequence) : m_historyIndex.Next(pos);
+    }
+
+    return false;
+}
+
+bool Journal::BuildHistory()
+{
+    // Built by the first query rather than on startup, so opening the
+    // journal still only reads the active segment. From then on appends
+    // and compaction keep it current.
+    m_historyIndex.Clear();
+
+    if (!WriteBatch()) {
+        return false;
+    }
+
+    JournalFormat::RecordHeader header;
+    const BYTE* payload = NULL;
+    DWORD recordOffset = 0;
+    ULONGLONG lastSequence = 0;
+    DWORD activeId = m_manifest.GetActiveSegment().id;
+
+    for (int i = 0; i < m_manifest.GetSegmentCount(); i++) {
+        DWORD segmentId = m_manifest.GetSegment(i).id;
+        HANDLE file = (segmentId == activeId) ? m_fileHandle : OpenSegmentForRead(segmentId);
+        if (file == INVALID_HANDLE_VALUE) {
+            continue;
+        }
+
+        RecordReader reader(file, JournalFormat::FILE_HEADER_SIZE);
+        while (reader.Next(&header, &payload, &recordOffset) == JournalFormat::DECODE_OK) {
+            if (header.type == JournalFormat::REC_TRANS && header.sequence > lastSequence) {
+                if (!AddHistory(header.sequence, header.timestamp, segmentId, recordOffset,
+                                payload, header.length, header.flags)) {
+                    m_historyIndex.Clear();
+                    return false;
+                }
+                lastSequence = header.sequence;
+            }
+        }
+    }
+
+    m_historyReady = true;
+    return true;
+}
+
+bool Journal::AddHistory(ULONGLONG sequence, ULONGLONG timestamp, DWORD segmentId, DWORD offset,
+                         const BYTE* payload, DWORD length, WORD flags)
+{
+    // Keyed by item id, with the type as the tag so a type filter is
+    // checked without reading the record. Untagged records from older
+    // builds get the keys of empty tags.
+    JournalFormat::PayloadTags tags;
+    JournalFormat::DecodeTags(payload, length, flags, &tags);
+
+    return m_historyIndex.Add(sequence, segmentId, offset,
+                              PayloadKey(payload + tags.itemOffset, tags.itemLength),
+                              PayloadKey(payload + tags.typeOffset, tags.typeLength), timestamp);
+}
+
+void Journal::DropHistory(DWORD segmentId)
+{
+    for (int pos = m_historyIndex.First(); pos != -1; pos = m_historyIndex.Next(pos)) {
+        if (m_historyIndex.GetEntry(pos).segment == segmentId) {
+            m_historyIndex.Remove(pos);
+        }
+    }
+}
+
+bool Journal::MarkTransactionSynced(ULONGLONG transactionId)
+{
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // Only transactions that are still pending can be marked
+    int position = m_pendingIndex.FindSequence(transactionId);
+    if (position == -1) {
+        return false;
+    }
+
+    return WriteAck(position);
+}
+
+bool Journal::MarkTransactionSynced(const TCHAR* transactionText)
+{
+    if (!transactionText) {
+        return false;
+    }
+
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    int length = EncodePayload(transactionText);
+    if (length < 0) {
+        return false;
+    }
+
+    int position = FindPending(m_recordBuffer + JournalFormat::RECORD_HEADER_SIZE, (DWORD)length);
+    if (position == -1) {
+        return false;
+    }
+
+    return WriteAck(position);
+}
+
+bool Journal::WriteAck(int position)
+{
+    // Positions move if an append has to roll back a batch
+    ULONGLONG sequence = m_pendingIndex.GetEntry(position).sequence;
+    if (!AppendAck(sequence)) {
+        return false;
+    }
+    RemoveAcked(sequence);
+
+    // A lost ACK only means the transaction is sent again
+    return FinishAppend(false);
+}
+
+bool Journal::AppendAck(ULONGLONG sequence)
+{
+    // A fixed-size ACK names the transaction by sequence number instead
+    // of repeating its text
+    JournalFormat::EncodeAckPayload(m_recordBuffer + JournalFormat::RECORD_HEADER_SIZE, sequence);
+
+    return AppendRecord(JournalFormat::REC_ACK, 0, GetJournalTime(), JournalFormat::ACK_PAYLOAD_SIZE, NULL);
+}
+
+void Journal::RemoveAcked(ULONGLONG sequence)
+{
+    int position = m_pendingIndex.FindSequence(sequence);
+    if (position == -1) {
+        return;
+    }
+
+    // An ACK still in the batch is undone with it, and the transaction
+    // then has to be pending again
+    if (m_batchLength > 0 && m_batchAckedCount < BATCH_MAX_ACKS) {
+        m_batchAcked[m_batchAckedCount++] = m_pendingIndex.GetEntry(position);
+    }
+    RemovePending(position);
+}
+
+bool Journal::BeginSyncSession(SyncSession* session, bool* resumed)
+{
+    if (!session) {
+        return false;
+    }
+
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    JournalFormat::SessionState state = m_manifest.GetSession();
+    bool open = (state.id != 0 && !(state.flags & JournalFormat::SESSION_CLOSED));
+    if (!open) {
+        // Named after the record that opens it, so IDs never repeat
+        state.id = m_nextSequence;
+        state.highWater = 0;
+        state.acknowledged = 0;
+        state.flags = 0;
+
+        // Nothing is lost if this is: the next sync opens another one
+        if (!AppendSession(state)) {
+            return false;
+        }
+        m_manifest.SetSession(state);
+        if (!FinishAppend(false)) {
+            return false;
+        }
+    }
+
+    session->id = state.id;
+    session->highWater = state.highWater;
+    session->acknowledged = state.acknowledged;
+    if (resumed) {
+        *resumed = open;
+    }
+    return true;
+}
+
+bool Journal::AcknowledgeSynced(const ULONGLONG* transactionIds, int count)
+{
+    if (!transactionIds || count <= 0) {
+        return false;
+    }
+
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    JournalFormat::SessionState state = m_manifest.GetSession();
+    bool open = (state.id != 0 && !(state.flags & JournalFormat::SESSION_CLOSED));
+
+    int acknowledged = 0;
+    for (int i = 0; i < count; i++) {
+        int position = m_pendingIndex.FindSequence(transactionIds[i]);
+        if (position == -1) {
+            continue;
+        }
+        if (!AppendAck(transactionIds[i])) {
+            return false;
+        }
+
+        acknowledged++;
+        if (transactionIds[i] > state.highWater) {
+            state.highWater = transactionIds[i];
+        }
+    }
+
+    if (open && acknowledged > 0) {
+        state.acknowledged += (DWORD)acknowledged;
+        if (!AppendSession(state)) {
+            return false;
+        }
+    }
+
+    // The server has applied these; one flush keeps a cut-off sync from
+    // sending them again. They stop being pending only once the ACKs are
+    // on flash, so after a failed flush memory still agrees with the file
+    // and the next checkpoint with both.
+    if (!FlushToDisk()) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int position = m_pendingIndex.FindSequence(transactionIds[i]);
+        if (position != -1) {
+            RemovePending(position);
+        }
+    }
+    if (open && acknowledged > 0) {
+        m_manifest.SetSession(state);
+    }
+
+    CheckpointIfDue();
+    RetainIfDue();
+    return true;
+}
+
+bool Journal::EndSyncSession()
+{
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    JournalFormat::SessionState state = m_manifest.GetSession();
+    if (state.id == 0 || (state.flags & JournalFormat::SESSION_CLOSED)) {
+        return true;
+    }
+
+    state.flags |= JournalFormat::SESSION_CLOSED;
+    if (!AppendSession(state)) {
+        return false;
+    }
+    m_manifest.SetSession(state);
+
+    // Lost, the next sync resumes a session with nothing left in it
+    return FinishAppend(false);
+}
+
+bool Journal::GetSyncSession(SyncSession* session) const
+{
+    ScopedLock lock(&m_lock);
+
+    const JournalFormat::SessionState& state = m_manifest.GetSession();
+    if (state.id == 0 || (state.flags & JournalFormat::SESSION_CLOSED)) {
+        return false;
+    }
+
+    if (session) {
+        session->id = state.id;
+        session->highWater = state.highWater;
+        session->acknowledged = state.acknowledged;
+    }
+    return true;
+}
+
+bool Journal::AppendSession(const JournalFormat::SessionState& session)
+{
+    JournalFormat::EncodeSessionPayload(m_recordBuffer + JournalFormat::RECORD_HEADER_SIZE, &session);
+
+    // Callers put it in the manifest, which carries it past the next
+    // checkpoint, once it is as far along as they need
+    return AppendRecord(JournalFormat::REC_SESSION, 0, GetJournalTime(), JournalFormat::SESSION_PAYLOAD_SIZE, NULL);
+}
+
+int Journal::GetTransactionCount() const
+{
+    // The writer moves entries from the queue to the index under the lock
+    ScopedLock lock(&m_lock);
+    return m_pendingIndex.GetCount() + m_ring.GetCount();
+}
+
+DWORD Journal::GetEpoch() const
+{
+    ScopedLock lock(&m_lock);
+    return m_manifest.GetEpoch();
+}
+
+bool Journal::Compact()
+{
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE || !m_journalPath) {
+        return false;
+    }
+
+    // Same work as the background compactor, without a time limit
+    for (;;) {
+        bool finished = false;
+        if (!CompactSlice(INFINITE, &finished)) {
+            return false;
+        }
+        if (finished) {
+            return true;
+        }
+    }
+}
+
+bool Journal::StartBackgroundCompaction(DWORD garbagePercent, DWORD sliceMs)
+{
+    ScopedLock lock(&m_lock);
+
+    m_compactGarbagePercent = garbagePercent;
+    m_compactSliceMs = (sliceMs > 0) ? sliceMs : 1;
+
+    if (m_compactThread) {
+        return true;
+    }
+
+    m_compactStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_compactThread = CreateThread(NULL, 0, CompactionThread, this, 0, NULL);
+
+    if (!m_compactThread) {
+        CloseHandle(m_compactStopEvent);
+        m_compactStopEvent = NULL;
+        return false;
+    }
+
+    // Compaction only runs when nothing else needs the device
+    SetThreadPriority(m_compactThread, THREAD_PRIORITY_BELOW_NORMAL);
+    return true;
+}
+
+void Journal::StopBackgroundCompaction()
+{
+    if (!m_compactThread) {
+        return;
+    }
+
+    // A job in progress is kept and resumed by Compact() or a restart of
+    // the compactor
+    SetEvent(m_compactStopEvent);
+    WaitForSingleObject(m_compactThread, INFINITE);
+    CloseHandle(m_compactThread);
+    CloseHandle(m_compactStopEvent);
+
+    m_compactThread = NULL;
+    m_compactStopEvent = NULL;
+}
+
+void Journal::GetCompactionStats(CompactionStats* stats) const
+{
+    if (!stats) {
+        return;
+    }
+
+    ScopedLock lock(&m_lock);
+    *stats = m_compactStats;
+}
+
+void Journal::SetRetention(DWORD maxBytes, DWORD maxAgeSeconds, DWORD pendingFloorBytes)
+{
+    ScopedLock lock(&m_lock);
+
+    m_retentionMaxBytes = maxBytes;
+    m_retentionMaxAgeSeconds = maxAgeSeconds;
+    m_retentionFloorBytes = pendingFloorBytes;
+
+    // The first check comes after the first RETENTION_CHECK_BYTES
+    m_retentionAppended = 0;
+    m_retentionTick = GetTickCount();
+    m_retentionBehind = false;
+}
+
+void Journal::GetRetentionStats(RetentionStats* stats) const
+{
+    if (!stats) {
+        return;
+    }
+
+    ScopedLock lock(&m_lock);
+
+    stats->bytesUsed = GetJournalBytes();
+    stats->bytesLimit = m_retentionMaxBytes;
+    stats->pendingBytes = 0;
+    for (int i = 0; i < m_manifest.GetSegmentCount(); i++) {
+        stats->pendingBytes += EstimatePendingBytes(i);
+    }
+    stats->lastEnforced = m_lastRetention;
+    stats->transactionsDropped = m_retentionDropped;
+
+    // Growth assumes nothing is reclaimed in the meantime
+    stats->secondsToLimit = INFINITE;
+    if (m_retentionMaxBytes > 0 && m_appendRate > 0) {
+        ULONGLONG remaining = (stats->bytesUsed < m_retentionMaxBytes) ? m_retentionMaxBytes - stats->bytesUsed : 0;
+        stats->secondsToLimit = (DWORD)(remaining / m_appendRate);
+    }
+}
+
+bool Journal::Clear()
+{
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // Drop anything still batched along with the file contents
+    m_batchLength = 0;
+    m_batchRecords = 0;
+    m_flushPending = false;
+
+    CloseHandle(m_fileHandle);
+    m_fileHandle = INVALID_HANDLE_VALUE;
+    CloseReadHandle();
+    AbortRewrite();
+
+    // Forget the manifest first so a crash part way through cannot
+    // leave it naming deleted segments
+    JournalManifest::Delete(m_journalPath);
+
+    TCHAR segmentPath[MAX_PATH];
+    for (int i = 0; i < m_manifest.GetSegmentCount(); i++) {
+        JournalManifest::GetSegmentPath(m_journalPath, m_manifest.GetSegment(i).id, segmentPath);
+        DeleteFile(segmentPath);
+    }
+
+    m_pendingIndex.Clear();
+    m_manifest.Reset();
+
+    // Nothing is left to query, so the empty history is complete
+    m_historyIndex.Clear();
+    m_historyReady = true;
+
+    // Sequence numbers keep counting so old IDs are never reused
+    return CreateJournal();
+}
+
+bool Journal::SetGroupCommit(DWORD windowMs, DWORD maxRecords)
+{
+    ScopedLock lock(&m_lock);
+
+    // Commit whatever was batched under the old settings
+    if (!FlushToDisk()) {
+        return false;
+    }
+
+    m_commitWindowMs = windowMs;
+    m_commitMaxRecords = (maxRecords > 0) ? maxRecords : 1;
+
+    if (windowMs == 0) {
+        return true;
+    }
+
+    if (!m_batchBuffer) {
+        m_batchBuffer = new BYTE[BATCH_BUFFER_SIZE];
+        m_batchAcked = new JournalIndex::Entry[BATCH_MAX_ACKS];
+    }
+
+    if (!m_commitThread) {
+        m_commitEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        m_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_commitThread = CreateThread(NULL, 0, CommitThread, this, 0, NULL);
+
+        if (!m_commitThread) {
+            // Without the timer thread nothing would flush a quiet batch
+            m_commitWindowMs = 0;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Journal::Flush()
+{
+    ScopedLock lock(&m_lock);
+    return FlushToDisk();
+}
+
+bool Journal::Checkpoint()
+{
+    ScopedLock lock(&m_lock);
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    return SaveManifest();
+}
+
+bool Journal::WriteEntry(WORD recordType, const TCHAR* message)
+{
+    ScopedLock lock(&m_lock);
+
+    int length = EncodePayload(message);
+    if (length < 0) {
+        return false;
+    }
+
+    // Diagnostics never touch the transaction segments
+    return m_diagLog.Write(recordType, GetJournalTime(),
+                           m_recordBuffer + JournalFormat::RECORD_HEADER_SIZE, (DWORD)length);
+}
+
+bool Journal::AppendTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details, BYTE opcode)
+{
+    int length = EncodeTransaction(transactionType, itemId, details);
+    if (length < 0) {
+        return false;
+    }
+
+    ULONGLONG sequence = m_nextSequence;
+    ULONGLONG timestamp = GetJournalTime();
+    DWORD recordOffset = 0;
+    WORD flags = (WORD)(JournalFormat::FLAG_TAGGED | JournalFormat::OpcodeFlags(opcode));
+    if (!AppendRecord(JournalFormat::REC_TRANS, flags, timestamp, (DWORD)length, &recordOffset)) {
+        return false;
+    }
+
+    // AppendRecord may have rolled over to a new active segment
+    DWORD segmentId = m_manifest.GetActiveSegment().id;
+    const BYTE* payload = m_recordBuffer + JournalFormat::RECORD_HEADER_SIZE;
+    DWORD textOffset = JournalFormat::TAG_HEADER_SIZE + payload[0] + payload[1];
+
+    if (!AddPending(sequence, segmentId, recordOffset, PayloadKey(payload + textOffset, (DWORD)length - textOffset),
+                    TypeKey(payload, (DWORD)length, JournalFormat::FLAG_TAGGED), timestamp)) {
+        // Left in the journal, it would not be synced until a restart
+        // rescanned it
+        DropLastRecord(JournalFormat::RECORD_HEADER_SIZE + (DWORD)length);
+        return false;
+    }
+
+    // The history is only kept up to date once a query has built it; if
+    // it cannot grow, the next query rebuilds it
+    if (m_historyReady &&
+        !AddHistory(sequence, timestamp, segmentId, recordOffset, payload, (DWORD)length, JournalFormat::FLAG_TAGGED)) {
+        m_historyIndex.Clear();
+        m_historyReady = false;
+    }
+    return true;
+}
+
+int Journal::EncodePayload(const TCHAR* message)
+{
+    // Encode the message as UTF-8 directly behind the record header; -1
+    // means it does not fit in a single record
+    return EncodeUtf8(message, m_recordBuffer + JournalFormat::RECORD_HEADER_SIZE, JournalFormat::MAX_PAYLOAD_SIZE);
+}
+
+int Journal::EncodeTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details)
+{
+    // Type and item id go ahead of the text so queries can match them
+    // without decoding it
+    BYTE typeTag[JournalFormat::MAX_TAG_SIZE];
+    BYTE itemTag[JournalFormat::MAX_TAG_SIZE];
+    DWORD typeLen = EncodeTag(transactionType, typeTag);
+    DWORD itemLen = EncodeTag(itemId, itemTag);
+
+    BYTE* payload = m_recordBuffer + JournalFormat::RECORD_HEADER_SIZE;
+    DWORD textOffset = JournalFormat::EncodeTags(payload, typeTag, typeLen, itemTag, itemLen);
+
+    int textLength = EncodeUtf8(details, payload + textOffset, JournalFormat::MAX_PAYLOAD_SIZE - textOffset);
+    return (textLength >= 0) ? (int)textOffset + textLength : -1;
+}
+
+bool Journal::AppendRecord(WORD recordType, WORD flags, ULONGLONG timestamp, DWORD length, DWORD* recordOffset)
+{
+    // Payload is expected at m_recordBuffer + RECORD_HEADER_SIZE
+    JournalFormat::RecordHeader header;
+    header.sequence = m_nextSequence;
+    header.timestamp = timestamp;
+    header.type = recordType;
+    header.flags = flags;
+    header.length = length;
+
+    JournalFormat::EncodeRecord(m_recordBuffer, &header);
+
+    DWORD recordSize = JournalFormat::RECORD_HEADER_SIZE + length;
+    DWORD offset;
+
+    // Start a new segment rather than grow the active one past its limit.
+    // If the manifest cannot be updated the record still goes into the
+    // current segment.
+    DWORD activeEnd = m_fileEnd + m_batchLength;
+    if (activeEnd > JournalFormat::FILE_HEADER_SIZE && activeEnd + recordSize > SEGMENT_SIZE_LIMIT) {
+        RollSegment();
+    }
+
+    if (m_commitWindowMs == 0) {
+        // Write straight through; FinishAppend() flushes
+        offset = m_fileEnd;
+        SetFilePointer(m_fileHandle, offset, NULL, FILE_BEGIN);
+
+        // Header and payload go out in a single write
+        DWORD bytesWritten = 0;
+        if (!WriteFile(m_fileHandle, m_recordBuffer, recordSize, &bytesWritten, NULL) ||
+            bytesWritten != recordSize) {
+            // Cut off a partial record so later appends stay readable
+            SetFilePointer(m_fileHandle, m_fileEnd, NULL, FILE_BEGIN);
+            SetEndOfFile(m_fileHandle);
+            return false;
+        }
+        m_fileEnd += recordSize;
+        m_flushPending = true;
+    } else {
+        // Batch in memory; the record's offset is where it will land
+        if (m_batchLength + recordSize > BATCH_BUFFER_SIZE && !FlushToDisk()) {
+            return false;
+        }
+
+        // What to put back should the batch not reach the file
+        if (m_batchRecords == 0) {
+            m_batchSequence = m_nextSequence;
+            m_batchSession = m_manifest.GetSession();
+            m_batchAckedCount = 0;
+        }
+
+        offset = m_fileEnd + m_batchLength;
+        memcpy(m_batchBuffer + m_batchLength, m_recordBuffer, recordSize);
+        m_batchLength += recordSize;
+        m_batchRecords++;
+
+        // First record of a batch starts the commit window
+        if (m_batchRecords == 1) {
+            SetEvent(m_commitEvent);
+        }
+    }
+
+    if (recordOffset) {
+        *recordOffset = offset;
+    }
+
+    m_manifest.GetActiveSegment().records++;
+    m_nextSequence++;
+    m_retentionAppended += recordSize;
+    m_lastAppendTick = GetTickCount();
+    return true;
+}
+
+void Journal::DropLastRecord(DWORD recordSize)
+{
+    // Takes back the record AppendRecord just added
+    if (m_commitWindowMs == 0) {
+        m_fileEnd -= recordSize;
+        SetFilePointer(m_fileHandle, m_fileEnd, NULL, FILE_BEGIN);
+        SetEndOfFile(m_fileHandle);
+    } else {
+        m_batchLength -= recordSize;
+        m_batchRecords--;
+    }
+
+    m_manifest.GetActiveSegment().records--;
+    m_nextSequence--;
+    m_retentionAppended -= recordSize;
+}
+
+bool Journal::ReadRecordAt(DWORD segmentId, DWORD offset, ULONGLONG sequence, JournalFormat::RecordHeader* header)
+{
+    // sequence is the record the caller expects there, 0 for any
+    HANDLE file;
+    if (segmentId == m_manifest.GetActiveSegment().id) {
+        // Batched records must reach the file before they can be read back
+        if (!WriteBatch()) {
+            return false;
+        }
+        file = m_fileHandle;
+    } else {
+        file = OpenSegmentForRead(segmentId);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+    }
+
+    // Reads one complete record into m_readBuffer
+    if (SetFilePointer(file, offset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
+        return false;
+    }
+
+    DWORD bytesRead = 0;
+    if (!ReadFile(file, m_readBuffer, JournalFormat::RECORD_HEADER_SIZE, &bytesRead, NULL) ||
+        bytesRead != JournalFormat::RECORD_HEADER_SIZE) {
+        return false;
+    }
+
+    JournalFormat::DecodeResult result =
+        JournalFormat::DecodeRecord(m_readBuffer, JournalFormat::RECORD_HEADER_SIZE, header);
+
+    if (result == JournalFormat::DECODE_NEED_MORE) {
+        DWORD payloadRead = 0;
+        if (!ReadFile(file, m_readBuffer + JournalFormat::RECORD_HEADER_SIZE, header->length, &payloadRead, NULL) ||
+            payloadRead != header->length) {
+            return false;
+        }
+        result = JournalFormat::DecodeRecord(m_readBuffer, JournalFormat::RECORD_HEADER_SIZE + header->length, header);
+    }
+
+    // An index entry that has come to point at another record is never
+    // taken for the one it names
+    return (result == JournalFormat::DECODE_OK && (sequence == 0 || header->sequence == sequence));
+}
+
+int Journal::FindPending(const BYTE* payload, DWORD length)
+{
+    // Hash hits are confirmed against the stored record, oldest first
+    // Only the text is compared; tags are not part of what sync sends
+    for (int pos = m_pendingIndex.FindKey(PayloadKey(payload, length)); pos != -1; pos = m_pendingIndex.FindNextKey(pos)) {
+        const JournalIndex::Entry& entry = m_pendingIndex.GetEntry(pos);
+        JournalFormat::RecordHeader header;
+        if (!ReadRecordAt(entry.segment, entry.offset, entry.sequence, &header)) {
+            continue;
+        }
+
+        const BYTE* stored = m_readBuffer + JournalFormat::RECORD_HEADER_SIZE;
+        DWORD textOffset = TextOffset(stored, header);
+        if (header.length - textOffset == length && memcmp(stored + textOffset, payload, length) == 0) {
+            return pos;
+        }
+    }
+
+    return -1;
+}
+
+bool Journal::FinishAppend(bool durable)
+{
+    if (m_commitWindowMs == 0 || durable || m_batchRecords >= m_commitMaxRecords) {
+        if (!FlushToDisk()) {
+            return false;
+        }
+        CheckpointIfDue();
+        RetainIfDue();
+    }
+
+    // Otherwise the commit thread flushes when the window closes
+    return true;
+}
+
+void Journal::CheckpointIfDue()
+{
+    // Records after the last checkpoint are replayed by Initialize, so
+    // keep them to a bounded amount
+    DWORD replayBytes = m_fileEnd - m_manifest.GetScanOffset();
+    DWORD manifestBytes = JournalFormat::MANIFEST_HEADER_SIZE +
+                          m_manifest.GetSegmentCount() * JournalFormat::MANIFEST_SEGMENT_SIZE +
+                          m_pendingIndex.GetCount() * JournalFormat::MANIFEST_PENDING_SIZE;
+
+    DWORD threshold = manifestBytes * 4;
+    if (threshold < CHECKPOINT_MIN_BYTES) {
+        threshold = CHECKPOINT_MIN_BYTES;
+    }
+
+    // A failed checkpoint only means a longer replay next time
+    if (replayBytes >= threshold) {
+        SaveManifest();
+    }
+}
+
+void Journal::RetainIfDue()
+{
+    // Paced by append volume, so an idle journal does no work
+    if ((m_retentionMaxBytes == 0 && m_retentionMaxAgeSeconds == 0) ||
+        (!m_retentionBehind && m_retentionAppended < RETENTION_CHECK_BYTES)) {
+        return;
+    }
+
+    if (m_retentionAppended >= RETENTION_CHECK_BYTES) {
+        // Append rate for the time-to-limit estimate
+        DWORD now = GetTickCount();
+        DWORD elapsed = now - m_retentionTick;
+        if (elapsed > 0) {
+            DWORD rate = (DWORD)((ULONGLONG)m_retentionAppended * 1000 / elapsed);
+            m_appendRate = (m_appendRate > 0) ? (m_appendRate * 3 + rate) / 4 : rate;
+        }
+        m_retentionAppended = 0;
+        m_retentionTick = now;
+
+        // The diagnostic log has a fixed size, so it only ages out
+        ULONGLONG maxAgeMs = (ULONGLONG)m_retentionMaxAgeSeconds * 1000;
+        ULONGLONG timeNow = GetJournalTime();
+        if (m_retentionMaxAgeSeconds > 0 && timeNow > maxAgeMs) {
+            m_diagLog.Expire(timeNow - maxAgeMs);
+        }
+    }
+
+    // One step of at most a compaction slice; a failed step waits for
+    // the next check rather than retrying on every commit
+    m_retentionBehind = EnforceRetention(m_compactSliceMs);
+}
+
+bool Journal::WriteBatch()
+{
+    if (m_batchLength == 0) {
+        return true;
+    }
+
+    SetFilePointer(m_fileHandle, m_fileEnd, NULL, FILE_BEGIN);
+
+    DWORD bytesWritten = 0;
+    bool success = (WriteFile(m_fileHandle, m_batchBuffer, m_batchLength, &bytesWritten, NULL) &&
+                    bytesWritten == m_batchLength);
+
+    if (success) {
+        m_fileEnd += m_batchLength;
+        m_flushPending = true;
+    } else {
+        // Cut off a partial batch so later appends stay readable
+        SetFilePointer(m_fileHandle, m_fileEnd, NULL, FILE_BEGIN);
+        SetEndOfFile(m_fileHandle);
+        RollBackBatch();
+    }
+
+    m_batchLength = 0;
+    m_batchRecords = 0;
+    return success;
+}
+
+void Journal::RollBackBatch()
+{
+    // The index may only name records that are in the file: forget the
+    // transactions the lost batch added and bring back those its ACKs
+    // removed. Its sequence numbers are not used again; the next records
+    // take over its offsets under new ones.
+    for (int pos = m_pendingIndex.FindAfter(m_batchSequence - 1); pos != -1; pos = m_pendingIndex.Next(pos)) {
+        RemovePending(pos);
+    }
+    if (m_historyReady) {
+        for (int pos = m_historyIndex.FindAfter(m_batchSequence - 1); pos != -1; pos = m_historyIndex.Next(pos)) {
+            m_historyIndex.Remove(pos);
+        }
+    }
+    for (int i = 0; i < m_batchAckedCount; i++) {
+        if (m_batchAcked[i].sequence < m_batchSequence && m_pendingIndex.Restore(m_batchAcked[i])) {
+            ChangePendingCount(m_batchAcked[i].segment, 1);
+        }
+    }
+
+    m_manifest.SetSession(m_batchSession);
+    m_manifest.GetActiveSegment().records -= m_batchRecords;
+    m_batchAckedCount = 0;
+}
+
+void Journal::StopCommitThread()
+{
+    if (!m_commitThread) {
+        return;
+    }
+
+    SetEvent(m_stopEvent);
+    WaitForSingleObject(m_commitThread, INFINITE);
+    CloseHandle(m_commitThread);
+    CloseHandle(m_commitEvent);
+    CloseHandle(m_stopEvent);
+
+    m_commitThread = NULL;
+    m_commitEvent = NULL;
+    m_stopEvent = NULL;
+}
+
+DWORD WINAPI Journal::CommitThread(LPVOID param)
+{
+    Journal* pThis = (Journal*)param;
+    if (!pThis) {
+        return 1;
+    }
+
+    HANDLE events[2] = { pThis->m_stopEvent, pThis->m_commitEvent };
+
+    for (;;) {
+        // Sleep until a batch is started
+        if (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0) {
+            break;
+        }
+
+        // Give the batch one window to fill up, then commit it
+        bool stopping = (WaitForSingleObject(pThis->m_stopEvent, pThis->m_commitWindowMs) == WAIT_OBJECT_0);
+
+        EnterCriticalSection(&pThis->m_lock);
+        if (pThis->FlushToDisk()) {
+            pThis->CheckpointIfDue();
+            pThis->RetainIfDue();
+        }
+        LeaveCriticalSection(&pThis->m_lock);
+
+        if (stopping) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void Journal::DrainQueue()
+{
+    if (!m_ring.Peek()) {
+        return;
+    }
+
+    DWORD ticket = 0;
+    bool success = true;
+
+    EnterCriticalSection(&m_lock);
+
+    // Everything queued so far goes out with a single flush
+    const TransactionRing::Slot* slot;
+    while ((slot = m_ring.Peek()) != NULL) {
+        if (m_fileHandle == INVALID_HANDLE_VALUE || !AppendTransaction(slot->type, slot->item, slot->text, slot->opcode)) {
+            success = false;
+        }
+        ticket = slot->ticket;
+        m_ring.Pop();
+    }
+    SetEvent(m_ringSpaceEvent);
+
+    if (FlushToDisk()) {
+        CheckpointIfDue();
+        RetainIfDue();
+    } else {
+        success = false;
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    // Outside the lock: the callback may well call back into the journal
+    if (m_commitCallback) {
+        m_commitCallback(ticket, success, m_commitUserData);
+    }
+}
+
+DWORD WINAPI Journal::WriterThread(LPVOID param)
+{
+    Journal* pThis = (Journal*)param;
+    if (!pThis) {
+        return 1;
+    }
+
+    HANDLE events[2] = { pThis->m_writerStopEvent, pThis->m_writerEvent };
+
+    for (;;) {
+        bool stopping = (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0);
+
+        pThis->DrainQueue();
+
+        if (stopping) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+bool Journal::OpenJournalFile()
+{
+    // Segmented journal: the manifest lists the segments and the pending
+    // transactions, so only the active segment has to be read
+    bool loaded = m_manifest.Load(m_journalPath, &m_pendingIndex);
+
+    // A new journal starts its IDs over, so it gets an epoch of its own.
+    // One written before epochs existed gets one too, saved right away so
+    // its keys do not change from run to run.
+    if (m_manifest.GetEpoch() == 0) {
+        m_manifest.SetEpoch(NewEpoch(GetJournalTime()));
+    }
+
+    if (loaded) {
+        if (!OpenActiveSegment()) {
+            return false;
+        }
+        if (m_manifest.GetVersion() < 2) {
+            RetagPending();
+        }
+        if (m_manifest.GetVersion() < 3) {
+            return SaveManifest();
+        }
+        return true;
+    }
+
+    m_pendingIndex.Clear();
+    m_manifest.Reset();
+
+    // Single-file journal written by an older build
+    DWORD attributes = GetFileAttributes(m_journalPath);
+    if (attributes != 0xFFFFFFFF) {
+        return ConvertSingleFile();
+    }
+
+    // Segments without a readable manifest are rescanned in full
+    if (RecoverSegments()) {
+        return true;
+    }
+
+    // New journal
+    m_nextSequence = 1;
+    return CreateJournal();
+}
+
+bool Journal::OpenActiveSegment()
+{
+    m_nextSequence = m_manifest.GetNextSequence();
+    m_lastTimestamp = m_manifest.GetLastTimestamp();
+
+    JournalManifest::Segment& active = m_manifest.GetActiveSegment();
+    TCHAR segmentPath[MAX_PATH];
+    JournalManifest::GetSegmentPath(m_journalPath, active.id, segmentPath);
+
+    m_fileHandle = CreateFile(
+        segmentPath,
+        GENERIC_WRITE | GENERIC_READ,
+        0,
+        NULL,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    DWORD fileSize = GetFileSize(m_fileHandle, NULL);
+    if (fileSize == INVALID_FILE_SIZE) {
+        return false;
+    }
+
+    // A segment created just before a crash may not have its header yet
+    if (fileSize < JournalFormat::FILE_HEADER_SIZE) {
+        if (!WriteFileHeader(m_fileHandle, m_nextSequence)) {
+            return false;
+        }
+        fileSize = JournalFormat::FILE_HEADER_SIZE;
+        m_flushPending = true;
+    }
+    m_fileEnd = fileSize;
+
+    // Replay what was appended after the manifest was written
+    DWORD scanOffset = m_manifest.GetScanOffset();
+    if (scanOffset < JournalFormat::FILE_HEADER_SIZE || scanOffset > fileSize) {
+        scanOffset = JournalFormat::FILE_HEADER_SIZE;
+    }
+
+    DWORD recovered = 0;
+    DWORD discarded = 0;
+    if (!RecoverActiveSegment(scanOffset, &recovered, &discarded)) {
+        return false;
+    }
+
+    // A clean shutdown leaves nothing to replay, so anything here means
+    // the device lost power or the process was killed
+    if (recovered > 0 || discarded > 0) {
+        TCHAR message[128];
+        wsprintf(message, TEXT("Journal recovered after unclean shutdown: %lu records replayed, %lu discarded"),
+                 recovered, discarded);
+        LogError(TEXT("JOURNAL_RECOVERY"), message);
+    }
+    return true;
+}
+
+bool Journal::RecoverActiveSegment(DWORD startOffset, DWORD* recovered, DWORD* discarded)
+{
+    // Validate framing and checksums from startOffset on. Records are
+    // only ever appended, so the first one that does not decode is a
+    // write torn by power loss; the segment is cut back to the record
+    // before it so new records follow intact ones
+    JournalManifest::Segment& active = m_manifest.GetActiveSegment();
+    DWORD recordsBefore = active.records;
+    DWORD validEnd = startOffset;
+
+    if (!ScanRecords(m_fileHandle, active.id, startOffset, &validEnd)) {
+        return false;
+    }
+
+    *recovered = active.records - recordsBefore;
+    *discarded = 0;
+
+    if (validEnd >= m_fileEnd) {
+        return true;
+    }
+
+    *discarded = CountDiscarded(m_fileHandle, validEnd);
+
+    if (SetFilePointer(m_fileHandle, validEnd, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+        !SetEndOfFile(m_fileHandle)) {
+        return false;
+    }
+    m_fileEnd = validEnd;
+    m_flushPending = true;
+
+    return true;
+}
+
+bool Journal::CreateJournal()
+{
+    DWORD segmentId = m_manifest.AllocateSegmentId();
+    if (!m_manifest.AddSegment(segmentId) || !CreateSegmentFile(segmentId, m_nextSequence, &m_fileHandle)) {
+        return false;
+    }
+
+    m_fileEnd = JournalFormat::FILE_HEADER_SIZE;
+    return SaveManifest();
+}
+
+bool Journal::ConvertSingleFile()
+{
+    HANDLE file = CreateFile(
+        m_journalPath,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    BYTE fileHeader[JournalFormat::FILE_HEADER_SIZE];
+    DWORD bytesRead = 0;
+    ReadFile(file, fileHeader, sizeof(fileHeader), &bytesRead, NULL);
+    CloseHandle(file);
+
+    // Empty file: start over
+    if (bytesRead == 0) {
+        DeleteFile(m_journalPath);
+        m_nextSequence = 1;
+        return CreateJournal();
+    }
+
+    // Binary journal: it becomes the first (and active) segment as is
+    ULONGLONG baseSequence = 1;
+    if (JournalFormat::DecodeFileHeader(fileHeader, bytesRead, &baseSequence)) {
+        DWORD segmentId = m_manifest.AllocateSegmentId();
+        TCHAR segmentPath[MAX_PATH];
+        JournalManifest::GetSegmentPath(m_journalPath, segmentId, segmentPath);
+
+        DeleteFile(segmentPath);
+        if (!MoveFile(m_journalPath, segmentPath) || !m_manifest.AddSegment(segmentId)) {
+            return false;
+        }
+
+        m_fileHandle = CreateFile(
+            segmentPath,
+            GENERIC_WRITE | GENERIC_READ,
+            0,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL
+        );
+
+        if (m_fileHandle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        m_nextSequence = baseSequence;
+        m_fileEnd = GetFileSize(m_fileHandle, NULL);
+
+        DWORD recovered = 0;
+        DWORD discarded = 0;
+        return RecoverActiveSegment(JournalFormat::FILE_HEADER_SIZE, &recovered, &discarded) && SaveManifest();
+    }
+
+    // Text journal written by an older build
+    if (JournalFormat::IsLegacyText(fileHeader, bytesRead)) {
+        return ImportLegacyJournal() && SaveManifest();
+    }
+
+    // Unrecognised content: set it aside rather than refusing to start
+    TCHAR asidePath[MAX_PATH];
+    wsprintf(asidePath, TEXT("%s.bad"), m_journalPath);
+    DeleteFile(asidePath);
+    MoveFile(m_journalPath, asidePath);
+
+    m_nextSequence = 1;
+    return CreateJournal();
+}
+
+bool Journal::RecoverSegments()
+{
+    // Find every "<path>.xxxxxxxx" segment file
+    TCHAR pattern[MAX_PATH];
+    wsprintf(pattern, TEXT("%s.*"), m_journalPath);
+
+    WIN32_FIND_DATA findData;
+    HANDLE find = FindFirstFile(pattern, &findData);
+    if (find == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // The search returns bare file names; match on the suffix after the
+    // last dot
+    int foundCount = 0;
+    int foundCapacity = 16;
+    DWORD* foundIds = new DWORD[foundCapacity];
+    ULONGLONG* foundBases = new ULONGLONG[foundCapacity];
+
+    do {
+        const TCHAR* dot = NULL;
+        for (const TCHAR* p = findData.cFileName; *p; p++) {
+            if (*p == '.') {
+                dot = p;
+            }
+        }
+
+        DWORD segmentId;
+        if (!dot || !ParseSegmentId(dot + 1, &segmentId)) {
+            continue;
+        }
+
+        HANDLE file = OpenSegmentForRead(segmentId);
+        BYTE fileHeader[JournalFormat::FILE_HEADER_SIZE];
+        DWORD bytesRead = 0;
+        ULONGLONG baseSequence = 0;
+
+        if (file == INVALID_HANDLE_VALUE ||
+            SetFilePointer(file, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+            !ReadFile(file, fileHeader, sizeof(fileHeader), &bytesRead, NULL) ||
+            !JournalFormat::DecodeFileHeader(fileHeader, bytesRead, &baseSequence)) {
+            continue;
+        }
+
+        if (foundCount == foundCapacity) {
+            DWORD* newIds = new DWORD[foundCapacity * 2];
+            ULONGLONG* newBases = new ULONGLONG[foundCapacity * 2];
+            for (int i = 0; i < foundCount; i++) {
+                newIds[i] = foundIds[i];
+                newBases[i] = foundBases[i];
+            }
+            delete[] foundIds;
+            delete[] foundBases;
+            foundIds = newIds;
+            foundBases = newBases;
+            foundCapacity *= 2;
+        }
+
+        // Keep the list in sequence order; compacted segments have newer
+        // ids than the segments written after them
+        int insertAt = foundCount;
+        while (insertAt > 0 && foundBases[insertAt - 1] > baseSequence) {
+            foundIds[insertAt] = foundIds[insertAt - 1];
+            foundBases[insertAt] = foundBases[insertAt - 1];
+            insertAt--;
+        }
+        foundIds[insertAt] = segmentId;
+        foundBases[insertAt] = baseSequence;
+        foundCount++;
+    } while (FindNextFile(find, &findData));
+
+    FindClose(find);
+    CloseReadHandle();
+
+    bool success = (foundCount > 0);
+    m_nextSequence = 1;
+
+    for (int i = 0; success && i < foundCount; i++) {
+        success = m_manifest.AddSegment(foundIds[i]);
+        if (!success) {
+            break;
+        }
+
+        if (i < foundCount - 1) {
+            // Sealed segments are scanned through a separate read handle
+            TCHAR segmentPath[MAX_PATH];
+            JournalManifest::GetSegmentPath(m_journalPath, foundIds[i], segmentPath);
+
+            HANDLE file = CreateFile(segmentPath, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            success = (file != INVALID_HANDLE_VALUE);
+            if (success) {
+                m_manifest.GetActiveSegment().size = GetFileSize(file, NULL);
+                success = ScanRecords(file, foundIds[i], JournalFormat::FILE_HEADER_SIZE, NULL);
+                CloseHandle(file);
+            }
+        }
+    }
+
+    delete[] foundIds;
+    delete[] foundBases;
+
+    if (!success) {
+        m_pendingIndex.Clear();
+        m_manifest.Reset();
+        return false;
+    }
+
+    // The newest segment becomes the active one again
+    JournalManifest::Segment& active = m_manifest.GetActiveSegment();
+    TCHAR segmentPath[MAX_PATH];
+    JournalManifest::GetSegmentPath(m_journalPath, active.id, segmentPath);
+
+    m_fileHandle = CreateFile(
+        segmentPath,
+        GENERIC_WRITE | GENERIC_READ,
+        0,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    m_fileEnd = GetFileSize(m_fileHandle, NULL);
+
+    DWORD recovered = 0;
+    DWORD discarded = 0;
+    if (!RecoverActiveSegment(JournalFormat::FILE_HEADER_SIZE, &recovered, &discarded) || !SaveManifest()) {
+        return false;
+    }
+
+    TCHAR message[160];
+    wsprintf(message, TEXT("Journal manifest missing; rebuilt from %d segments, %lu records discarded"),
+             m_manifest.GetSegmentCount(), discarded);
+
+    // The journal itself is usable whether or not this can be logged
+    LogError(TEXT("JOURNAL_RECOVERY"), message);
+    return true;
+}
+
+bool Journal::CreateSegmentFile(DWORD segmentId, ULONGLONG baseSequence, HANDLE* file)
+{
+    TCHAR segmentPath[MAX_PATH];
+    JournalManifest::GetSegmentPath(m_journalPath, segmentId, segmentPath);
+
+    *file = CreateFile(
+        segmentPath,
+        GENERIC_WRITE | GENERIC_READ,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (*file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // The header must be on flash before the manifest names the segment
+    if (!WriteFileHeader(*file, baseSequence) || !FlushFileBuffers(*file)) {
+        CloseHandle(*file);
+        *file = INVALID_HANDLE_VALUE;
+        DeleteFile(segmentPath);
+        return false;
+    }
+
+    return true;
+}
+
+HANDLE Journal::OpenSegmentForRead(DWORD segmentId)
+{
+    // One sealed segment is kept open for reading at a time
+    if (m_readHandle != INVALID_HANDLE_VALUE && m_readSegment == segmentId) {
+        return m_readHandle;
+    }
+
+    CloseReadHandle();
+
+    TCHAR segmentPath[MAX_PATH];
+    JournalManifest::GetSegmentPath(m_journalPath, segmentId, segmentPath);
+
+    m_readHandle = CreateFile(
+        segmentPath,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    m_readSegment = segmentId;
+    return m_readHandle;
+}
+
+void Journal::CloseReadHandle()
+{
+    if (m_readHandle != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_readHandle);
+        m_readHandle = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool Journal::RollSegment()
+{
+    // Seal the active segment with everything batched for it
+    if (!FlushToDisk()) {
+        return false;
+    }
+
+    DWORD segmentId = m_manifest.AllocateSegmentId();
+    HANDLE newHandle = INVALID_HANDLE_VALUE;
+    if (!CreateSegmentFile(segmentId, m_nextSequence, &newHandle)) {
+        return false;
+    }
+
+    m_manifest.GetActiveSegment().size = m_fileEnd;
+    if (!m_manifest.AddSegment(segmentId)) {
+        CloseHandle(newHandle);
+        return false;
+    }
+
+    // The new segment only counts once the manifest names it
+    if (!m_manifest.Save(m_journalPath, m_pendingIndex, m_nextSequence, m_lastTimestamp,
+                         JournalFormat::FILE_HEADER_SIZE)) {
+        m_manifest.RemoveSegment(m_manifest.GetSegmentCount() - 1);
+        CloseHandle(newHandle);
+
+        TCHAR segmentPath[MAX_PATH];
+        JournalManifest::GetSegmentPath(m_journalPath, segmentId, segmentPath);
+        DeleteFile(segmentPath);
+        return false;
+    }
+
+    CloseHandle(m_fileHandle);
+    m_fileHandle = newHandle;
+    m_fileEnd = JournalFormat::FILE_HEADER_SIZE;
+    return true;
+}
+
+bool Journal::SaveManifest()
+{
+    // The manifest may only describe records that are already in the file
+    if (!FlushToDisk()) {
+        return false;
+    }
+
+    m_manifest.GetActiveSegment().size = m_fileEnd;
+    return m_manifest.Save(m_journalPath, m_pendingIndex, m_nextSequence, m_lastTimestamp, m_fileEnd);
+}
+
+bool Journal::AddPending(ULONGLONG sequence, DWORD segmentId, DWORD offset, DWORD key, DWORD tag, ULONGLONG timestamp)
+{
+    if (!m_pendingIndex.Add(sequence, segmentId, offset, key, tag, timestamp)) {
+        return false;
+    }
+    ChangePendingCount(segmentId, 1);
+    return true;
+}
+
+void Journal::RemovePending(int position)
+{
+    ChangePendingCount(m_pendingIndex.GetEntry(position).segment, -1);
+    m_pendingIndex.Remove(position);
+}
+
+void Journal::ChangePendingCount(DWORD segmentId, int delta)
+{
+    // Nearly always the active segment, at the end of the list
+    int position = m_manifest.GetSegmentCount() - 1;
+    if (position < 0 || m_manifest.GetSegment(position).id != segmentId) {
+        position = m_manifest.FindSegment(segmentId);
+    }
+    if (position == -1) {
+        return;
+    }
+
+    JournalManifest::Segment& segment = m_manifest.GetSegment(position);
+    if (delta > 0 || segment.pending > 0) {
+        segment.pending += delta;
+    }
+}
+
+void Journal::RecountPending()
+{
+    for (int i = 0; i < m_manifest.GetSegmentCount(); i++) {
+        m_manifest.GetSegment(i).pending = 0;
+    }
+    for (int pos = m_pendingIndex.First(); pos != -1; pos = m_pendingIndex.Next(pos)) {
+        ChangePendingCount(m_pendingIndex.GetEntry(pos).segment, 1);
+    }
+}
+
+DWORD Journal::GetGarbagePercent()
+{
+    // Sealed segments hold synced transactions, SYNCED records and log
+    // history; their live share is estimated from the pending count
+    ULONGLONG totalBytes = m_fileEnd + m_batchLength;
+    ULONGLONG garbageBytes = 0;
+
+    for (int i = 0; i < m_manifest.GetSegmentCount() - 1; i++) {
+        const JournalManifest::Segment& segment = m_manifest.GetSegment(i);
+        totalBytes += segment.size;
+
+        if (segment.records > 0 && segment.pending < segment.records) {
+            garbageBytes += (ULONGLONG)segment.size * (segment.records - segment.pending) / segment.records;
+        }
+    }
+
+    return (totalBytes > 0) ? (DWORD)(garbageBytes * 100 / totalBytes) : 0;
+}
+
+bool Journal::CompactSlice(DWORD budgetMs, bool* finished)
+{
+    DWORD startTick = GetTickCount();
+    *finished = false;
+
+    // Segments are only moved under a written batch, whose undo could
+    // otherwise bring back entries pointing at a dropped segment
+    if (!WriteBatch()) {
+        return false;
+    }
+
+    bool success;
+    if (m_compactJob.sourceId != 0) {
+        // Continue copying, or switch over once the copy is complete
+        bool copied = false;
+        success = CopyRewrite(startTick, budgetMs, &copied);
+        if (success && copied) {
+            success = FinishRewrite();
+        }
+        if (!success) {
+            AbortRewrite();
+        }
+    } else {
+        // Start on the oldest sealed segment worth compacting
+        bool drop = false;
+        int position = FindCompactionCandidate(&drop);
+
+        if (position == -1) {
+            *finished = true;
+            return true;
+        }
+
+        success = drop ? DropSegment(position) : BeginRewrite(position);
+    }
+
+    m_compactStats.slicesRun++;
+    m_compactStats.timeSpentMs += GetTickCount() - startTick;
+    return success;
+}
+
+int Journal::FindCompactionCandidate(bool* drop)
 {
+    // Only sealed segments are compacted; the active one keeps growing
+    for (int i = 0; i < m_manifest.GetSegmentCount() - 1; i++) {
+        const JournalManifest::Segment& segment = m_manifest.GetSegment(i);
+
+        // Nothing left to sync (only synced transactions or history)
+        if (segment.pending == 0) {
+            *drop = true;
+            return i;
+        }
+
+        // Leave segments that are still mostly pending alone
+        if (segment.pending * 2 <= segment.records) {
+            *drop = false;
+            return i;
+        }
+    }
+
+    return -1;
 }
 
-Journal::~Journal()
+bool Journal::EnforceRetention(DWORD budgetMs)
 {
-    if (m_fileHandle != INVALID_HANDLE_VALUE) {
-        CloseHandle(m_fileHandle);
+    // Returns true if the step made progress and there may be more to do
+    ULONGLONG now = GetJournalTime();
+    m_lastRetention = now;
+
+    ULONGLONG maxAgeMs = (ULONGLONG)m_retentionMaxAgeSeconds * 1000;
+    ULONGLONG cutoff = (m_retentionMaxAgeSeconds > 0 && now > maxAgeMs) ? now - maxAgeMs : 0;
+    bool overBudget = (m_retentionMaxBytes > 0 && GetJournalBytes() > m_retentionMaxBytes);
+    bool finished = false;
+
+    // A rewrite in progress goes first; it is usually what frees space
+    if (m_compactJob.sourceId != 0) {
+        return CompactSlice(budgetMs, &finished);
     }
-    if (m_journalPath) {
-        delete[] m_journalPath;
+
+    // Sealed segments with synced records or ACKs to remove
+    bool drop = false;
+    int position = FindRetentionCandidate(cutoff, overBudget, &drop);
+    if (position != -1) {
+        if (drop) {
+            return DropSegment(position);
+        }
+        return BeginRewrite(position) && CompactSlice(budgetMs, &finished);
+    }
+
+    // Age and budget only apply to sealed segments, so seal the active
+    // one once it spans half the age limit, or once it is a reasonable
+    // size when over budget (so ACKs alone do not roll tiny segments)
+    JournalManifest::Segment& active = m_manifest.GetActiveSegment();
+    if (active.records > active.pending) {
+        JournalFormat::RecordHeader header;
+        bool aging = (cutoff > 0 &&
+                      ReadRecordAt(active.id, JournalFormat::FILE_HEADER_SIZE, 0, &header) &&
+                      header.timestamp < now - maxAgeMs / 2);
+        if (aging || (overBudget && m_fileEnd + m_batchLength >= SEGMENT_SIZE_LIMIT / 4)) {
+            return RollSegment();
+        }
+    }
+
+    // Only unsynced transactions are left over budget: the oldest go, a
+    // segment at a time, while the floor stays covered
+    if (overBudget && m_manifest.GetSegmentCount() > 1) {
+        ULONGLONG pendingBytes = 0;
+        for (int i = 0; i < m_manifest.GetSegmentCount(); i++) {
+            pendingBytes += EstimatePendingBytes(i);
+        }
+        if (pendingBytes - EstimatePendingBytes(0) >= m_retentionFloorBytes) {
+            return DropPendingSegment(0);
+        }
     }
+
+    return false;
 }
 
-bool Journal::Initialize(const TCHAR* journalPath)
+int Journal::FindRetentionCandidate(ULONGLONG cutoff, bool overBudget, bool* drop)
 {
-    if (m_journalPath) {
-        delete[] m_journalPath;
+    // Oldest first. Segments written by compaction hold only pending
+    // transactions until some of them are synced.
+    for (int i = 0; i < m_manifest.GetSegmentCount() - 1; i++) {
+        const JournalManifest::Segment& segment = m_manifest.GetSegment(i);
+        if (segment.pending >= segment.records) {
+            continue;
+        }
+
+        // Segments are in time order, so once one is too new for the
+        // age limit the rest are too
+        if (!overBudget && (cutoff == 0 || GetSegmentEndTime(i) >= cutoff)) {
+            return -1;
+        }
+
+        *drop = (segment.pending == 0);
+        return i;
     }
-    
-    int len = lstrlen(journalPath) + 1;
-    m_journalPath = new TCHAR[len];
-    lstrcpy(m_journalPath, journalPath);
-    
-    // Open or create journal file
-    m_fileHandle = CreateFile(
-        journalPath,
-        GENERIC_WRITE | GENERIC_READ,
-        0,
-        NULL,
-        OPEN_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
-    
-    return (m_fileHandle != INVALID_HANDLE_VALUE);
+
+    return -1;
 }
 
-bool Journal::LogTransaction(const TCHAR* transactionType, const TCHAR* itemId, const TCHAR* details)
+ULONGLONG Journal::GetSegmentEndTime(int position)
 {
-    m_transactionCount++;
-    return WriteEntry(TEXT("TRANS"), details);
+    // Sequence and time order agree, so the first record of the next
+    // segment bounds the newest one in this segment
+    JournalFormat::RecordHeader header;
+    if (position + 1 < m_manifest.GetSegmentCount() &&
+        ReadRecordAt(m_manifest.GetSegment(position + 1).id, JournalFormat::FILE_HEADER_SIZE, 0, &header)) {
+        return header.timestamp;
+    }
+    return m_lastTimestamp;
 }
 
-bool Journal::LogError(const TCHAR* errorCode, const TCHAR* errorMessage)
+ULONGLONG Journal::GetJournalBytes() const
 {
-    return WriteEntry(TEXT("ERROR"), errorMessage);
+    // The active segment's size in the manifest lags behind
+    ULONGLONG totalBytes = m_fileEnd + m_batchLength;
+    for (int i = 0; i < m_manifest.GetSegmentCount() - 1; i++) {
+        totalBytes += m_manifest.GetSegment(i).size;
+    }
+    return totalBytes;
 }
 
-bool Journal::LogInfo(const TCHAR* message)
+ULONGLONG Journal::EstimatePendingBytes(int position) const
 {
-    return WriteEntry(TEXT("INFO"), message);
+    // Records are about the same size, so the pending share of the
+    // records is taken as the pending share of the bytes
+    const JournalManifest::Segment& segment = m_manifest.GetSegment(position);
+    DWORD size = (position == m_manifest.GetSegmentCount() - 1) ? m_fileEnd + m_batchLength : segment.size;
+
+    if (segment.records == 0 || segment.pending == 0 || size <= JournalFormat::FILE_HEADER_SIZE) {
+        return 0;
+    }
+    if (segment.pending >= segment.records) {
+        return size - JournalFormat::FILE_HEADER_SIZE;
+    }
+    return (ULONGLONG)(size - JournalFormat::FILE_HEADER_SIZE) * segment.pending / segment.records;
 }
 
-bool Journal::GetPendingTransactions(TCHAR*** transactions, int* count)
+bool Journal::DropPendingSegment(int position)
 {
-    if (!transactions || !count) {
-        return false;
+    DWORD segmentId = m_manifest.GetSegment(position).id;
+
+    // Forget the transactions first so the manifest DropSegment writes no
+    // longer lists them. Should that write fail, the segment stays with
+    // nothing pending and the next step drops it as usual. The index is in
+    // sequence order like the segments, so the walk stops once the
+    // segment's count is used up
+    const JournalManifest::Segment& segment = m_manifest.GetSegment(position);
+    DWORD dropped = 0;
+    for (int pos = m_pendingIndex.First(); pos != -1 && segment.pending > 0; pos = m_pendingIndex.Next(pos)) {
+        if (m_pendingIndex.GetEntry(pos).segment == segmentId) {
+            RemovePending(pos);
+            dropped++;
+        }
     }
+    m_retentionDropped += dropped;
 
-    *transactions = NULL;
-    *count = 0;
+    TCHAR message[128];
+    wsprintf(message, TEXT("Journal over its flash budget: %lu unsynced transactions removed"), dropped);
+    LogError(TEXT("JOURNAL_RETENTION"), message);
 
-    if (m_fileHandle == INVALID_HANDLE_VALUE || m_transactionCount == 0) {
-        return true; // No transactions
+    return DropSegment(position);
+}
+
+bool Journal::DropSegment(int position)
+{
+    JournalManifest::Segment source = m_manifest.GetSegment(position);
+
+    m_manifest.RemoveSegment(position);
+    if (!SaveManifest()) {
+        m_manifest.InsertSegment(position, source);
+        return false;
     }
 
-    // Allocate array for transaction pointers
-    int maxTransactions = m_transactionCount;
-    TCHAR** transArray = new TCHAR*[maxTransactions];
-    int transCount = 0;
+    if (m_readSegment == source.id) {
+        CloseReadHandle();
+    }
 
-    // Read file from beginning
-    SetFilePointer(m_fileHandle, 0, NULL, FILE_BEGIN);
+    TCHAR sourcePath[MAX_PATH];
+    JournalManifest::GetSegmentPath(m_journalPath, source.id, sourcePath);
+    DeleteFile(sourcePath);
 
-    char buffer[1024];
-    DWORD bytesRead;
-    char line[1024];
-    int linePos = 0;
+    // Queries only cover what the journal still holds
+    DropHistory(source.id);
 
-    while (ReadFile(m_fileHandle, buffer, sizeof(buffer) - 1, &bytesRead, NULL) && bytesRead > 0) {
-        for (DWORD i = 0; i < bytesRead; i++) {
-            if (buffer[i] == '\n' || buffer[i] == '\r') {
-                if (linePos > 0) {
-                    line[linePos] = '\0';
-
-                    // Check if line contains transaction (simple check for "TRANS")
-                    if (strstr(line, "TRANS") && !strstr(line, "SYNCED")) {
-                        // Convert to TCHAR and store
-                        int len = linePos + 1;
-                        TCHAR* trans = new TCHAR[len];
-                        for (int j = 0; j < linePos; j++) {
-                            trans[j] = (TCHAR)line[j];
-                        }
-                        trans[linePos] = '\0';
-
-                        transArray[transCount++] = trans;
-
-                        if (transCount >= maxTransactions) {
-                            break;
-                        }
-                    }
+    m_compactStats.bytesReclaimed += source.size;
+    m_compactStats.segmentsDropped++;
+    return true;
+}
 
-                    linePos = 0;
-                }
-            } else {
-                if (linePos < sizeof(line) - 1) {
-                    line[linePos++] = buffer[i];
+bool Journal::BeginRewrite(int position)
+{
+    const JournalManifest::Segment& source = m_manifest.GetSegment(position);
+
+    TCHAR sourcePath[MAX_PATH];
+    JournalManifest::GetSegmentPath(m_journalPath, source.id, sourcePath);
+
+    HANDLE sourceHandle = CreateFile(sourcePath, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (sourceHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // New segment ids are always higher, but the file header keeps the
+    // source base so the segment still sorts by sequence
+    BYTE fileHeader[JournalFormat::FILE_HEADER_SIZE];
+    DWORD bytesRead = 0;
+    ULONGLONG baseSequence = 1;
+    if (ReadFile(sourceHandle, fileHeader, sizeof(fileHeader), &bytesRead, NULL)) {
+        JournalFormat::DecodeFileHeader(fileHeader, bytesRead, &baseSequence);
+    }
+
+    DWORD targetId = m_manifest.AllocateSegmentId();
+    HANDLE targetHandle = INVALID_HANDLE_VALUE;
+    if (!CreateSegmentFile(targetId, baseSequence, &targetHandle)) {
+        CloseHandle(sourceHandle);
+        return false;
+    }
+
+    // Sealed segments get no new transactions, so the pending count is
+    // an upper bound on the records to copy
+    int capacity = (int)source.pending;
+
+    m_compactJob.sourceId = source.id;
+    m_compactJob.targetId = targetId;
+    m_compactJob.source = sourceHandle;
+    m_compactJob.target = targetHandle;
+    m_compactJob.readOffset = JournalFormat::FILE_HEADER_SIZE;
+    m_compactJob.targetEnd = JournalFormat::FILE_HEADER_SIZE;
+    m_compactJob.sequences = new ULONGLONG[capacity];
+    m_compactJob.offsets = new DWORD[capacity];
+    m_compactJob.moved = 0;
+    m_compactJob.capacity = capacity;
+    return true;
+}
+
+bool Journal::CopyRewrite(DWORD startTick, DWORD budgetMs, bool* copied)
+{
+    CompactionJob& job = m_compactJob;
+    JournalFormat::RecordHeader header;
+    const BYTE* payload = NULL;
+    JournalFormat::DecodeResult result;
+
+    RecordReader reader(job.source, job.readOffset);
+    SetFilePointer(job.target, job.targetEnd, NULL, FILE_BEGIN);
+
+    while ((result = reader.Next(&header, &payload, NULL)) == JournalFormat::DECODE_OK) {
+        if (header.type == JournalFormat::REC_TRANS && job.moved < job.capacity) {
+            // Transactions synced since the job started are left behind
+            int pos = m_pendingIndex.FindSequence(header.sequence);
+            if (pos != -1 && m_pendingIndex.GetEntry(pos).segment == job.sourceId) {
+                // Records are copied verbatim, so sequence numbers and
+                // checksums are preserved
+                DWORD recordSize = JournalFormat::RECORD_HEADER_SIZE + header.length;
+                DWORD written = 0;
+                if (!WriteFile(job.target, payload - JournalFormat::RECORD_HEADER_SIZE, recordSize, &written, NULL) ||
+                    written != recordSize) {
+                    return false;
                 }
+
+                job.sequences[job.moved] = header.sequence;
+                job.offsets[job.moved] = job.targetEnd;
+                job.moved++;
+                job.targetEnd += recordSize;
             }
         }
 
-        if (transCount >= maxTransactions) {
-            break;
+        job.readOffset = reader.GetOffset();
+
+        if (budgetMs != INFINITE && GetTickCount() - startTick >= budgetMs) {
+            return true;
         }
     }
 
-    *transactions = transArray;
-    *count = transCount;
-
+    *copied = true;
     return true;
 }
 
-bool Journal::MarkTransactionSynced(const TCHAR* transactionId)
+bool Journal::FinishRewrite()
 {
-    if (!transactionId || m_fileHandle == INVALID_HANDLE_VALUE) {
+    CompactionJob& job = m_compactJob;
+
+    // The copy must be on flash before the manifest points at it
+    if (!FlushFileBuffers(job.target)) {
+        return false;
+    }
+
+    // Earlier compaction may have moved the source within the list
+    int position = m_manifest.FindSegment(job.sourceId);
+    if (position == -1) {
         return false;
     }
 
-    // Mark transaction as synced by writing a SYNCED entry
-    // Format: [TIMESTAMP] SYNCED: transactionId
-    TCHAR syncEntry[512];
-    wsprintf(syncEntry, TEXT("%s"), transactionId);
+    JournalManifest::Segment source = m_manifest.GetSegment(position);
+
+    // Switch the index and the segment list over, then commit both.
+    // Transactions synced while copying are simply not relocated.
+    DWORD* sourceOffsets = new DWORD[job.moved > 0 ? job.moved : 1];
+    int* positions = new int[job.moved > 0 ? job.moved : 1];
+    int movedCount = 0;
+
+    for (int i = 0; i < job.moved; i++) {
+        int pos = m_pendingIndex.FindSequence(job.sequences[i]);
+        if (pos != -1 && m_pendingIndex.GetEntry(pos).segment == job.sourceId) {
+            positions[movedCount] = pos;
+            sourceOffsets[movedCount] = m_pendingIndex.GetEntry(pos).offset;
+            m_pendingIndex.SetLocation(pos, job.targetId, job.offsets[i]);
+            movedCount++;
+        }
+    }
 
-    bool result = WriteEntry(TEXT("SYNCED"), syncEntry);
+    JournalManifest::Segment& target = m_manifest.GetSegment(position);
+    target.id = job.targetId;
+    target.size = job.targetEnd;
+    target.records = (DWORD)job.moved;
+    target.pending = (DWORD)movedCount;
 
-    if (result) {
-        // Decrement transaction count since it's now synced
-        if (m_transactionCount > 0) {
-            m_transactionCount--;
+    bool success = SaveManifest();
+
+    if (!success) {
+        // The previous manifest is still current; undo in memory
+        for (int i = 0; i < movedCount; i++) {
+            m_pendingIndex.SetLocation(positions[i], source.id, sourceOffsets[i]);
         }
+        m_manifest.GetSegment(position) = source;
     }
 
-    return result;
+    delete[] sourceOffsets;
+    delete[] positions;
+
+    if (!success) {
+        return false;
+    }
+
+    CloseHandle(job.source);
+    CloseHandle(job.target);
+    job.source = INVALID_HANDLE_VALUE;
+    job.target = INVALID_HANDLE_VALUE;
+
+    if (m_readSegment == source.id) {
+        CloseReadHandle();
+    }
+
+    TCHAR sourcePath[MAX_PATH];
+    JournalManifest::GetSegmentPath(m_journalPath, source.id, sourcePath);
+    DeleteFile(sourcePath);
+
+    // Every copied record moves in the history, pending or not; the
+    // synced ones left behind are gone
+    for (int i = 0; i < job.moved; i++) {
+        int pos = m_historyIndex.FindSequence(job.sequences[i]);
+        if (pos != -1 && m_historyIndex.GetEntry(pos).segment == source.id) {
+            m_historyIndex.SetLocation(pos, job.targetId, job.offsets[i]);
+        }
+    }
+    DropHistory(source.id);
+
+    if (source.size > job.targetEnd) {
+        m_compactStats.bytesReclaimed += source.size - job.targetEnd;
+    }
+    m_compactStats.segmentsRewritten++;
+
+    // The target is now a regular segment; only the job state goes
+    job.targetId = 0;
+    AbortRewrite();
+    return true;
 }
 
-int Journal::GetTransactionCount() const
+void Journal::AbortRewrite()
 {
-    return m_transactionCount;
+    CompactionJob& job = m_compactJob;
+
+    if (job.source != INVALID_HANDLE_VALUE) {
+        CloseHandle(job.source);
+    }
+    if (job.target != INVALID_HANDLE_VALUE) {
+        CloseHandle(job.target);
+    }
+
+    // An unfinished target was never named by a manifest
+    if (job.targetId != 0 && m_journalPath) {
+        TCHAR targetPath[MAX_PATH];
+        JournalManifest::GetSegmentPath(m_journalPath, job.targetId, targetPath);
+        DeleteFile(targetPath);
+    }
+
+    if (job.sequences) {
+        delete[] job.sequences;
+    }
+    if (job.offsets) {
+        delete[] job.offsets;
+    }
+
+    job.sourceId = 0;
+    job.targetId = 0;
+    job.source = INVALID_HANDLE_VALUE;
+    job.target = INVALID_HANDLE_VALUE;
+    job.sequences = NULL;
+    job.offsets = NULL;
+    job.moved = 0;
+    job.capacity = 0;
 }
 
-bool Journal::Compact()
+DWORD WINAPI Journal::CompactionThread(LPVOID param)
 {
-    if (m_fileHandle == INVALID_HANDLE_VALUE || !m_journalPath) {
-        return false;
+    Journal* pThis = (Journal*)param;
+    if (!pThis) {
+        return 1;
     }
 
-    // Read all entries
-    SetFilePointer(m_fileHandle, 0, NULL, FILE_BEGIN);
+    for (;;) {
+        if (WaitForSingleObject(pThis->m_compactStopEvent, COMPACT_CHECK_INTERVAL_MS) == WAIT_OBJECT_0) {
+            break;
+        }
 
-    char* fileContent = NULL;
-    DWORD fileSize = GetFileSize(m_fileHandle, NULL);
+        // Run slices back to back while the journal stays idle; each one
+        // holds the lock for about one slice, so appends wait at most that
+        for (;;) {
+            bool more = false;
+
+            EnterCriticalSection(&pThis->m_lock);
+            bool idle = (GetTickCount() - pThis->m_lastAppendTick >= COMPACT_IDLE_MS);
+            if (idle && pThis->m_fileHandle != INVALID_HANDLE_VALUE &&
+                (pThis->m_compactJob.sourceId != 0 ||
+                 pThis->GetGarbagePercent() >= pThis->m_compactGarbagePercent)) {
+                bool finished = false;
+                more = pThis->CompactSlice(pThis->m_compactSliceMs, &finished) && !finished;
+            }
+            LeaveCriticalSection(&pThis->m_lock);
 
-    if (fileSize == INVALID_FILE_SIZE || fileSize == 0) {
-        return false;
+            if (!more) {
+                break;
+            }
+
+            // Leave the device to the scanner and UI between slices
+            if (WaitForSingleObject(pThis->m_compactStopEvent, pThis->m_compactSliceMs * 4) == WAIT_OBJECT_0) {
+                return 0;
+            }
+        }
     }
 
-    fileContent = new char[fileSize + 1];
-    DWORD bytesRead;
+    return 0;
+}
+
+bool Journal::WriteFileHeader(HANDLE file, ULONGLONG baseSequence)
+{
+    BYTE fileHeader[JournalFormat::FILE_HEADER_SIZE];
+    JournalFormat::EncodeFileHeader(fileHeader, baseSequence);
 
-    if (!ReadFile(m_fileHandle, fileContent, fileSize, &bytesRead, NULL)) {
-        delete[] fileContent;
+    SetFilePointer(file, 0, NULL, FILE_BEGIN);
+
+    DWORD bytesWritten = 0;
+    return (WriteFile(file, fileHeader, sizeof(fileHeader), &bytesWritten, NULL) &&
+            bytesWritten == sizeof(fileHeader));
+}
+
+bool Journal::ImportLegacyJournal()
+{
+    // Keep the old text file next to the new journal for reference
+    TCHAR legacyPath[MAX_PATH];
+    wsprintf(legacyPath, TEXT("%s.legacy"), m_journalPath);
+
+    DeleteFile(legacyPath);
+    if (!MoveFile(m_journalPath, legacyPath)) {
         return false;
     }
-    fileContent[bytesRead] = '\0';
-
-    // Create temporary file for compacted journal
-    TCHAR tempPath[MAX_PATH];
-    wsprintf(tempPath, TEXT("%s.tmp"), m_journalPath);
 
-    HANDLE tempHandle = CreateFile(
-        tempPath,
-        GENERIC_WRITE,
-        0,
+    HANDLE legacyHandle = CreateFile(
+        legacyPath,
+        GENERIC_READ,
+        FILE_SHARE_READ,
         NULL,
-        CREATE_ALWAYS,
+        OPEN_EXISTING,
         FILE_ATTRIBUTE_NORMAL,
         NULL
     );
 
-    if (tempHandle == INVALID_HANDLE_VALUE) {
-        delete[] fileContent;
+    if (legacyHandle == INVALID_HANDLE_VALUE) {
         return false;
     }
 
-    // Write only unsynced transactions and recent INFO/ERROR entries
+    // Entries are re-encoded into the first segment
+    m_nextSequence = 1;
+    DWORD segmentId = m_manifest.AllocateSegmentId();
+    if (!m_manifest.AddSegment(segmentId) || !CreateSegmentFile(segmentId, m_nextSequence, &m_fileHandle)) {
+        CloseHandle(legacyHandle);
+        return false;
+    }
+    m_fileEnd = JournalFormat::FILE_HEADER_SIZE;
+
+    // Stream the text file line by line and re-encode each entry
+    char buffer[1024];
     char line[2048];
     int linePos = 0;
-    int newTransactionCount = 0;
-
-    for (DWORD i = 0; i < bytesRead; i++) {
-        if (fileContent[i] == '\n' || fileContent[i] == '\r') {
-            if (linePos > 0) {
-                line[linePos] = '\0';
-
-                // Keep unsynced transactions
-                bool keepLine = false;
-                if (strstr(line, "TRANS") && !strstr(line, "SYNCED")) {
-                    keepLine = true;
-                    newTransactionCount++;
-                }
-                // Keep recent errors (for debugging)
-                else if (strstr(line, "ERROR")) {
-                    keepLine = true;
-                }
+    DWORD bytesRead;
+    int importedCount = 0;
+    int skippedCount = 0;
+
+    for (;;) {
+        bool more = (ReadFile(legacyHandle, buffer, sizeof(buffer), &bytesRead, NULL) && bytesRead > 0);
+        if (!more) {
+            // Terminate an unfinished last line
+            buffer[0] = '\n';
+            bytesRead = 1;
+        }
 
-                if (keepLine) {
-                    DWORD written;
-                    WriteFile(tempHandle, line, linePos, &written, NULL);
-                    WriteFile(tempHandle, "\r\n", 2, &written, NULL);
+        for (DWORD i = 0; i < bytesRead; i++) {
+            if (buffer[i] == '\n' || buffer[i] == '\r') {
+                if (linePos > 0) {
+                    if (ImportLegacyLine(line, linePos)) {
+                        importedCount++;
+                    } else {
+                        skippedCount++;
+                    }
+                    linePos = 0;
+                }
+            } else {
+                if (linePos < (int)sizeof(line) - 1) {
+                    line[linePos++] = buffer[i];
                 }
-
-                linePos = 0;
-            }
-        } else {
-            if (linePos < sizeof(line) - 1) {
-                line[linePos++] = fileContent[i];
             }
         }
-    }
 
-    CloseHandle(tempHandle);
-    delete[] fileContent;
-
-    // Replace original file with compacted version
-    CloseHandle(m_fileHandle);
-    DeleteFile(m_journalPath);
-    MoveFile(tempPath, m_journalPath);
+        if (!more) {
+            break;
+        }
+    }
 
-    // Reopen journal file
-    m_fileHandle = CreateFile(
-        m_journalPath,
-        GENERIC_WRITE | GENERIC_READ,
-        0,
-        NULL,
-        OPEN_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
+    CloseHandle(legacyHandle);
 
-    m_transactionCount = newTransactionCount;
+    TCHAR message[128];
+    wsprintf(message, TEXT("Imported %d entries from text journal (%d skipped)"), importedCount, skippedCount);
 
-    return (m_fileHandle != INVALID_HANDLE_VALUE);
+    int length = EncodePayload(message);
+    return (length >= 0 &&
+            AppendRecord(JournalFormat::REC_INFO, 0, GetJournalTime(), (DWORD)length, NULL) &&
+            FlushToDisk());
 }
 
-bool Journal::Clear()
+bool Journal::ImportLegacyLine(const char* line, int length)
 {
-    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+    WORD recordType;
+    ULONGLONG timestamp;
+    int messageOffset;
+
+    if (!JournalFormat::ParseLegacyLine(line, length, &recordType, &timestamp, &messageOffset)) {
         return false;
     }
 
-    // Close and reopen file to truncate it
-    CloseHandle(m_fileHandle);
-
-    m_fileHandle = CreateFile(
-        m_journalPath,
-        GENERIC_WRITE | GENERIC_READ,
-        0,
-        NULL,
-        CREATE_ALWAYS, // Truncate existing file
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
+    // Old journals narrowed TCHARs to single bytes, so the text is Latin-1
+    BYTE* payload = m_recordBuffer + JournalFormat::RECORD_HEADER_SIZE;
+    DWORD payloadLen = 0;
+    for (int i = messageOffset; i < length && payloadLen + 2 <= JournalFormat::MAX_PAYLOAD_SIZE; i++) {
+        BYTE c = (BYTE)line[i];
+        if (c < 0x80) {
+            payload[payloadLen++] = c;
+        } else {
+            payload[payloadLen++] = (BYTE)(0xC0 | (c >> 6));
+            payload[payloadLen++] = (BYTE)(0x80 | (c & 0x3F));
+        }
+    }
 
-    m_transactionCount = 0;
+    if (timestamp < m_lastTimestamp) {
+        timestamp = m_lastTimestamp;
+    }
+    m_lastTimestamp = timestamp;
 
-    return (m_fileHandle != INVALID_HANDLE_VALUE);
-}
+    // Old diagnostics move to the diagnostic log, which keeps the newest
+    if (recordType == JournalFormat::REC_INFO || recordType == JournalFormat::REC_ERROR) {
+        m_diagLog.Write(recordType, timestamp, payload, payloadLen);
+        return true;
+    }
 
-bool Journal::WriteEntry(const TCHAR* level, const TCHAR* message)
-{
-    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+    // A long text journal can span several segments, so the index is
+    // built while importing rather than by scanning afterwards
+    ULONGLONG sequence = m_nextSequence;
+    DWORD recordOffset = 0;
+    if (!AppendRecord(recordType, 0, timestamp, payloadLen, &recordOffset)) {
         return false;
     }
 
-    // Format and write entry with timestamp
-    // Format: [TIMESTAMP] LEVEL: message\r\n
-    TCHAR* timestamp = FormatTimestamp();
+    if (recordType == JournalFormat::REC_TRANS) {
+        AddPending(sequence, m_manifest.GetActiveSegment().id, recordOffset, PayloadKey(payload, payloadLen),
+                   TypeKey(payload, payloadLen, 0), timestamp);
+    } else if (recordType == JournalFormat::REC_SYNCED) {
+        int position = FindPending(payload, payloadLen);
+        if (position != -1) {
+            RemovePending(position);
+        }
+    }
+    return true;
+}
 
-    // Build entry string
-    TCHAR entry[2048];
-    wsprintf(entry, TEXT("[%s] %s: %s\r\n"), timestamp, level, message);
+void Journal::RetagPending()
+{
+    // Older manifests list pending transactions without their type key,
+    // which cursors filter on. Each record is read once for it; the next
+    // checkpoint saves the keys.
+    JournalFormat::RecordHeader header;
+    for (int pos = m_pendingIndex.First(); pos != -1; pos = m_pendingIndex.Next(pos)) {
+        const JournalIndex::Entry& entry = m_pendingIndex.GetEntry(pos);
+        if (entry.timestamp == 0 && ReadRecordAt(entry.segment, entry.offset, entry.sequence, &header)) {
+            const BYTE* payload = m_readBuffer + JournalFormat::RECORD_HEADER_SIZE;
+            m_pendingIndex.SetTag(pos, TypeKey(payload, header.length, header.flags), header.timestamp);
+        }
+    }
+}
 
-    // Convert to ANSI for file writing (journal file is ANSI)
-    char ansiEntry[2048];
-    for (int i = 0; i < lstrlen(entry) && i < 2047; i++) {
-        ansiEntry[i] = (char)entry[i];
+bool Journal::ScanRecords(HANDLE file, DWORD segmentId, DWORD startOffset, DWORD* endOffset)
+{
+    // Walk the segment once to find where the sequence left off and to
+    // rebuild the pending index; ACK and SYNCED records cancel
+    // earlier TRANS ones
+    RecordReader reader(file, startOffset);
+    JournalFormat::RecordHeader header;
+    const BYTE* payload = NULL;
+    DWORD recordOffset = 0;
+    JournalManifest::Segment& segment = m_manifest.GetActiveSegment();
+
+    while (reader.Next(&header, &payload, &recordOffset) == JournalFormat::DECODE_OK) {
+        // Transactions already seen are copies left by an interrupted
+        // compaction (only possible when segments are recovered)
+        bool copy = (header.sequence < m_nextSequence);
+
+        if (header.sequence >= m_nextSequence) {
+            m_nextSequence = header.sequence + 1;
+        }
+        if (header.timestamp > m_lastTimestamp) {
+            m_lastTimestamp = header.timestamp;
+        }
+        segment.records++;
+
+        if (header.type == JournalFormat::REC_TRANS && !copy) {
+            DWORD textOffset = TextOffset(payload, header);
+            AddPending(header.sequence, segmentId, recordOffset, PayloadKey(payload + textOffset, header.length - textOffset),
+                       TypeKey(payload, header.length, header.flags), header.timestamp);
+        } else if (header.type == JournalFormat::REC_ACK) {
+            ULONGLONG sequence;
+            int position = -1;
+            if (JournalFormat::DecodeAckPayload(payload, header.length, &sequence)) {
+                position = m_pendingIndex.FindSequence(sequence);
+            }
+            if (position != -1) {
+                RemovePending(position);
+            }
+        } else if (header.type == JournalFormat::REC_SYNCED) {
+            int position = FindPending(payload, header.length);
+            if (position != -1) {
+                RemovePending(position);
+            }
+        } else if (header.type == JournalFormat::REC_SESSION) {
+            // The last one is the session's state
+            JournalFormat::SessionState session;
+            if (JournalFormat::DecodeSessionPayload(payload, header.length, &session)) {
+                m_manifest.SetSession(session);
+            }
+        }
     }
-    ansiEntry[lstrlen(entry)] = '\0';
 
-    // Seek to end of file
-    SetFilePointer(m_fileHandle, 0, NULL, FILE_END);
+    if (endOffset) {
+        *endOffset = reader.GetOffset();
+    }
+    return true;
+}
 
-    // Write entry
-    DWORD bytesWritten;
-    bool success = WriteFile(m_fileHandle, ansiEntry, strlen(ansiEntry), &bytesWritten, NULL);
+ULONGLONG Journal::GetWallClockMs()
+{
+    SYSTEMTIME st;
+    GetSystemTime(&st);
 
-    if (success) {
-        FlushToDisk();
-    }
+    FILETIME ft;
+    SystemTimeToFileTime(&st, &ft);
 
-    return success;
+    ULONGLONG now = (((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10000;
+    return (now > FILETIME_UNIX_EPOCH_MS) ? now - FILETIME_UNIX_EPOCH_MS : 0;
 }
 
-TCHAR* Journal::FormatTimestamp()
+ULONGLONG Journal::GetJournalTime()
 {
-    // Format timestamp as YYYY-MM-DD HH:MM:SS
-    static TCHAR buffer[32];
-
-    SYSTEMTIME st;
-    GetLocalTime(&st);
+    ULONGLONG now = GetWallClockMs();
 
-    wsprintf(buffer, TEXT("%04d-%02d-%02d %02d:%02d:%02d"),
-        st.wYear, st.wMonth, st.wDay,
-        st.wHour, st.wMinute, st.wSecond);
+    // The wall clock can step backwards (cradle time sync); record
+    // timestamps must not
+    if (now < m_lastTimestamp) {
+        now = m_lastTimestamp;
+    }
+    m_lastTimestamp = now;
 
-    return buffer;
+    return now;
 }
 
 bool Journal::FlushToDisk()
 {
-    if (m_fileHandle != INVALID_HANDLE_VALUE) {
-        FlushFileBuffers(m_fileHandle);
-        return true;
+    // Commit: write out any batch, then one flush covers all of it
+    if (m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
     }
-    return false;
+
+    if (!WriteBatch()) {
+        return false;
+    }
+
+    if (m_flushPending) {
+        if (!FlushFileBuffers(m_fileHandle)) {
+            return false;
+        }
+        m_flushPending = false;
+    }
+    return true;
 }
 
 } // namespace HBX
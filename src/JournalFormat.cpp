@@ -0,0 +1,526 @@
+#include "../include/JournalFormat.hpp"
+#include <stdio.h>
+#include <string.h>
+
+namespace HBX {
+
+// File header: "HBXJ", u16 version, u16 header size, u64 base sequence
+static const unsigned char kFileMagic[4] = { 'H', 'B', 'X', 'J' };
+static const unsigned int kRecordMagic = 0x52584248; // "HBXR" little-endian
+static const unsigned int kManifestMagic = 0x4D584248; // "HBXM" little-endian
+
+// Standard CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320)
+static const unsigned int kCrcTable[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+    0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+    0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+    0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+    0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+    0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+    0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+    0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+    0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+    0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+    0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+    0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+    0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+    0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+    0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+    0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+    0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+void JournalFormat::EncodeFileHeader(unsigned char* out, JournalU64 baseSequence)
+{
+    memcpy(out, kFileMagic, 4);
+    PutU16(out + 4, FORMAT_VERSION);
+    PutU16(out + 6, FILE_HEADER_SIZE);
+    PutU64(out + 8, baseSequence);
+}
+
+bool JournalFormat::DecodeFileHeader(const unsigned char* in, unsigned int avail, JournalU64* baseSequence)
+{
+    if (avail < FILE_HEADER_SIZE || memcmp(in, kFileMagic, 4) != 0) {
+        return false;
+    }
+
+    // Newer versions may grow the header; refuse what we cannot read
+    if (GetU16(in + 4) != FORMAT_VERSION || GetU16(in + 6) != FILE_HEADER_SIZE) {
+        return false;
+    }
+
+    if (baseSequence) {
+        *baseSequence = GetU64(in + 8);
+    }
+    return true;
+}
+
+bool JournalFormat::IsLegacyText(const unsigned char* in, unsigned int avail)
+{
+    // Text journals always start with "[YYYY-" from the old WriteEntry
+    return (avail >= 6 && in[0] == '[' &&
+            in[1] >= '0' && in[1] <= '9' && in[5] == '-');
+}
+
+void JournalFormat::EncodeRecord(unsigned char* out, RecordHeader* header)
+{
+    PutU32(out, kRecordMagic);
+    PutU16(out + 4, header->type);
+    PutU16(out + 6, header->flags);
+    PutU64(out + 8, header->sequence);
+    PutU64(out + 16, header->timestamp);
+    PutU32(out + 24, header->length);
+
+    unsigned int crc = Crc32(out, 28, 0);
+    crc = Crc32(out + RECORD_HEADER_SIZE, header->length, crc);
+    header->crc = crc;
+    PutU32(out + 28, crc);
+}
+
+JournalFormat::DecodeResult JournalFormat::DecodeRecord(const unsigned char* in, unsigned int avail, RecordHeader* header)
+{
+    if (avail < RECORD_HEADER_SIZE) {
+        return DECODE_NEED_MORE;
+    }
+
+    if (GetU32(in) != kRecordMagic) {
+        return DECODE_BAD_MAGIC;
+    }
+
+    header->type = GetU16(in + 4);
+    header->flags = GetU16(in + 6);
+    header->sequence = GetU64(in + 8);
+    header->timestamp = GetU64(in + 16);
+    header->length = GetU32(in + 24);
+    header->crc = GetU32(in + 28);
+
+    if (header->length > MAX_PAYLOAD_SIZE) {
+        return DECODE_BAD_LENGTH;
+    }
+
+    if (avail < RECORD_HEADER_SIZE + header->length) {
+        return DECODE_NEED_MORE;
+    }
+
+    unsigned int crc = Crc32(in, 28, 0);
+    crc = Crc32(in + RECORD_HEADER_SIZE, header->length, crc);
+    if (crc != header->crc) {
+        return DECODE_BAD_CRC;
+    }
+
+    return DECODE_OK;
+}
+
+void JournalFormat::EncodeAckPayload(unsigned char* out, JournalU64 sequence)
+{
+    PutU64(out, sequence);
+}
+
+bool JournalFormat::DecodeAckPayload(const unsigned char* in, unsigned int len, JournalU64* sequence)
+{
+    if (len != ACK_PAYLOAD_SIZE) {
+        return false;
+    }
+
+    *sequence = GetU64(in);
+    return true;
+}
+
+void JournalFormat::EncodeSessionPayload(unsigned char* out, const SessionState* session)
+{
+    PutU64(out, session->id);
+    PutU64(out + 8, session->highWater);
+    PutU32(out + 16, session->acknowledged);
+    PutU32(out + 20, session->flags);
+}
+
+bool JournalFormat::DecodeSessionPayload(const unsigned char* in, unsigned int len, SessionState* session)
+{
+    if (len != SESSION_PAYLOAD_SIZE) {
+        return false;
+    }
+
+    session->id = GetU64(in);
+    session->highWater = GetU64(in + 8);
+    session->acknowledged = GetU32(in + 16);
+    session->flags = GetU32(in + 20);
+    return true;
+}
+
+unsigned int JournalFormat::EncodeTags(unsigned char* out, const unsigned char* type, unsigned int typeLen,
+                                       const unsigned char* item, unsigned int itemLen)
+{
+    if (typeLen > MAX_TAG_SIZE) {
+        typeLen = MAX_TAG_SIZE;
+    }
+    if (itemLen > MAX_TAG_SIZE) {
+        itemLen = MAX_TAG_SIZE;
+    }
+
+    out[0] = (unsigned char)typeLen;
+    out[1] = (unsigned char)itemLen;
+    if (typeLen > 0) {
+        memmove(out + TAG_HEADER_SIZE, type, typeLen);
+    }
+    if (itemLen > 0) {
+        memmove(out + TAG_HEADER_SIZE + typeLen, item, itemLen);
+    }
+
+    return TAG_HEADER_SIZE + typeLen + itemLen;
+}
+
+bool JournalFormat::DecodeTags(const unsigned char* in, unsigned int len, unsigned short flags, PayloadTags* tags)
+{
+    tags->typeOffset = 0;
+    tags->typeLength = 0;
+    tags->itemOffset = 0;
+    tags->itemLength = 0;
+    tags->textOffset = 0;
+
+    if (!(flags & FLAG_TAGGED)) {
+        return false;
+    }
+
+    if (len < TAG_HEADER_SIZE || TAG_HEADER_SIZE + (unsigned int)in[0] + in[1] > len) {
+        return false;
+    }
+
+    tags->typeOffset = TAG_HEADER_SIZE;
+    tags->typeLength = in[0];
+    tags->itemOffset = TAG_HEADER_SIZE + in[0];
+    tags->itemLength = in[1];
+    tags->textOffset = tags->itemOffset + in[1];
+    return true;
+}
+
+unsigned short JournalFormat::OpcodeFlags(unsigned int opcode)
+{
+    return (unsigned short)((opcode << 8) & FLAG_OPCODE_MASK);
+}
+
+unsigned int JournalFormat::GetOpcode(unsigned short flags)
+{
+    return (flags & FLAG_OPCODE_MASK) >> 8;
+}
+
+void JournalFormat::EncodeManifestHeader(unsigned char* out, const ManifestHeader* header)
+{
+    PutU32(out, kManifestMagic);
+    PutU16(out + 4, MANIFEST_VERSION);
+    PutU16(out + 6, MANIFEST_HEADER_SIZE);
+    PutU64(out + 8, header->generation);
+    PutU64(out + 16, header->nextSequence);
+    PutU64(out + 24, header->lastTimestamp);
+    PutU32(out + 32, header->nextSegmentId);
+    PutU32(out + 36, header->segmentCount);
+    PutU32(out + 40, header->pendingCount);
+    PutU32(out + 44, header->scanOffset);
+    PutU32(out + 48, header->crc);
+    PutU32(out + 52, header->epoch);
+}
+
+bool JournalFormat::DecodeManifestHeader(const unsigned char* in, unsigned int avail, ManifestHeader* header)
+{
+    if (avail < MANIFEST_HEADER_SIZE || GetU32(in) != kManifestMagic) {
+        return false;
+    }
+
+    header->version = GetU16(in + 4);
+    if (header->version < 1 || header->version > MANIFEST_VERSION || GetU16(in + 6) != MANIFEST_HEADER_SIZE) {
+        return false;
+    }
+
+    header->generation = GetU64(in + 8);
+    header->nextSequence = GetU64(in + 16);
+    header->lastTimestamp = GetU64(in + 24);
+    header->nextSegmentId = GetU32(in + 32);
+    header->segmentCount = GetU32(in + 36);
+    header->pendingCount = GetU32(in + 40);
+    header->scanOffset = GetU32(in + 44);
+    header->crc = GetU32(in + 48);
+    header->epoch = (header->version >= 3) ? GetU32(in + 52) : 0;
+
+    // A manifest always names at least the active segment
+    return (header->segmentCount > 0);
+}
+
+unsigned int JournalFormat::GetManifestHeaderCrc(const unsigned char* in, unsigned short version)
+{
+    // Everything but the CRC field itself; older versions stop before it
+    unsigned int crc = Crc32(in, 48, 0);
+    return (version >= 3) ? Crc32(in + 52, 4, crc) : crc;
+}
+
+void JournalFormat::EncodeManifestSegment(unsigned char* out, const ManifestSegment* segment)
+{
+    PutU32(out, segment->id);
+    PutU32(out + 4, segment->size);
+    PutU32(out + 8, segment->records);
+}
+
+void JournalFormat::DecodeManifestSegment(const unsigned char* in, ManifestSegment* segment)
+{
+    segment->id = GetU32(in);
+    segment->size = GetU32(in + 4);
+    segment->records = GetU32(in + 8);
+    segment->pending = 0;
+}
+
+unsigned int JournalFormat::GetManifestPendingSize(unsigned short version)
+{
+    return (version < 2) ? (unsigned int)MANIFEST_PENDING_V1_SIZE : (unsigned int)MANIFEST_PENDING_SIZE;
+}
+
+void JournalFormat::EncodeManifestPending(unsigned char* out, const ManifestPending* pending)
+{
+    PutU64(out, pending->sequence);
+    PutU32(out + 8, pending->segment);
+    PutU32(out + 12, pending->offset);
+    PutU32(out + 16, pending->key);
+    PutU32(out + 20, pending->tag);
+    PutU64(out + 24, pending->timestamp);
+}
+
+void JournalFormat::DecodeManifestPending(const unsigned char* in, unsigned short version, ManifestPending* pending)
+{
+    pending->sequence = GetU64(in);
+    pending->segment = GetU32(in + 8);
+    pending->offset = GetU32(in + 12);
+    pending->key = GetU32(in + 16);
+
+    if (version < 2) {
+        pending->tag = 0;
+        pending->timestamp = 0;
+    } else {
+        pending->tag = GetU32(in + 20);
+        pending->timestamp = GetU64(in + 24);
+    }
+}
+
+void JournalFormat::EncodeManifestSession(unsigned char* out, const SessionState* session)
+{
+    EncodeSessionPayload(out, session);
+    PutU32(out + SESSION_PAYLOAD_SIZE, Crc32(out, SESSION_PAYLOAD_SIZE, 0));
+}
+
+bool JournalFormat::DecodeManifestSession(const unsigned char* in, unsigned int avail, SessionState* session)
+{
+    // A torn trailer only loses the session, not the manifest
+    if (avail < MANIFEST_SESSION_SIZE ||
+        GetU32(in + SESSION_PAYLOAD_SIZE) != Crc32(in, SESSION_PAYLOAD_SIZE, 0)) {
+        return false;
+    }
+
+    return DecodeSessionPayload(in, SESSION_PAYLOAD_SIZE, session);
+}
+
+bool JournalFormat::ParseLegacyLine(const char* line, int len, unsigned short* type,
+                                    JournalU64* timestamp, int* messageOffset)
+{
+    // "[YYYY-MM-DD HH:MM:SS] LEVEL: message"
+    if (!line || len < 24 || line[0] != '[' || line[20] != ']' || line[21] != ' ') {
+        return false;
+    }
+
+    for (int i = 1; i < 20; i++) {
+        bool separator = (i == 5 || i == 8 || i == 11 || i == 14 || i == 17);
+        if (!separator && (line[i] < '0' || line[i] > '9')) {
+            return false;
+        }
+    }
+
+    int year = (line[1] - '0') * 1000 + (line[2] - '0') * 100 + (line[3] - '0') * 10 + (line[4] - '0');
+    int month = (line[6] - '0') * 10 + (line[7] - '0');
+    int day = (line[9] - '0') * 10 + (line[10] - '0');
+    int hour = (line[12] - '0') * 10 + (line[13] - '0');
+    int minute = (line[15] - '0') * 10 + (line[16] - '0');
+    int second = (line[18] - '0') * 10 + (line[19] - '0');
+
+    // Find "LEVEL: "
+    int levelStart = 22;
+    int levelEnd = levelStart;
+    while (levelEnd < len && line[levelEnd] != ':') {
+        levelEnd++;
+    }
+    if (levelEnd >= len) {
+        return false;
+    }
+
+    int levelLen = levelEnd - levelStart;
+    const char* level = line + levelStart;
+
+    if (levelLen == 4 && strncmp(level, "INFO", 4) == 0) {
+        *type = REC_INFO;
+    } else if (levelLen == 5 && strncmp(level, "ERROR", 5) == 0) {
+        *type = REC_ERROR;
+    } else if (levelLen == 5 && strncmp(level, "TRANS", 5) == 0) {
+        *type = REC_TRANS;
+    } else if (levelLen == 6 && strncmp(level, "SYNCED", 6) == 0) {
+        *type = REC_SYNCED;
+    } else {
+        return false;
+    }
+
+    // Old journals stored local time without a zone; keep it as-is
+    *timestamp = MakeTimestamp(year, month, day, hour, minute, second, 0);
+
+    int msg = levelEnd + 1;
+    if (msg < len && line[msg] == ' ') {
+        msg++;
+    }
+    *messageOffset = msg;
+
+    return true;
+}
+
+unsigned int JournalFormat::Crc32(const unsigned char* data, unsigned int len, unsigned int crc)
+{
+    crc = ~crc;
+    for (unsigned int i = 0; i < len; i++) {
+        crc = kCrcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+const char* JournalFormat::RecordTypeName(unsigned short type)
+{
+    switch (type) {
+    case REC_INFO:
+        return "INFO";
+    case REC_ERROR:
+        return "ERROR";
+    case REC_TRANS:
+        return "TRANS";
+    case REC_SYNCED:
+        return "SYNCED";
+    case REC_ACK:
+        return "ACK";
+    case REC_SESSION:
+        return "SESSION";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+void JournalFormat::FormatTimestamp(JournalU64 ms, char* buffer, int maxLen)
+{
+    if (!buffer || maxLen < 24) {
+        if (buffer && maxLen > 0) {
+            buffer[0] = '\0';
+        }
+        return;
+    }
+
+    // Civil-from-days conversion (proleptic Gregorian calendar)
+    long days = (long)(ms / 86400000);
+    long msOfDay = (long)(ms % 86400000);
+
+    days += 719468;
+    long era = days / 146097;
+    long doe = days - era * 146097;
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long year = yoe + era * 400;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+    long day = doy - (153 * mp + 2) / 5 + 1;
+    long month = mp < 10 ? mp + 3 : mp - 9;
+    if (month <= 2) {
+        year++;
+    }
+
+    sprintf(buffer, "%04ld-%02ld-%02ld %02ld:%02ld:%02ld.%03ld",
+            year, month, day,
+            msOfDay / 3600000, (msOfDay / 60000) % 60, (msOfDay / 1000) % 60, msOfDay % 1000);
+}
+
+JournalU64 JournalFormat::MakeTimestamp(int year, int month, int day, int hour, int minute, int second, int millis)
+{
+    // Days-from-civil conversion (proleptic Gregorian calendar)
+    long y = year - (month <= 2 ? 1 : 0);
+    long era = y / 400;
+    long yoe = y - era * 400;
+    long mp = (month + 9) % 12;
+    long doy = (153 * mp + 2) / 5 + day - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = era * 146097 + doe - 719468;
+
+    if (days < 0) {
+        return 0;
+    }
+
+    return (JournalU64)days * 86400000 +
+           (JournalU64)hour * 3600000 +
+           (JournalU64)minute * 60000 +
+           (JournalU64)second * 1000 +
+           (JournalU64)millis;
+}
+
+void JournalFormat::PutU16(unsigned char* out, unsigned short value)
+{
+    out[0] = (unsigned char)(value & 0xFF);
+    out[1] = (unsigned char)((value >> 8) & 0xFF);
+}
+
+void JournalFormat::PutU32(unsigned char* out, unsigned int value)
+{
+    for (int i = 0; i < 4; i++) {
+        out[i] = (unsigned char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+void JournalFormat::PutU64(unsigned char* out, JournalU64 value)
+{
+    for (int i = 0; i < 8; i++) {
+        out[i] = (unsigned char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+unsigned short JournalFormat::GetU16(const unsigned char* in)
+{
+    return (unsigned short)(in[0] | (in[1] << 8));
+}
+
+unsigned int JournalFormat::GetU32(const unsigned char* in)
+{
+    return (unsigned int)in[0] |
+           ((unsigned int)in[1] << 8) |
+           ((unsigned int)in[2] << 16) |
+           ((unsigned int)in[3] << 24);
+}
+
+JournalU64 JournalFormat::GetU64(const unsigned char* in)
+{
+    JournalU64 value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+} // namespace HBX
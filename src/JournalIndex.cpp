@@ -0,0 +1,340 @@
+#include "../include/JournalIndex.hpp"
+
+namespace HBX {
+
+namespace {
+
+const int INITIAL_CAPACITY = 64;
+
+} // namespace
+
+JournalIndex::JournalIndex()
+    : m_entries(NULL)
+    , m_used(0)
+    , m_capacity(0)
+    , m_liveCount(0)
+    , m_buckets(NULL)
+    , m_bucketCount(0)
+{
+}
+
+JournalIndex::~JournalIndex()
+{
+    if (m_entries) {
+        delete[] m_entries;
+    }
+    if (m_buckets) {
+        delete[] m_buckets;
+    }
+}
+
+bool JournalIndex::Add(ULONGLONG sequence, DWORD segment, DWORD offset, DWORD key,
+                       DWORD tag, ULONGLONG timestamp)
+{
+    if (m_used == m_capacity) {
+        // Reuse the space of removed entries before growing
+        if (m_liveCount <= m_used / 2 && m_used > 0) {
+            Pack();
+        } else if (!Grow()) {
+            return false;
+        }
+    }
+
+    Entry& entry = m_entries[m_used];
+    entry.sequence = sequence;
+    entry.segment = segment;
+    entry.offset = offset;
+    entry.key = key;
+    entry.tag = tag;
+    entry.timestamp = timestamp;
+    entry.live = true;
+
+    int bucket = BucketFor(key);
+    entry.next = m_buckets[bucket];
+    m_buckets[bucket] = m_used;
+
+    m_used++;
+    m_liveCount++;
+    return true;
+}
+
+bool JournalIndex::Remove(int position)
+{
+    if (position < 0 || position >= m_used || !m_entries[position].live) {
+        return false;
+    }
+
+    // Unlink from the hash chain; the slot itself is reclaimed by Pack()
+    int bucket = BucketFor(m_entries[position].key);
+    int* link = &m_buckets[bucket];
+    while (*link != -1) {
+        if (*link == position) {
+            *link = m_entries[position].next;
+            break;
+        }
+        link = &m_entries[*link].next;
+    }
+
+    m_entries[position].live = false;
+    m_entries[position].next = -1;
+    m_liveCount--;
+    return true;
+}
+
+bool JournalIndex::Restore(const Entry& entry)
+{
+    // Revived in place while its slot has not been packed away
+    int position = m_used;
+    while (position > 0 && m_entries[position - 1].sequence >= entry.sequence) {
+        position--;
+    }
+
+    if (position < m_used && m_entries[position].sequence == entry.sequence) {
+        if (m_entries[position].live) {
+            return false;
+        }
+    } else {
+        if (m_used == m_capacity && !Grow()) {
+            return false;
+        }
+        for (int i = m_used; i > position; i--) {
+            m_entries[i] = m_entries[i - 1];
+        }
+        m_used++;
+    }
+
+    m_entries[position] = entry;
+    m_entries[position].live = true;
+    m_liveCount++;
+
+    // Chains are kept newest-first, which an insert in the middle breaks
+    RebuildBuckets();
+    return true;
+}
+
+void JournalIndex::Clear()
+{
+    m_used = 0;
+    m_liveCount = 0;
+    for (int i = 0; i < m_bucketCount; i++) {
+        m_buckets[i] = -1;
+    }
+}
+
+int JournalIndex::FindKey(DWORD key) const
+{
+    if (m_bucketCount == 0) {
+        return -1;
+    }
+
+    // Chains are newest-first; walk to the oldest matching entry so that
+    // duplicates are resolved in FIFO order
+    int found = -1;
+    for (int i = m_buckets[BucketFor(key)]; i != -1; i = m_entries[i].next) {
+        if (m_entries[i].key == key) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+int JournalIndex::FindNextKey(int position) const
+{
+    if (position < 0 || position >= m_used) {
+        return -1;
+    }
+
+    // Next newer entry with the same key (chain order is newest-first)
+    DWORD key = m_entries[position].key;
+    int found = -1;
+    for (int i = m_buckets[BucketFor(key)]; i != -1 && i != position; i = m_entries[i].next) {
+        if (m_entries[i].key == key) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+int JournalIndex::FindKeyAfter(DWORD key, ULONGLONG sequence) const
+{
+    if (m_bucketCount == 0) {
+        return -1;
+    }
+
+    // Oldest entry with the key and a greater sequence number; the chain
+    // is newest-first, so the walk stops at the first older entry
+    int found = -1;
+    for (int i = m_buckets[BucketFor(key)]; i != -1 && m_entries[i].sequence > sequence; i = m_entries[i].next) {
+        if (m_entries[i].key == key) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+int JournalIndex::FindSequence(ULONGLONG sequence) const
+{
+    // Entries are appended in sequence order, so binary search works
+    int low = 0;
+    int high = m_used - 1;
+
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (m_entries[mid].sequence == sequence) {
+            return m_entries[mid].live ? mid : -1;
+        }
+        if (m_entries[mid].sequence < sequence) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+int JournalIndex::FindAfter(ULONGLONG sequence) const
+{
+    // First entry with a greater sequence number, then the first live one
+    int low = 0;
+    int high = m_used;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (m_entries[mid].sequence <= sequence) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return Next(low - 1);
+}
+
+int JournalIndex::FindTime(ULONGLONG timestamp) const
+{
+    // First live entry at or after the given time; timestamps follow
+    // sequence order, so the same binary search applies
+    int low = 0;
+    int high = m_used;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (m_entries[mid].timestamp < timestamp) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return Next(low - 1);
+}
+
+int JournalIndex::First() const
+{
+    return Next(-1);
+}
+
+int JournalIndex::Next(int position) const
+{
+    for (int i = position + 1; i < m_used; i++) {
+        if (m_entries[i].live) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const JournalIndex::Entry& JournalIndex::GetEntry(int position) const
+{
+    return m_entries[position];
+}
+
+void JournalIndex::SetLocation(int position, DWORD segment, DWORD offset)
+{
+    if (position >= 0 && position < m_used) {
+        m_entries[position].segment = segment;
+        m_entries[position].offset = offset;
+    }
+}
+
+void JournalIndex::SetTag(int position, DWORD tag, ULONGLONG timestamp)
+{
+    if (position >= 0 && position < m_used) {
+        m_entries[position].tag = tag;
+        m_entries[position].timestamp = timestamp;
+    }
+}
+
+int JournalIndex::GetCount() const
+{
+    return m_liveCount;
+}
+
+bool JournalIndex::Grow()
+{
+    int newCapacity = m_capacity ? m_capacity * 2 : INITIAL_CAPACITY;
+
+    Entry* newEntries = new Entry[newCapacity];
+    int* newBuckets = new int[newCapacity];
+    if (!newEntries || !newBuckets) {
+        delete[] newEntries;
+        delete[] newBuckets;
+        return false;
+    }
+
+    for (int i = 0; i < m_used; i++) {
+        newEntries[i] = m_entries[i];
+    }
+
+    if (m_entries) {
+        delete[] m_entries;
+    }
+    if (m_buckets) {
+        delete[] m_buckets;
+    }
+
+    m_entries = newEntries;
+    m_capacity = newCapacity;
+    m_buckets = newBuckets;
+    m_bucketCount = newCapacity;
+
+    RebuildBuckets();
+    return true;
+}
+
+void JournalIndex::Pack()
+{
+    int target = 0;
+    for (int i = 0; i < m_used; i++) {
+        if (m_entries[i].live) {
+            m_entries[target++] = m_entries[i];
+        }
+    }
+    m_used = target;
+
+    RebuildBuckets();
+}
+
+void JournalIndex::RebuildBuckets()
+{
+    for (int i = 0; i < m_bucketCount; i++) {
+        m_buckets[i] = -1;
+    }
+
+    for (int i = 0; i < m_used; i++) {
+        if (m_entries[i].live) {
+            int bucket = BucketFor(m_entries[i].key);
+            m_entries[i].next = m_buckets[bucket];
+            m_buckets[bucket] = i;
+        }
+    }
+}
+
+int JournalIndex::BucketFor(DWORD key) const
+{
+    // Bucket count is always a power of two
+    return (int)((key ^ (key >> 16)) & (DWORD)(m_bucketCount - 1));
+}
+
+} // namespace HBX
@@ -0,0 +1,480 @@
+#include "../include/JournalManifest.hpp"
+#include <string.h>
+
+namespace HBX {
+
+namespace {
+
+const int INITIAL_CAPACITY = 16;
+
+// Manifest bodies are streamed through a buffer of this size
+const DWORD CHUNK_SIZE = 2048;
+
+} // namespace
+
+JournalManifest::JournalManifest()
+    : m_segments(NULL)
+    , m_segmentCount(0)
+    , m_capacity(0)
+    , m_nextSegmentId(1)
+    , m_generation(0)
+    , m_currentSlot(1)
+    , m_nextSequence(1)
+    , m_lastTimestamp(0)
+    , m_scanOffset(JournalFormat::FILE_HEADER_SIZE)
+    , m_version(JournalFormat::MANIFEST_VERSION)
+    , m_epoch(0)
+{
+    m_session.id = 0;
+    m_session.highWater = 0;
+    m_session.acknowledged = 0;
+    m_session.flags = 0;
+}
+
+JournalManifest::~JournalManifest()
+{
+    if (m_segments) {
+        delete[] m_segments;
+    }
+}
+
+bool JournalManifest::Load(const TCHAR* basePath, JournalIndex* pending)
+{
+    // Read both headers and try the newer generation first
+    ULONGLONG generations[2] = { 0, 0 };
+    bool present[2] = { false, false };
+
+    for (int slot = 0; slot < 2; slot++) {
+        TCHAR path[MAX_PATH];
+        GetSlotPath(basePath, slot, path);
+
+        HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            continue;
+        }
+
+        BYTE buffer[JournalFormat::MANIFEST_HEADER_SIZE];
+        DWORD bytesRead = 0;
+        JournalFormat::ManifestHeader header;
+        if (ReadFile(file, buffer, sizeof(buffer), &bytesRead, NULL) &&
+            JournalFormat::DecodeManifestHeader(buffer, bytesRead, &header)) {
+            generations[slot] = header.generation;
+            present[slot] = true;
+
+            // Whatever loads, the next Save must outrank both slots. The
+            // epoch is kept even if no slot loads, as the journal is the same
+            if (header.generation > m_generation) {
+                m_generation = header.generation;
+                m_epoch = header.epoch;
+            }
+        }
+        CloseHandle(file);
+    }
+
+    int first = (present[1] && (!present[0] || generations[1] > generations[0])) ? 1 : 0;
+    int order[2] = { first, 1 - first };
+
+    for (int i = 0; i < 2; i++) {
+        int slot = order[i];
+        if (present[slot] && LoadSlot(basePath, slot, pending)) {
+            return true;
+        }
+
+        // A torn slot may have added part of its pending list
+        pending->Clear();
+    }
+
+    Reset();
+    return false;
+}
+
+bool JournalManifest::Save(const TCHAR* basePath, const JournalIndex& pending,
+                           ULONGLONG nextSequence, ULONGLONG lastTimestamp, DWORD scanOffset)
+{
+    if (m_segmentCount == 0) {
+        return false;
+    }
+
+    // Overwrite the other slot; the current one stays valid until the
+    // new one is complete and flushed
+    ULONGLONG generation = m_generation + 1;
+    int slot = 1 - m_currentSlot;
+    TCHAR path[MAX_PATH];
+    GetSlotPath(basePath, slot, path);
+
+    HANDLE file = CreateFile(path, GENERIC_WRITE, 0, NULL,
+                             CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    JournalFormat::ManifestHeader header;
+    header.generation = generation;
+    header.nextSequence = nextSequence;
+    header.lastTimestamp = lastTimestamp;
+    header.nextSegmentId = m_nextSegmentId;
+    header.segmentCount = (unsigned int)m_segmentCount;
+    header.pendingCount = (unsigned int)pending.GetCount();
+    header.scanOffset = scanOffset;
+    header.crc = 0;
+    header.epoch = m_epoch;
+
+    BYTE headerBuffer[JournalFormat::MANIFEST_HEADER_SIZE];
+    JournalFormat::EncodeManifestHeader(headerBuffer, &header);
+    unsigned int crc = JournalFormat::GetManifestHeaderCrc(headerBuffer, JournalFormat::MANIFEST_VERSION);
+
+    // Stream the body after the header, which is written last
+    BYTE chunk[CHUNK_SIZE];
+    DWORD chunkLength = 0;
+    DWORD bytesWritten = 0;
+    bool success = (SetFilePointer(file, JournalFormat::MANIFEST_HEADER_SIZE, NULL, FILE_BEGIN) !=
+                    INVALID_SET_FILE_POINTER);
+
+    for (int i = 0; success && i < m_segmentCount; i++) {
+        if (chunkLength + JournalFormat::MANIFEST_SEGMENT_SIZE > CHUNK_SIZE) {
+            success = (WriteFile(file, chunk, chunkLength, &bytesWritten, NULL) && bytesWritten == chunkLength);
+            chunkLength = 0;
+        }
+        JournalFormat::EncodeManifestSegment(chunk + chunkLength, &m_segments[i]);
+        crc = JournalFormat::Crc32(chunk + chunkLength, JournalFormat::MANIFEST_SEGMENT_SIZE, crc);
+        chunkLength += JournalFormat::MANIFEST_SEGMENT_SIZE;
+    }
+
+    for (int pos = pending.First(); success && pos != -1; pos = pending.Next(pos)) {
+        if (chunkLength + JournalFormat::MANIFEST_PENDING_SIZE > CHUNK_SIZE) {
+            success = (WriteFile(file, chunk, chunkLength, &bytesWritten, NULL) && bytesWritten == chunkLength);
+            chunkLength = 0;
+        }
+
+        const JournalIndex::Entry& entry = pending.GetEntry(pos);
+        JournalFormat::ManifestPending record;
+        record.sequence = entry.sequence;
+        record.segment = entry.segment;
+        record.offset = entry.offset;
+        record.key = entry.key;
+        record.tag = entry.tag;
+        record.timestamp = entry.timestamp;
+
+        JournalFormat::EncodeManifestPending(chunk + chunkLength, &record);
+        crc = JournalFormat::Crc32(chunk + chunkLength, JournalFormat::MANIFEST_PENDING_SIZE, crc);
+        chunkLength += JournalFormat::MANIFEST_PENDING_SIZE;
+    }
+
+    // The session trailer is outside the header CRC; it has its own
+    if (success && m_session.id != 0) {
+        if (chunkLength + JournalFormat::MANIFEST_SESSION_SIZE > CHUNK_SIZE) {
+            success = (WriteFile(file, chunk, chunkLength, &bytesWritten, NULL) && bytesWritten == chunkLength);
+            chunkLength = 0;
+        }
+        JournalFormat::EncodeManifestSession(chunk + chunkLength, &m_session);
+        chunkLength += JournalFormat::MANIFEST_SESSION_SIZE;
+    }
+
+    if (success && chunkLength > 0) {
+        success = (WriteFile(file, chunk, chunkLength, &bytesWritten, NULL) && bytesWritten == chunkLength);
+    }
+
+    if (success) {
+        header.crc = crc;
+        JournalFormat::EncodeManifestHeader(headerBuffer, &header);
+        SetFilePointer(file, 0, NULL, FILE_BEGIN);
+        success = (WriteFile(file, headerBuffer, sizeof(headerBuffer), &bytesWritten, NULL) &&
+                   bytesWritten == sizeof(headerBuffer));
+    }
+
+    if (success) {
+        success = (FlushFileBuffers(file) != FALSE);
+    }
+    CloseHandle(file);
+
+    if (!success) {
+        // Leave no half-written slot behind; the previous one still loads
+        DeleteFile(path);
+        return false;
+    }
+
+    m_generation = generation;
+    m_currentSlot = slot;
+    m_nextSequence = nextSequence;
+    m_lastTimestamp = lastTimestamp;
+    m_scanOffset = scanOffset;
+    m_version = JournalFormat::MANIFEST_VERSION;
+    return true;
+}
+
+void JournalManifest::Delete(const TCHAR* basePath)
+{
+    TCHAR path[MAX_PATH];
+    for (int slot = 0; slot < 2; slot++) {
+        GetSlotPath(basePath, slot, path);
+        DeleteFile(path);
+    }
+}
+
+void JournalManifest::GetSegmentPath(const TCHAR* basePath, DWORD segmentId, TCHAR* path)
+{
+    wsprintf(path, TEXT("%s.%08lx"), basePath, segmentId);
+}
+
+void JournalManifest::Reset()
+{
+    m_segmentCount = 0;
+    m_nextSegmentId = 1;
+    m_nextSequence = 1;
+    m_lastTimestamp = 0;
+    m_scanOffset = JournalFormat::FILE_HEADER_SIZE;
+    m_version = JournalFormat::MANIFEST_VERSION;
+    m_session.id = 0;
+    m_session.highWater = 0;
+    m_session.acknowledged = 0;
+    m_session.flags = 0;
+
+    // m_generation keeps counting so a new manifest always wins over an
+    // old slot left on disk; m_epoch stays with the journal
+}
+
+DWORD JournalManifest::AllocateSegmentId()
+{
+    return m_nextSegmentId++;
+}
+
+bool JournalManifest::AddSegment(DWORD segmentId)
+{
+    Segment segment;
+    segment.id = segmentId;
+    segment.size = JournalFormat::FILE_HEADER_SIZE;
+    segment.records = 0;
+    segment.pending = 0;
+
+    return InsertSegment(m_segmentCount, segment);
+}
+
+bool JournalManifest::InsertSegment(int position, const Segment& segment)
+{
+    if (position < 0 || position > m_segmentCount) {
+        return false;
+    }
+
+    if (m_segmentCount == m_capacity) {
+        int newCapacity = m_capacity ? m_capacity * 2 : INITIAL_CAPACITY;
+        Segment* newSegments = new Segment[newCapacity];
+        if (!newSegments) {
+            return false;
+        }
+
+        for (int i = 0; i < m_segmentCount; i++) {
+            newSegments[i] = m_segments[i];
+        }
+        if (m_segments) {
+            delete[] m_segments;
+        }
+        m_segments = newSegments;
+        m_capacity = newCapacity;
+    }
+
+    for (int i = m_segmentCount; i > position; i--) {
+        m_segments[i] = m_segments[i - 1];
+    }
+    m_segments[position] = segment;
+    m_segmentCount++;
+
+    if (segment.id >= m_nextSegmentId) {
+        m_nextSegmentId = segment.id + 1;
+    }
+    return true;
+}
+
+void JournalManifest::RemoveSegment(int position)
+{
+    if (position < 0 || position >= m_segmentCount) {
+        return;
+    }
+
+    for (int i = position; i < m_segmentCount - 1; i++) {
+        m_segments[i] = m_segments[i + 1];
+    }
+    m_segmentCount--;
+}
+
+int JournalManifest::FindSegment(DWORD segmentId) const
+{
+    for (int i = 0; i < m_segmentCount; i++) {
+        if (m_segments[i].id == segmentId) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int JournalManifest::GetSegmentCount() const
+{
+    return m_segmentCount;
+}
+
+JournalManifest::Segment& JournalManifest::GetSegment(int position)
+{
+    return m_segments[position];
+}
+
+const JournalManifest::Segment& JournalManifest::GetSegment(int position) const
+{
+    return m_segments[position];
+}
+
+JournalManifest::Segment& JournalManifest::GetActiveSegment()
+{
+    return m_segments[m_segmentCount - 1];
+}
+
+ULONGLONG JournalManifest::GetNextSequence() const
+{
+    return m_nextSequence;
+}
+
+ULONGLONG JournalManifest::GetLastTimestamp() const
+{
+    return m_lastTimestamp;
+}
+
+DWORD JournalManifest::GetScanOffset() const
+{
+    return m_scanOffset;
+}
+
+WORD JournalManifest::GetVersion() const
+{
+    return m_version;
+}
+
+DWORD JournalManifest::GetEpoch() const
+{
+    return m_epoch;
+}
+
+void JournalManifest::SetEpoch(DWORD epoch)
+{
+    m_epoch = epoch;
+}
+
+const JournalFormat::SessionState& JournalManifest::GetSession() const
+{
+    return m_session;
+}
+
+void JournalManifest::SetSession(const JournalFormat::SessionState& session)
+{
+    m_session = session;
+}
+
+bool JournalManifest::LoadSlot(const TCHAR* basePath, int slot, JournalIndex* pending)
+{
+    TCHAR path[MAX_PATH];
+    GetSlotPath(basePath, slot, path);
+
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    BYTE chunk[CHUNK_SIZE];
+    DWORD bytesRead = 0;
+    JournalFormat::ManifestHeader header;
+
+    if (!ReadFile(file, chunk, JournalFormat::MANIFEST_HEADER_SIZE, &bytesRead, NULL) ||
+        !JournalFormat::DecodeManifestHeader(chunk, bytesRead, &header)) {
+        CloseHandle(file);
+        return false;
+    }
+
+    unsigned int crc = JournalFormat::GetManifestHeaderCrc(chunk, header.version);
+
+    Reset();
+    bool success = true;
+
+    // Both tables use fixed-size items, so read them one item at a time
+    // out of a refilled chunk
+    DWORD length = 0;
+    DWORD position = 0;
+    unsigned int total = header.segmentCount + header.pendingCount;
+
+    for (unsigned int i = 0; success && i < total; i++) {
+        DWORD itemSize = (i < header.segmentCount) ?
+            (DWORD)JournalFormat::MANIFEST_SEGMENT_SIZE : (DWORD)JournalFormat::GetManifestPendingSize(header.version);
+
+        if (length - position < itemSize) {
+            DWORD remaining = length - position;
+            memmove(chunk, chunk + position, remaining);
+            length = remaining;
+            position = 0;
+
+            if (!ReadFile(file, chunk + length, CHUNK_SIZE - length, &bytesRead, NULL) ||
+                length + bytesRead < itemSize) {
+                success = false;
+                break;
+            }
+            length += bytesRead;
+        }
+
+        crc = JournalFormat::Crc32(chunk + position, itemSize, crc);
+
+        if (i < header.segmentCount) {
+            JournalFormat::ManifestSegment segment;
+            JournalFormat::DecodeManifestSegment(chunk + position, &segment);
+            success = AddSegment(segment.id);
+            if (success) {
+                GetActiveSegment() = segment;
+            }
+        } else {
+            JournalFormat::ManifestPending record;
+            JournalFormat::DecodeManifestPending(chunk + position, header.version, &record);
+            success = pending->Add(record.sequence, record.segment, record.offset, record.key,
+                                   record.tag, record.timestamp);
+        }
+        position += itemSize;
+    }
+
+    // Manifests written without a session, or by older builds, end here
+    if (success && length - position < JournalFormat::MANIFEST_SESSION_SIZE) {
+        DWORD remaining = length - position;
+        memmove(chunk, chunk + position, remaining);
+        length = remaining;
+        position = 0;
+
+        if (ReadFile(file, chunk + length, CHUNK_SIZE - length, &bytesRead, NULL)) {
+            length += bytesRead;
+        }
+    }
+    JournalFormat::SessionState session;
+    bool hasSession = success &&
+        JournalFormat::DecodeManifestSession(chunk + position, length - position, &session);
+
+    CloseHandle(file);
+
+    if (!success || crc != header.crc) {
+        return false;
+    }
+
+    if (hasSession) {
+        m_session = session;
+    }
+
+    if (header.nextSegmentId > m_nextSegmentId) {
+        m_nextSegmentId = header.nextSegmentId;
+    }
+    m_currentSlot = slot;
+    m_nextSequence = header.nextSequence;
+    m_lastTimestamp = header.lastTimestamp;
+    m_scanOffset = header.scanOffset;
+    m_version = header.version;
+    m_epoch = header.epoch;
+    return true;
+}
+
+void JournalManifest::GetSlotPath(const TCHAR* basePath, int slot, TCHAR* path)
+{
+    wsprintf(path, TEXT("%s.mf%d"), basePath, slot);
+}
+
+} // namespace HBX
@@ -4,6 +4,26 @@
 namespace HBX {
 namespace Models {
 
+namespace {
+
+// Edited fields by their JSON names; originals go under "base.<name>"
+struct FieldName {
+    DWORD field;
+    const TCHAR* name;
+};
+
+const FieldName kFields[] = {
+    { Item::FIELD_NAME, TEXT("name") },
+    { Item::FIELD_DESCRIPTION, TEXT("description") },
+    { Item::FIELD_LOCATION, TEXT("locationId") },
+    { Item::FIELD_QUANTITY, TEXT("quantity") },
+    { Item::FIELD_CATEGORY, TEXT("category") }
+};
+
+const int kFieldCount = sizeof(kFields) / sizeof(kFields[0]);
+
+} // namespace
+
 Item::Item()
     : m_id(NULL)
     , m_barcode(NULL)
@@ -12,6 +32,9 @@ Item::Item()
     , m_locationId(NULL)
     , m_quantity(0)
     , m_category(NULL)
+    , m_version(NULL)
+    , m_changed(0)
+    , m_original(NULL)
 {
 }
 
@@ -28,8 +51,12 @@ void Item::Cleanup()
     if (m_description) delete[] m_description;
     if (m_locationId) delete[] m_locationId;
     if (m_category) delete[] m_category;
+    if (m_version) delete[] m_version;
+    delete m_original;
     
-    m_id = m_barcode = m_name = m_description = m_locationId = m_category = NULL;
+    m_id = m_barcode = m_name = m_description = m_locationId = m_category = m_version = NULL;
+    m_original = NULL;
+    m_changed = 0;
 }
 
 const TCHAR* Item::GetId() const { return m_id; }
@@ -39,6 +66,8 @@ const TCHAR* Item::GetDescription() const { return m_description; }
 const TCHAR* Item::GetLocationId() const { return m_locationId; }
 int Item::GetQuantity() const { return m_quantity; }
 const TCHAR* Item::GetCategory() const { return m_category; }
+const TCHAR* Item::GetVersion() const { return m_version; }
+DWORD Item::GetChangedFields() const { return m_changed; }
 
 void Item::SetId(const TCHAR* id)
 {
@@ -108,6 +137,128 @@ void Item::SetCategory(const TCHAR* category)
     }
 }
 
+void Item::SetVersion(const TCHAR* version)
+{
+    if (version == m_version) {
+        return;
+    }
+    if (m_version) delete[] m_version;
+    if (version) {
+        m_version = new TCHAR[lstrlen(version) + 1];
+        lstrcpy(m_version, version);
+    } else {
+        m_version = NULL;
+    }
+}
+
+void Item::TrackChanges(const Item& original)
+{
+    SetVersion(original.m_version);
+    if (!m_original) {
+        m_original = new Item();
+    }
+
+    m_changed = 0;
+    for (int i = 0; i < kFieldCount; i++) {
+        if (!SameField(original, kFields[i].field)) {
+            m_changed |= kFields[i].field;
+            m_original->CopyField(original, kFields[i].field);
+        }
+    }
+}
+
+void Item::KeepChangesOf(const Item& earlier)
+{
+    if (!earlier.m_original) {
+        return;
+    }
+    if (!m_original) {
+        m_original = new Item();
+    }
+
+    // The earlier edit was made on the older copy, so its version is the
+    // one the server must still be at
+    for (int i = 0; i < kFieldCount; i++) {
+        if (earlier.m_changed & kFields[i].field) {
+            m_original->CopyField(*earlier.m_original, kFields[i].field);
+            m_changed |= kFields[i].field;
+        }
+    }
+    SetVersion(earlier.m_version);
+}
+
+DWORD Item::Rebase(const Item& current, bool keepLocal)
+{
+    DWORD conflicts = 0;
+    if (m_original) {
+        for (int i = 0; i < kFieldCount; i++) {
+            DWORD field = kFields[i].field;
+            if ((m_changed & field) && !current.SameField(*m_original, field) && !current.SameField(*this, field)) {
+                conflicts |= field;
+            }
+        }
+    }
+    if (conflicts && !keepLocal) {
+        return conflicts;
+    }
+
+    for (int i = 0; i < kFieldCount; i++) {
+        if (!(m_changed & kFields[i].field)) {
+            CopyField(current, kFields[i].field);
+        }
+    }
+    if (!m_id && current.m_id) {
+        SetId(current.m_id);
+    }
+    TrackChanges(current);
+    return conflicts;
+}
+
+const TCHAR* Item::GetText(DWORD field) const
+{
+    switch (field) {
+    case FIELD_NAME: return m_name;
+    case FIELD_DESCRIPTION: return m_description;
+    case FIELD_LOCATION: return m_locationId;
+    case FIELD_CATEGORY: return m_category;
+    default: return NULL;
+    }
+}
+
+void Item::SetText(DWORD field, const TCHAR* text)
+{
+    switch (field) {
+    case FIELD_NAME: SetName(text); break;
+    case FIELD_DESCRIPTION: SetDescription(text); break;
+    case FIELD_LOCATION: SetLocationId(text); break;
+    case FIELD_CATEGORY: SetCategory(text); break;
+    }
+}
+
+bool Item::SameField(const Item& other, DWORD field) const
+{
+    if (field == FIELD_QUANTITY) {
+        return m_quantity == other.m_quantity;
+    }
+
+    // A missing field and an empty one are the same to the server
+    const TCHAR* mine = GetText(field);
+    const TCHAR* theirs = other.GetText(field);
+    return lstrcmp(mine ? mine : TEXT(""), theirs ? theirs : TEXT("")) == 0;
+}
+
+void Item::CopyField(const Item& from, DWORD field)
+{
+    if (&from == this) {
+        return;
+    }
+    if (field == FIELD_QUANTITY) {
+        m_quantity = from.m_quantity;
+    } else {
+        SetText(field, from.GetText(field));
+    }
+}
+
 bool Item::FromJson(const TCHAR* json)
 {
     if (!json) {
@@ -151,6 +302,30 @@ bool Item::FromJson(const TCHAR* json)
         SetQuantity(quantity);
     }
 
+    if (parser.GetString(TEXT("version"), buffer, sizeof(buffer) / sizeof(TCHAR))) {
+        SetVersion(buffer);
+    }
+
+    // Originals of an edit's changed fields
+    for (int i = 0; i < kFieldCount; i++) {
+        TCHAR key[32];
+        wsprintf(key, TEXT("base.%s"), kFields[i].name);
+        if (!parser.HasKey(key)) {
+            continue;
+        }
+
+        if (!m_original) {
+            m_original = new Item();
+        }
+        m_changed |= kFields[i].field;
+        if (kFields[i].field == FIELD_QUANTITY) {
+            parser.GetInt(key, &quantity);
+            m_original->SetQuantity(quantity);
+        } else if (parser.GetString(key, buffer, sizeof(buffer) / sizeof(TCHAR))) {
+            m_original->SetText(kFields[i].field, buffer);
+        }
+    }
+
     return IsValid();
 }
 
@@ -209,6 +384,44 @@ TCHAR* Item::ToJson() const
     return json;
 }
 
+TCHAR* Item::ToChangeJson() const
+{
+    TCHAR* item = ToJson();
+    int length = lstrlen(item);
+    int size = length + 32 + (m_version ? lstrlen(m_version) : 0);
+    for (int i = 0; m_original && i < kFieldCount; i++) {
+        const TCHAR* text = m_original->GetText(kFields[i].field);
+        size += 32 + (text ? lstrlen(text) : 0);
+    }
+
+    TCHAR* json = new TCHAR[size];
+    lstrcpy(json, item);
+    delete[] item;
+
+    // Reopen the object after the last field
+    int pos = length - 1;
+    if (m_version) {
+        wsprintf(json + pos, TEXT(",\"version\":\"%s\""), m_version);
+        pos = lstrlen(json);
+    }
+    for (int i = 0; m_original && i < kFieldCount; i++) {
+        if (!(m_changed & kFields[i].field)) {
+            continue;
+        }
+        if (kFields[i].field == FIELD_QUANTITY) {
+            wsprintf(json + pos, TEXT(",\"base.%s\":%d"), kFields[i].name, m_original->m_quantity);
+        } else {
+            const TCHAR* text = m_original->GetText(kFields[i].field);
+            wsprintf(json + pos, TEXT(",\"base.%s\":\"%s\""), kFields[i].name, text ? text : TEXT(""));
+        }
+        pos = lstrlen(json);
+    }
+
+    json[pos++] = '}';
+    json[pos] = '\0';
+    return json;
+}
+
 bool Item::IsValid() const
 {
     return (m_barcode != NULL && lstrlen(m_barcode) > 0);
@@ -0,0 +1,121 @@
+#include "../include/ReplayCache.hpp"
+
+namespace HBX {
+
+namespace {
+
+int FormatNumber(TCHAR* out, ULONGLONG value)
+{
+    TCHAR digits[24];
+    int count = 0;
+    do {
+        digits[count++] = (TCHAR)('0' + (int)(value % 10));
+        value /= 10;
+    } while (value > 0);
+
+    for (int i = 0; i < count; i++) {
+        out[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+} // namespace
+
+ReplayCache::ReplayCache()
+    : m_count(0)
+    , m_next(0)
+{
+    InitializeCriticalSection(&m_lock);
+}
+
+ReplayCache::~ReplayCache()
+{
+    DeleteCriticalSection(&m_lock);
+}
+
+void ReplayCache::Record(ULONGLONG firstId, ULONGLONG lastId, Outcome outcome)
+{
+    EnterCriticalSection(&m_lock);
+    int index = Find(firstId);
+
+    if (outcome == OUTCOME_NONE) {
+        // Move the last entry into the gap
+        if (index != -1) {
+            m_entries[index] = m_entries[--m_count];
+            if (m_next > m_count) {
+                m_next = 0;
+            }
+        }
+    } else {
+        if (index == -1) {
+            if (m_count < CAPACITY) {
+                index = m_count++;
+            } else {
+                index = m_next;
+                m_next = (m_next + 1) % CAPACITY;
+            }
+        }
+        m_entries[index].firstId = firstId;
+        m_entries[index].lastId = lastId;
+        m_entries[index].outcome = outcome;
+    }
+    LeaveCriticalSection(&m_lock);
+}
+
+ReplayCache::Outcome ReplayCache::Lookup(ULONGLONG firstId, ULONGLONG lastId) const
+{
+    EnterCriticalSection(&m_lock);
+    int index = Find(firstId);
+    Outcome outcome = OUTCOME_NONE;
+    if (index != -1 && m_entries[index].lastId == lastId) {
+        outcome = m_entries[index].outcome;
+    }
+    LeaveCriticalSection(&m_lock);
+    return outcome;
+}
+
+int ReplayCache::GetInDoubt(ULONGLONG* firstIds, ULONGLONG* lastIds, int maxCount) const
+{
+    EnterCriticalSection(&m_lock);
+    int count = 0;
+    for (int i = 0; i < m_count; i++) {
+        if (m_entries[i].outcome == OUTCOME_IN_DOUBT) {
+            if (count < maxCount) {
+                firstIds[count] = m_entries[i].firstId;
+                lastIds[count] = m_entries[i].lastId;
+            }
+            count++;
+        }
+    }
+    LeaveCriticalSection(&m_lock);
+    return count;
+}
+
+void ReplayCache::Clear()
+{
+    EnterCriticalSection(&m_lock);
+    m_count = 0;
+    m_next = 0;
+    LeaveCriticalSection(&m_lock);
+}
+
+void ReplayCache::FormatKey(DWORD epoch, ULONGLONG firstId, ULONGLONG lastId, TCHAR* key)
+{
+    int pos = wsprintf(key, TEXT("%08lx-"), epoch);
+    pos += FormatNumber(key + pos, firstId);
+    key[pos++] = '-';
+    pos += FormatNumber(key + pos, lastId);
+    key[pos] = '\0';
+}
+
+int ReplayCache::Find(ULONGLONG firstId) const
+{
+    for (int i = 0; i < m_count; i++) {
+        if (m_entries[i].firstId == firstId) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+} // namespace HBX
@@ -0,0 +1,435 @@
+#include "../include/SyncBatch.hpp"
+#include "../include/JournalFormat.hpp"
+#include <string.h>
+
+namespace HBX {
+
+namespace {
+
+// The appenders write when out is set and otherwise only count, so an
+// entry can be measured before it is placed; they return the new position
+int Append(TCHAR* out, int pos, const TCHAR* text)
+{
+    for (; *text; text++, pos++) {
+        if (out) {
+            out[pos] = *text;
+        }
+    }
+    return pos;
+}
+
+int AppendEscaped(TCHAR* out, int pos, const TCHAR* text, int length)
+{
+    for (int i = 0; i < length; i++) {
+        if (text[i] == '"' || text[i] == '\\') {
+            if (out) {
+                out[pos] = '\\';
+            }
+            pos++;
+        }
+        if (out) {
+            out[pos] = text[i];
+        }
+        pos++;
+    }
+    return pos;
+}
+
+int AppendNumber(TCHAR* out, int pos, ULONGLONG value)
+{
+    TCHAR digits[24];
+    int count = 0;
+    do {
+        digits[count++] = (TCHAR)('0' + (int)(value % 10));
+        value /= 10;
+    } while (value > 0);
+
+    while (count > 0) {
+        if (out) {
+            out[pos] = digits[count - 1];
+        }
+        pos++;
+        count--;
+    }
+    return pos;
+}
+
+// ISO 8601 in UTC, "2025-11-15T14:30:15.000Z"
+int AppendTimestamp(TCHAR* out, int pos, ULONGLONG timestamp)
+{
+    char text[32];
+    JournalFormat::FormatTimestamp(timestamp, text, sizeof(text));
+
+    TCHAR wide[32];
+    int length = 0;
+    for (; text[length] != '\0'; length++) {
+        wide[length] = (text[length] == ' ') ? 'T' : (TCHAR)text[length];
+    }
+    wide[length++] = 'Z';
+    wide[length] = '\0';
+
+    return Append(out, pos, wide);
+}
+
+const TCHAR* SkipSpace(const TCHAR* p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+// From an opening quote to just past the closing one; NULL if unterminated
+const TCHAR* SkipString(const TCHAR* p)
+{
+    for (p++; *p; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+const TCHAR* SkipValue(const TCHAR* p)
+{
+    if (*p == '"') {
+        return SkipString(p);
+    }
+
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (*p) {
+            if (*p == '"') {
+                p = SkipString(p);
+                if (!p) {
+                    return NULL;
+                }
+                continue;
+            }
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (*p == '}' || *p == ']') {
+                if (--depth == 0) {
+                    return p + 1;
+                }
+            }
+            p++;
+        }
+        return NULL;
+    }
+
+    // Number, true, false or null
+    while (*p && *p != ',' && *p != '}' && *p != ']') {
+        p++;
+    }
+    return p;
+}
+
+bool KeyIs(const TCHAR* key, int length, const TCHAR* name)
+{
+    return length == lstrlen(name) && wcsncmp(key, name, length) == 0;
+}
+
+// Transaction IDs go out as decimal strings; a number is taken as well
+bool ParseId(const TCHAR* value, ULONGLONG* id)
+{
+    if (*value == '"') {
+        value++;
+    }
+    if (*value < '0' || *value > '9') {
+        return false;
+    }
+
+    ULONGLONG result = 0;
+    for (; *value >= '0' && *value <= '9'; value++) {
+        result = result * 10 + (*value - '0');
+    }
+    *id = result;
+    return true;
+}
+
+} // namespace
+
+SyncBatch::SyncBatch()
+    : m_count(0)
+    , m_maxOperations(DEFAULT_MAX_OPERATIONS)
+    , m_maxBytes(DEFAULT_MAX_BYTES)
+    , m_sessionId(0)
+    , m_body(new TCHAR[DEFAULT_MAX_BYTES + 1])
+    , m_length(0)
+    , m_capacity(DEFAULT_MAX_BYTES + 1)
+{
+    m_body[0] = '\0';
+}
+
+SyncBatch::~SyncBatch()
+{
+    delete[] m_body;
+}
+
+void SyncBatch::SetLimits(int maxOperations, DWORD maxBytes)
+{
+    if (maxOperations < 1) {
+        maxOperations = 1;
+    } else if (maxOperations > MAX_OPERATIONS) {
+        maxOperations = MAX_OPERATIONS;
+    }
+
+    m_maxOperations = maxOperations;
+    m_maxBytes = maxBytes;
+
+    delete[] m_body;
+    m_capacity = maxBytes + 1;
+    m_body = new TCHAR[m_capacity];
+    Clear();
+}
+
+void SyncBatch::SetSessionId(ULONGLONG sessionId)
+{
+    m_sessionId = sessionId;
+}
+
+void SyncBatch::Clear()
+{
+    m_count = 0;
+    m_length = 0;
+    m_body[0] = '\0';
+}
+
+bool SyncBatch::CanBatch(const TransactionCoalescer::Operation& operation)
+{
+    // Without a handler the payload did not parse; sent on its own, it
+    // fails as before
+    return operation.handler && (operation.handler->flags & TransactionHandler::HANDLER_BATCH);
+}
+
+bool SyncBatch::Add(int tag, const TransactionCoalescer::Operation& operation, ULONGLONG transactionId)
+{
+    if (!CanBatch(operation) || m_count >= m_maxOperations) {
+        return false;
+    }
+
+    if (HoldsItem(operation)) {
+        return false;
+    }
+
+    DWORD length = (DWORD)FormatEntry(NULL, operation, transactionId) + (m_count > 0 ? 1 : 0);
+    if (m_count > 0 && m_length + length > m_maxBytes) {
+        return false;
+    }
+
+    if (m_length + length + 1 > m_capacity) {
+        TCHAR* body = new TCHAR[m_length + length + 1];
+        memcpy(body, m_body, m_length * sizeof(TCHAR));
+        delete[] m_body;
+        m_body = body;
+        m_capacity = m_length + length + 1;
+    }
+
+    if (m_count > 0) {
+        m_body[m_length++] = ',';
+    }
+    m_length += FormatEntry(m_body + m_length, operation, transactionId);
+    m_body[m_length] = '\0';
+
+    Entry& entry = m_entries[m_count++];
+    entry.tag = tag;
+    entry.transactionId = transactionId;
+    entry.item = operation.payload.barcode;
+    entry.itemKey = operation.itemKey;
+    entry.succeeded = false;
+    return true;
+}
+
+bool SyncBatch::HoldsItem(const TransactionCoalescer::Operation& operation) const
+{
+    for (int i = 0; i < m_count; i++) {
+        if (m_entries[i].itemKey == operation.itemKey && lstrcmp(m_entries[i].item, operation.payload.barcode) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int SyncBatch::GetCount() const
+{
+    return m_count;
+}
+
+int SyncBatch::GetTag(int index) const
+{
+    return m_entries[index].tag;
+}
+
+TCHAR* SyncBatch::BuildRequest(const TCHAR* deviceId) const
+{
+    if (!deviceId) {
+        deviceId = TEXT("");
+    }
+
+    // Measured first, then written
+    TCHAR* request = NULL;
+    int pos = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        pos = Append(request, 0, TEXT("{\"deviceId\":\""));
+        pos = AppendEscaped(request, pos, deviceId, lstrlen(deviceId));
+        if (m_sessionId != 0) {
+            pos = Append(request, pos, TEXT("\",\"sessionId\":\""));
+            pos = AppendNumber(request, pos, m_sessionId);
+        }
+        pos = Append(request, pos, TEXT("\",\"transactions\":["));
+
+        if (!request) {
+            request = new TCHAR[pos + m_length + 2 + 1];
+        }
+    }
+    pos = Append(request, pos, m_body);
+    pos = Append(request, pos, TEXT("]}"));
+    request[pos] = '\0';
+
+    return request;
+}
+
+void SyncBatch::ParseResponse(const TCHAR* response)
+{
+    // {"syncedCount":..,"failedCount":..,"results":[{"transactionId":"..","status":"success"},..]}
+    const TCHAR* p = response ? wcsstr(response, TEXT("\"results\"")) : NULL;
+    if (!p) {
+        return;
+    }
+    p = wcschr(p, '[');
+    if (!p) {
+        return;
+    }
+    p++;
+
+    int next = 0;
+    for (;;) {
+        p = SkipSpace(p);
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p != '{') {
+            return;
+        }
+        p++;
+
+        // One result: pick out its ID and status, skipping anything else
+        ULONGLONG id = 0;
+        bool hasId = false;
+        bool succeeded = false;
+        for (;;) {
+            p = SkipSpace(p);
+            if (*p == ',') {
+                p++;
+                continue;
+            }
+            if (*p != '"') {
+                break;
+            }
+
+            const TCHAR* key = p + 1;
+            p = SkipString(p);
+            if (!p) {
+                return;
+            }
+            int keyLength = (int)(p - key) - 1;
+
+            p = SkipSpace(p);
+            if (*p != ':') {
+                return;
+            }
+            const TCHAR* value = SkipSpace(p + 1);
+            p = SkipValue(value);
+            if (!p) {
+                return;
+            }
+
+            if (KeyIs(key, keyLength, TEXT("transactionId"))) {
+                hasId = ParseId(value, &id);
+            } else if (KeyIs(key, keyLength, TEXT("status"))) {
+                succeeded = (wcsncmp(value, TEXT("\"success\""), 9) == 0);
+            }
+        }
+
+        if (*p != '}') {
+            return;
+        }
+        p++;
+
+        if (hasId) {
+            SetResult(id, succeeded, &next);
+        }
+    }
+}
+
+bool SyncBatch::Succeeded(int index) const
+{
+    return m_entries[index].succeeded;
+}
+
+int SyncBatch::FormatEntry(TCHAR* out, const TransactionCoalescer::Operation& operation, ULONGLONG transactionId)
+{
+    const TransactionPayload& payload = operation.payload;
+
+    int pos = Append(out, 0, TEXT("{\"transactionId\":\""));
+    pos = AppendNumber(out, pos, transactionId);
+    pos = Append(out, pos, TEXT("\",\"type\":\""));
+    pos = Append(out, pos, operation.handler->batchType);
+
+    switch (operation.handler->opcode) {
+    case JournalFormat::OP_ITEM_SCAN:
+        // Repeated scans of the item were merged; the count keeps them
+        pos = Append(out, pos, TEXT("\",\"barcode\":\""));
+        pos = AppendEscaped(out, pos, payload.barcode, lstrlen(payload.barcode));
+        pos = Append(out, pos, TEXT("\""));
+        if (operation.count > 1) {
+            pos = Append(out, pos, TEXT(",\"count\":"));
+            pos = AppendNumber(out, pos, (ULONGLONG)operation.count);
+        }
+        break;
+    case JournalFormat::OP_ITEM_MOVE:
+        pos = Append(out, pos, TEXT("\",\"barcode\":\""));
+        pos = AppendEscaped(out, pos, payload.barcode, lstrlen(payload.barcode));
+        pos = Append(out, pos, TEXT("\",\"locationId\":\""));
+        pos = AppendEscaped(out, pos, payload.locationId, lstrlen(payload.locationId));
+        pos = Append(out, pos, TEXT("\""));
+        break;
+    default:
+        // Item JSON, serialized once by the handler
+        pos = Append(out, pos, TEXT("\",\"item\":"));
+        pos = Append(out, pos, payload.itemJson);
+        break;
+    }
+
+    pos = Append(out, pos, TEXT(",\"timestamp\":\""));
+    pos = AppendTimestamp(out, pos, operation.timestamp);
+    pos = Append(out, pos, TEXT("\"}"));
+    return pos;
+}
+
+void SyncBatch::SetResult(ULONGLONG transactionId, bool succeeded, int* next)
+{
+    // Results normally come back in request order
+    int index = -1;
+    if (*next < m_count && m_entries[*next].transactionId == transactionId) {
+        index = *next;
+    } else {
+        for (int i = 0; i < m_count; i++) {
+            if (m_entries[i].transactionId == transactionId) {
+                index = i;
+                break;
+            }
+        }
+    }
+
+    if (index != -1) {
+        m_entries[index].succeeded = succeeded;
+        *next = index + 1;
+    }
+}
+
+} // namespace HBX
@@ -2,6 +2,24 @@
 
 namespace HBX {
 
+namespace {
+
+// Types by priority class, as Journal::PendingCursor filters take them
+const TCHAR* const kInteractiveTypes[] = { TEXT("ITEM_CREATE"), TEXT("ITEM_UPDATE"), NULL };
+const TCHAR* const kMoveTypes[] = { TEXT("ITEM_MOVE"), NULL };
+const TCHAR* const kWriteTypes[] = { TEXT("ITEM_CREATE"), TEXT("ITEM_UPDATE"), TEXT("ITEM_MOVE"), NULL };
+
+// The server refused a conditional change; the item changed there
+const int HTTP_PRECONDITION_FAILED = 412;
+
+// Upper bounds of the wait time histogram buckets
+const DWORD kWaitBucketMs[] = {
+    1000, 2000, 5000, 10000, 30000, 60000, 300000, 900000,
+    3600000, 14400000, 86400000, 0xFFFFFFFF
+};
+
+} // namespace
+
 SyncEngine::SyncEngine(HbClient* hbClient, Journal* journal)
     : m_hbClient(hbClient)
     , m_journal(journal)
@@ -9,17 +27,61 @@ SyncEngine::SyncEngine(HbClient* hbClient, Journal* journal)
     , m_lastSyncError(NULL)
     , m_lastSyncTime(0)
     , m_autoSyncEnabled(false)
+    , m_batchingEnabled(true)
+    , m_batchMaxOperations(SyncBatch::DEFAULT_MAX_OPERATIONS)
+    , m_batchMaxBytes(SyncBatch::DEFAULT_MAX_BYTES)
+    , m_lanes(NULL)
+    , m_laneCount(0)
+    , m_progress(0)
+    , m_interactiveQueued(0)
+    , m_conflictCount(0)
+    , m_autoSyncIntervalMs(SyncScheduler::DEFAULT_INTERVAL_MS)
+    , m_syncCallback(NULL)
+    , m_syncUserData(NULL)
+    , m_workerThread(NULL)
+    , m_workerWakeEvent(NULL)
+    , m_workerStopEvent(NULL)
+    , m_connectivity(hbClient)
 {
+    m_lastSyncStats.transactions = 0;
+    m_lastSyncStats.operations = 0;
+    m_lastSyncStats.requests = 0;
+    m_lastSyncStats.failed = 0;
+
+    for (int p = 0; p < SYNC_PRIORITY_COUNT; p++) {
+        for (int b = 0; b < WAIT_BUCKET_COUNT; b++) {
+            m_waitCounts[p][b] = 0;
+        }
+        m_waitMaxMs[p] = 0;
+        m_loggedWaitP90Ms[p] = 0;
+    }
+
+    InitializeCriticalSection(&m_syncLock);
+    InitializeCriticalSection(&m_scheduleLock);
+    InitializeCriticalSection(&m_blockLock);
+    InitializeCriticalSection(&m_statsLock);
+    InitializeCriticalSection(&m_conflictLock);
+    CreateLanes(1);
+    m_scheduler.SetBatchSize(SyncBatch::DEFAULT_MAX_OPERATIONS);
+    UpdateSchedule();
 }
 
 SyncEngine::~SyncEngine()
 {
+    StopAutoSync();
+    DeleteLanes();
+    DeleteCriticalSection(&m_conflictLock);
+    DeleteCriticalSection(&m_statsLock);
+    DeleteCriticalSection(&m_blockLock);
+    DeleteCriticalSection(&m_scheduleLock);
+    DeleteCriticalSection(&m_syncLock);
+
     if (m_lastSyncError) {
         delete[] m_lastSyncError;
     }
 }
 
-bool SyncEngine::QueueTransaction(const TCHAR* transactionType, const TCHAR* data)
+bool SyncEngine::QueueTransaction(const TCHAR* transactionType, const TCHAR* data, const TCHAR* itemId)
 {
     if (!transactionType || !data) {
         return false;
@@ -31,8 +93,29 @@ bool SyncEngine::QueueTransaction(const TCHAR* transactionType, const TCHAR* dat
 
     wsprintf(transactionEntry, TEXT("[%lu] %s: %s"), timestamp, transactionType, data);
 
-    // Log to journal (which maintains the queue)
-    return m_journal->LogTransaction(transactionType, TEXT(""), transactionEntry);
+    // Journaled with its handler's opcode, so sync dispatches it without
+    // looking up the type again
+    const TransactionHandler* handler = TransactionHandlers::FindByType(transactionType);
+    BYTE opcode = handler ? (BYTE)handler->opcode : (BYTE)JournalFormat::OP_NONE;
+
+    // Settling would only hold up what the operator is waiting for
+    if (GetPriority(handler) == SYNC_PRIORITY_INTERACTIVE) {
+        InterlockedExchange(&m_interactiveQueued, 1);
+    }
+
+    // Log to journal (which maintains the queue). With the journal writer
+    // running this only queues it; the writer makes it durable and reports
+    // back through the commit callback
+    if (!m_journal->EnqueueTransaction(transactionType, itemId, transactionEntry, NULL, opcode)) {
+        return false;
+    }
+
+    // Queued for the writer, it cannot be synced before the commit
+    // callback has reported it durable
+    if (!m_journal->IsWriterRunning()) {
+        NotifyQueued();
+    }
+    return true;
 }
 
 int SyncEngine::GetQueuedTransactionCount() const
@@ -46,6 +129,15 @@ bool SyncEngine::ClearQueue()
 }
 
 bool SyncEngine::Sync()
+{
+    // The worker and a caller on the UI thread may both get here
+    EnterCriticalSection(&m_syncLock);
+    bool result = RunSync();
+    LeaveCriticalSection(&m_syncLock);
+    return result;
+}
+
+bool SyncEngine::RunSync()
 {
     m_syncStatus = SYNC_IN_PROGRESS;
 
@@ -55,8 +147,13 @@ bool SyncEngine::Sync()
         m_lastSyncError = NULL;
     }
 
-    // Check if we're online
-    if (!CheckConnectivity()) {
+    m_lastSyncStats.transactions = 0;
+    m_lastSyncStats.operations = 0;
+    m_lastSyncStats.requests = 0;
+    m_lastSyncStats.failed = 0;
+
+    // Check if we're online; while the circuit is open this fails at once
+    if (!m_connectivity.Check()) {
         m_syncStatus = SYNC_FAILED;
 
         m_lastSyncError = new TCHAR[64];
@@ -65,47 +162,150 @@ bool SyncEngine::Sync()
         return false;
     }
 
-    // Get pending transactions from journal
-    TCHAR** transactions = NULL;
-    int count = 0;
+    // Walk the pending transactions a window at a time, collapsed per item
+    // to their net effect; memory stays the same however large the
+    // backlog is. Edits and moves and the bulk work are walked apart,
+    // so a large backlog of scans cannot hold up a change
+    Journal::PendingCursor writes(m_journal, kWriteTypes, false);
+    Journal::PendingCursor bulk(m_journal, kWriteTypes, true);
+    const TCHAR* write = NULL;
+    const TCHAR* read = NULL;
+    int successCount = 0;
+    int failCount = 0;
+    bool stopping = false;
+    bool sessionOpen = false;
 
-    if (!m_journal->GetPendingTransactions(&transactions, &count)) {
-        m_syncStatus = SYNC_FAILED;
+    // A change that got no answer may have been applied; until it gets
+    // one it is sent again exactly as it was, under the same key
+    m_coalescer.Reset();
+    ULONGLONG sealedFirst[ReplayCache::CAPACITY];
+    ULONGLONG sealedLast[ReplayCache::CAPACITY];
+    int sealedCount = m_replayCache.GetInDoubt(sealedFirst, sealedLast, ReplayCache::CAPACITY);
+    for (int i = 0; i < sealedCount && i < ReplayCache::CAPACITY; i++) {
+        m_coalescer.Seal(sealedFirst[i], sealedLast[i]);
+    }
+    for (;;) {
+        // Work queued since the last window joins the next one
+        if (!write) {
+            write = writes.Next();
+        }
+        if (!read) {
+            read = bulk.Next();
+        }
+        if ((!write && !read) || stopping) {
+            break;
+        }
 
-        m_lastSyncError = new TCHAR[64];
-        lstrcpy(m_lastSyncError, TEXT("Failed to retrieve pending transactions"));
+        // Both walks are merged in journal order, so the coalescer sees
+        // each item's transactions in order, but while changes are
+        // waiting bulk work only gets its share of the window
+        m_coalescer.ClearWindow();
+        int bulkCount = 0;
+        for (;;) {
+            bool takeBulk = read && (!write ||
+                            (bulkCount < TransactionCoalescer::WINDOW_SIZE / BULK_WINDOW_SHARE &&
+                             bulk.GetId() < writes.GetId()));
+            Journal::PendingCursor& cursor = takeBulk ? bulk : writes;
+            const TCHAR* transaction = takeBulk ? read : write;
+            if (!transaction || !m_coalescer.Add(cursor.GetId(), cursor.GetTimestamp(), cursor.GetOpcode(), transaction)) {
+                break;
+            }
 
-        return false;
-    }
+            if (takeBulk) {
+                read = bulk.Next();
+                bulkCount++;
+            } else {
+                write = writes.Next();
+            }
+        }
 
-    // If no transactions, we're done
-    if (count == 0) {
-        m_syncStatus = SYNC_SUCCESS;
-        m_lastSyncTime = GetTickCount();
-        return true;
-    }
+        // An item's operations share a lane, so they go out in order;
+        // operations without an item do not depend on each other. Within
+        // a lane changes go first; scans only read, so they may follow
+        for (int l = 0; l < m_laneCount; l++) {
+            SyncLane& lane = m_lanes[l];
+            lane.count = 0;
+            lane.successCount = 0;
+            lane.failCount = 0;
+            lane.operations = 0;
+            lane.requests = 0;
+            lane.batch.Clear();
+        }
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < m_coalescer.GetOperationCount(); i++) {
+                const TransactionCoalescer::Operation& operation = m_coalescer.GetOperation(i);
+                if ((GetPriority(operation.handler) == SYNC_PRIORITY_BULK) != (pass == 1)) {
+                    continue;
+                }
 
-    // Process each transaction
-    int successCount = 0;
-    int failCount = 0;
+                SyncLane& lane = m_lanes[(operation.payload.barcode ? operation.itemKey : (DWORD)i) % m_laneCount];
+                lane.positions[lane.count++] = i;
+            }
+        }
 
-    for (int i = 0; i < count; i++) {
-        if (transactions[i]) {
-            if (ProcessQueuedTransaction(transactions[i])) {
-                successCount++;
-                // Mark as synced in journal
-                m_journal->MarkTransactionSynced(transactions[i]);
-            } else {
-                failCount++;
+        // Only once there is work, so idle syncs write nothing
+        if (!sessionOpen) {
+            Journal::SyncSession session;
+            bool resumed = false;
+            ULONGLONG sessionId = 0;
+            if (m_journal->BeginSyncSession(&session, &resumed)) {
+                sessionId = session.id;
+            }
+            if (resumed) {
+                TCHAR message[128];
+                wsprintf(message, TEXT("Resuming sync session; %lu transactions acknowledged in it already"),
+                         session.acknowledged);
+                m_journal->LogInfo(message);
+            }
+            for (int l = 0; l < m_laneCount; l++) {
+                m_lanes[l].batch.SetSessionId(sessionId);
             }
+            sessionOpen = true;
+            StartLaneThreads();
+        }
+
+        m_progress = successCount + failCount;
+        RunLanes();
 
-            // Free the transaction string
-            delete[] transactions[i];
+        for (int l = 0; l < m_laneCount; l++) {
+            successCount += m_lanes[l].successCount;
+            failCount += m_lanes[l].failCount;
+            m_lastSyncStats.operations += m_lanes[l].operations;
+            m_lastSyncStats.requests += m_lanes[l].requests;
         }
+
+        // On shutdown the rest simply stays pending
+        stopping = IsStopping();
+        ReportSync(SYNC_EVENT_PROGRESS, (DWORD)(successCount + failCount));
+    }
+    StopLaneThreads();
+    m_coalescer.ClearWindow();
+
+    // A session that got through the backlog is done; one that was cut
+    // off or left work behind is resumed by the next sync
+    if (sessionOpen && !stopping && failCount == 0) {
+        m_journal->EndSyncSession();
     }
 
-    // Free the array
-    delete[] transactions;
+    int count = successCount + failCount;
+    m_lastSyncStats.transactions = (DWORD)count;
+    m_lastSyncStats.failed = (DWORD)failCount;
+
+    // Whether requests got through says more than the name lookup did
+    if (m_lastSyncStats.requests > 0) {
+        if (successCount > 0) {
+            m_connectivity.ReportSuccess();
+        } else {
+            m_connectivity.ReportFailure();
+        }
+    }
+
+    // If no transactions, we're done
+    if (count == 0) {
+        m_syncStatus = SYNC_SUCCESS;
+        m_lastSyncTime = GetTickCount();
+        return true;
+    }
 
     // Update status
     if (failCount == 0) {
@@ -140,7 +340,7 @@ bool SyncEngine::SyncItem(const TCHAR* transactionId)
     }
 
     // Check connectivity
-    if (!CheckConnectivity()) {
+    if (!m_connectivity.Check()) {
         return false;
     }
 
@@ -154,9 +354,9 @@ bool SyncEngine::SyncItem(const TCHAR* transactionId)
     return false;
 }
 
-bool SyncEngine::IsOnline() const
+bool SyncEngine::IsOnline()
 {
-    return CheckConnectivity();
+    return m_connectivity.IsOnline();
 }
 
 SyncEngine::SyncStatus SyncEngine::GetSyncStatus() const
@@ -174,9 +374,186 @@ DWORD SyncEngine::GetLastSyncTime() const
     return m_lastSyncTime;
 }
 
+SyncEngine::SyncStats SyncEngine::GetLastSyncStats() const
+{
+    return m_lastSyncStats;
+}
+
+void SyncEngine::GetPriorityStats(SyncPriority priority, PriorityStats* stats)
+{
+    if (!stats || priority < 0 || priority >= SYNC_PRIORITY_COUNT) {
+        return;
+    }
+
+    // Counted in the journal's index, without reading the transactions
+    const TCHAR* const* types = (priority == SYNC_PRIORITY_INTERACTIVE) ? kInteractiveTypes :
+                                (priority == SYNC_PRIORITY_MOVE) ? kMoveTypes : kWriteTypes;
+    Journal::PendingCursor cursor(m_journal, types, priority == SYNC_PRIORITY_BULK);
+    stats->pending = (DWORD)cursor.GetRemaining();
+
+    EnterCriticalSection(&m_statsLock);
+    const DWORD* counts = m_waitCounts[priority];
+    DWORD total = 0;
+    for (int b = 0; b < WAIT_BUCKET_COUNT; b++) {
+        total += counts[b];
+    }
+
+    stats->synced = total;
+    stats->waitMaxMs = m_waitMaxMs[priority];
+
+    DWORD* percentiles[3] = { &stats->waitP50Ms, &stats->waitP90Ms, &stats->waitP99Ms };
+    const DWORD shares[3] = { 50, 90, 99 };
+    for (int p = 0; p < 3; p++) {
+        // Smallest bucket holding the share; never past the longest wait
+        DWORD needed = (DWORD)(((ULONGLONG)total * shares[p] + 99) / 100);
+        DWORD seen = 0;
+        int b = 0;
+        while (b < WAIT_BUCKET_COUNT - 1 && seen + counts[b] < needed) {
+            seen += counts[b];
+            b++;
+        }
+        DWORD bound = (total > 0) ? kWaitBucketMs[b] : 0;
+        *percentiles[p] = (bound < m_waitMaxMs[priority]) ? bound : m_waitMaxMs[priority];
+    }
+    LeaveCriticalSection(&m_statsLock);
+}
+
+SyncEngine::SyncPriority SyncEngine::GetPriority(const TCHAR* transactionType)
+{
+    return GetPriority(TransactionHandlers::FindByType(transactionType));
+}
+
+SyncEngine::SyncPriority SyncEngine::GetPriority(const TransactionHandler* handler)
+{
+    // Reads and anything unknown are bulk work
+    if (!handler || !(handler->flags & TransactionHandler::HANDLER_WRITE)) {
+        return SYNC_PRIORITY_BULK;
+    }
+    return (handler->flags & TransactionHandler::HANDLER_EDIT) ? SYNC_PRIORITY_INTERACTIVE : SYNC_PRIORITY_MOVE;
+}
+
+bool SyncEngine::StartAutoSync(DWORD intervalSeconds, SyncCallback callback, void* userData)
+{
+    EnterCriticalSection(&m_scheduleLock);
+    m_autoSyncIntervalMs = intervalSeconds * 1000;
+    UpdateSchedule();
+    LeaveCriticalSection(&m_scheduleLock);
+
+    if (m_workerThread) {
+        SetEvent(m_workerWakeEvent);
+        return true;
+    }
+
+    m_syncCallback = callback;
+    m_syncUserData = userData;
+    m_workerWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_workerStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    // Work left from before starts out as if just queued
+    EnterCriticalSection(&m_scheduleLock);
+    m_scheduler.OnQueued(GetTickCount(), (DWORD)GetQueuedTransactionCount());
+    LeaveCriticalSection(&m_scheduleLock);
+
+    m_workerThread = CreateThread(NULL, 0, WorkerThread, this, 0, NULL);
+    if (!m_workerThread) {
+        CloseHandle(m_workerWakeEvent);
+        CloseHandle(m_workerStopEvent);
+        m_workerWakeEvent = NULL;
+        m_workerStopEvent = NULL;
+        return false;
+    }
+
+    // Scanning and the UI come first
+    SetThreadPriority(m_workerThread, THREAD_PRIORITY_BELOW_NORMAL);
+
+    // Without its thread the monitor probes on the caller's, as before
+    m_connectivity.Start(ConnectivityChanged, this);
+    return true;
+}
+
+void SyncEngine::StopAutoSync()
+{
+    if (!m_workerThread) {
+        return;
+    }
+
+    // First, so no probe wakes a worker that is going away
+    m_connectivity.Stop();
+
+    // A sync in progress stops after the request it is waiting on
+    SetEvent(m_workerStopEvent);
+    WaitForSingleObject(m_workerThread, INFINITE);
+    CloseHandle(m_workerThread);
+    CloseHandle(m_workerWakeEvent);
+    CloseHandle(m_workerStopEvent);
+
+    m_workerThread = NULL;
+    m_workerWakeEvent = NULL;
+    m_workerStopEvent = NULL;
+}
+
+bool SyncEngine::IsAutoSyncRunning() const
+{
+    return m_workerThread != NULL;
+}
+
+void SyncEngine::RequestSync()
+{
+    if (!m_workerThread) {
+        return;
+    }
+
+    // Asked for, so worth a probe even while backing off
+    m_connectivity.Refresh();
+
+    EnterCriticalSection(&m_scheduleLock);
+    m_scheduler.OnSyncRequested(GetTickCount());
+    LeaveCriticalSection(&m_scheduleLock);
+    SetEvent(m_workerWakeEvent);
+}
+
+void SyncEngine::NotifyQueued()
+{
+    if (!m_workerThread) {
+        return;
+    }
+
+    bool urgent = InterlockedExchange(&m_interactiveQueued, 0) != 0;
+
+    EnterCriticalSection(&m_scheduleLock);
+    m_scheduler.OnQueued(GetTickCount(), (DWORD)GetQueuedTransactionCount(), urgent);
+    LeaveCriticalSection(&m_scheduleLock);
+    SetEvent(m_workerWakeEvent);
+}
+
+void SyncEngine::NotifyNetworkAvailable()
+{
+    m_connectivity.ReportSuccess();
+    ScheduleForNetwork();
+}
+
+void SyncEngine::ScheduleForNetwork()
+{
+    if (!m_workerThread) {
+        return;
+    }
+
+    EnterCriticalSection(&m_scheduleLock);
+    m_scheduler.OnNetworkAvailable(GetTickCount());
+    LeaveCriticalSection(&m_scheduleLock);
+    SetEvent(m_workerWakeEvent);
+}
+
 void SyncEngine::SetAutoSyncEnabled(bool enabled)
 {
+    EnterCriticalSection(&m_scheduleLock);
     m_autoSyncEnabled = enabled;
+    UpdateSchedule();
+    LeaveCriticalSection(&m_scheduleLock);
+
+    if (m_workerThread) {
+        SetEvent(m_workerWakeEvent);
+    }
 }
 
 bool SyncEngine::IsAutoSyncEnabled() const
@@ -184,107 +561,664 @@ bool SyncEngine::IsAutoSyncEnabled() const
     return m_autoSyncEnabled;
 }
 
-bool SyncEngine::CheckConnectivity() const
+void SyncEngine::SetBatchLimits(int maxOperations, DWORD maxBytes)
 {
-    if (!m_hbClient) {
+    EnterCriticalSection(&m_syncLock);
+    m_batchingEnabled = (maxOperations > 0);
+    if (m_batchingEnabled) {
+        m_batchMaxOperations = maxOperations;
+        m_batchMaxBytes = maxBytes;
+        for (int l = 0; l < m_laneCount; l++) {
+            m_lanes[l].batch.SetLimits(maxOperations, maxBytes);
+        }
+    }
+    LeaveCriticalSection(&m_syncLock);
+
+    // A full batch of queued work is worth sending without settling
+    EnterCriticalSection(&m_scheduleLock);
+    m_scheduler.SetBatchSize(m_batchingEnabled ? (DWORD)maxOperations : (DWORD)SyncBatch::DEFAULT_MAX_OPERATIONS);
+    LeaveCriticalSection(&m_scheduleLock);
+}
+
+void SyncEngine::SetPipelineDepth(int depth)
+{
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > MAX_PIPELINE_DEPTH) {
+        depth = MAX_PIPELINE_DEPTH;
+    }
+
+    EnterCriticalSection(&m_syncLock);
+    if (depth != m_laneCount) {
+        DeleteLanes();
+        CreateLanes(depth);
+    }
+    LeaveCriticalSection(&m_syncLock);
+
+    // One more for lookups, so a scan does not wait for a lane
+    if (m_hbClient) {
+        m_hbClient->SetMaxConnections(depth + 1);
+    }
+}
+
+bool SyncEngine::ProcessQueuedTransaction(const TCHAR* transaction)
+{
+    TCHAR transactionType[TransactionCoalescer::TYPE_CHARS];
+    const TCHAR* data;
+    if (!m_hbClient || !TransactionCoalescer::ParseTransaction(transaction, transactionType,
+                                                               TransactionCoalescer::TYPE_CHARS, &data)) {
+        return false;
+    }
+
+    // Unknown or unsupported transaction type
+    const TransactionHandler* handler = TransactionHandlers::FindByType(transactionType);
+    if (!handler) {
         return false;
     }
 
-    // Try a simple HTTP connection to test connectivity
-    // We'll try to resolve the hostname from the base URL
-    const TCHAR* baseUrl = m_hbClient->GetBaseUrl();
-    if (!baseUrl || lstrlen(baseUrl) == 0) {
+    TransactionPayload payload;
+    TransactionHandlers::ClearPayload(&payload);
+    bool success = handler->parse(data, &payload) && handler->send(m_hbClient, payload, NULL, NULL);
+    TransactionHandlers::FreePayload(&payload);
+    return success;
+}
+
+void SyncEngine::RunLanes()
+{
+    // The first lane runs here; one that has no thread runs here too
+    for (int l = 1; l < m_laneCount; l++) {
+        if (m_lanes[l].thread && m_lanes[l].count > 0) {
+            SetEvent(m_lanes[l].startEvent);
+        }
+    }
+
+    RunLane(&m_lanes[0]);
+
+    for (int l = 1; l < m_laneCount; l++) {
+        if (m_lanes[l].count == 0) {
+            continue;
+        }
+        if (m_lanes[l].thread) {
+            WaitForSingleObject(m_lanes[l].doneEvent, INFINITE);
+        } else {
+            RunLane(&m_lanes[l]);
+        }
+    }
+}
+
+void SyncEngine::RunLane(SyncLane* lane)
+{
+    bool stopping = false;
+    for (int n = 0; n < lane->count; n++) {
+        if (IsStopping()) {
+            stopping = true;
+            break;
+        }
+
+        int i = lane->positions[n];
+        const TransactionCoalescer::Operation& operation = m_coalescer.GetOperation(i);
+
+        // Once an item's operation fails, the rest for that item wait
+        // so they are not applied out of order
+        if (IsItemBlocked(i)) {
+            lane->failCount += operation.count;
+            continue;
+        }
+
+        // The server applied it before; only the acknowledgement is missing
+        if (IsApplied(i)) {
+            lane->successCount += operation.count;
+            AcknowledgeOperations(lane, &i, 1);
+            AddProgress(operation.count);
+            continue;
+        }
+
+        // Batched operations go out when the batch is full or already
+        // holds the item
+        if (m_batchingEnabled && SyncBatch::CanBatch(operation)) {
+            ULONGLONG transactionId = m_coalescer.GetMemberId(operation.firstMember);
+            if (!lane->batch.Add(i, operation, transactionId)) {
+                SendBatch(lane);
+
+                // The batch may have failed an earlier change to the item
+                if (IsItemBlocked(i)) {
+                    lane->failCount += operation.count;
+                    continue;
+                }
+                lane->batch.Add(i, operation, transactionId);
+            }
+            continue;
+        }
+
+        // One sent on its own goes after the batch holding an earlier
+        // change to the item, and not at all if that change failed
+        if (lane->batch.HoldsItem(operation)) {
+            SendBatch(lane);
+            if (IsItemBlocked(i)) {
+                lane->failCount += operation.count;
+                continue;
+            }
+        }
+
+        lane->operations++;
+        if (SendOperation(lane, i)) {
+            lane->successCount += operation.count;
+            AcknowledgeOperations(lane, &i, 1);
+        } else {
+            lane->failCount += operation.count;
+            BlockItem(i);
+        }
+        AddProgress(operation.count);
+    }
+
+    if (lane->batch.GetCount() > 0 && !stopping) {
+        SendBatch(lane);
+    }
+    lane->batch.Clear();
+}
+
+bool SyncEngine::SendOperation(SyncLane* lane, int position)
+{
+    TransactionCoalescer::Operation& operation = m_coalescer.GetOperation(position);
+    ULONGLONG transactionId = m_coalescer.GetMemberId(operation.firstMember);
+    TCHAR key[ReplayCache::KEY_CHARS + 16];
+    ReplayCache::FormatKey(m_journal->GetEpoch(), transactionId, m_coalescer.GetMemberId(operation.lastMember), key);
+
+    // Until the operator resolves a conflict, sending it again would only
+    // be refused again. Choosing the server's copy drops the edit as if sent
+    ConflictResolution resolution = RESOLVE_PENDING;
+    bool conflicted = FindConflict(transactionId, &resolution);
+    if (conflicted && resolution == RESOLVE_PENDING) {
+        RecordOutcome(position, false, false);
         return false;
     }
+    if (resolution == RESOLVE_KEEP_SERVER) {
+        RemoveConflict(transactionId);
+        RecordOutcome(position, true, false);
+        return true;
+    }
+
+    int status = -1;
+    bool success = SendWithRetry(lane, operation, key, &status);
+
+    // The item changed on the server since the edit was made: merge the
+    // edit onto its current copy and send that, unless both changed the
+    // same field
+    if (!success && status == HTTP_PRECONDITION_FAILED && operation.handler->rebase && !IsStopping()) {
+        DWORD conflicts = 0;
+        lane->requests++;
+        bool keepLocal = (resolution == RESOLVE_KEEP_LOCAL);
+        if (operation.handler->rebase(m_hbClient, &operation.payload, keepLocal, &conflicts)) {
+            if (conflicts && !keepLocal) {
+                AddConflict(transactionId, operation.payload.barcode, conflicts);
+            } else {
+                // A different change from the one the key was first sent
+                // with, so it gets a key of its own
+                const TCHAR* json = operation.payload.itemJson;
+                unsigned int crc = JournalFormat::Crc32((const unsigned char*)json, lstrlen(json) * sizeof(TCHAR), 0);
+                wsprintf(key + lstrlen(key), TEXT("-%08X"), crc);
+                success = SendWithRetry(lane, operation, key, &status);
+            }
+        }
+    }
+
+    if (success) {
+        RemoveConflict(transactionId);
+    }
+    RecordOutcome(position, success, !success && IsRetryable(status));
+    return success;
+}
+
+bool SyncEngine::SendWithRetry(SyncLane* lane, const TransactionCoalescer::Operation& operation, const TCHAR* key, int* status)
+{
+    // Under its key a repeat cannot apply the change twice, so one that
+    // got no answer goes out again at once. status stays -1 if nothing
+    // was sent
+    *status = -1;
+    bool success = false;
+    for (int attempt = 0; attempt < MAX_SEND_ATTEMPTS && !success; attempt++) {
+        if (attempt > 0 && (!IsRetryable(*status) || IsStopping())) {
+            break;
+        }
+        *status = -1;
+        lane->requests++;
+        success = operation.handler && m_hbClient &&
+                  operation.handler->send(m_hbClient, operation.payload, key, status);
+    }
+    return success;
+}
+
+int SyncEngine::GetConflicts(SyncConflict* conflicts, int max)
+{
+    int count = 0;
+    EnterCriticalSection(&m_conflictLock);
+    for (int i = 0; i < m_conflictCount && count < max; i++) {
+        if (m_conflicts[i].resolution == RESOLVE_PENDING) {
+            conflicts[count++] = m_conflicts[i].conflict;
+        }
+    }
+    LeaveCriticalSection(&m_conflictLock);
+    return count;
+}
 
-    // Extract host from URL
-    TCHAR host[256];
-    const TCHAR* start = baseUrl;
+bool SyncEngine::ResolveConflict(ULONGLONG transactionId, ConflictResolution resolution)
+{
+    bool found = false;
+    EnterCriticalSection(&m_conflictLock);
+    for (int i = 0; i < m_conflictCount; i++) {
+        if (m_conflicts[i].conflict.transactionId == transactionId) {
+            m_conflicts[i].resolution = resolution;
+            found = true;
+            break;
+        }
+    }
+    LeaveCriticalSection(&m_conflictLock);
 
-    // Skip protocol
-    if (wcsncmp(baseUrl, TEXT("http://"), 7) == 0) {
-        start = baseUrl + 7;
-    } else if (wcsncmp(baseUrl, TEXT("https://"), 8) == 0) {
-        start = baseUrl + 8;
+    if (found && resolution != RESOLVE_PENDING) {
+        RequestSync();
     }
+    return found;
+}
+
+bool SyncEngine::FindConflict(ULONGLONG transactionId, ConflictResolution* resolution)
+{
+    bool found = false;
+    EnterCriticalSection(&m_conflictLock);
+    for (int i = 0; i < m_conflictCount; i++) {
+        if (m_conflicts[i].conflict.transactionId == transactionId) {
+            *resolution = m_conflicts[i].resolution;
+            found = true;
+            break;
+        }
+    }
+    LeaveCriticalSection(&m_conflictLock);
+    return found;
+}
 
-    // Copy host (up to first slash or colon)
+void SyncEngine::AddConflict(ULONGLONG transactionId, const TCHAR* barcode, DWORD fields)
+{
+    EnterCriticalSection(&m_conflictLock);
     int i = 0;
-    while (start[i] && start[i] != '/' && start[i] != ':' && i < 255) {
-        host[i] = start[i];
+    while (i < m_conflictCount && m_conflicts[i].conflict.transactionId != transactionId) {
         i++;
     }
-    host[i] = '\0';
 
-    // Try to resolve the host
-    char asciiHost[256];
-    for (int j = 0; j < 255 && host[j] != '\0'; j++) {
-        asciiHost[j] = (char)host[j];
+    // When full, the oldest makes way; it is found again when next sent
+    if (i == m_conflictCount) {
+        if (m_conflictCount == MAX_CONFLICTS) {
+            for (int j = 1; j < m_conflictCount; j++) {
+                m_conflicts[j - 1] = m_conflicts[j];
+            }
+            m_conflictCount--;
+        }
+        i = m_conflictCount++;
     }
-    asciiHost[255] = '\0';
 
-    // Initialize WinSock if needed
-    WSADATA wsaData;
-    WSAStartup(MAKEWORD(2, 2), &wsaData);
+    ConflictEntry& entry = m_conflicts[i];
+    entry.conflict.transactionId = transactionId;
+    lstrcpyn(entry.conflict.barcode, barcode ? barcode : TEXT(""), sizeof(entry.conflict.barcode) / sizeof(TCHAR));
+    entry.conflict.fields = fields;
+    entry.resolution = RESOLVE_PENDING;
+    LeaveCriticalSection(&m_conflictLock);
+}
 
-    struct hostent* hostInfo = gethostbyname(asciiHost);
+void SyncEngine::RemoveConflict(ULONGLONG transactionId)
+{
+    EnterCriticalSection(&m_conflictLock);
+    for (int i = 0; i < m_conflictCount; i++) {
+        if (m_conflicts[i].conflict.transactionId == transactionId) {
+            for (int j = i + 1; j < m_conflictCount; j++) {
+                m_conflicts[j - 1] = m_conflicts[j];
+            }
+            m_conflictCount--;
+            break;
+        }
+    }
+    LeaveCriticalSection(&m_conflictLock);
+}
 
-    WSACleanup();
+void SyncEngine::SendBatch(SyncLane* lane)
+{
+    // The server skips transactions it has applied, so a batch that got
+    // no answer goes out again as it is
+    SyncBatch& batch = lane->batch;
+    int status = -1;
+    bool sent = false;
+    for (int attempt = 0; attempt < MAX_SEND_ATTEMPTS && !sent; attempt++) {
+        if (attempt > 0 && (!IsRetryable(status) || IsStopping())) {
+            break;
+        }
+        status = -1;
+        lane->requests++;
+        sent = m_hbClient && m_hbClient->SyncPendingTransactions(&batch, &status);
+    }
+
+    // Without a response nothing is known to be applied, so the whole
+    // batch stays pending
+    bool inDoubt = !sent && IsRetryable(status);
+    int applied[SyncBatch::MAX_OPERATIONS];
+    int appliedCount = 0;
+    int handled = 0;
+    for (int i = 0; i < batch.GetCount(); i++) {
+        int tag = batch.GetTag(i);
+        const TransactionCoalescer::Operation& operation = m_coalescer.GetOperation(tag);
+
+        lane->operations++;
+        handled += operation.count;
+        bool succeeded = sent && batch.Succeeded(i);
+        RecordOutcome(tag, succeeded, inDoubt);
+        if (succeeded) {
+            lane->successCount += operation.count;
+            applied[appliedCount++] = tag;
+        } else {
+            lane->failCount += operation.count;
+            BlockItem(tag);
+        }
+    }
 
-    return (hostInfo != NULL);
+    AcknowledgeOperations(lane, applied, appliedCount);
+    batch.Clear();
+    AddProgress(handled);
 }
 
-bool SyncEngine::ProcessQueuedTransaction(const TCHAR* transaction)
+bool SyncEngine::IsApplied(int position) const
 {
-    if (!transaction || !m_hbClient) {
-        return false;
+    const TransactionCoalescer::Operation& operation = m_coalescer.GetOperation(position);
+    return m_replayCache.Lookup(m_coalescer.GetMemberId(operation.firstMember),
+                                m_coalescer.GetMemberId(operation.lastMember)) == ReplayCache::OUTCOME_APPLIED;
+}
+
+void SyncEngine::RecordOutcome(int position, bool applied, bool inDoubt)
+{
+    const TransactionCoalescer::Operation& operation = m_coalescer.GetOperation(position);
+    ReplayCache::Outcome outcome = ReplayCache::OUTCOME_NONE;
+    if (applied) {
+        outcome = ReplayCache::OUTCOME_APPLIED;
+    } else if (inDoubt) {
+        outcome = ReplayCache::OUTCOME_IN_DOUBT;
     }
+    m_replayCache.Record(m_coalescer.GetMemberId(operation.firstMember),
+                         m_coalescer.GetMemberId(operation.lastMember), outcome);
+}
 
-    // Parse transaction format: "[timestamp] TYPE: DATA"
-    // Example: "[12345] ITEM_SCAN: SCAN:123456789"
+bool SyncEngine::IsRetryable(int status)
+{
+    // No response, throttled, or the server failed; other answers stand
+    return status == 0 || status == 429 || status >= 500;
+}
 
-    // Find the type separator
-    const TCHAR* typeStart = wcschr(transaction, ']');
-    if (!typeStart) {
-        return false;
+bool SyncEngine::IsItemBlocked(int position)
+{
+    EnterCriticalSection(&m_blockLock);
+    bool blocked = m_coalescer.IsBlocked(position);
+    LeaveCriticalSection(&m_blockLock);
+    return blocked;
+}
+
+void SyncEngine::BlockItem(int position)
+{
+    EnterCriticalSection(&m_blockLock);
+    m_coalescer.Block(position);
+    LeaveCriticalSection(&m_blockLock);
+}
+
+void SyncEngine::AddProgress(int transactions)
+{
+    LONG progress = InterlockedExchangeAdd(&m_progress, transactions) + transactions;
+    ReportSync(SYNC_EVENT_PROGRESS, (DWORD)progress);
+}
+
+void SyncEngine::AcknowledgeOperations(SyncLane* lane, const int* positions, int count)
+{
+    // As soon as the server has applied them, and on flash before the
+    // lane sends again, so a sync cut off after this does not resend
+    // them. An item's operations share the lane, so its acknowledgements
+    // still follow its journal order
+    ULONGLONG now = Journal::GetWallClockMs();
+    int idCount = 0;
+    for (int n = 0; n < count; n++) {
+        const TransactionCoalescer::Operation& operation = m_coalescer.GetOperation(positions[n]);
+        SyncPriority priority = GetPriority(operation.handler);
+        for (int member = operation.firstMember; member != -1; member = m_coalescer.GetNextMember(member)) {
+            lane->acks[idCount++] = m_coalescer.GetMemberId(member);
+            RecordWait(priority, m_coalescer.GetMemberTimestamp(member), now);
+        }
     }
-    typeStart += 2; // Skip "] "
 
-    const TCHAR* dataStart = wcschr(typeStart, ':');
-    if (!dataStart) {
-        return false;
+    if (idCount > 0) {
+        m_journal->AcknowledgeSynced(lane->acks, idCount);
     }
-    dataStart += 2; // Skip ": "
-
-    // Extract transaction type
-    int typeLen = (int)(dataStart - typeStart - 2);
-    TCHAR transactionType[64];
-    if (typeLen >= 64) typeLen = 63;
-    wcsncpy(transactionType, typeStart, typeLen);
-    transactionType[typeLen] = '\0';
-
-    // Process based on transaction type
-    if (wcscmp(transactionType, TEXT("ITEM_SCAN")) == 0) {
-        // Parse SCAN:barcode format
-        if (wcsncmp(dataStart, TEXT("SCAN:"), 5) == 0) {
-            const TCHAR* barcode = dataStart + 5;
-
-            // Try to sync this scan with the server
-            // For now, we'll just attempt to get the item to verify connectivity
-            Models::Item item;
-            if (m_hbClient->GetItem(barcode, &item)) {
-                // Successfully contacted server and retrieved item
-                return true;
+}
+
+void SyncEngine::RecordWait(SyncPriority priority, ULONGLONG queuedTime, ULONGLONG now)
+{
+    // A wall clock stepped back counts as no wait
+    ULONGLONG wait = (now > queuedTime) ? now - queuedTime : 0;
+    DWORD waitMs = (wait < 0xFFFFFFFF) ? (DWORD)wait : 0xFFFFFFFF;
+
+    int b = 0;
+    while (b < WAIT_BUCKET_COUNT - 1 && waitMs > kWaitBucketMs[b]) {
+        b++;
+    }
+
+    EnterCriticalSection(&m_statsLock);
+    m_waitCounts[priority][b]++;
+    if (waitMs > m_waitMaxMs[priority]) {
+        m_waitMaxMs[priority] = waitMs;
+    }
+    LeaveCriticalSection(&m_statsLock);
+}
+
+void SyncEngine::CreateLanes(int count)
+{
+    m_lanes = new SyncLane[count];
+    m_laneCount = count;
+
+    for (int l = 0; l < count; l++) {
+        SyncLane& lane = m_lanes[l];
+        lane.engine = this;
+        lane.positions = new int[TransactionCoalescer::WINDOW_SIZE];
+        lane.acks = new ULONGLONG[TransactionCoalescer::WINDOW_SIZE];
+        lane.count = 0;
+        lane.successCount = 0;
+        lane.failCount = 0;
+        lane.operations = 0;
+        lane.requests = 0;
+        lane.batch.SetLimits(m_batchMaxOperations, m_batchMaxBytes);
+        lane.thread = NULL;
+        lane.startEvent = NULL;
+        lane.doneEvent = NULL;
+        lane.exiting = false;
+    }
+}
+
+void SyncEngine::DeleteLanes()
+{
+    StopLaneThreads();
+    for (int l = 0; l < m_laneCount; l++) {
+        delete[] m_lanes[l].positions;
+        delete[] m_lanes[l].acks;
+    }
+    delete[] m_lanes;
+
+    m_lanes = NULL;
+    m_laneCount = 0;
+}
+
+void SyncEngine::StartLaneThreads()
+{
+    // Started once a sync has work and kept for all of its windows, at
+    // the priority of the thread that syncs
+    for (int l = 1; l < m_laneCount; l++) {
+        SyncLane& lane = m_lanes[l];
+        if (lane.thread) {
+            continue;
+        }
+
+        lane.exiting = false;
+        lane.startEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        lane.doneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (lane.startEvent && lane.doneEvent) {
+            lane.thread = CreateThread(NULL, 0, LaneThread, &lane, 0, NULL);
+        }
+        if (lane.thread) {
+            SetThreadPriority(lane.thread, GetThreadPriority(GetCurrentThread()));
+        } else {
+            // Its windows run on the syncing thread instead
+            if (lane.startEvent) {
+                CloseHandle(lane.startEvent);
+                lane.startEvent = NULL;
+            }
+            if (lane.doneEvent) {
+                CloseHandle(lane.doneEvent);
+                lane.doneEvent = NULL;
             }
         }
-    } else if (wcscmp(transactionType, TEXT("ITEM_UPDATE")) == 0) {
-        // Future: Handle item updates
-        // For now, just return true to clear from queue
-        return true;
     }
+}
 
-    // Unknown or unsupported transaction type
-    return false;
+void SyncEngine::StopLaneThreads()
+{
+    for (int l = 1; l < m_laneCount; l++) {
+        SyncLane& lane = m_lanes[l];
+        if (!lane.thread) {
+            continue;
+        }
+
+        lane.exiting = true;
+        SetEvent(lane.startEvent);
+        WaitForSingleObject(lane.thread, INFINITE);
+        CloseHandle(lane.thread);
+        CloseHandle(lane.startEvent);
+        CloseHandle(lane.doneEvent);
+        lane.thread = NULL;
+        lane.startEvent = NULL;
+        lane.doneEvent = NULL;
+    }
+}
+
+DWORD WINAPI SyncEngine::LaneThread(LPVOID param)
+{
+    SyncLane* lane = (SyncLane*)param;
+    if (!lane) {
+        return 1;
+    }
+
+    // One window's share per wake until the sync is over
+    for (;;) {
+        WaitForSingleObject(lane->startEvent, INFINITE);
+        if (lane->exiting) {
+            break;
+        }
+        lane->engine->RunLane(lane);
+        SetEvent(lane->doneEvent);
+    }
+    return 0;
+}
+
+void SyncEngine::RunScheduledSync()
+{
+    EnterCriticalSection(&m_scheduleLock);
+    m_scheduler.OnSyncStarted();
+    LeaveCriticalSection(&m_scheduleLock);
+
+    ReportSync(SYNC_EVENT_STARTED, 0);
+    bool success = Sync();
+
+    // Only the worker syncs while it runs, so the results are still ours.
+    // A sync that failed without handling anything never got online
+    SyncStats stats = m_lastSyncStats;
+    bool connected = success || stats.transactions > 0;
+    DWORD backlog = (DWORD)GetQueuedTransactionCount();
+
+    EnterCriticalSection(&m_scheduleLock);
+    m_scheduler.OnSyncFinished(GetTickCount(), connected, stats.transactions, stats.failed, backlog);
+    DWORD failures = m_scheduler.GetConsecutiveFailures();
+    LeaveCriticalSection(&m_scheduleLock);
+
+    // Retries while offline would fill the log; the first failure says it
+    if (!success && failures == 1) {
+        m_journal->LogError(TEXT("SYNC_FAILED"), m_lastSyncError);
+    } else if (success && stats.transactions > 0) {
+        // How long each class has been waiting, to check the priorities
+        // hold up under a backlog. The waits are bucketed, so they only
+        // change now and then; logging every sync would crowd the
+        // diagnostic log's ring
+        PriorityStats edits, moves, scans;
+        GetPriorityStats(SYNC_PRIORITY_INTERACTIVE, &edits);
+        GetPriorityStats(SYNC_PRIORITY_MOVE, &moves);
+        GetPriorityStats(SYNC_PRIORITY_BULK, &scans);
+
+        if (edits.waitP90Ms != m_loggedWaitP90Ms[SYNC_PRIORITY_INTERACTIVE] ||
+            moves.waitP90Ms != m_loggedWaitP90Ms[SYNC_PRIORITY_MOVE] ||
+            scans.waitP90Ms != m_loggedWaitP90Ms[SYNC_PRIORITY_BULK]) {
+            m_loggedWaitP90Ms[SYNC_PRIORITY_INTERACTIVE] = edits.waitP90Ms;
+            m_loggedWaitP90Ms[SYNC_PRIORITY_MOVE] = moves.waitP90Ms;
+            m_loggedWaitP90Ms[SYNC_PRIORITY_BULK] = scans.waitP90Ms;
+
+            TCHAR message[256];
+            wsprintf(message, TEXT("%s; wait p90 edits %lus, moves %lus, scans %lus; pending %lu/%lu/%lu"),
+                     m_lastSyncError ? m_lastSyncError : TEXT("Background sync completed"),
+                     edits.waitP90Ms / 1000, moves.waitP90Ms / 1000, scans.waitP90Ms / 1000,
+                     edits.pending, moves.pending, scans.pending);
+            m_journal->LogInfo(message);
+        }
+    }
+
+    ReportSync(SYNC_EVENT_FINISHED, backlog);
+}
+
+bool SyncEngine::IsStopping() const
+{
+    return m_workerStopEvent && WaitForSingleObject(m_workerStopEvent, 0) == WAIT_OBJECT_0;
+}
+
+void SyncEngine::ReportSync(SyncEvent event, DWORD value)
+{
+    if (m_syncCallback) {
+        m_syncCallback(event, value, m_syncUserData);
+    }
+}
+
+void SyncEngine::UpdateSchedule()
+{
+    // Called with the schedule lock held
+    m_scheduler.SetInterval(m_autoSyncEnabled ? m_autoSyncIntervalMs : 0);
+}
+
+void SyncEngine::ConnectivityChanged(bool available, void* userData)
+{
+    // Pending work has waited for the circuit to let requests out
+    SyncEngine* pThis = (SyncEngine*)userData;
+    if (pThis && available) {
+        pThis->ScheduleForNetwork();
+    }
+}
+
+DWORD WINAPI SyncEngine::WorkerThread(LPVOID param)
+{
+    SyncEngine* pThis = (SyncEngine*)param;
+    if (!pThis) {
+        return 1;
+    }
+
+    HANDLE events[2] = { pThis->m_workerStopEvent, pThis->m_workerWakeEvent };
+    for (;;) {
+        EnterCriticalSection(&pThis->m_scheduleLock);
+        DWORD wait = pThis->m_scheduler.GetWaitMs(GetTickCount());
+        LeaveCriticalSection(&pThis->m_scheduleLock);
+
+        // A wake only means the schedule changed; look at it again
+        DWORD result = WaitForMultipleObjects(2, events, FALSE, wait);
+        if (result == WAIT_OBJECT_0) {
+            break;
+        }
+        if (result == WAIT_TIMEOUT) {
+            pThis->RunScheduledSync();
+        }
+    }
+
+    return 0;
 }
 
 } // namespace HBX
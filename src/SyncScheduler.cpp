@@ -0,0 +1,141 @@
+#include "../include/SyncScheduler.hpp"
+
+namespace HBX {
+
+SyncScheduler::SyncScheduler()
+    : m_intervalMs(DEFAULT_INTERVAL_MS)
+    , m_batchSize(1)
+    , m_due(false)
+    , m_dueTime(0)
+    , m_backlog(0)
+    , m_backingOff(false)
+    , m_failures(0)
+    , m_failureRate(0)
+{
+}
+
+void SyncScheduler::SetInterval(DWORD intervalMs)
+{
+    m_intervalMs = intervalMs;
+    if (intervalMs == 0) {
+        m_due = false;
+        m_backingOff = false;
+    }
+}
+
+void SyncScheduler::SetBatchSize(DWORD transactions)
+{
+    m_batchSize = (transactions > 0) ? transactions : 1;
+}
+
+void SyncScheduler::OnQueued(DWORD now, DWORD backlog, bool urgent)
+{
+    m_backlog = backlog;
+
+    // While backing off, new work would only fail the same way; it goes
+    // with the retry
+    if (m_intervalMs == 0 || m_backingOff || backlog == 0) {
+        return;
+    }
+
+    ScheduleAt(now, (urgent || backlog >= m_batchSize) ? 0 : GetSettleMs());
+}
+
+void SyncScheduler::OnSyncRequested(DWORD now)
+{
+    ScheduleAt(now, 0);
+}
+
+void SyncScheduler::OnNetworkAvailable(DWORD now)
+{
+    if (m_intervalMs == 0 || m_backlog == 0) {
+        return;
+    }
+
+    // Pending work has waited for exactly this
+    m_backingOff = false;
+    m_failures = 0;
+    ScheduleAt(now, 0);
+}
+
+void SyncScheduler::OnSyncStarted()
+{
+    // Work queued from here on needs a sync of its own
+    m_due = false;
+}
+
+void SyncScheduler::OnSyncFinished(DWORD now, bool connected, DWORD transactions, DWORD failed, DWORD backlog)
+{
+    m_backlog = backlog;
+
+    if (transactions > 0) {
+        m_failureRate = (m_failureRate * 3 + failed * 100 / transactions) / 4;
+    }
+
+    if (!connected || (transactions > 0 && failed == transactions)) {
+        m_failures++;
+        if (m_intervalMs == 0) {
+            return;
+        }
+
+        DWORD shift = (m_failures - 1 < 16) ? m_failures - 1 : 16;
+        DWORD delay = (DWORD)RETRY_MIN_MS << shift;
+        if (delay > m_intervalMs) {
+            delay = m_intervalMs;
+        }
+        if (!connected && delay > OFFLINE_PROBE_MS) {
+            delay = OFFLINE_PROBE_MS;
+        }
+
+        m_backingOff = true;
+        ScheduleAt(now, delay);
+        return;
+    }
+
+    m_failures = 0;
+    m_backingOff = false;
+
+    // What is still pending failed or arrived during the sync; the latter
+    // has been scheduled already
+    if (m_intervalMs > 0 && backlog > 0) {
+        ScheduleAt(now, m_intervalMs);
+    }
+}
+
+DWORD SyncScheduler::GetWaitMs(DWORD now) const
+{
+    if (!m_due) {
+        return INFINITE;
+    }
+
+    LONG left = (LONG)(m_dueTime - now);
+    return (left > 0) ? (DWORD)left : 0;
+}
+
+DWORD SyncScheduler::GetFailureRate() const
+{
+    return m_failureRate;
+}
+
+DWORD SyncScheduler::GetConsecutiveFailures() const
+{
+    return m_failures;
+}
+
+void SyncScheduler::ScheduleAt(DWORD now, DWORD delayMs)
+{
+    // An earlier sync covers this one too
+    if (m_due && (LONG)(m_dueTime - now) <= (LONG)delayMs) {
+        return;
+    }
+
+    m_due = true;
+    m_dueTime = now + delayMs;
+}
+
+DWORD SyncScheduler::GetSettleMs() const
+{
+    return SETTLE_MS + SETTLE_MS * (MAX_SETTLE_FACTOR - 1) * m_failureRate / 100;
+}
+
+} // namespace HBX
@@ -0,0 +1,270 @@
+#include "../include/TransactionCoalescer.hpp"
+#include "../include/JournalFormat.hpp"
+
+namespace HBX {
+
+namespace {
+
+DWORD ItemKey(const TCHAR* item)
+{
+    return JournalFormat::Crc32((const unsigned char*)item, lstrlen(item) * sizeof(TCHAR), 0);
+}
+
+} // namespace
+
+TransactionCoalescer::TransactionCoalescer()
+    : m_operations(new Operation[WINDOW_SIZE])
+    , m_operationCount(0)
+    , m_memberIds(new ULONGLONG[WINDOW_SIZE])
+    , m_memberTimes(new ULONGLONG[WINDOW_SIZE])
+    , m_memberNext(new int[WINDOW_SIZE])
+    , m_memberCount(0)
+    , m_blockedCount(0)
+    , m_blockAll(false)
+    , m_sealedCount(0)
+{
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        m_buckets[i] = -1;
+    }
+}
+
+TransactionCoalescer::~TransactionCoalescer()
+{
+    ClearWindow();
+    delete[] m_operations;
+    delete[] m_memberIds;
+    delete[] m_memberTimes;
+    delete[] m_memberNext;
+}
+
+void TransactionCoalescer::Reset()
+{
+    ClearWindow();
+    m_blockedCount = 0;
+    m_blockAll = false;
+    m_sealedCount = 0;
+}
+
+void TransactionCoalescer::ClearWindow()
+{
+    for (int i = 0; i < m_operationCount; i++) {
+        TransactionHandlers::FreePayload(&m_operations[i].payload);
+    }
+
+    m_operationCount = 0;
+    m_memberCount = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        m_buckets[i] = -1;
+    }
+}
+
+bool TransactionCoalescer::IsFull() const
+{
+    return m_memberCount >= WINDOW_SIZE;
+}
+
+bool TransactionCoalescer::Add(ULONGLONG id, ULONGLONG timestamp, unsigned int opcode, const TCHAR* transaction)
+{
+    if (!transaction || IsFull()) {
+        return false;
+    }
+
+    // Parsed here once; sending and merging work on the payload
+    const TransactionHandler* handler = NULL;
+    TransactionPayload payload;
+    TransactionHandlers::ClearPayload(&payload);
+
+    TCHAR type[TYPE_CHARS];
+    const TCHAR* data;
+    if (ParseTransaction(transaction, type, TYPE_CHARS, &data)) {
+        handler = opcode ? TransactionHandlers::Find(opcode) : TransactionHandlers::FindByType(type);
+        if (handler && !handler->parse(data, &payload)) {
+            // Kept; it fails to send as before and stays pending
+            TransactionHandlers::FreePayload(&payload);
+            handler = NULL;
+        }
+    }
+
+    const TCHAR* item = payload.barcode;
+    DWORD key = item ? ItemKey(item) : 0;
+    if (item) {
+        // Newest first in the chain, so the first match is the item's
+        // latest operation; anything older must not be merged past it
+        for (int pos = m_buckets[key & (BUCKET_COUNT - 1)]; pos != -1; pos = m_operations[pos].nextInBucket) {
+            Operation& target = m_operations[pos];
+            if (target.itemKey == key && lstrcmp(target.payload.barcode, item) == 0) {
+                if (!IsSealedBefore(target, id) && target.handler->merge(&target.payload, handler, &payload)) {
+                    TransactionHandlers::FreePayload(&payload);
+                    target.timestamp = timestamp;
+                    AddMember(target, id, timestamp);
+                    return true;
+                }
+                break;
+            }
+        }
+    }
+
+    Operation& operation = m_operations[m_operationCount];
+    operation.handler = handler;
+    operation.payload = payload;
+    operation.count = 0;
+    operation.timestamp = timestamp;
+    operation.firstMember = -1;
+    operation.lastMember = -1;
+    operation.itemKey = key;
+    operation.nextInBucket = -1;
+
+    if (item) {
+        int bucket = key & (BUCKET_COUNT - 1);
+        operation.nextInBucket = m_buckets[bucket];
+        m_buckets[bucket] = m_operationCount;
+    }
+
+    m_operationCount++;
+    AddMember(operation, id, timestamp);
+    return true;
+}
+
+int TransactionCoalescer::GetOperationCount() const
+{
+    return m_operationCount;
+}
+
+const TransactionCoalescer::Operation& TransactionCoalescer::GetOperation(int position) const
+{
+    return m_operations[position];
+}
+
+TransactionCoalescer::Operation& TransactionCoalescer::GetOperation(int position)
+{
+    return m_operations[position];
+}
+
+int TransactionCoalescer::GetTransactionCount() const
+{
+    return m_memberCount;
+}
+
+int TransactionCoalescer::GetNextMember(int member) const
+{
+    return m_memberNext[member];
+}
+
+ULONGLONG TransactionCoalescer::GetMemberId(int member) const
+{
+    return m_memberIds[member];
+}
+
+ULONGLONG TransactionCoalescer::GetMemberTimestamp(int member) const
+{
+    return m_memberTimes[member];
+}
+
+void TransactionCoalescer::Block(int position)
+{
+    // Reads such as scans do not depend on their order
+    const Operation& operation = m_operations[position];
+    if (!operation.payload.barcode || !(operation.handler->flags & TransactionHandler::HANDLER_WRITE) ||
+        IsBlocked(position)) {
+        return;
+    }
+
+    // Past the limit every item waits, which is safe if slow
+    if (m_blockedCount == BLOCKED_LIMIT) {
+        m_blockAll = true;
+        return;
+    }
+    m_blocked[m_blockedCount++] = operation.itemKey;
+}
+
+bool TransactionCoalescer::IsBlocked(int position) const
+{
+    const Operation& operation = m_operations[position];
+    if (!operation.payload.barcode) {
+        return false;
+    }
+    if (m_blockAll) {
+        return true;
+    }
+
+    // Keys may collide; that only holds back an unrelated item
+    for (int i = 0; i < m_blockedCount; i++) {
+        if (m_blocked[i] == operation.itemKey) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TransactionCoalescer::Seal(ULONGLONG firstId, ULONGLONG lastId)
+{
+    for (int i = 0; i < m_sealedCount; i++) {
+        if (m_sealedFirst[i] == firstId) {
+            m_sealedLast[i] = lastId;
+            return;
+        }
+    }
+    if (m_sealedCount < SEALED_LIMIT) {
+        m_sealedFirst[m_sealedCount] = firstId;
+        m_sealedLast[m_sealedCount] = lastId;
+        m_sealedCount++;
+    }
+}
+
+bool TransactionCoalescer::IsSealedBefore(const Operation& target, ULONGLONG id) const
+{
+    ULONGLONG firstId = m_memberIds[target.firstMember];
+    for (int i = 0; i < m_sealedCount; i++) {
+        if (m_sealedFirst[i] == firstId) {
+            return id > m_sealedLast[i];
+        }
+    }
+    return false;
+}
+
+bool TransactionCoalescer::ParseTransaction(const TCHAR* transaction, TCHAR* type, int maxType, const TCHAR** data)
+{
+    if (!transaction || !type || maxType <= 0 || !data) {
+        return false;
+    }
+
+    // Format: "[timestamp] TYPE: DATA"
+    // Example: "[12345] ITEM_SCAN: SCAN:123456789"
+    const TCHAR* typeStart = wcschr(transaction, ']');
+    if (!typeStart || typeStart[1] == '\0') {
+        return false;
+    }
+    typeStart += 2; // Skip "] "
+
+    const TCHAR* dataStart = wcschr(typeStart, ':');
+    if (!dataStart || dataStart[1] == '\0') {
+        return false;
+    }
+
+    int typeLen = (int)(dataStart - typeStart);
+    if (typeLen >= maxType) {
+        typeLen = maxType - 1;
+    }
+    lstrcpyn(type, typeStart, typeLen + 1);
+
+    *data = dataStart + 2; // Skip ": "
+    return true;
+}
+
+void TransactionCoalescer::AddMember(Operation& operation, ULONGLONG id, ULONGLONG timestamp)
+{
+    int member = m_memberCount++;
+    m_memberIds[member] = id;
+    m_memberTimes[member] = timestamp;
+    m_memberNext[member] = -1;
+
+    if (operation.lastMember == -1) {
+        operation.firstMember = member;
+    } else {
+        m_memberNext[operation.lastMember] = member;
+    }
+    operation.lastMember = member;
+    operation.count++;
+}
+
+} // namespace HBX
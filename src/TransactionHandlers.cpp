@@ -0,0 +1,238 @@
+#include "../include/TransactionHandlers.hpp"
+#include "../include/HbClient.hpp"
+
+namespace HBX {
+
+namespace {
+
+TCHAR* CopyString(const TCHAR* text, int length)
+{
+    TCHAR* copy = new TCHAR[length + 1];
+    lstrcpyn(copy, text, length + 1);
+    return copy;
+}
+
+// Moves a later payload's field into the target, dropping the target's
+void TakeString(TCHAR** target, TCHAR** source)
+{
+    delete[] *target;
+    *target = *source;
+    *source = NULL;
+}
+
+void TakeItem(TransactionPayload* target, TransactionPayload* source)
+{
+    delete target->item;
+    target->item = source->item;
+    source->item = NULL;
+    TakeString(&target->itemJson, &source->itemJson);
+}
+
+// "SCAN:<barcode>"
+bool ParseScan(const TCHAR* data, TransactionPayload* payload)
+{
+    if (wcsncmp(data, TEXT("SCAN:"), 5) != 0 || data[5] == '\0') {
+        return false;
+    }
+    payload->barcode = CopyString(data + 5, lstrlen(data + 5));
+    return true;
+}
+
+// "MOVE:<barcode>:<locationId>"
+bool ParseMove(const TCHAR* data, TransactionPayload* payload)
+{
+    const TCHAR* separator = (wcsncmp(data, TEXT("MOVE:"), 5) == 0) ? wcschr(data + 5, ':') : NULL;
+    if (!separator || separator == data + 5 || separator[1] == '\0') {
+        return false;
+    }
+    payload->barcode = CopyString(data + 5, (int)(separator - (data + 5)));
+    payload->locationId = CopyString(separator + 1, lstrlen(separator + 1));
+    return true;
+}
+
+// Item JSON, keyed by barcode
+bool ParseItem(const TCHAR* data, TransactionPayload* payload)
+{
+    Models::Item* item = new Models::Item();
+    if (!item->FromJson(data) || !item->GetBarcode()) {
+        delete item;
+        return false;
+    }
+    payload->item = item;
+    payload->barcode = CopyString(item->GetBarcode(), lstrlen(item->GetBarcode()));
+    payload->itemJson = CopyString(data, lstrlen(data));
+    return true;
+}
+
+// The same request again; the coalescer counts it
+bool MergeScan(TransactionPayload* /*target*/, const TransactionHandler* later, TransactionPayload* /*laterPayload*/)
+{
+    return later->opcode == JournalFormat::OP_ITEM_SCAN;
+}
+
+// The last location wins
+bool MergeMove(TransactionPayload* target, const TransactionHandler* later, TransactionPayload* laterPayload)
+{
+    if (later->opcode != JournalFormat::OP_ITEM_MOVE) {
+        return false;
+    }
+    TakeString(&target->locationId, &laterPayload->locationId);
+    return true;
+}
+
+// An item not yet created takes later updates and moves with it
+bool MergeCreate(TransactionPayload* target, const TransactionHandler* later, TransactionPayload* laterPayload)
+{
+    if (later->opcode == JournalFormat::OP_ITEM_UPDATE) {
+        // Created with the update's values; its version and originals
+        // mean nothing to an item the server has not seen
+        TCHAR* json = laterPayload->item->ToJson();
+        if (!json) {
+            return false;
+        }
+        TakeItem(target, laterPayload);
+        delete[] target->itemJson;
+        target->itemJson = json;
+        return true;
+    }
+
+    if (later->opcode == JournalFormat::OP_ITEM_MOVE) {
+        target->item->SetLocationId(laterPayload->locationId);
+        TCHAR* json = target->item->ToJson();
+        if (!json) {
+            return false;
+        }
+        delete[] target->itemJson;
+        target->itemJson = json;
+        return true;
+    }
+    return false;
+}
+
+// The last update wins, as an edit of the version the first was made on
+bool MergeUpdate(TransactionPayload* target, const TransactionHandler* later, TransactionPayload* laterPayload)
+{
+    if (later->opcode != JournalFormat::OP_ITEM_UPDATE) {
+        return false;
+    }
+    laterPayload->item->KeepChangesOf(*target->item);
+    TCHAR* json = laterPayload->item->ToChangeJson();
+    if (!json) {
+        return false;
+    }
+    TakeItem(target, laterPayload);
+    delete[] target->itemJson;
+    target->itemJson = json;
+    return true;
+}
+
+bool SendScan(HbClient* client, const TransactionPayload& payload, const TCHAR* /*requestKey*/, int* status)
+{
+    // Only read, so no key; getting the item confirms the server has it.
+    // The status lets an unanswered scan be retried like any other request
+    Models::Item item;
+    return client->GetItem(payload.barcode, &item, status);
+}
+
+bool SendMove(HbClient* client, const TransactionPayload& payload, const TCHAR* requestKey, int* status)
+{
+    return client->UpdateItemLocation(payload.barcode, payload.locationId, requestKey, status);
+}
+
+bool SendCreate(HbClient* client, const TransactionPayload& payload, const TCHAR* requestKey, int* status)
+{
+    return client->CreateItem(payload.item, requestKey, status);
+}
+
+bool SendUpdate(HbClient* client, const TransactionPayload& payload, const TCHAR* requestKey, int* status)
+{
+    // Without the server's ID there is nothing to address; cleared from
+    // the queue as before
+    if (!payload.item->GetId()) {
+        return true;
+    }
+    return client->UpdateItem(payload.item, requestKey, status);
+}
+
+// Merges the edit onto the server's current copy after the server refused
+// it as stale
+bool RebaseUpdate(HbClient* client, TransactionPayload* payload, bool keepLocal, DWORD* conflicts)
+{
+    Models::Item current;
+    if (!client->GetItem(payload->barcode, &current)) {
+        return false;
+    }
+
+    *conflicts = payload->item->Rebase(current, keepLocal);
+    if (*conflicts && !keepLocal) {
+        return true;
+    }
+
+    TCHAR* json = payload->item->ToChangeJson();
+    if (!json) {
+        return false;
+    }
+    delete[] payload->itemJson;
+    payload->itemJson = json;
+    return true;
+}
+
+// Indexed by opcode
+const TransactionHandler kHandlers[JournalFormat::OP_COUNT] = {
+    { JournalFormat::OP_NONE, NULL, NULL, 0, NULL, NULL, NULL, NULL },
+    { JournalFormat::OP_ITEM_SCAN, TEXT("ITEM_SCAN"), TEXT("SCAN"),
+      TransactionHandler::HANDLER_BATCH,
+      ParseScan, MergeScan, SendScan, NULL },
+    { JournalFormat::OP_ITEM_MOVE, TEXT("ITEM_MOVE"), TEXT("UPDATE_LOCATION"),
+      TransactionHandler::HANDLER_BATCH | TransactionHandler::HANDLER_WRITE,
+      ParseMove, MergeMove, SendMove, NULL },
+    { JournalFormat::OP_ITEM_CREATE, TEXT("ITEM_CREATE"), TEXT("CREATE_ITEM"),
+      TransactionHandler::HANDLER_BATCH | TransactionHandler::HANDLER_WRITE | TransactionHandler::HANDLER_EDIT,
+      ParseItem, MergeCreate, SendCreate, NULL },
+    { JournalFormat::OP_ITEM_UPDATE, TEXT("ITEM_UPDATE"), NULL,
+      TransactionHandler::HANDLER_WRITE | TransactionHandler::HANDLER_EDIT,
+      ParseItem, MergeUpdate, SendUpdate, RebaseUpdate }
+};
+
+} // namespace
+
+const TransactionHandler* TransactionHandlers::Find(unsigned int opcode)
+{
+    if (opcode == JournalFormat::OP_NONE || opcode >= JournalFormat::OP_COUNT) {
+        return NULL;
+    }
+    return &kHandlers[opcode];
+}
+
+const TransactionHandler* TransactionHandlers::FindByType(const TCHAR* type)
+{
+    if (!type) {
+        return NULL;
+    }
+
+    for (int i = JournalFormat::OP_NONE + 1; i < JournalFormat::OP_COUNT; i++) {
+        if (lstrcmp(type, kHandlers[i].type) == 0) {
+            return &kHandlers[i];
+        }
+    }
+    return NULL;
+}
+
+void TransactionHandlers::ClearPayload(TransactionPayload* payload)
+{
+    payload->barcode = NULL;
+    payload->locationId = NULL;
+    payload->item = NULL;
+    payload->itemJson = NULL;
+}
+
+void TransactionHandlers::FreePayload(TransactionPayload* payload)
+{
+    delete[] payload->barcode;
+    delete[] payload->locationId;
+    delete payload->item;
+    delete[] payload->itemJson;
+    ClearPayload(payload);
+}
+
+} // namespace HBX
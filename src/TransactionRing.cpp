@@ -0,0 +1,94 @@
+#include "../include/TransactionRing.hpp"
+
+namespace HBX {
+
+namespace {
+
+// Reads an index written by the other thread
+DWORD LoadIndex(const LONG* index)
+{
+    return (DWORD)InterlockedCompareExchange(const_cast<LONG*>(index), 0, 0);
+}
+
+} // namespace
+
+TransactionRing::TransactionRing()
+    : m_slots(new Slot[SLOT_COUNT])
+    , m_head(0)
+    , m_tail(0)
+{
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        m_slots[i].text = m_slots[i].buffer;
+    }
+}
+
+TransactionRing::~TransactionRing()
+{
+    // Texts still queued may have been copied to the heap
+    for (DWORD i = (DWORD)m_tail; i != (DWORD)m_head; i++) {
+        FreeText(m_slots[i & (SLOT_COUNT - 1)]);
+    }
+    delete[] m_slots;
+}
+
+bool TransactionRing::Push(const TCHAR* type, const TCHAR* item, const TCHAR* text, BYTE opcode, DWORD ticket)
+{
+    if (!text) {
+        return false;
+    }
+
+    // Counters run freely and wrap; unsigned differences stay correct
+    DWORD head = (DWORD)m_head;
+    if (head - LoadIndex(&m_tail) >= SLOT_COUNT) {
+        return false;
+    }
+
+    Slot& slot = m_slots[head & (SLOT_COUNT - 1)];
+    slot.ticket = ticket;
+    slot.opcode = opcode;
+    lstrcpyn(slot.type, type ? type : TEXT(""), TAG_CHARS);
+    lstrcpyn(slot.item, item ? item : TEXT(""), TAG_CHARS);
+    int length = lstrlen(text);
+    slot.text = (length < SLOT_CHARS) ? slot.buffer : new TCHAR[length + 1];
+    lstrcpy(slot.text, text);
+
+    // Publish the slot; the interlocked store is a full barrier
+    InterlockedExchange(&m_head, (LONG)(head + 1));
+    return true;
+}
+
+const TransactionRing::Slot* TransactionRing::Peek() const
+{
+    DWORD tail = (DWORD)m_tail;
+    if (LoadIndex(&m_head) == tail) {
+        return NULL;
+    }
+    return &m_slots[tail & (SLOT_COUNT - 1)];
+}
+
+void TransactionRing::Pop()
+{
+    DWORD tail = (DWORD)m_tail;
+    if (LoadIndex(&m_head) == tail) {
+        return;
+    }
+
+    // Hand the slot back to the producer only after it has been read
+    FreeText(m_slots[tail & (SLOT_COUNT - 1)]);
+    InterlockedExchange(&m_tail, (LONG)(tail + 1));
+}
+
+int TransactionRing::GetCount() const
+{
+    return (int)(LoadIndex(&m_head) - LoadIndex(&m_tail));
+}
+
+void TransactionRing::FreeText(Slot& slot)
+{
+    if (slot.text != slot.buffer) {
+        delete[] slot.text;
+    }
+    slot.text = slot.buffer;
+}
+
+} // namespace HBX
@@ -15,6 +15,7 @@ QueueView::QueueView()
     , m_syncEngine(NULL)
     , m_syncCallback(NULL)
     , m_callbackUserData(NULL)
+    , m_conflictCount(0)
 {
 }
 
@@ -138,10 +139,33 @@ void QueueView::RefreshQueue()
     // Clear current list
     ListView_DeleteAllItems(m_listView);
 
+    // Conflicting edits first; they hold up the rest of their item
+    SyncEngine::SyncConflict conflicts[SyncEngine::MAX_CONFLICTS];
+    m_conflictCount = m_syncEngine->GetConflicts(conflicts, SyncEngine::MAX_CONFLICTS);
+    for (int i = 0; i < m_conflictCount; i++) {
+        m_conflictIds[i] = conflicts[i].transactionId;
+        AddConflictItem(conflicts[i]);
+    }
+
     // Get pending transactions from sync engine's journal
     // In a real implementation, we'd query the sync engine
     // For now, just update the count
-    SetItemCount(0);
+    SetItemCount(m_conflictCount);
+}
+
+void QueueView::AddConflictItem(const SyncEngine::SyncConflict& conflict)
+{
+    TCHAR description[128];
+    wsprintf(description, TEXT("Edit of %s"), conflict.barcode);
+
+    LVITEM item;
+    item.mask = LVIF_TEXT;
+    item.iItem = ListView_GetItemCount(m_listView);
+    item.iSubItem = 0;
+    item.pszText = description;
+    int index = ListView_InsertItem(m_listView, &item);
+
+    ListView_SetItemText(m_listView, index, 1, TEXT("Conflict"));
 }
 
 void QueueView::SetSyncEngine(SyncEngine* syncEngine)
@@ -322,9 +346,26 @@ void QueueView::OnClearClick()
 
 void QueueView::OnItemSelected(int index)
 {
-    // Item selected in list view
-    // Could be used to show item details or enable/disable buttons
-    // For now, just a placeholder
+    if (!m_syncEngine || index < 0 || index >= m_conflictCount) {
+        return;
+    }
+
+    // A conflict: keep the edit over the server's changes, or drop it
+    int result = MessageBox(
+        m_hwnd,
+        TEXT("This item was also changed on the server. Keep your changes? No keeps the server's."),
+        TEXT("Sync Conflict"),
+        MB_YESNOCANCEL | MB_ICONQUESTION
+    );
+
+    if (result == IDYES) {
+        m_syncEngine->ResolveConflict(m_conflictIds[index], SyncEngine::RESOLVE_KEEP_LOCAL);
+    } else if (result == IDNO) {
+        m_syncEngine->ResolveConflict(m_conflictIds[index], SyncEngine::RESOLVE_KEEP_SERVER);
+    } else {
+        return;
+    }
+    RefreshQueue();
 }
 
 void QueueView::LayoutControls()
@@ -0,0 +1,361 @@
+/**
+ * journal_bench - journal timings on the host
+ *
+ * Usage: journal_bench [scan|append] [options]
+ *   -n <records>  largest history for the pending scan (default 1000000)
+ *   -a <appends>  appends timed in each commit mode (default 2000)
+ *   -f <us>       time each flush takes (default 2000, about an MC75's
+ *                 flash; flushes on the host are otherwise free)
+ *
+ * Both are run unless one is named.
+ *
+ * Pending scan: a journal grows from 1 000 to <records> transactions,
+ * with all but the newest PENDING_COUNT synced, and at each size the
+ * pending transactions are read through a PendingCursor and through
+ * GetPendingTransactions, and the history is queried by item id and by
+ * time. With the pending index the scan reads the same records whatever
+ * the journal's size; the bytes read show it.
+ *
+ * Append: scans are logged back to back, as in a stocktake, with every
+ * entry flushed (the default), with group commit (a 20 ms window or 32
+ * records, whichever comes first), and queued for the writer thread,
+ * which commits whatever has queued up with one flush. For each it
+ * prints appends per second, the latency of the call, and the flushes
+ * it took; for the writer thread also the time until the commit
+ * callback, which is when the transaction is on flash.
+ *
+ * Times are for the host and only comparable with each other; the
+ * device's flash is slower, but in the same proportions.
+ */
+
+#include "../../include/Journal.hpp"
+#include "../host/host_faults.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+
+namespace {
+
+const int PENDING_COUNT = 100;
+const int ITEM_COUNT = 5000;        // Distinct barcodes in the history
+const int SCAN_REPEATS = 5;         // Scans timed at each size; the median is printed
+
+// Group commit settings for the append benchmark
+const DWORD GROUP_WINDOW_MS = 20;
+const DWORD GROUP_MAX_RECORDS = 32;
+
+void ScanDetails(int n, TCHAR* text)
+{
+    wsprintf(text, TEXT("{\"barcode\":\"%013d\",\"location\":\"A-%02d-%02d\",\"n\":%d}"), n % ITEM_COUNT,
+             n % 40, n % 12, n);
+}
+
+void ScanItem(int n, TCHAR* item)
+{
+    wsprintf(item, TEXT("%013d"), n % ITEM_COUNT);
+}
+
+void Sort(double* values, int count)
+{
+    for (int gap = count / 2; gap > 0; gap /= 2) {
+        for (int i = gap; i < count; i++) {
+            for (int j = i; j >= gap && values[j] < values[j - gap]; j -= gap) {
+                double swap = values[j];
+                values[j] = values[j - gap];
+                values[j - gap] = swap;
+            }
+        }
+    }
+}
+
+double Median(double* values, int count)
+{
+    Sort(values, count);
+    return values[count / 2];
+}
+
+// The given percentile of latencies already sorted
+double Percentile(const double* sorted, int count, int percent)
+{
+    int index = (count * percent + 99) / 100 - 1;
+    return sorted[index < 0 ? 0 : index];
+}
+
+// Appends transactions up to total and syncs all but the newest
+// PENDING_COUNT, as SyncEngine would have along the way
+bool GrowJournal(Journal* journal, int from, int total)
+{
+    TCHAR text[128];
+    TCHAR item[32];
+    for (int n = from; n < total; n++) {
+        ScanDetails(n, text);
+        ScanItem(n, item);
+        if (!journal->LogTransaction(TEXT("ITEM_SCAN"), item, text, false)) {
+            return false;
+        }
+    }
+    if (!journal->Flush()) {
+        return false;
+    }
+
+    ULONGLONG ids[512];
+    for (int remaining = journal->GetTransactionCount() - PENDING_COUNT; remaining > 0; ) {
+        Journal::PendingCursor cursor(journal);
+        int count = 0;
+        while (count < 512 && count < remaining && cursor.Next()) {
+            ids[count++] = cursor.GetId();
+        }
+        if (count == 0 || !journal->AcknowledgeSynced(ids, count)) {
+            return false;
+        }
+        remaining -= count;
+    }
+    return true;
+}
+
+void RunPendingScan(const TCHAR* path, const char* nativePath, int maxRecords)
+{
+    printf("Pending scan: %d pending, history growing\n", PENDING_COUNT);
+    printf("%10s %10s | %12s %12s | %12s | %18s | %16s\n", "records", "journal", "cursor", "read",
+           "GetPending", "item query", "time query");
+
+    Journal journal;
+    if (!journal.Initialize(path) || !journal.SetGroupCommit(20, 256)) {
+        printf("cannot open %s\n", nativePath);
+        return;
+    }
+
+    int size = 0;
+    for (int target = 1000; target <= maxRecords; target *= 10) {
+        if (!GrowJournal(&journal, size, target)) {
+            printf("cannot grow the journal to %d records\n", target);
+            return;
+        }
+        size = target;
+
+        double cursorMs[SCAN_REPEATS];
+        double copyMs[SCAN_REPEATS];
+        ULONGLONG bytesRead = 0;
+        for (int r = 0; r < SCAN_REPEATS; r++) {
+            HostResetCounters();
+            double start = HostNowUs();
+            Journal::PendingCursor cursor(&journal);
+            int seen = 0;
+            while (cursor.Next()) {
+                seen++;
+            }
+            cursorMs[r] = (HostNowUs() - start) / 1000.0;
+            bytesRead = HostGetBytesRead();
+            if (seen != PENDING_COUNT) {
+                printf("expected %d pending, found %d\n", PENDING_COUNT, seen);
+                return;
+            }
+
+            start = HostNowUs();
+            TCHAR** transactions = NULL;
+            int count = 0;
+            journal.GetPendingTransactions(&transactions, &count);
+            for (int i = 0; i < count; i++) {
+                delete[] transactions[i];
+            }
+            delete[] transactions;
+            copyMs[r] = (HostNowUs() - start) / 1000.0;
+        }
+
+        // One barcode, and everything since the oldest pending transaction
+        Journal::QueryFilter filter;
+        filter.transactionType = NULL;
+        filter.itemId = TEXT("0000000000042");
+        filter.fromTime = 0;
+        filter.toTime = 0;
+
+        double start = HostNowUs();
+        int itemMatches = 0;
+        Journal::QueryCursor byItem(&journal, filter);
+        while (byItem.Next()) {
+            itemMatches++;
+        }
+        double itemMs = (HostNowUs() - start) / 1000.0;
+
+        Journal::PendingCursor oldest(&journal);
+        oldest.Next();
+        filter.itemId = NULL;
+        filter.fromTime = oldest.GetTimestamp();
+
+        start = HostNowUs();
+        int timeMatches = 0;
+        Journal::QueryCursor byTime(&journal, filter);
+        while (byTime.Next()) {
+            timeMatches++;
+        }
+        double timeMs = (HostNowUs() - start) / 1000.0;
+
+        printf("%10d %8.1fMB | %9.3f ms %10luB | %9.3f ms | %9.3f ms %6d | %7.3f ms %6d\n", size,
+               HostJournalBytes(nativePath) / 1048576.0, Median(cursorMs, SCAN_REPEATS), (unsigned long)bytesRead,
+               Median(copyMs, SCAN_REPEATS), itemMs, itemMatches, timeMs, timeMatches);
+        fflush(stdout);
+    }
+}
+
+enum AppendMode {
+    APPEND_FLUSH_EACH,
+    APPEND_GROUP_COMMIT,
+    APPEND_WRITER_THREAD
+};
+
+// Commit callbacks of the writer thread, with the time each ticket was
+// queued, to tell how long it took to reach flash
+struct CommitTimes {
+    const double* queuedUs;
+    double* committedUs;
+    DWORD lastTicket;
+};
+
+void RecordCommit(DWORD ticket, bool success, void* userData)
+{
+    CommitTimes* times = (CommitTimes*)userData;
+    double now = HostNowUs();
+    for (DWORD t = times->lastTicket + 1; t <= ticket && success; t++) {
+        times->committedUs[t - 1] = now - times->queuedUs[t - 1];
+    }
+    times->lastTicket = ticket;
+}
+
+void PrintLatencies(const char* label, double elapsedUs, double* latencies, int count, DWORD flushes)
+{
+    Sort(latencies, count);
+    printf("%-26s %10.0f %9.3f ms %9.3f ms %9.3f ms %8lu\n", label, count / (elapsedUs / 1000000.0),
+           Percentile(latencies, count, 50) / 1000.0, Percentile(latencies, count, 99) / 1000.0,
+           latencies[count - 1] / 1000.0, (unsigned long)flushes);
+}
+
+bool TimeAppends(const TCHAR* path, AppendMode mode, int appends)
+{
+    double* callUs = new double[appends];
+    double* queuedUs = new double[appends];
+    double* committedUs = new double[appends];
+    CommitTimes times = { queuedUs, committedUs, 0 };
+
+    Journal journal;
+    bool ready = journal.Initialize(path);
+    if (mode == APPEND_GROUP_COMMIT) {
+        ready = ready && journal.SetGroupCommit(GROUP_WINDOW_MS, GROUP_MAX_RECORDS);
+    } else if (mode == APPEND_WRITER_THREAD) {
+        ready = ready && journal.StartWriter(RecordCommit, &times);
+    }
+
+    TCHAR text[128];
+    TCHAR item[32];
+    HostResetCounters();
+    double start = HostNowUs();
+    for (int n = 0; n < appends && ready; n++) {
+        ScanDetails(n, text);
+        ScanItem(n, item);
+
+        double before = HostNowUs();
+        queuedUs[n] = before;
+        if (mode == APPEND_WRITER_THREAD) {
+            ready = journal.EnqueueTransaction(TEXT("ITEM_SCAN"), item, text, NULL);
+        } else {
+            // Scans are durable only when flushed one by one
+            ready = journal.LogTransaction(TEXT("ITEM_SCAN"), item, text, mode == APPEND_FLUSH_EACH);
+        }
+        callUs[n] = HostNowUs() - before;
+    }
+
+    // Everything on flash before the clock stops
+    if (mode == APPEND_WRITER_THREAD) {
+        journal.StopWriter();
+    } else {
+        ready = ready && journal.Flush();
+    }
+    double elapsed = HostNowUs() - start;
+    DWORD flushes = HostGetFlushCount();
+
+    if (!ready || (mode == APPEND_WRITER_THREAD && times.lastTicket != (DWORD)appends)) {
+        printf("appends failed\n");
+    } else if (mode == APPEND_FLUSH_EACH) {
+        PrintLatencies("flush each entry", elapsed, callUs, appends, flushes);
+    } else if (mode == APPEND_GROUP_COMMIT) {
+        PrintLatencies("group commit (20 ms/32)", elapsed, callUs, appends, flushes);
+    } else {
+        PrintLatencies("writer thread, enqueue", elapsed, callUs, appends, flushes);
+        PrintLatencies("writer thread, committed", elapsed, committedUs, appends, flushes);
+    }
+
+    delete[] callUs;
+    delete[] queuedUs;
+    delete[] committedUs;
+    return ready;
+}
+
+void RunAppend(const char* nativePath, int appends, DWORD flushDelayUs)
+{
+    printf("Append: %d scans, flushes taking %lu us\n", appends, (unsigned long)flushDelayUs);
+    printf("%-26s %10s %12s %12s %12s %8s\n", "mode", "appends/s", "p50", "p99", "max", "flushes");
+
+    HostSetFlushDelay(flushDelayUs);
+    AppendMode modes[3] = { APPEND_FLUSH_EACH, APPEND_GROUP_COMMIT, APPEND_WRITER_THREAD };
+    for (int m = 0; m < 3; m++) {
+        // A fresh journal next to the given one for each mode
+        char modePath[MAX_PATH + 8];
+        TCHAR path[MAX_PATH];
+        snprintf(modePath, sizeof(modePath), "%s.mode%d", nativePath, m);
+        MultiByteToWideChar(CP_UTF8, 0, modePath, -1, path, MAX_PATH);
+        if (!TimeAppends(path, modes[m], appends)) {
+            break;
+        }
+    }
+    HostSetFlushDelay(0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    bool scan = true;
+    bool append = true;
+    int maxRecords = 1000000;
+    int appends = 2000;
+    DWORD flushDelayUs = 2000;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = (i + 1 < argc);
+        if (strcmp(argv[i], "scan") == 0) {
+            append = false;
+        } else if (strcmp(argv[i], "append") == 0) {
+            scan = false;
+        } else if (strcmp(argv[i], "-n") == 0 && hasValue) {
+            maxRecords = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0 && hasValue) {
+            appends = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && hasValue) {
+            flushDelayUs = (DWORD)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: journal_bench [scan|append] [-n <records>] [-a <appends>] [-f <us>]\n");
+            return 2;
+        }
+    }
+    if (appends < 1) {
+        appends = 1;
+    }
+
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    if (!HostMakeJournalPath(nativePath, sizeof(nativePath), path)) {
+        fprintf(stderr, "cannot make a directory under /tmp\n");
+        return 1;
+    }
+
+    if (scan) {
+        RunPendingScan(path, nativePath, maxRecords);
+    }
+    if (scan && append) {
+        printf("\n");
+    }
+    if (append) {
+        RunAppend(nativePath, appends, flushDelayUs);
+    }
+
+    HostRemoveJournalDir(nativePath);
+    return 0;
+}
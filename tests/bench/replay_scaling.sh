@@ -0,0 +1,86 @@
+#!/bin/bash
+# Pipelined sync scaling: replays the same backlog against the mock
+# server, with a round trip added to every response, at each pipeline
+# depth, and prints how throughput grows with the requests in flight.
+# Every change goes in a request of its own (-b 0), as on a server
+# without the batch endpoint.
+#
+# Usage: replay_scaling.sh [-l <ms>] [-n <scans>] [-p "<depths>"]
+#   -l <ms>          round trip added by the server (default 300)
+#   -n <scans>       scans replayed at each depth (default 100)
+#   -p "<depths>"    pipeline depths (default "1 2 4 8")
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+ROOT_DIR="$(dirname "$(dirname "$SCRIPT_DIR")")"
+TOOL="${HBX_HOST_BIN:-$ROOT_DIR/bin/host}/journal_replay"
+
+LATENCY=300
+COUNT=100
+DEPTHS="1 2 4 8"
+while getopts "l:n:p:" option; do
+    case $option in
+        l) LATENCY="$OPTARG" ;;
+        n) COUNT="$OPTARG" ;;
+        p) DEPTHS="$OPTARG" ;;
+        *) echo "usage: replay_scaling.sh [-l <ms>] [-n <scans>] [-p \"<depths>\"]"; exit 2 ;;
+    esac
+done
+
+if [ ! -x "$TOOL" ]; then
+    echo "$TOOL not found; run scripts/build_host_debug.sh first"
+    exit 1
+fi
+
+WORK_DIR="$(mktemp -d /tmp/hbx_bench_XXXXXX)"
+SERVER=""
+cleanup() {
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# Each scan is an audit record, counted but not sent, and an ITEM_SCAN
+# that goes out as a request of its own
+"$TOOL" synth "$WORK_DIR/hbx.journal" -n "$COUNT" -d 1 > /dev/null || exit 1
+
+# A port that is free, and the server answering on it
+for attempt in 1 2 3 4 5; do
+    PORT=$((20000 + RANDOM % 20000))
+    "$TOOL" serve "$PORT" -l "$LATENCY" > /dev/null 2>&1 &
+    SERVER=$!
+    for wait in $(seq 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null; then
+            break 2
+        fi
+        kill -0 "$SERVER" 2>/dev/null || break
+        sleep 0.1
+    done
+    kill "$SERVER" 2>/dev/null
+    SERVER=""
+done
+if [ -z "$SERVER" ]; then
+    echo "could not start the mock server"
+    exit 1
+fi
+
+echo "Pipelined replay: $COUNT scans, one request each, ${LATENCY} ms round trip"
+printf "%6s %10s %12s %9s %10s %12s\n" "depth" "elapsed" "requests/s" "speedup" "p99" "connections"
+
+BASE_RATE=""
+for depth in $DEPTHS; do
+    OUTPUT="$("$TOOL" replay "$WORK_DIR/hbx.journal" "http://127.0.0.1:$PORT" -b 0 -u -n $((COUNT * 2)) -p "$depth")" || {
+        echo "replay at depth $depth failed"
+        exit 1
+    }
+
+    ELAPSED="$(echo "$OUTPUT" | awk '/^elapsed/ { print $2 }')"
+    RATE="$(echo "$OUTPUT" | awk '/^elapsed/ { print $(NF - 1) }')"
+    P99="$(echo "$OUTPUT" | awk '/^latency ms/ { for (i = 1; i < NF; i++) if ($i == "p99") print $(i + 1) }')"
+    CONNECTIONS="$(echo "$OUTPUT" | awk '/^connections/ { print $2 }')"
+    [ -z "$BASE_RATE" ] && BASE_RATE="$RATE"
+
+    printf "%6s %8s s %12s %8.2fx %7s ms %12s\n" "$depth" "$ELAPSED" "$RATE" \
+        "$(awk -v rate="$RATE" -v base="$BASE_RATE" 'BEGIN { print (base > 0) ? rate / base : 0 }')" \
+        "$P99" "$CONNECTIONS"
+done
+exit 0
@@ -0,0 +1,38 @@
+#ifndef HOST_FAULTS_HPP
+#define HOST_FAULTS_HPP
+
+#include <windows.h>
+
+/**
+ * Controls and counters of the host Win32 layer
+ * A write budget stands in for a power loss: the write that crosses it
+ * is cut short, and from then on every change to the file system fails,
+ * so whatever the code under test does afterwards (destructors
+ * included) leaves the files as the crash did. A flush delay stands in
+ * for the flash of a handheld, where FlushFileBuffers is the expensive
+ * part of an append; by default flushes cost nothing. A stopped clock
+ * lets GetTickCount be moved by hand, to take code through its timeouts
+ * and backoffs without waiting for them.
+ */
+
+// Bytes that may still be written before the power fails; -1 (the
+// default) for no limit. Setting it restores the power.
+void HostSetWriteBudget(long bytes);
+bool HostIsPowerLost();
+
+// Time every FlushFileBuffers takes
+void HostSetFlushDelay(DWORD microseconds);
+
+// GetTickCount stays at ticks, moving only when advanced, until the
+// clock is run again; waits still take real time
+void HostStopClock(DWORD ticks);
+void HostAdvanceClock(DWORD milliseconds);
+void HostRunClock();
+
+// Counted since the last reset
+void HostResetCounters();
+DWORD HostGetFlushCount();
+ULONGLONG HostGetBytesRead();
+ULONGLONG HostGetBytesWritten();
+
+#endif // HOST_FAULTS_HPP
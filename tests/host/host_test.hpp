@@ -0,0 +1,302 @@
+#ifndef HOST_TEST_HPP
+#define HOST_TEST_HPP
+
+/**
+ * Test support for the host build
+ * Each test is a function returning true when it passes; CHECK reports
+ * the first failed condition and returns false from it. RUN_TEST runs
+ * one and prints the outcome, and HostTestResult turns the tally into
+ * the exit code. Tests work in a fresh directory under /tmp, and those
+ * that need a server start the mock in journal_replay (built next to the
+ * tests by scripts/run_host_tests.sh).
+ */
+
+#include <windows.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("    %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            return false; \
+        } \
+    } while (0)
+
+#define RUN_TEST(test) HostRunTest(#test, test)
+
+static int g_testsRun = 0;
+static int g_testsFailed = 0;
+
+// Microseconds on a monotonic clock
+inline double HostNowUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+inline void HostRunTest(const char* name, bool (*test)())
+{
+    printf("%-48s ", name);
+    fflush(stdout);
+    double start = HostNowUs();
+    bool passed = test();
+    printf("%s (%.0f ms)\n", passed ? "PASS" : "FAIL", (HostNowUs() - start) / 1000.0);
+    g_testsRun++;
+    if (!passed) {
+        g_testsFailed++;
+    }
+}
+
+inline int HostTestResult()
+{
+    printf("%d of %d passed\n", g_testsRun - g_testsFailed, g_testsRun);
+    return g_testsFailed == 0 ? 0 : 1;
+}
+
+// Makes a new directory under /tmp and a journal path in it, as a native
+// and a wide string
+inline bool HostMakeJournalPath(char* nativePath, int nativeSize, TCHAR* path)
+{
+    char directory[] = "/tmp/hbx_test_XXXXXX";
+    if (!mkdtemp(directory)) {
+        return false;
+    }
+    snprintf(nativePath, nativeSize, "%s/hbx.journal", directory);
+    MultiByteToWideChar(CP_UTF8, 0, nativePath, -1, path, MAX_PATH);
+    return true;
+}
+
+// Removes the directory HostMakeJournalPath made, with everything in it
+inline void HostRemoveJournalDir(const char* nativePath)
+{
+    char command[MAX_PATH + 16];
+    const char* slash = strrchr(nativePath, '/');
+    if (slash && strncmp(nativePath, "/tmp/hbx_test_", 14) == 0) {
+        snprintf(command, sizeof(command), "rm -rf '%.*s'", (int)(slash - nativePath), nativePath);
+        if (system(command) != 0) {
+            printf("    could not remove %s\n", nativePath);
+        }
+    }
+}
+
+// Size of a journal's segment files
+inline ULONGLONG HostJournalBytes(const char* nativePath)
+{
+    char command[MAX_PATH + 32];
+    snprintf(command, sizeof(command), "du -cb %s.0* | tail -1", nativePath);
+    FILE* output = popen(command, "r");
+    unsigned long long bytes = 0;
+    if (output) {
+        if (fscanf(output, "%llu", &bytes) != 1) {
+            bytes = 0;
+        }
+        pclose(output);
+    }
+    return bytes;
+}
+
+// Copies the files next to one journal into the directory of another
+inline bool HostCopyJournalDir(const char* fromPath, const char* toPath)
+{
+    char fromDir[MAX_PATH];
+    char toDir[MAX_PATH];
+    snprintf(fromDir, sizeof(fromDir), "%.*s", (int)(strrchr(fromPath, '/') - fromPath), fromPath);
+    snprintf(toDir, sizeof(toDir), "%.*s", (int)(strrchr(toPath, '/') - toPath), toPath);
+
+    DIR* dir = opendir(fromDir);
+    if (!dir) {
+        return false;
+    }
+
+    bool copied = true;
+    static char buffer[64 * 1024];
+    for (struct dirent* entry = readdir(dir); entry && copied; entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char from[MAX_PATH * 2];
+        char to[MAX_PATH * 2];
+        snprintf(from, sizeof(from), "%s/%s", fromDir, entry->d_name);
+        snprintf(to, sizeof(to), "%s/%s", toDir, entry->d_name);
+
+        FILE* in = fopen(from, "rb");
+        FILE* out = fopen(to, "wb");
+        copied = (in && out);
+        size_t n = 0;
+        while (copied && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+            copied = (fwrite(buffer, 1, n, out) == n);
+        }
+        if (in) {
+            fclose(in);
+        }
+        if (out) {
+            fclose(out);
+        }
+    }
+    closedir(dir);
+    return copied;
+}
+
+// journal_replay, next to the test executables' directory
+inline void HostToolPath(char* path, int size)
+{
+    const char* bin = getenv("HBX_HOST_BIN");
+    snprintf(path, size, "%s/journal_replay", bin ? bin : "bin/host");
+}
+
+// Runs journal_replay with the arguments (NULL-terminated) and waits for
+// it; its output is dropped unless HBX_TEST_VERBOSE is set
+inline int HostRunTool(const char* const* arguments)
+{
+    char tool[MAX_PATH];
+    HostToolPath(tool, sizeof(tool));
+
+    const char* argv[16];
+    int argc = 0;
+    argv[argc++] = tool;
+    for (int i = 0; arguments[i] && argc < 15; i++) {
+        argv[argc++] = arguments[i];
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        if (!getenv("HBX_TEST_VERBOSE")) {
+            freopen("/dev/null", "w", stdout);
+        }
+        execv(tool, (char* const*)argv);
+        _exit(127);
+    }
+
+    int status = 0;
+    if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+// A free port on 127.0.0.1
+inline int HostFreePort()
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    int port = 0;
+    if (bind(s, (struct sockaddr*)&address, sizeof(address)) == 0 &&
+        getsockname(s, (struct sockaddr*)&address, &length) == 0) {
+        port = ntohs(address.sin_port);
+    }
+    close(s);
+    return port;
+}
+
+inline bool HostCanConnect(int port)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool connected = (connect(s, (struct sockaddr*)&address, sizeof(address)) == 0);
+    close(s);
+    return connected;
+}
+
+// The mock server, journal_replay serve, with its options (NULL-terminated)
+struct HostServer {
+    pid_t pid;
+    int port;
+};
+
+inline bool HostStartServer(HostServer* server, const char* const* options)
+{
+    char tool[MAX_PATH];
+    char port[16];
+    HostToolPath(tool, sizeof(tool));
+    server->port = HostFreePort();
+    snprintf(port, sizeof(port), "%d", server->port);
+
+    const char* argv[16];
+    int argc = 0;
+    argv[argc++] = tool;
+    argv[argc++] = "serve";
+    argv[argc++] = port;
+    for (int i = 0; options && options[i] && argc < 15; i++) {
+        argv[argc++] = options[i];
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);
+    server->pid = fork();
+    if (server->pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        execv(tool, (char* const*)argv);
+        _exit(127);
+    }
+    if (server->pid < 0) {
+        return false;
+    }
+
+    for (int attempt = 0; attempt < 200; attempt++) {
+        if (HostCanConnect(server->port)) {
+            return true;
+        }
+        if (waitpid(server->pid, NULL, WNOHANG) == server->pid) {
+            break;
+        }
+        usleep(10000);
+    }
+    printf("    could not start %s serve\n", tool);
+    return false;
+}
+
+inline void HostStopServer(HostServer* server)
+{
+    if (server->pid > 0) {
+        kill(server->pid, SIGTERM);
+        waitpid(server->pid, NULL, 0);
+        server->pid = 0;
+    }
+}
+
+inline void HostServerUrl(const HostServer& server, const char* path, char* url, int size)
+{
+    snprintf(url, size, "http://127.0.0.1:%d%s", server.port, path);
+}
+
+inline void HostServerUrl(const HostServer& server, const char* path, TCHAR* url, int chars)
+{
+    char native[256];
+    HostServerUrl(server, path, native, sizeof(native));
+    MultiByteToWideChar(CP_UTF8, 0, native, -1, url, chars);
+}
+
+// A count from the JSON of GET /api/v1/mock/stats; -1 if it is missing
+inline long HostStatValue(const TCHAR* stats, const char* name)
+{
+    TCHAR member[64];
+    member[0] = '"';
+    MultiByteToWideChar(CP_UTF8, 0, name, -1, member + 1, 60);
+    lstrcpy(member + lstrlen(member), L"\":");
+
+    const TCHAR* found = wcsstr(stats, member);
+    return found ? wcstol(found + lstrlen(member), NULL, 10) : -1;
+}
+
+#endif // HOST_TEST_HPP
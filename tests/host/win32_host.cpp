@@ -0,0 +1,807 @@
+#include "windows.h"
+#include "host_faults.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+// Seconds between the FILETIME epoch (1601) and the Unix epoch (1970)
+const ULONGLONG FILETIME_UNIX_EPOCH_S = 11644473600ULL;
+
+// Longest path in UTF-8
+const int NATIVE_PATH_SIZE = MAX_PATH * 4;
+
+enum ObjectKind {
+    OBJECT_FILE,
+    OBJECT_FIND,
+    OBJECT_EVENT,
+    OBJECT_THREAD
+};
+
+struct HostObject {
+    ObjectKind kind;
+};
+
+struct HostFile : HostObject {
+    int fd;
+};
+
+struct HostFind : HostObject {
+    glob_t matches;
+    size_t next;
+};
+
+// Events and threads. A thread is signaled once it has returned; the
+// object is freed when both the thread and the handle are done with it
+struct HostWaitable : HostObject {
+    bool signaled;
+    bool manualReset;
+    int references;
+    LPTHREAD_START_ROUTINE start;
+    LPVOID parameter;
+};
+
+// Every wait is on one condition, which any SetEvent or finished thread
+// broadcasts; the tests never have more than a few threads
+pthread_mutex_t g_waitLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_waitChanged = PTHREAD_COND_INITIALIZER;
+
+pthread_mutex_t g_faultLock = PTHREAD_MUTEX_INITIALIZER;
+long g_writeBudget = -1;
+bool g_powerLost = false;
+DWORD g_flushDelayUs = 0;
+bool g_clockStopped = false;
+DWORD g_clockTicks = 0;
+
+DWORD g_flushCount = 0;
+ULONGLONG g_bytesRead = 0;
+ULONGLONG g_bytesWritten = 0;
+
+// Wide path to UTF-8
+void ToNative(const TCHAR* path, char* out)
+{
+    WideCharToMultiByte(CP_UTF8, 0, path, -1, out, NATIVE_PATH_SIZE, NULL, NULL);
+    out[NATIVE_PATH_SIZE - 1] = '\0';
+}
+
+bool PowerLost()
+{
+    pthread_mutex_lock(&g_faultLock);
+    bool lost = g_powerLost;
+    pthread_mutex_unlock(&g_faultLock);
+    return lost;
+}
+
+// How much of a write of length bytes reaches the file
+DWORD ClaimWrite(DWORD length)
+{
+    pthread_mutex_lock(&g_faultLock);
+    DWORD allowed = length;
+    if (g_powerLost) {
+        allowed = 0;
+    } else if (g_writeBudget >= 0) {
+        if ((long)length > g_writeBudget) {
+            allowed = (DWORD)g_writeBudget;
+            g_powerLost = true;
+        }
+        g_writeBudget -= allowed;
+    }
+    pthread_mutex_unlock(&g_faultLock);
+    return allowed;
+}
+
+void Release(HostWaitable* object)
+{
+    // Called with g_waitLock held
+    if (--object->references == 0) {
+        delete object;
+    }
+}
+
+void* ThreadMain(void* parameter)
+{
+    HostWaitable* thread = (HostWaitable*)parameter;
+    thread->start(thread->parameter);
+
+    pthread_mutex_lock(&g_waitLock);
+    thread->signaled = true;
+    pthread_cond_broadcast(&g_waitChanged);
+    Release(thread);
+    pthread_mutex_unlock(&g_waitLock);
+    return NULL;
+}
+
+int EncodeUtf8(unsigned int c, char* out)
+{
+    if (c < 0x80) {
+        out[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = (char)(0xC0 | (c >> 6));
+        out[1] = (char)(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = (char)(0xE0 | (c >> 12));
+        out[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (c & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (c >> 18));
+    out[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (c & 0x3F));
+    return 4;
+}
+
+// Decodes one character; malformed input comes out a byte at a time
+int DecodeUtf8(const unsigned char* in, int length, unsigned int* c)
+{
+    int count = (in[0] >= 0xF0) ? 4 : (in[0] >= 0xE0) ? 3 : (in[0] >= 0xC0) ? 2 : 1;
+    if (count > length) {
+        count = 1;
+    }
+    for (int i = 1; i < count; i++) {
+        if ((in[i] & 0xC0) != 0x80) {
+            count = 1;
+        }
+    }
+
+    static const unsigned char leadMask[5] = { 0, 0xFF, 0x1F, 0x0F, 0x07 };
+    *c = in[0] & leadMask[count];
+    for (int i = 1; i < count; i++) {
+        *c = (*c << 6) | (in[i] & 0x3F);
+    }
+    return count;
+}
+
+// Win32 format to C library format: %s and %c take TCHARs, %hs and %hc
+// chars, and l on an integer is the 32-bit DWORD it is on the device
+void ConvertFormat(const TCHAR* format, TCHAR* out, int outChars)
+{
+    int pos = 0;
+    while (*format && pos < outChars - 4) {
+        if (*format != '%') {
+            out[pos++] = *format++;
+            continue;
+        }
+
+        out[pos++] = *format++;
+        while (*format && wcschr(L"-+ #0123456789.*", *format) && pos < outChars - 4) {
+            out[pos++] = *format++;
+        }
+
+        bool narrow = false;
+        if (*format == 'h') {
+            narrow = true;
+            format++;
+        } else if (*format == 'l' && format[1] && wcschr(L"duxXi", format[1])) {
+            format++;
+        } else if (wcsncmp(format, L"I64", 3) == 0) {
+            out[pos++] = 'l';
+            out[pos++] = 'l';
+            format += 3;
+        }
+
+        if ((*format == 's' || *format == 'c') && !narrow) {
+            out[pos++] = 'l';
+        }
+        if (*format == 'S' || *format == 'C') {
+            out[pos++] = (TCHAR)(*format++ == 'S' ? 's' : 'c');
+            continue;
+        }
+        if (*format) {
+            out[pos++] = *format++;
+        }
+    }
+    out[pos] = '\0';
+}
+
+HostWaitable* NewWaitable(ObjectKind kind, bool manualReset, bool signaled, int references)
+{
+    HostWaitable* object = new HostWaitable;
+    object->kind = kind;
+    object->signaled = signaled;
+    object->manualReset = manualReset;
+    object->references = references;
+    object->start = NULL;
+    object->parameter = NULL;
+    return object;
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------------
+// Files
+
+HANDLE CreateFile(const TCHAR* path, DWORD access, DWORD, void*, DWORD disposition, DWORD, HANDLE)
+{
+    char native[NATIVE_PATH_SIZE];
+    ToNative(path, native);
+
+    struct stat info;
+    bool exists = (stat(native, &info) == 0);
+
+    int flags = O_RDONLY;
+    if ((access & GENERIC_READ) && (access & GENERIC_WRITE)) {
+        flags = O_RDWR;
+    } else if (access & GENERIC_WRITE) {
+        flags = O_WRONLY;
+    }
+
+    bool changes = false;
+    switch (disposition) {
+    case CREATE_NEW:
+        if (exists) {
+            return INVALID_HANDLE_VALUE;
+        }
+        flags |= O_CREAT | O_EXCL;
+        changes = true;
+        break;
+    case CREATE_ALWAYS:
+        flags |= O_CREAT | O_TRUNC;
+        changes = true;
+        break;
+    case OPEN_EXISTING:
+        break;
+    case OPEN_ALWAYS:
+        flags |= O_CREAT;
+        changes = !exists;
+        break;
+    case TRUNCATE_EXISTING:
+        flags |= O_TRUNC;
+        changes = true;
+        break;
+    default:
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (changes && PowerLost()) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    int fd = open(native, flags, 0644);
+    if (fd < 0) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    HostFile* file = new HostFile;
+    file->kind = OBJECT_FILE;
+    file->fd = fd;
+    return file;
+}
+
+BOOL ReadFile(HANDLE file, void* buffer, DWORD length, DWORD* bytesRead, void*)
+{
+    ssize_t n = read(((HostFile*)file)->fd, buffer, length);
+    *bytesRead = (n > 0) ? (DWORD)n : 0;
+    if (n > 0) {
+        __sync_fetch_and_add(&g_bytesRead, (ULONGLONG)n);
+    }
+    return (n >= 0);
+}
+
+BOOL WriteFile(HANDLE file, const void* buffer, DWORD length, DWORD* bytesWritten, void*)
+{
+    DWORD allowed = ClaimWrite(length);
+    DWORD written = 0;
+    while (written < allowed) {
+        ssize_t n = write(((HostFile*)file)->fd, (const char*)buffer + written, allowed - written);
+        if (n <= 0) {
+            break;
+        }
+        written += (DWORD)n;
+    }
+
+    *bytesWritten = written;
+    __sync_fetch_and_add(&g_bytesWritten, (ULONGLONG)written);
+    return (written == length);
+}
+
+DWORD SetFilePointer(HANDLE file, LONG distance, LONG*, DWORD method)
+{
+    int whence = (method == FILE_BEGIN) ? SEEK_SET : (method == FILE_CURRENT) ? SEEK_CUR : SEEK_END;
+    off_t position = lseek(((HostFile*)file)->fd, (off_t)distance, whence);
+    return (position < 0) ? INVALID_SET_FILE_POINTER : (DWORD)position;
+}
+
+DWORD GetFileSize(HANDLE file, DWORD* sizeHigh)
+{
+    struct stat info;
+    if (fstat(((HostFile*)file)->fd, &info) != 0) {
+        return INVALID_FILE_SIZE;
+    }
+    if (sizeHigh) {
+        *sizeHigh = 0;
+    }
+    return (DWORD)info.st_size;
+}
+
+BOOL SetEndOfFile(HANDLE file)
+{
+    if (PowerLost()) {
+        return FALSE;
+    }
+    int fd = ((HostFile*)file)->fd;
+    return (ftruncate(fd, lseek(fd, 0, SEEK_CUR)) == 0);
+}
+
+BOOL FlushFileBuffers(HANDLE)
+{
+    __sync_fetch_and_add(&g_flushCount, 1);
+
+    pthread_mutex_lock(&g_faultLock);
+    DWORD delayUs = g_flushDelayUs;
+    bool lost = g_powerLost;
+    pthread_mutex_unlock(&g_faultLock);
+
+    if (delayUs > 0) {
+        usleep(delayUs);
+    }
+    return !lost;
+}
+
+BOOL CloseHandle(HANDLE object)
+{
+    if (!object || object == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    HostObject* host = (HostObject*)object;
+    if (host->kind == OBJECT_FILE) {
+        close(((HostFile*)host)->fd);
+        delete (HostFile*)host;
+    } else if (host->kind == OBJECT_EVENT || host->kind == OBJECT_THREAD) {
+        pthread_mutex_lock(&g_waitLock);
+        Release((HostWaitable*)host);
+        pthread_mutex_unlock(&g_waitLock);
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL DeleteFile(const TCHAR* path)
+{
+    char native[NATIVE_PATH_SIZE];
+    ToNative(path, native);
+    return !PowerLost() && unlink(native) == 0;
+}
+
+BOOL MoveFile(const TCHAR* from, const TCHAR* to)
+{
+    char nativeFrom[NATIVE_PATH_SIZE];
+    char nativeTo[NATIVE_PATH_SIZE];
+    ToNative(from, nativeFrom);
+    ToNative(to, nativeTo);
+
+    // Unlike rename, MoveFile never replaces the target
+    struct stat info;
+    if (PowerLost() || stat(nativeTo, &info) == 0) {
+        return FALSE;
+    }
+    return (rename(nativeFrom, nativeTo) == 0);
+}
+
+DWORD GetFileAttributes(const TCHAR* path)
+{
+    char native[NATIVE_PATH_SIZE];
+    ToNative(path, native);
+
+    struct stat info;
+    return (stat(native, &info) == 0) ? (DWORD)FILE_ATTRIBUTE_NORMAL : 0xFFFFFFFF;
+}
+
+static void FillFindData(const char* path, WIN32_FIND_DATA* data)
+{
+    struct stat info;
+    data->dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+    data->nFileSizeLow = (stat(path, &info) == 0) ? (DWORD)info.st_size : 0;
+
+    const char* name = strrchr(path, '/');
+    MultiByteToWideChar(CP_UTF8, 0, name ? name + 1 : path, -1, data->cFileName, MAX_PATH);
+    data->cFileName[MAX_PATH - 1] = '\0';
+}
+
+HANDLE FindFirstFile(const TCHAR* pattern, WIN32_FIND_DATA* data)
+{
+    char native[NATIVE_PATH_SIZE];
+    ToNative(pattern, native);
+
+    HostFind* find = new HostFind;
+    find->kind = OBJECT_FIND;
+    find->next = 1;
+    if (glob(native, 0, NULL, &find->matches) != 0 || find->matches.gl_pathc == 0) {
+        globfree(&find->matches);
+        delete find;
+        return INVALID_HANDLE_VALUE;
+    }
+
+    FillFindData(find->matches.gl_pathv[0], data);
+    return find;
+}
+
+BOOL FindNextFile(HANDLE handle, WIN32_FIND_DATA* data)
+{
+    HostFind* find = (HostFind*)handle;
+    if (find->next >= find->matches.gl_pathc) {
+        return FALSE;
+    }
+    FillFindData(find->matches.gl_pathv[find->next++], data);
+    return TRUE;
+}
+
+BOOL FindClose(HANDLE handle)
+{
+    HostFind* find = (HostFind*)handle;
+    globfree(&find->matches);
+    delete find;
+    return TRUE;
+}
+
+// ---------------------------------------------------------------------------
+// Time
+
+DWORD GetTickCount()
+{
+    pthread_mutex_lock(&g_faultLock);
+    bool stopped = g_clockStopped;
+    DWORD ticks = g_clockTicks;
+    pthread_mutex_unlock(&g_faultLock);
+    if (stopped) {
+        return ticks;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (DWORD)((ULONGLONG)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+void Sleep(DWORD milliseconds)
+{
+    struct timespec delay;
+    delay.tv_sec = milliseconds / 1000;
+    delay.tv_nsec = (long)(milliseconds % 1000) * 1000000;
+    nanosleep(&delay, NULL);
+}
+
+void GetSystemTime(SYSTEMTIME* time)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    time_t seconds = now.tv_sec;
+    struct tm fields;
+    gmtime_r(&seconds, &fields);
+
+    time->wYear = (WORD)(fields.tm_year + 1900);
+    time->wMonth = (WORD)(fields.tm_mon + 1);
+    time->wDayOfWeek = (WORD)fields.tm_wday;
+    time->wDay = (WORD)fields.tm_mday;
+    time->wHour = (WORD)fields.tm_hour;
+    time->wMinute = (WORD)fields.tm_min;
+    time->wSecond = (WORD)fields.tm_sec;
+    time->wMilliseconds = (WORD)(now.tv_usec / 1000);
+}
+
+BOOL SystemTimeToFileTime(const SYSTEMTIME* time, FILETIME* fileTime)
+{
+    struct tm fields;
+    memset(&fields, 0, sizeof(fields));
+    fields.tm_year = time->wYear - 1900;
+    fields.tm_mon = time->wMonth - 1;
+    fields.tm_mday = time->wDay;
+    fields.tm_hour = time->wHour;
+    fields.tm_min = time->wMinute;
+    fields.tm_sec = time->wSecond;
+
+    // 100 ns units since 1601
+    ULONGLONG seconds = (ULONGLONG)timegm(&fields) + FILETIME_UNIX_EPOCH_S;
+    ULONGLONG value = seconds * 10000000 + (ULONGLONG)time->wMilliseconds * 10000;
+    fileTime->dwLowDateTime = (DWORD)value;
+    fileTime->dwHighDateTime = (DWORD)(value >> 32);
+    return TRUE;
+}
+
+// ---------------------------------------------------------------------------
+// Threads and synchronization
+
+HANDLE CreateThread(void*, DWORD, LPTHREAD_START_ROUTINE start, LPVOID parameter, DWORD, DWORD*)
+{
+    // One reference for the handle, one for the running thread
+    HostWaitable* thread = NewWaitable(OBJECT_THREAD, true, false, 2);
+    thread->start = start;
+    thread->parameter = parameter;
+
+    pthread_t id;
+    if (pthread_create(&id, NULL, ThreadMain, thread) != 0) {
+        delete thread;
+        return NULL;
+    }
+    pthread_detach(id);
+    return thread;
+}
+
+HANDLE GetCurrentThread()
+{
+    // A pseudo handle, as on the device; only priorities take it
+    return (HANDLE)-2;
+}
+
+BOOL SetThreadPriority(HANDLE, int)
+{
+    // The tests run at whatever priority they were started with
+    return TRUE;
+}
+
+int GetThreadPriority(HANDLE)
+{
+    return THREAD_PRIORITY_NORMAL;
+}
+
+HANDLE CreateEvent(void*, BOOL manualReset, BOOL initialState, const TCHAR*)
+{
+    return NewWaitable(OBJECT_EVENT, manualReset != FALSE, initialState != FALSE, 1);
+}
+
+BOOL SetEvent(HANDLE event)
+{
+    pthread_mutex_lock(&g_waitLock);
+    ((HostWaitable*)event)->signaled = true;
+    pthread_cond_broadcast(&g_waitChanged);
+    pthread_mutex_unlock(&g_waitLock);
+    return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE object, DWORD milliseconds)
+{
+    return WaitForMultipleObjects(1, &object, FALSE, milliseconds);
+}
+
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE* objects, BOOL, DWORD milliseconds)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    ULONGLONG nanoseconds = (ULONGLONG)deadline.tv_nsec + (ULONGLONG)milliseconds * 1000000;
+    deadline.tv_sec += (time_t)(nanoseconds / 1000000000);
+    deadline.tv_nsec = (long)(nanoseconds % 1000000000);
+
+    pthread_mutex_lock(&g_waitLock);
+    DWORD result = WAIT_TIMEOUT;
+    for (;;) {
+        for (DWORD i = 0; i < count; i++) {
+            HostWaitable* object = (HostWaitable*)objects[i];
+            if (object->signaled) {
+                if (!object->manualReset) {
+                    object->signaled = false;
+                }
+                result = WAIT_OBJECT_0 + i;
+                break;
+            }
+        }
+        if (result != WAIT_TIMEOUT || milliseconds == 0) {
+            break;
+        }
+
+        int error = (milliseconds == INFINITE) ?
+            pthread_cond_wait(&g_waitChanged, &g_waitLock) :
+            pthread_cond_timedwait(&g_waitChanged, &g_waitLock, &deadline);
+        if (error == ETIMEDOUT) {
+            milliseconds = 0;   // One last look
+        }
+    }
+    pthread_mutex_unlock(&g_waitLock);
+    return result;
+}
+
+void InitializeCriticalSection(CRITICAL_SECTION* section)
+{
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+
+    pthread_mutex_t* mutex = new pthread_mutex_t;
+    pthread_mutex_init(mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    section->mutex = mutex;
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION* section)
+{
+    pthread_mutex_t* mutex = (pthread_mutex_t*)section->mutex;
+    pthread_mutex_destroy(mutex);
+    delete mutex;
+    section->mutex = NULL;
+}
+
+void EnterCriticalSection(CRITICAL_SECTION* section)
+{
+    pthread_mutex_lock((pthread_mutex_t*)section->mutex);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION* section)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)section->mutex);
+}
+
+LONG InterlockedExchange(LONG volatile* target, LONG value)
+{
+    return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+LONG InterlockedCompareExchange(LONG volatile* target, LONG exchange, LONG comparand)
+{
+    return __sync_val_compare_and_swap(target, comparand, exchange);
+}
+
+LONG InterlockedExchangeAdd(LONG volatile* target, LONG value)
+{
+    return __sync_fetch_and_add(target, value);
+}
+
+// ---------------------------------------------------------------------------
+// Strings
+
+int lstrlen(const TCHAR* text)
+{
+    return text ? (int)wcslen(text) : 0;
+}
+
+TCHAR* lstrcpy(TCHAR* target, const TCHAR* source)
+{
+    return wcscpy(target, source);
+}
+
+TCHAR* lstrcpyn(TCHAR* target, const TCHAR* source, int maxChars)
+{
+    if (maxChars <= 0) {
+        return target;
+    }
+    int i = 0;
+    for (; i < maxChars - 1 && source[i]; i++) {
+        target[i] = source[i];
+    }
+    target[i] = '\0';
+    return target;
+}
+
+TCHAR* lstrcat(TCHAR* target, const TCHAR* source)
+{
+    return wcscat(target, source);
+}
+
+int lstrcmp(const TCHAR* first, const TCHAR* second)
+{
+    return wcscmp(first, second);
+}
+
+int wsprintf(TCHAR* buffer, const TCHAR* format, ...)
+{
+    // wsprintf writes at most 1024 characters
+    TCHAR converted[1024];
+    ConvertFormat(format, converted, sizeof(converted) / sizeof(TCHAR));
+
+    va_list args;
+    va_start(args, format);
+    int length = vswprintf(buffer, 1025, converted, args);
+    va_end(args);
+    return length;
+}
+
+int WideCharToMultiByte(UINT, DWORD, const WCHAR* text, int length, char* out, int outSize, const char*, BOOL*)
+{
+    // A length of -1 takes the terminator along; a size of 0 only measures
+    if (length < 0) {
+        length = (int)wcslen(text) + 1;
+    }
+
+    int total = 0;
+    for (int i = 0; i < length; i++) {
+        char encoded[4];
+        int count = EncodeUtf8((unsigned int)text[i], encoded);
+        if (outSize > 0) {
+            if (total + count > outSize) {
+                return 0;
+            }
+            memcpy(out + total, encoded, count);
+        }
+        total += count;
+    }
+    return total;
+}
+
+int MultiByteToWideChar(UINT, DWORD, const char* text, int length, WCHAR* out, int outChars)
+{
+    if (length < 0) {
+        length = (int)strlen(text) + 1;
+    }
+
+    const unsigned char* in = (const unsigned char*)text;
+    int total = 0;
+    for (int pos = 0; pos < length; ) {
+        unsigned int c = 0;
+        pos += DecodeUtf8(in + pos, length - pos, &c);
+        if (outChars > 0) {
+            if (total >= outChars) {
+                return 0;
+            }
+            out[total] = (WCHAR)c;
+        }
+        total++;
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// Controls
+
+void HostSetWriteBudget(long bytes)
+{
+    pthread_mutex_lock(&g_faultLock);
+    g_writeBudget = bytes;
+    g_powerLost = false;
+    pthread_mutex_unlock(&g_faultLock);
+}
+
+bool HostIsPowerLost()
+{
+    return PowerLost();
+}
+
+void HostSetFlushDelay(DWORD microseconds)
+{
+    pthread_mutex_lock(&g_faultLock);
+    g_flushDelayUs = microseconds;
+    pthread_mutex_unlock(&g_faultLock);
+}
+
+void HostStopClock(DWORD ticks)
+{
+    pthread_mutex_lock(&g_faultLock);
+    g_clockStopped = true;
+    g_clockTicks = ticks;
+    pthread_mutex_unlock(&g_faultLock);
+}
+
+void HostAdvanceClock(DWORD milliseconds)
+{
+    pthread_mutex_lock(&g_faultLock);
+    g_clockTicks += milliseconds;
+    pthread_mutex_unlock(&g_faultLock);
+}
+
+void HostRunClock()
+{
+    pthread_mutex_lock(&g_faultLock);
+    g_clockStopped = false;
+    pthread_mutex_unlock(&g_faultLock);
+}
+
+void HostResetCounters()
+{
+    __atomic_store_n(&g_flushCount, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&g_bytesRead, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&g_bytesWritten, 0, __ATOMIC_SEQ_CST);
+}
+
+DWORD HostGetFlushCount()
+{
+    return __atomic_load_n(&g_flushCount, __ATOMIC_SEQ_CST);
+}
+
+ULONGLONG HostGetBytesRead()
+{
+    return __atomic_load_n(&g_bytesRead, __ATOMIC_SEQ_CST);
+}
+
+ULONGLONG HostGetBytesWritten()
+{
+    return __atomic_load_n(&g_bytesWritten, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,157 @@
+#ifndef HOST_WINDOWS_H
+#define HOST_WINDOWS_H
+
+/**
+ * Host stand-in for <windows.h>
+ * Just the part of Win32 the journal and sync code use, built
+ * on POSIX (see win32_host.cpp) so that code can be tested and measured
+ * on a development machine. Only the tests and the host tools include
+ * it, by putting this directory ahead of the system headers. Strings are wide, as in the
+ * device's Unicode build. Files are plain POSIX files with the
+ * disposition rules of CreateFile; writes and flushes can be cut short
+ * or slowed down through host_faults.hpp.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+typedef wchar_t TCHAR;
+typedef wchar_t WCHAR;
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef unsigned int DWORD;
+typedef int LONG;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef unsigned long long ULONGLONG;
+typedef long long LONGLONG;
+typedef void* LPVOID;
+typedef void* HANDLE;
+typedef unsigned long UINT_PTR;
+
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+#define CALLBACK
+#define TEXT(text) L##text
+#define _T(text) L##text
+#define MAX_PATH 260
+#define INFINITE 0xFFFFFFFF
+#define MAKEWORD(low, high) ((WORD)(((BYTE)(low)) | (((WORD)((BYTE)(high))) << 8)))
+#define _wtoi(text) ((int)wcstol((text), NULL, 10))
+
+// Files
+#define INVALID_HANDLE_VALUE ((HANDLE)(long)-1)
+#define INVALID_SET_FILE_POINTER ((DWORD)-1)
+#define INVALID_FILE_SIZE ((DWORD)0xFFFFFFFF)
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x00000001
+#define FILE_SHARE_WRITE 0x00000002
+#define CREATE_NEW 1
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define TRUNCATE_EXISTING 5
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+
+struct WIN32_FIND_DATA {
+    DWORD dwFileAttributes;
+    DWORD nFileSizeLow;
+    TCHAR cFileName[MAX_PATH];
+};
+
+HANDLE CreateFile(const TCHAR* path, DWORD access, DWORD shareMode, void* security, DWORD disposition,
+                  DWORD attributes, HANDLE templateFile);
+BOOL ReadFile(HANDLE file, void* buffer, DWORD length, DWORD* bytesRead, void* overlapped);
+BOOL WriteFile(HANDLE file, const void* buffer, DWORD length, DWORD* bytesWritten, void* overlapped);
+DWORD SetFilePointer(HANDLE file, LONG distance, LONG* distanceHigh, DWORD method);
+DWORD GetFileSize(HANDLE file, DWORD* sizeHigh);
+BOOL SetEndOfFile(HANDLE file);
+BOOL FlushFileBuffers(HANDLE file);
+BOOL CloseHandle(HANDLE object);
+BOOL DeleteFile(const TCHAR* path);
+BOOL MoveFile(const TCHAR* from, const TCHAR* to);
+DWORD GetFileAttributes(const TCHAR* path);
+HANDLE FindFirstFile(const TCHAR* pattern, WIN32_FIND_DATA* data);
+BOOL FindNextFile(HANDLE find, WIN32_FIND_DATA* data);
+BOOL FindClose(HANDLE find);
+
+// Time
+struct SYSTEMTIME {
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+};
+
+struct FILETIME {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+};
+
+DWORD GetTickCount();
+void Sleep(DWORD milliseconds);
+void GetSystemTime(SYSTEMTIME* time);
+BOOL SystemTimeToFileTime(const SYSTEMTIME* time, FILETIME* fileTime);
+
+// Threads and synchronization
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define THREAD_PRIORITY_IDLE -15
+#define THREAD_PRIORITY_BELOW_NORMAL -1
+#define THREAD_PRIORITY_NORMAL 0
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID parameter);
+
+struct CRITICAL_SECTION {
+    void* mutex;
+};
+
+HANDLE CreateThread(void* security, DWORD stackSize, LPTHREAD_START_ROUTINE start, LPVOID parameter,
+                    DWORD flags, DWORD* threadId);
+HANDLE GetCurrentThread();
+BOOL SetThreadPriority(HANDLE thread, int priority);
+int GetThreadPriority(HANDLE thread);
+HANDLE CreateEvent(void* security, BOOL manualReset, BOOL initialState, const TCHAR* name);
+BOOL SetEvent(HANDLE event);
+DWORD WaitForSingleObject(HANDLE object, DWORD milliseconds);
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE* objects, BOOL waitAll, DWORD milliseconds);
+void InitializeCriticalSection(CRITICAL_SECTION* section);
+void DeleteCriticalSection(CRITICAL_SECTION* section);
+void EnterCriticalSection(CRITICAL_SECTION* section);
+void LeaveCriticalSection(CRITICAL_SECTION* section);
+LONG InterlockedExchange(LONG volatile* target, LONG value);
+LONG InterlockedCompareExchange(LONG volatile* target, LONG exchange, LONG comparand);
+LONG InterlockedExchangeAdd(LONG volatile* target, LONG value);
+
+// Strings
+#define CP_ACP 0
+#define CP_UTF8 65001
+
+int lstrlen(const TCHAR* text);
+TCHAR* lstrcpy(TCHAR* target, const TCHAR* source);
+TCHAR* lstrcpyn(TCHAR* target, const TCHAR* source, int maxChars);
+TCHAR* lstrcat(TCHAR* target, const TCHAR* source);
+int lstrcmp(const TCHAR* first, const TCHAR* second);
+// The Win32 format rules: %s is a TCHAR string, %hs a char string
+int wsprintf(TCHAR* buffer, const TCHAR* format, ...);
+int WideCharToMultiByte(UINT codePage, DWORD flags, const WCHAR* text, int length, char* out, int outSize,
+                        const char* defaultChar, BOOL* usedDefault);
+int MultiByteToWideChar(UINT codePage, DWORD flags, const char* text, int length, WCHAR* out, int outChars);
+
+#endif // HOST_WINDOWS_H
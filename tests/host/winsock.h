@@ -0,0 +1,70 @@
+#ifndef HOST_WINSOCK_H
+#define HOST_WINSOCK_H
+
+/**
+ * Host stand-in for <winsock.h>
+ * BSD sockets with the few places Winsock differs smoothed over: socket
+ * timeouts are DWORD milliseconds, select ignores its first argument,
+ * and a send to a closed peer fails instead of raising SIGPIPE.
+ */
+
+#include "windows.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+typedef int SOCKET;
+
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+
+struct WSADATA {
+    WORD wVersion;
+};
+
+inline int WSAStartup(WORD, WSADATA* data)
+{
+    data->wVersion = MAKEWORD(2, 2);
+    return 0;
+}
+
+inline int WSACleanup()
+{
+    return 0;
+}
+
+inline int closesocket(SOCKET s)
+{
+    return close(s);
+}
+
+inline int HostSetSockOpt(SOCKET s, int level, int name, const char* value, int length)
+{
+    if (level == SOL_SOCKET && (name == SO_RCVTIMEO || name == SO_SNDTIMEO) && length == sizeof(DWORD)) {
+        DWORD milliseconds = *(const DWORD*)value;
+        struct timeval timeout;
+        timeout.tv_sec = milliseconds / 1000;
+        timeout.tv_usec = (milliseconds % 1000) * 1000;
+        return setsockopt(s, level, name, &timeout, sizeof(timeout));
+    }
+    return setsockopt(s, level, name, value, (socklen_t)length);
+}
+
+inline int HostSelect(int, fd_set* readable, fd_set* writable, fd_set* failed, struct timeval* timeout)
+{
+    return select(FD_SETSIZE, readable, writable, failed, timeout);
+}
+
+inline int HostSend(SOCKET s, const char* data, int length, int flags)
+{
+    return (int)send(s, data, (size_t)length, flags | MSG_NOSIGNAL);
+}
+
+#define setsockopt HostSetSockOpt
+#define select HostSelect
+#define send HostSend
+
+#endif // HOST_WINSOCK_H
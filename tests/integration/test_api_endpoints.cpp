@@ -1 +1,188 @@
-// placeholder
+/**
+ * API endpoint tests
+ * The device and journal_replay against the mock server, journal_replay
+ * serve, with what took effect read back from its GET /api/v1/mock/stats.
+ * A change sent again, whether after a lost answer, side by side with
+ * its copies or in a journal replayed from the start, must be applied
+ * once and answered as the first copy was. Requests to one server must
+ * share one connection.
+ */
+
+#include "../../include/HttpClient.hpp"
+#include "../../include/ReplayCache.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+
+namespace {
+
+const DWORD RESPONSE_CHARS = 4096;
+
+bool GetStats(HttpClient& client, const HostServer& server, TCHAR* stats)
+{
+    TCHAR url[256];
+    HostServerUrl(server, "/api/v1/mock/stats", url, 256);
+    return client.Get(url, stats, RESPONSE_CHARS);
+}
+
+bool TestRetryStorm()
+{
+    // Three changes in ten applied and then left unanswered
+    const char* options[] = { "-d", "30", NULL };
+    HostServer server;
+    CHECK(HostStartServer(&server, options));
+
+    char url[256];
+    HostServerUrl(server, "", url, sizeof(url));
+    const char* storm[] = { "storm", url, "-n", "300", "-c", "4", "-p", "8", NULL };
+    int exitCode = HostRunTool(storm);
+
+    HttpClient client;
+    TCHAR stats[RESPONSE_CHARS];
+    bool answered = GetStats(client, server, stats);
+    HostStopServer(&server);
+
+    // Storm checks every confirmed change took effect once; the counts
+    // show the retries and copies really were answered from the record
+    CHECK(exitCode == 0);
+    CHECK(answered);
+    CHECK(HostStatValue(stats, "creates") == 100);
+    CHECK(HostStatValue(stats, "moves") == 100);
+    CHECK(HostStatValue(stats, "syncApplied") == 500);
+    CHECK(HostStatValue(stats, "dropped") > 0);
+    CHECK(HostStatValue(stats, "replayed") > 0);
+    CHECK(HostStatValue(stats, "duplicates") > 0);
+    CHECK(HostStatValue(stats, "conflicts") == 0);
+    return true;
+}
+
+bool TestIdempotencyKey()
+{
+    HostServer server;
+    CHECK(HostStartServer(&server, NULL));
+
+    TCHAR url[256];
+    TCHAR key[ReplayCache::KEY_CHARS];
+    TCHAR response[RESPONSE_CHARS];
+    TCHAR stats[RESPONSE_CHARS];
+    HostServerUrl(server, "/api/v1/items", url, 256);
+
+    HttpClient client;
+    ReplayCache::FormatKey(0x2a5f0c11, 41, 43, key);
+    client.SetHeader(TEXT("Idempotency-Key"), key);
+
+    // The same create twice, as a retry after a lost answer sends it
+    bool passed = client.Post(url, TEXT("{\"name\":\"Drill\"}"), response, RESPONSE_CHARS) &&
+                  client.GetLastHttpStatusCode() == 201;
+    passed = passed && client.Post(url, TEXT("{\"name\":\"Drill\"}"), response, RESPONSE_CHARS) &&
+             client.GetLastHttpStatusCode() == 201;
+    passed = passed && GetStats(client, server, stats) && HostStatValue(stats, "creates") == 1 &&
+             HostStatValue(stats, "replayed") == 1;
+
+    // The key on another request is refused rather than answered
+    passed = passed && !client.Post(url, TEXT("{\"name\":\"Saw\"}"), response, RESPONSE_CHARS) &&
+             client.GetLastHttpStatusCode() == 422;
+
+    // The same IDs in a recreated journal are a new change; headers are
+    // set anew for each request, as HbClient does
+    ReplayCache::FormatKey(0x2a5f0c12, 41, 43, key);
+    client.ClearHeaders();
+    client.SetHeader(TEXT("Idempotency-Key"), key);
+    passed = passed && client.Post(url, TEXT("{\"name\":\"Saw\"}"), response, RESPONSE_CHARS) &&
+             client.GetLastHttpStatusCode() == 201;
+    passed = passed && GetStats(client, server, stats);
+    HostStopServer(&server);
+
+    CHECK(passed);
+    CHECK(HostStatValue(stats, "creates") == 2);
+    CHECK(HostStatValue(stats, "replayed") == 1);
+    CHECK(HostStatValue(stats, "conflicts") == 1);
+    return true;
+}
+
+bool TestReplayedBatches()
+{
+    HostServer server;
+    CHECK(HostStartServer(&server, NULL));
+
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    bool passed = HostMakeJournalPath(nativePath, sizeof(nativePath), path);
+
+    const char* synth[] = { "synth", nativePath, "-n", "200", "-d", "1", NULL };
+    passed = passed && HostRunTool(synth) == 0;
+
+    char url[256];
+    HostServerUrl(server, "", url, sizeof(url));
+    const char* replay[] = { "replay", nativePath, url, NULL };
+
+    // The whole backlog twice, as a device that lost every acknowledgement
+    HttpClient client;
+    TCHAR first[RESPONSE_CHARS];
+    TCHAR second[RESPONSE_CHARS];
+    passed = passed && HostRunTool(replay) == 0 && GetStats(client, server, first);
+    passed = passed && HostRunTool(replay) == 0 && GetStats(client, server, second);
+    HostStopServer(&server);
+    HostRemoveJournalDir(nativePath);
+
+    CHECK(passed);
+    long applied = HostStatValue(first, "syncApplied");
+    CHECK(applied > 0);
+    CHECK(HostStatValue(first, "duplicates") == 0);
+    CHECK(HostStatValue(second, "syncApplied") == applied);
+    CHECK(HostStatValue(second, "duplicates") == applied);
+    CHECK(HostStatValue(second, "conflicts") == 0);
+    return true;
+}
+
+bool TestConnectionReuse()
+{
+    HostServer server;
+    CHECK(HostStartServer(&server, NULL));
+
+    TCHAR itemUrl[256];
+    TCHAR itemsUrl[256];
+    TCHAR syncUrl[256];
+    TCHAR response[RESPONSE_CHARS];
+    TCHAR before[RESPONSE_CHARS];
+    TCHAR after[RESPONSE_CHARS];
+    HostServerUrl(server, "/api/v1/items/4006381333931", itemUrl, 256);
+    HostServerUrl(server, "/api/v1/items", itemsUrl, 256);
+    HostServerUrl(server, "/api/v1/sync", syncUrl, 256);
+
+    // The server counts the connections it accepts; the observer's own
+    // stays open between its two reads
+    HttpClient observer;
+    bool passed = GetStats(observer, server, before);
+
+    // A sync session's worth of lookups, changes and batches
+    HttpClient client;
+    for (int round = 0; round < 5 && passed; round++) {
+        passed = client.Get(itemUrl, response, RESPONSE_CHARS) &&
+                 client.Put(itemUrl, TEXT("{\"name\":\"Drill\"}"), response, RESPONSE_CHARS) &&
+                 client.Post(itemsUrl, TEXT("{\"name\":\"Saw\"}"), response, RESPONSE_CHARS) &&
+                 client.Post(syncUrl, TEXT("{\"transactions\":[{\"transactionId\":\"7\"}]}"), response,
+                             RESPONSE_CHARS);
+    }
+    passed = passed && GetStats(observer, server, after);
+    HostStopServer(&server);
+
+    CHECK(passed);
+    CHECK(client.GetConnectionCount() == 1);
+    CHECK(observer.GetConnectionCount() == 1);
+    CHECK(HostStatValue(after, "connections") - HostStatValue(before, "connections") == 1);
+    // The client's 20 and the observer's first read
+    CHECK(HostStatValue(after, "requests") - HostStatValue(before, "requests") == 21);
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    RUN_TEST(TestRetryStorm);
+    RUN_TEST(TestIdempotencyKey);
+    RUN_TEST(TestReplayedBatches);
+    RUN_TEST(TestConnectionReuse);
+    return HostTestResult();
+}
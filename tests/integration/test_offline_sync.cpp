@@ -1 +1,194 @@
-// placeholder
+/**
+ * Offline sync tests
+ * A backlog built up offline, synthesized by journal_replay synth, sent
+ * to the mock server the way SyncEngine sends it on reconnect. Batched,
+ * it must take a small fraction of the requests it takes one operation
+ * at a time, and every operation must still be applied. While the server
+ * fails every operation, or cannot be reached, the SyncScheduler must
+ * space the retries out up to their cap, and go back to the shortest
+ * once a sync gets through.
+ */
+
+#include "../../include/HttpClient.hpp"
+#include "../../include/SyncScheduler.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+
+namespace {
+
+const DWORD RESPONSE_CHARS = 4096;
+
+// Replays the journal against a server of its own, with the replay
+// options (NULL-terminated), and gets what the server saw
+bool ReplayBacklog(const char* nativePath, const char* const* options, TCHAR* stats)
+{
+    HostServer server;
+    CHECK(HostStartServer(&server, NULL));
+
+    char url[256];
+    HostServerUrl(server, "", url, sizeof(url));
+    const char* arguments[16];
+    int count = 0;
+    arguments[count++] = "replay";
+    arguments[count++] = nativePath;
+    arguments[count++] = url;
+    for (int i = 0; options[i] && count < 15; i++) {
+        arguments[count++] = options[i];
+    }
+    arguments[count] = NULL;
+
+    bool passed = (HostRunTool(arguments) == 0);
+
+    HttpClient client;
+    TCHAR statsUrl[256];
+    HostServerUrl(server, "/api/v1/mock/stats", statsUrl, 256);
+    passed = passed && client.Get(statsUrl, stats, RESPONSE_CHARS);
+    HostStopServer(&server);
+    return passed;
+}
+
+bool TestBatchedBacklog()
+{
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    CHECK(HostMakeJournalPath(nativePath, sizeof(nativePath), path));
+
+    const char* synth[] = { "synth", nativePath, "-n", "300", "-d", "1", NULL };
+    bool passed = (HostRunTool(synth) == 0);
+
+    // The same backlog in batches of 64, and as older firmware sent it
+    const char* batched[] = { NULL };
+    const char* single[] = { "-b", "0", NULL };
+    TCHAR batchedStats[RESPONSE_CHARS];
+    TCHAR singleStats[RESPONSE_CHARS];
+    passed = passed && ReplayBacklog(nativePath, batched, batchedStats);
+    passed = passed && ReplayBacklog(nativePath, single, singleStats);
+    HostRemoveJournalDir(nativePath);
+    CHECK(passed);
+
+    long operations = HostStatValue(singleStats, "requests");
+    long requests = HostStatValue(batchedStats, "requests");
+    printf("(%ld operations, %ld batched requests) ", operations, requests);
+
+    // Every operation applied once, in as few requests as fit them
+    CHECK(operations > 64);
+    CHECK(HostStatValue(batchedStats, "syncApplied") == operations);
+    CHECK(HostStatValue(batchedStats, "duplicates") == 0);
+    CHECK(requests <= (operations + 63) / 64 + 1);
+    return true;
+}
+
+// Sends the backlog as one sync batch; false if there was no answer.
+// failed gets the operations the server did not apply
+bool SyncBacklog(HttpClient& client, const TCHAR* url, DWORD backlog, DWORD* failed)
+{
+    TCHAR body[1024];
+    TCHAR response[RESPONSE_CHARS];
+    int length = wsprintf(body, TEXT("{\"deviceId\":\"test\",\"transactions\":["));
+    for (DWORD i = 1; i <= backlog; i++) {
+        length += wsprintf(body + length, TEXT("%s{\"transactionId\":\"%lu\",\"type\":\"ITEM_SCAN\"}"),
+                           (i > 1) ? TEXT(",") : TEXT(""), i);
+    }
+    lstrcpy(body + length, TEXT("]}"));
+
+    *failed = backlog;
+    if (!client.Post(url, body, response, RESPONSE_CHARS)) {
+        return client.GetLastHttpStatusCode() != 0;
+    }
+
+    // A result per operation, "status":"failed" on those not applied
+    *failed = 0;
+    const TCHAR* found = response;
+    while ((found = wcsstr(found, TEXT("\"failed\""))) != NULL) {
+        (*failed)++;
+        found++;
+    }
+    return true;
+}
+
+// One sync at the scheduled time on the simulated clock; the wait after
+// it, as the sync thread would sleep
+DWORD RunDueSync(SyncScheduler& scheduler, HttpClient& client, const TCHAR* url, DWORD* now, bool* connected)
+{
+    *now += scheduler.GetWaitMs(*now);
+    scheduler.OnSyncStarted();
+
+    const DWORD backlog = 5;
+    DWORD failed = 0;
+    *connected = SyncBacklog(client, url, backlog, &failed);
+    scheduler.OnSyncFinished(*now, *connected, backlog, failed, failed);
+    return scheduler.GetWaitMs(*now);
+}
+
+bool TestRetryBackoff()
+{
+    const char* failing[] = { "-f", "100", NULL };
+    HostServer failingServer;
+    HostServer server;
+    CHECK(HostStartServer(&failingServer, failing));
+    if (!HostStartServer(&server, NULL)) {
+        HostStopServer(&failingServer);
+        CHECK(false);
+    }
+
+    TCHAR failingUrl[256];
+    TCHAR url[256];
+    TCHAR offlineUrl[256];
+    HostServerUrl(failingServer, "/api/v1/sync", failingUrl, 256);
+    HostServerUrl(server, "/api/v1/sync", url, 256);
+    wsprintf(offlineUrl, TEXT("http://127.0.0.1:%d/api/v1/sync"), HostFreePort());
+
+    SyncScheduler scheduler;
+    scheduler.SetBatchSize(64);
+    HttpClient client;
+    client.SetTimeout(2000);
+
+    // Just short of the tick count wrapping, which the schedule must ride
+    DWORD now = 0xFFFF0000;
+    scheduler.OnQueued(now, 5);
+    bool passed = (scheduler.GetWaitMs(now) == SyncScheduler::SETTLE_MS);
+
+    // Answered, but every operation failed: the retries double up to the
+    // interval and stay there, and new work does not bring them forward
+    bool connected = false;
+    DWORD expected = SyncScheduler::RETRY_MIN_MS;
+    for (int attempt = 0; attempt < 8 && passed; attempt++) {
+        DWORD wait = RunDueSync(scheduler, client, failingUrl, &now, &connected);
+        passed = connected && wait == expected;
+        if (!passed) {
+            printf("    retry %d after %lu ms, expected %lu\n", attempt + 1, (unsigned long)wait, (unsigned long)expected);
+        }
+        scheduler.OnQueued(now, 6);
+        passed = passed && scheduler.GetWaitMs(now) == wait;
+        expected = (expected * 2 < (DWORD)SyncScheduler::DEFAULT_INTERVAL_MS) ? expected * 2
+                                                                               : (DWORD)SyncScheduler::DEFAULT_INTERVAL_MS;
+    }
+    passed = passed && scheduler.GetConsecutiveFailures() == 8 && scheduler.GetFailureRate() > 80;
+
+    // No answer at all: retries stop at the probe interval
+    DWORD wait = RunDueSync(scheduler, client, offlineUrl, &now, &connected);
+    passed = passed && !connected && wait == SyncScheduler::OFFLINE_PROBE_MS;
+
+    // A sync that gets through ends the backoff; nothing is left to do,
+    // and the next failure is retried after the shortest wait again
+    wait = RunDueSync(scheduler, client, url, &now, &connected);
+    passed = passed && connected && wait == INFINITE && scheduler.GetConsecutiveFailures() == 0;
+    scheduler.OnSyncRequested(now);
+    wait = RunDueSync(scheduler, client, failingUrl, &now, &connected);
+    passed = passed && connected && wait == SyncScheduler::RETRY_MIN_MS;
+
+    HostStopServer(&failingServer);
+    HostStopServer(&server);
+    CHECK(passed);
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    RUN_TEST(TestBatchedBacklog);
+    RUN_TEST(TestRetryBackoff);
+    return HostTestResult();
+}
@@ -0,0 +1,483 @@
+/**
+ * Sync engine tests
+ * The device's own sync code, SyncEngine with its lanes and batches and
+ * HbClient, against the mock server, journal_replay serve, with what
+ * took effect read back from its GET /api/v1/mock/stats. A backlog spread
+ * over several lanes and windows must be applied once, in the requests
+ * the engine counted, and leave nothing pending. A change sent on its
+ * own must wait for the batch holding an earlier change to its item, and
+ * not go out at all if that change failed. An edit of a version the
+ * server has moved on from must be merged onto the server's copy and
+ * sent again, or, when both changed the same field, held as a conflict
+ * until the operator keeps one side. A sync session cut off by a power
+ * loss must be resumed from the journal as it was left: nothing it
+ * acknowledged sent again, nothing else left out.
+ */
+
+#include "../../include/HbClient.hpp"
+#include "../../include/HttpClient.hpp"
+#include "../../include/Journal.hpp"
+#include "../../include/SyncEngine.hpp"
+#include "../host/host_faults.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+
+namespace {
+
+const DWORD RESPONSE_CHARS = 4096;
+const int BACKLOG_ITEMS = 600;          // About 1400 transactions, two windows
+const int RESUME_ITEMS = 300;           // About 400, none merged
+const int PIPELINE_DEPTH = 4;
+
+bool GetStats(const HostServer& server, TCHAR* stats)
+{
+    HttpClient client;
+    TCHAR url[256];
+    HostServerUrl(server, "/api/v1/mock/stats", url, 256);
+    return client.Get(url, stats, RESPONSE_CHARS);
+}
+
+// Points the client at the server and logs the device in
+bool Connect(HbClient& client, const HostServer& server)
+{
+    TCHAR url[256];
+    HostServerUrl(server, "", url, 256);
+    client.SetBaseUrl(url);
+    return client.Authenticate(TEXT("hbx-test"), TEXT("test-key"));
+}
+
+// A rename of the item as read at version 1, with the item's ID the same
+// as its barcode as the mock has them. The mock's own copy is always
+// named "Mock item"
+void FormatEdit(const TCHAR* barcode, const TCHAR* originalName, const TCHAR* name, TCHAR* json)
+{
+    Models::Item original;
+    original.SetId(barcode);
+    original.SetBarcode(barcode);
+    original.SetName(originalName);
+    original.SetQuantity(1);
+    original.SetVersion(TEXT("1"));
+
+    Models::Item edit;
+    edit.SetId(barcode);
+    edit.SetBarcode(barcode);
+    edit.SetName(name);
+    edit.SetQuantity(1);
+    edit.TrackChanges(original);
+
+    TCHAR* text = edit.ToChangeJson();
+    lstrcpy(json, text);
+    delete[] text;
+}
+
+// Somebody else updates the item on the server, which moves it on from
+// version 1
+bool ChangeOnServer(const HostServer& server, const char* barcode)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/api/v1/items/%s", barcode);
+    TCHAR url[256];
+    HostServerUrl(server, path, url, 256);
+
+    HttpClient client;
+    TCHAR response[RESPONSE_CHARS];
+    return client.Put(url, TEXT("{\"name\":\"Mock item\"}"), response, RESPONSE_CHARS);
+}
+
+// Scans of every item, some of them repeated unless each is to be an
+// operation of its own, with moves, edits and creates among them;
+// returns the transactions queued
+int QueueBacklog(SyncEngine& engine, int items, bool repeatScans, int* edits)
+{
+    int queued = 0;
+    *edits = 0;
+    TCHAR barcode[32];
+    TCHAR data[1024];
+    bool passed = true;
+    for (int k = 0; k < items && passed; k++) {
+        wsprintf(barcode, TEXT("STK%05d"), k);
+        for (int scan = 0; scan <= (repeatScans ? k % 3 : 0); scan++) {
+            wsprintf(data, TEXT("SCAN:%s"), barcode);
+            passed = passed && engine.QueueTransaction(TEXT("ITEM_SCAN"), data, barcode);
+            queued++;
+        }
+        if (k % 4 == 0) {
+            wsprintf(data, TEXT("MOVE:%s:LOC-%d"), barcode, k % 7);
+            passed = passed && engine.QueueTransaction(TEXT("ITEM_MOVE"), data, barcode);
+            queued++;
+        }
+        if (k % 20 == 0) {
+            FormatEdit(barcode, TEXT("Mock item"), TEXT("Relabelled"), data);
+            passed = passed && engine.QueueTransaction(TEXT("ITEM_UPDATE"), data, barcode);
+            queued++;
+            (*edits)++;
+        }
+        if (k % 10 == 0) {
+            wsprintf(data, TEXT("{\"barcode\":\"NEW%05d\",\"name\":\"Bin %d\",\"quantity\":1}"), k, k);
+            passed = passed && engine.QueueTransaction(TEXT("ITEM_CREATE"), data, NULL);
+            queued++;
+        }
+    }
+    return passed ? queued : -1;
+}
+
+bool TestBacklogOverLanes()
+{
+    HostServer server;
+    CHECK(HostStartServer(&server, NULL));
+
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    TCHAR before[RESPONSE_CHARS];
+    TCHAR after[RESPONSE_CHARS];
+    bool passed = HostMakeJournalPath(nativePath, sizeof(nativePath), path);
+    int queued = 0;
+    int edits = 0;
+    SyncEngine::SyncStats stats;
+    SyncEngine::SyncStats second;
+    int left = -1;
+    {
+        Journal journal;
+        HbClient client;
+        SyncEngine engine(&client, &journal);
+        engine.SetPipelineDepth(PIPELINE_DEPTH);
+        passed = passed && journal.Initialize(path) && Connect(client, server);
+        queued = passed ? QueueBacklog(engine, BACKLOG_ITEMS, true, &edits) : -1;
+
+        passed = passed && GetStats(server, before) && engine.Sync();
+        stats = engine.GetLastSyncStats();
+        left = engine.GetQueuedTransactionCount();
+        passed = passed && GetStats(server, after);
+
+        // Nothing is left to send
+        passed = passed && engine.Sync();
+        second = engine.GetLastSyncStats();
+    }
+    HostStopServer(&server);
+    HostRemoveJournalDir(nativePath);
+
+    CHECK(passed);
+    printf("(%lu transactions, %lu operations, %lu requests) ", (unsigned long)stats.transactions,
+           (unsigned long)stats.operations, (unsigned long)stats.requests);
+    CHECK(queued > TransactionCoalescer::WINDOW_SIZE);
+    CHECK(stats.transactions == (DWORD)queued && stats.failed == 0 && left == 0);
+    CHECK(second.transactions == 0 && second.requests == 0);
+
+    // Every operation applied once: edits on their own, the rest batched.
+    // The engine's requests and the observer's first read
+    long applied = HostStatValue(after, "syncApplied") - HostStatValue(before, "syncApplied");
+    long updates = HostStatValue(after, "updates") - HostStatValue(before, "updates");
+    CHECK(updates == edits);
+    CHECK(applied + updates == (long)stats.operations);
+    CHECK(HostStatValue(after, "duplicates") == 0 && HostStatValue(after, "stale") == 0);
+    CHECK(HostStatValue(after, "requests") - HostStatValue(before, "requests") == (long)stats.requests + 1);
+    CHECK(stats.requests < stats.operations / 8);
+    return true;
+}
+
+bool TestLoneChangeWaitsForBatch()
+{
+    const char* failing[] = { "-f", "100", NULL };
+    HostServer failingServer;
+    HostServer server;
+    CHECK(HostStartServer(&failingServer, failing));
+    if (!HostStartServer(&server, NULL)) {
+        HostStopServer(&failingServer);
+        CHECK(false);
+    }
+
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    TCHAR before[RESPONSE_CHARS];
+    TCHAR failed[RESPONSE_CHARS];
+    TCHAR applied[RESPONSE_CHARS];
+    TCHAR edit[1024];
+    bool passed = HostMakeJournalPath(nativePath, sizeof(nativePath), path);
+    SyncEngine::SyncStats first;
+    SyncEngine::SyncStats second;
+    int pending = -1;
+    int left = -1;
+    {
+        Journal journal;
+        HbClient client;
+        SyncEngine engine(&client, &journal);
+        passed = passed && journal.Initialize(path) && Connect(client, failingServer);
+
+        // The move goes into a batch; the edit after it goes on its own
+        FormatEdit(TEXT("STK00001"), TEXT("Mock item"), TEXT("Relabelled"), edit);
+        passed = passed && engine.QueueTransaction(TEXT("ITEM_MOVE"), TEXT("MOVE:STK00001:LOC-2"), TEXT("STK00001")) &&
+                 engine.QueueTransaction(TEXT("ITEM_UPDATE"), edit, TEXT("STK00001"));
+
+        // The batch is sent first and fails, so the edit is held back
+        passed = passed && GetStats(failingServer, before) && !engine.Sync() && GetStats(failingServer, failed);
+        first = engine.GetLastSyncStats();
+        pending = engine.GetQueuedTransactionCount();
+
+        // Both go through once the server takes them
+        passed = passed && Connect(client, server) && engine.Sync() && GetStats(server, applied);
+        second = engine.GetLastSyncStats();
+        left = engine.GetQueuedTransactionCount();
+    }
+    HostStopServer(&failingServer);
+    HostStopServer(&server);
+    HostRemoveJournalDir(nativePath);
+
+    CHECK(passed);
+    CHECK(first.failed == 2 && first.requests == 1 && pending == 2);
+    CHECK(HostStatValue(failed, "requests") - HostStatValue(before, "requests") == 2);
+    CHECK(HostStatValue(failed, "updates") == 0);
+    CHECK(second.failed == 0 && second.requests == 2 && left == 0);
+    CHECK(HostStatValue(applied, "syncApplied") == 1 && HostStatValue(applied, "updates") == 1);
+    return true;
+}
+
+bool TestStaleEditRebased()
+{
+    HostServer server;
+    CHECK(HostStartServer(&server, NULL));
+
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    TCHAR stats[RESPONSE_CHARS];
+    TCHAR edit[1024];
+    bool passed = HostMakeJournalPath(nativePath, sizeof(nativePath), path);
+    SyncEngine::SyncStats synced;
+    SyncEngine::SyncConflict conflicts[4];
+    int conflictCount = -1;
+    int left = -1;
+    {
+        Journal journal;
+        HbClient client;
+        SyncEngine engine(&client, &journal);
+        passed = passed && journal.Initialize(path) && Connect(client, server);
+
+        // Renamed on the device; only the location changed on the server
+        FormatEdit(TEXT("STK00011"), TEXT("Mock item"), TEXT("Relabelled"), edit);
+        passed = passed && engine.QueueTransaction(TEXT("ITEM_UPDATE"), edit, TEXT("STK00011")) &&
+                 ChangeOnServer(server, "STK00011");
+
+        // Refused as stale, merged onto the server's copy and sent again
+        passed = passed && engine.Sync() && GetStats(server, stats);
+        synced = engine.GetLastSyncStats();
+        conflictCount = engine.GetConflicts(conflicts, 4);
+        left = engine.GetQueuedTransactionCount();
+    }
+    HostStopServer(&server);
+    HostRemoveJournalDir(nativePath);
+
+    CHECK(passed);
+    CHECK(synced.failed == 0 && synced.requests == 3 && left == 0 && conflictCount == 0);
+    CHECK(HostStatValue(stats, "stale") == 1);
+    CHECK(HostStatValue(stats, "updates") == 2);
+    return true;
+}
+
+bool TestConflictResolution()
+{
+    HostServer server;
+    CHECK(HostStartServer(&server, NULL));
+
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    TCHAR held[RESPONSE_CHARS];
+    TCHAR resolved[RESPONSE_CHARS];
+    TCHAR edit[1024];
+    bool passed = HostMakeJournalPath(nativePath, sizeof(nativePath), path);
+    SyncEngine::SyncStats first;
+    SyncEngine::SyncStats waiting;
+    SyncEngine::SyncStats last;
+    SyncEngine::SyncConflict conflicts[4];
+    int conflictCount = -1;
+    int stillHeld = -1;
+    int remaining = -1;
+    int pending = -1;
+    int left = -1;
+    bool unknownResolved = true;
+    {
+        Journal journal;
+        HbClient client;
+        SyncEngine engine(&client, &journal);
+        passed = passed && journal.Initialize(path) && Connect(client, server);
+
+        // Both items renamed on the device and, to something else, on the
+        // server since
+        FormatEdit(TEXT("STK00012"), TEXT("Old label"), TEXT("Relabelled"), edit);
+        passed = passed && engine.QueueTransaction(TEXT("ITEM_UPDATE"), edit, TEXT("STK00012"));
+        FormatEdit(TEXT("STK00013"), TEXT("Old label"), TEXT("Relabelled"), edit);
+        passed = passed && engine.QueueTransaction(TEXT("ITEM_UPDATE"), edit, TEXT("STK00013")) &&
+                 ChangeOnServer(server, "STK00012") && ChangeOnServer(server, "STK00013");
+
+        // Refused and looked up, but not sent again
+        passed = passed && !engine.Sync() && GetStats(server, held);
+        first = engine.GetLastSyncStats();
+        conflictCount = engine.GetConflicts(conflicts, 4);
+        pending = engine.GetQueuedTransactionCount();
+
+        // Unresolved, they are not even sent
+        passed = passed && !engine.Sync();
+        waiting = engine.GetLastSyncStats();
+        stillHeld = engine.GetConflicts(conflicts, 4);
+
+        // The device's name for one, the server's for the other
+        for (int i = 0; i < conflictCount && i < 4; i++) {
+            bool keepLocal = (lstrcmp(conflicts[i].barcode, TEXT("STK00012")) == 0);
+            passed = passed && engine.ResolveConflict(conflicts[i].transactionId,
+                                                      keepLocal ? SyncEngine::RESOLVE_KEEP_LOCAL
+                                                                : SyncEngine::RESOLVE_KEEP_SERVER);
+        }
+        unknownResolved = engine.ResolveConflict(999999, SyncEngine::RESOLVE_KEEP_LOCAL);
+        passed = passed && engine.Sync() && GetStats(server, resolved);
+        last = engine.GetLastSyncStats();
+        remaining = engine.GetConflicts(conflicts, 4);
+        left = engine.GetQueuedTransactionCount();
+    }
+    HostStopServer(&server);
+    HostRemoveJournalDir(nativePath);
+
+    CHECK(passed);
+    CHECK(conflictCount == 2 && conflicts[0].fields == Models::Item::FIELD_NAME);
+    CHECK(first.failed == 2 && first.requests == 4 && pending == 2);
+    CHECK(HostStatValue(held, "stale") == 2 && HostStatValue(held, "updates") == 2);
+    CHECK(waiting.failed == 2 && waiting.requests == 0 && stillHeld == 2);
+    CHECK(!unknownResolved);
+
+    // Kept locally: refused again, from the record under its key, then
+    // merged over the server's name and sent under a key of its own; kept
+    // on the server: dropped without a request
+    CHECK(last.failed == 0 && last.requests == 3 && remaining == 0 && left == 0);
+    CHECK(HostStatValue(resolved, "replayed") == 1 && HostStatValue(resolved, "stale") == 2);
+    CHECK(HostStatValue(resolved, "updates") == 3);
+    return true;
+}
+
+// Operations the server applied for the first time
+long AppliedCount(const TCHAR* stats)
+{
+    return HostStatValue(stats, "syncApplied") + HostStatValue(stats, "updates");
+}
+
+// The device dying part way through a sync: once half the backlog is
+// acknowledged, nothing more reaches the flash or the server
+struct PowerCut {
+    HostServer* server;
+    DWORD threshold;
+    DWORD handled;              // Acknowledged when the power went
+    TCHAR stats[RESPONSE_CHARS];
+    bool cut;
+    HANDLE finished;
+};
+
+void CutPowerMidSync(SyncEngine::SyncEvent event, DWORD value, void* userData)
+{
+    PowerCut* cut = (PowerCut*)userData;
+    if (event == SyncEngine::SYNC_EVENT_PROGRESS && !cut->cut && value >= cut->threshold) {
+        cut->cut = true;
+        cut->handled = value;
+        HostSetWriteBudget(0);
+        if (!GetStats(*cut->server, cut->stats)) {
+            cut->stats[0] = '\0';
+        }
+        HostStopServer(cut->server);
+    } else if (event == SyncEngine::SYNC_EVENT_FINISHED && cut->cut) {
+        SetEvent(cut->finished);
+    }
+}
+
+bool TestSessionResumedAfterPowerLoss()
+{
+    HostServer server;
+    CHECK(HostStartServer(&server, NULL));
+
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    bool passed = HostMakeJournalPath(nativePath, sizeof(nativePath), path);
+    PowerCut cut;
+    cut.server = &server;
+    cut.threshold = 0;
+    cut.handled = 0;
+    cut.stats[0] = '\0';
+    cut.cut = false;
+    cut.finished = CreateEvent(NULL, TRUE, FALSE, NULL);
+    int queued = -1;
+    {
+        // One lane, so the acknowledgements stop with the requests
+        Journal journal;
+        HbClient client;
+        SyncEngine engine(&client, &journal);
+        engine.SetPipelineDepth(1);
+        int edits = 0;
+        passed = passed && journal.Initialize(path) && Connect(client, server);
+        queued = passed ? QueueBacklog(engine, RESUME_ITEMS, false, &edits) : -1;
+        cut.threshold = (DWORD)queued / 2;
+
+        // As the device runs it, until the sync the power went in ends
+        passed = passed && queued > 0 && engine.StartAutoSync(60, CutPowerMidSync, &cut);
+        if (passed) {
+            engine.RequestSync();
+            passed = WaitForSingleObject(cut.finished, 60000) == WAIT_OBJECT_0;
+        }
+        engine.StopAutoSync();
+    }
+    CloseHandle(cut.finished);
+    HostSetWriteBudget(-1);
+    if (!cut.cut) {
+        HostStopServer(&server);
+    }
+
+    // Back up, against a server of its own
+    HostServer resumed;
+    TCHAR stats[RESPONSE_CHARS];
+    bool sessionOpen = false;
+    bool sessionClosed = false;
+    int pending = -1;
+    int left = -1;
+    SyncEngine::SyncStats synced;
+    if (passed && HostStartServer(&resumed, NULL)) {
+        Journal journal;
+        HbClient client;
+        SyncEngine engine(&client, &journal);
+        Journal::SyncSession session;
+        passed = journal.Initialize(path) && Connect(client, resumed);
+        pending = journal.GetTransactionCount();
+        sessionOpen = journal.GetSyncSession(&session) && session.acknowledged == cut.handled;
+
+        passed = passed && engine.Sync() && GetStats(resumed, stats);
+        synced = engine.GetLastSyncStats();
+        left = engine.GetQueuedTransactionCount();
+        sessionClosed = !journal.GetSyncSession(&session);
+        HostStopServer(&resumed);
+    } else {
+        passed = false;
+    }
+    HostRemoveJournalDir(nativePath);
+
+    CHECK(passed && cut.cut);
+    printf("(cut after %lu of %d) ", (unsigned long)cut.handled, queued);
+    CHECK(cut.handled < (DWORD)queued && cut.stats[0]);
+
+    // What was acknowledged stayed so, in the session left open
+    CHECK(pending == queued - (int)cut.handled);
+    CHECK(sessionOpen);
+
+    // Only the rest is sent, and all of it; with no transaction merged
+    // into another, between them the two servers applied each once
+    CHECK(synced.transactions == (DWORD)pending && synced.failed == 0 && left == 0);
+    CHECK(sessionClosed);
+    CHECK(AppliedCount(cut.stats) == (long)cut.handled);
+    CHECK(AppliedCount(stats) == (long)pending);
+    CHECK(HostStatValue(stats, "duplicates") == 0 && HostStatValue(stats, "replayed") == 0);
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    RUN_TEST(TestBacklogOverLanes);
+    RUN_TEST(TestLoneChangeWaitsForBatch);
+    RUN_TEST(TestStaleEditRebased);
+    RUN_TEST(TestConflictResolution);
+    RUN_TEST(TestSessionResumedAfterPowerLoss);
+    return HostTestResult();
+}
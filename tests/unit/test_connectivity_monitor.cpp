@@ -0,0 +1,205 @@
+/**
+ * ConnectivityMonitor tests
+ * The circuit breaker on a clock moved by hand (see host_faults.hpp), with
+ * Check probing as the sync thread does when the probe thread is not
+ * running. A probe of a numeric address always resolves and one without
+ * a server never does, so no network is needed. Failed requests must
+ * open the circuit at the threshold and no earlier; while it is open no
+ * probe may go out before its time, and the waits must double, with
+ * jitter, up to their cap, across the tick count wrapping. A probe that
+ * gets through half-opens it, and the next request closes it or opens
+ * it again. A good result is trusted only for its time to live.
+ */
+
+#include "../../include/ConnectivityMonitor.hpp"
+#include "../../include/HbClient.hpp"
+#include "../host/host_faults.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+
+namespace {
+
+const TCHAR* const REACHABLE_URL = TEXT("http://127.0.0.1:1");
+const TCHAR* const UNREACHABLE_URL = TEXT("");
+
+// How far the clock moves between checks while waiting for a probe
+const DWORD STEP_MS = 50;
+
+// The clock stopped at a tick count for the test, and running again after
+struct StoppedClock {
+    explicit StoppedClock(DWORD ticks)
+    {
+        HostStopClock(ticks);
+    }
+
+    ~StoppedClock()
+    {
+        HostRunClock();
+    }
+};
+
+// Changes the monitor announced
+struct Changes {
+    int available;
+    int unavailable;
+};
+
+void OnChange(bool available, void* userData)
+{
+    Changes* changes = (Changes*)userData;
+    if (available) {
+        changes->available++;
+    } else {
+        changes->unavailable++;
+    }
+}
+
+void ReportFailures(ConnectivityMonitor& monitor, int count)
+{
+    for (int i = 0; i < count; i++) {
+        monitor.ReportFailure();
+    }
+}
+
+// Checks as the clock moves on until a probe half-opens the circuit;
+// how long that took, or INFINITE if it did not within limit
+DWORD WaitForProbe(ConnectivityMonitor& monitor, DWORD limit)
+{
+    for (DWORD elapsed = 0; elapsed <= limit; elapsed += STEP_MS) {
+        if (monitor.Check()) {
+            return (monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_HALF_OPEN) ? elapsed : INFINITE;
+        }
+        HostAdvanceClock(STEP_MS);
+    }
+    return INFINITE;
+}
+
+bool TestCircuitStates()
+{
+    StoppedClock clock(1000);
+    HbClient client;
+    client.SetBaseUrl(REACHABLE_URL);
+    Changes changes = { 0, 0 };
+    ConnectivityMonitor monitor(&client);
+
+    // Started only to take the callback; Check probes from here on
+    CHECK(monitor.Start(OnChange, &changes));
+    monitor.Stop();
+    CHECK(monitor.IsOnline());
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_CLOSED);
+
+    // Failures in a row open it, a success in between starts them over
+    ReportFailures(monitor, ConnectivityMonitor::FAILURE_THRESHOLD - 1);
+    monitor.ReportSuccess();
+    ReportFailures(monitor, ConnectivityMonitor::FAILURE_THRESHOLD - 1);
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_CLOSED && changes.unavailable == 0);
+    monitor.ReportFailure();
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_OPEN);
+    CHECK(changes.unavailable == 1 && changes.available == 0);
+
+    // Open: unreachable, and no probe before the first is due
+    CHECK(!monitor.IsOnline() && !monitor.Check());
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_OPEN);
+
+    // A probe half-opens it; the request after it closes it
+    CHECK(WaitForProbe(monitor, ConnectivityMonitor::PROBE_MIN_MS) != INFINITE);
+    CHECK(changes.available == 1 && monitor.IsOnline());
+    monitor.ReportSuccess();
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_CLOSED);
+    CHECK(changes.available == 1);
+
+    // Or, failing, opens it again at once
+    ReportFailures(monitor, ConnectivityMonitor::FAILURE_THRESHOLD);
+    CHECK(WaitForProbe(monitor, ConnectivityMonitor::PROBE_MIN_MS) != INFINITE);
+    monitor.ReportFailure();
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_OPEN);
+    CHECK(changes.unavailable == 3 && !monitor.Check());
+
+    // Asked to, it probes without waiting out the backoff
+    monitor.Refresh();
+    CHECK(monitor.Check());
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_HALF_OPEN);
+    monitor.ReportSuccess();
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_CLOSED);
+    CHECK(changes.available == 3 && changes.unavailable == 3);
+    return true;
+}
+
+bool TestProbeBackoff()
+{
+    // The tick count wraps during the second wait
+    StoppedClock clock(0xFFFFFFFF - 6000);
+    HbClient client;
+    client.SetBaseUrl(REACHABLE_URL);
+    ConnectivityMonitor monitor(&client);
+
+    // Each opening without a success in between waits twice as long, the
+    // last half of it jitter, up to the cap
+    ReportFailures(monitor, ConnectivityMonitor::FAILURE_THRESHOLD);
+    DWORD delay = ConnectivityMonitor::PROBE_MIN_MS;
+    bool passed = true;
+    for (int opening = 1; opening <= 8 && passed; opening++) {
+        DWORD waited = WaitForProbe(monitor, ConnectivityMonitor::PROBE_MAX_MS + STEP_MS);
+        passed = waited != INFINITE && waited >= delay / 2 && waited <= delay;
+        if (!passed) {
+            printf("    opening %d probed after %lu ms, expected %lu to %lu\n", opening, (unsigned long)waited,
+                   (unsigned long)(delay / 2), (unsigned long)delay);
+        }
+        monitor.ReportFailure();
+        delay = (delay * 2 < (DWORD)ConnectivityMonitor::PROBE_MAX_MS) ? delay * 2
+                                                                       : (DWORD)ConnectivityMonitor::PROBE_MAX_MS;
+    }
+    CHECK(passed);
+
+    // A success starts the backoff over
+    CHECK(WaitForProbe(monitor, ConnectivityMonitor::PROBE_MAX_MS) != INFINITE);
+    monitor.ReportSuccess();
+    ReportFailures(monitor, ConnectivityMonitor::FAILURE_THRESHOLD);
+    CHECK(WaitForProbe(monitor, ConnectivityMonitor::PROBE_MAX_MS) <= ConnectivityMonitor::PROBE_MIN_MS);
+    return true;
+}
+
+bool TestResultLifetime()
+{
+    StoppedClock clock(50000);
+    HbClient client;
+    client.SetBaseUrl(REACHABLE_URL);
+    Changes changes = { 0, 0 };
+    ConnectivityMonitor monitor(&client);
+    CHECK(monitor.Start(OnChange, &changes));
+    monitor.Stop();
+    monitor.ReportSuccess();
+
+    // The network goes; until the result is stale nobody asks
+    client.SetBaseUrl(UNREACHABLE_URL);
+    HostAdvanceClock(ConnectivityMonitor::ONLINE_TTL_MS - 1);
+    CHECK(monitor.IsOnline());
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_CLOSED);
+
+    // Then a probe finds out, and opens the circuit without waiting for
+    // requests to fail
+    HostAdvanceClock(1);
+    CHECK(!monitor.IsOnline());
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_OPEN && changes.unavailable == 1);
+
+    // Probes that fail keep it open, and say so only once
+    HostAdvanceClock(ConnectivityMonitor::PROBE_MAX_MS);
+    CHECK(!monitor.Check());
+    CHECK(monitor.GetCircuitState() == ConnectivityMonitor::CIRCUIT_OPEN && changes.unavailable == 1);
+
+    client.SetBaseUrl(REACHABLE_URL);
+    CHECK(WaitForProbe(monitor, ConnectivityMonitor::PROBE_MAX_MS) != INFINITE);
+    CHECK(changes.available == 1);
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    RUN_TEST(TestCircuitStates);
+    RUN_TEST(TestProbeBackoff);
+    RUN_TEST(TestResultLifetime);
+    return HostTestResult();
+}
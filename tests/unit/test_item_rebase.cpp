@@ -0,0 +1,161 @@
+/**
+ * Item rebase tests
+ * An offline edit remembers the version it was made on and the original
+ * value of each field it changed, through the queue's JSON as well. When
+ * the server has moved on, Rebase must take the fields only the server
+ * changed, keep those only the edit changed, and report a field both
+ * changed to different values, leaving the edit as it was unless told
+ * to keep its own values. A later edit of the same item must carry the
+ * earlier one's originals, so the merge still sees what that one changed.
+ */
+
+#include "../../include/Models/Item.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+using namespace HBX::Models;
+
+namespace {
+
+// The item as the server has it
+void SetServerCopy(Item& item, const TCHAR* version, const TCHAR* name, const TCHAR* description, int quantity)
+{
+    item.SetId(TEXT("it-41"));
+    item.SetBarcode(TEXT("4006381333931"));
+    item.SetName(name);
+    item.SetDescription(description);
+    item.SetLocationId(TEXT("LOC-1"));
+    item.SetQuantity(quantity);
+    item.SetVersion(version);
+}
+
+// Renamed offline from version 1
+void MakeRename(Item& edit, const TCHAR* name)
+{
+    Item original;
+    SetServerCopy(original, TEXT("1"), TEXT("Drill"), TEXT("Cordless"), 1);
+    SetServerCopy(edit, NULL, name, TEXT("Cordless"), 1);
+    edit.TrackChanges(original);
+}
+
+bool SameText(const TCHAR* text, const TCHAR* expected)
+{
+    return text && lstrcmp(text, expected) == 0;
+}
+
+bool TestTrackChanges()
+{
+    Item edit;
+    MakeRename(edit, TEXT("Drill XL"));
+    CHECK(edit.GetChangedFields() == Item::FIELD_NAME);
+    CHECK(SameText(edit.GetVersion(), TEXT("1")));
+
+    // Queued as JSON, the version and the original come back with it
+    TCHAR* json = edit.ToChangeJson();
+    CHECK(json != NULL);
+    bool hasBase = (wcsstr(json, TEXT("\"base.name\":\"Drill\"")) != NULL);
+    Item queued;
+    bool parsed = queued.FromJson(json);
+    delete[] json;
+    CHECK(hasBase && parsed);
+    CHECK(queued.GetChangedFields() == Item::FIELD_NAME);
+    CHECK(SameText(queued.GetVersion(), TEXT("1")));
+
+    // The same value on both sides is no conflict
+    Item current;
+    SetServerCopy(current, TEXT("2"), TEXT("Drill XL"), TEXT("Cordless"), 1);
+    CHECK(queued.Rebase(current, false) == 0);
+    CHECK(SameText(queued.GetVersion(), TEXT("2")));
+    return true;
+}
+
+bool TestCleanRebase()
+{
+    Item edit;
+    MakeRename(edit, TEXT("Drill XL"));
+
+    // Only the description and quantity changed on the server
+    Item current;
+    SetServerCopy(current, TEXT("2"), TEXT("Drill"), TEXT("Cordless, 18 V"), 3);
+    CHECK(edit.Rebase(current, false) == 0);
+
+    // Now an edit of version 2 that changes only the name
+    CHECK(SameText(edit.GetName(), TEXT("Drill XL")));
+    CHECK(SameText(edit.GetDescription(), TEXT("Cordless, 18 V")));
+    CHECK(edit.GetQuantity() == 3);
+    CHECK(SameText(edit.GetVersion(), TEXT("2")));
+    CHECK(edit.GetChangedFields() == Item::FIELD_NAME);
+    return true;
+}
+
+bool TestSameFieldConflict()
+{
+    Item edit;
+    MakeRename(edit, TEXT("Drill XL"));
+    Item current;
+    SetServerCopy(current, TEXT("2"), TEXT("Drill Pro"), TEXT("Cordless, 18 V"), 1);
+
+    // Reported, and the edit left as it was
+    CHECK(edit.Rebase(current, false) == Item::FIELD_NAME);
+    CHECK(SameText(edit.GetName(), TEXT("Drill XL")));
+    CHECK(SameText(edit.GetDescription(), TEXT("Cordless")));
+    CHECK(SameText(edit.GetVersion(), TEXT("1")));
+
+    // Kept: the edit's name over the server's, the rest merged
+    CHECK(edit.Rebase(current, true) == Item::FIELD_NAME);
+    CHECK(SameText(edit.GetName(), TEXT("Drill XL")));
+    CHECK(SameText(edit.GetDescription(), TEXT("Cordless, 18 V")));
+    CHECK(SameText(edit.GetVersion(), TEXT("2")));
+    CHECK(edit.Rebase(current, false) == 0);
+    return true;
+}
+
+bool TestKeepChangesOf()
+{
+    Item first;
+    MakeRename(first, TEXT("Drill XL"));
+
+    // Made on the device's copy after the first edit, not yet synced
+    Item seen;
+    SetServerCopy(seen, TEXT("1"), TEXT("Drill XL"), TEXT("Cordless"), 1);
+    Item second;
+    SetServerCopy(second, NULL, TEXT("Drill XL"), TEXT("Cordless"), 4);
+    second.TrackChanges(seen);
+    CHECK(second.GetChangedFields() == Item::FIELD_QUANTITY);
+
+    // Merged, the name is a change of the edit too, from the first original
+    second.KeepChangesOf(first);
+    CHECK(second.GetChangedFields() == (Item::FIELD_NAME | Item::FIELD_QUANTITY));
+    CHECK(SameText(second.GetVersion(), TEXT("1")));
+
+    // So a server that renamed the item is a conflict on the name
+    Item renamed;
+    SetServerCopy(renamed, TEXT("2"), TEXT("Drill Pro"), TEXT("Cordless"), 1);
+    CHECK(second.Rebase(renamed, false) == Item::FIELD_NAME);
+
+    // And one that only changed the description merges cleanly
+    Item described;
+    SetServerCopy(described, TEXT("2"), TEXT("Drill"), TEXT("Cordless, 18 V"), 1);
+    CHECK(second.Rebase(described, false) == 0);
+    CHECK(SameText(second.GetName(), TEXT("Drill XL")) && second.GetQuantity() == 4);
+    CHECK(SameText(second.GetDescription(), TEXT("Cordless, 18 V")));
+
+    // An untracked edit has nothing to carry
+    Item plain;
+    SetServerCopy(plain, NULL, TEXT("Drill"), TEXT("Cordless"), 1);
+    second.KeepChangesOf(plain);
+    CHECK(second.GetChangedFields() == (Item::FIELD_NAME | Item::FIELD_QUANTITY));
+    CHECK(SameText(second.GetVersion(), TEXT("2")));
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    RUN_TEST(TestTrackChanges);
+    RUN_TEST(TestCleanRebase);
+    RUN_TEST(TestSameFieldConflict);
+    RUN_TEST(TestKeepChangesOf);
+    return HostTestResult();
+}
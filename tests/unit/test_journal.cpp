@@ -1 +1,810 @@
-// placeholder
+/**
+ * Journal tests: crash safety
+ * A power loss is simulated by cutting the writes short after a byte
+ * budget (see host_faults.hpp). Each test runs a piece of work once to
+ * learn how many bytes it writes, then again with the power failing at
+ * each of those bytes, and checks what the next Initialize makes of the
+ * files: every transaction confirmed durable is there, in order and
+ * intact, nothing half-written is, and the journal takes new
+ * transactions that survive another restart.
+ *
+ * The startup test checks that opening a journal after a crash costs
+ * about the same whatever its history: Initialize reads the checkpoint
+ * and the records after it, not every record ever written.
+ *
+ * The compaction test checks that segments are dropped or rewritten by
+ * how much of them is still pending, counted as transactions are
+ * appended and acknowledged, and that nothing pending is lost on the way.
+ * The retention test checks that a journal over its flash budget with
+ * nothing synced gives up its oldest transactions, a segment at a time,
+ * and keeps the newest above the floor.
+ *
+ * The cursor test checks that a PendingCursor returns the pending
+ * transactions in order and passes over synced ones, including those
+ * acknowledged and appended while it is part way through. The ack test
+ * checks that a transaction marked synced by ID is that one, even among
+ * copies of its text, and that an ID the journal does not hold pending,
+ * never seen or already synced, is refused without effect.
+ *
+ * The query test checks that a QueryCursor returns the transactions of a
+ * type, of an item and in a time window, synced or not and in order,
+ * with the window taking its start and not its end.
+ */
+
+#include "../../include/Journal.hpp"
+#include "../host/host_faults.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+
+namespace {
+
+// Transactions in the journal before the power fails
+const int BASE_TRANSACTIONS = 3;
+// Transactions written while it fails
+const int TORN_TRANSACTIONS = 3;
+
+// Transactions of this much padding fill the first segment in
+// ROLL_BASE; the next one starts a new segment and rewrites the manifest
+const DWORD ROLL_PADDING = 4000;
+const int ROLL_BASE = 64;
+
+// Startup: transactions in the history, how many of them are still
+// pending, and how many were appended after the last checkpoint
+const int STARTUP_SMALL_HISTORY = 1000;
+const int STARTUP_LARGE_HISTORY = 100000;
+const int STARTUP_PENDING = 500;
+const int STARTUP_TAIL = 50;
+// What an MC75 may spend on it; the host should be far inside it
+const double STARTUP_BUDGET_MS = 200.0;
+
+// Compaction: four segments' worth of transactions, of ROLL_PADDING
+const int COMPACT_TRANSACTIONS = ROLL_BASE * 4;
+
+// Cursor: transactions logged before the walk, and where in it the
+// journal changes
+const int CURSOR_TRANSACTIONS = 40;
+const int CURSOR_CHANGE_AT = 10;
+
+// Query: transactions logged, a ms or more apart
+const int QUERY_TRANSACTIONS = 12;
+
+// Retention: a budget of about two segments, half of it kept pending
+const DWORD RETENTION_MAX_BYTES = 512 * 1024;
+const DWORD RETENTION_FLOOR_BYTES = 256 * 1024;
+
+// A journal path in a fresh directory, removed again at the end of the test
+struct TestJournal {
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+
+    TestJournal()
+    {
+        HostSetWriteBudget(-1);
+        if (!HostMakeJournalPath(nativePath, sizeof(nativePath), path)) {
+            nativePath[0] = '\0';
+            path[0] = '\0';
+        }
+    }
+
+    ~TestJournal()
+    {
+        HostSetWriteBudget(-1);
+        if (nativePath[0]) {
+            HostRemoveJournalDir(nativePath);
+        }
+    }
+};
+
+void NumberedDetails(int n, DWORD padding, TCHAR* text)
+{
+    int length = wsprintf(text, TEXT("{\"n\":%d,\"note\":\""), n);
+    for (DWORD i = 0; i < padding; i++) {
+        text[length++] = (TCHAR)('a' + (n + i) % 26);
+    }
+    lstrcpy(text + length, TEXT("\"}"));
+}
+
+bool LogNumbered(Journal* journal, int n, bool durable, DWORD padding = 0)
+{
+    TCHAR* text = new TCHAR[padding + 64];
+    NumberedDetails(n, padding, text);
+    bool logged = journal->LogTransaction(TEXT("ITEM_SCAN"), TEXT("0012345678905"), text, durable);
+    delete[] text;
+    return logged;
+}
+
+// The journal holds transactions 0 to count - 1, pending and in order
+bool CheckPending(Journal* journal, int count, DWORD padding = 0)
+{
+    CHECK(journal->GetTransactionCount() == count);
+
+    TCHAR* expected = new TCHAR[padding + 64];
+    Journal::PendingCursor cursor(journal);
+    bool intact = true;
+    for (int n = 0; n < count && intact; n++) {
+        NumberedDetails(n, padding, expected);
+        const TCHAR* text = cursor.Next();
+        intact = (text && lstrcmp(text, expected) == 0);
+        if (!intact) {
+            printf("    transaction %d is missing or damaged\n", n);
+        }
+    }
+    delete[] expected;
+
+    CHECK(intact);
+    CHECK(cursor.Next() == NULL);
+    return true;
+}
+
+// After a crash that may have cut off the transactions past confirmed
+// (of attempted), the journal opens with all of the confirmed ones,
+// takes a new one and keeps it across a clean restart
+bool CheckRecovery(const TCHAR* path, int confirmed, int attempted, DWORD padding)
+{
+    int count = 0;
+    {
+        Journal journal;
+        CHECK(journal.Initialize(path));
+        count = journal.GetTransactionCount();
+        CHECK(count >= confirmed && count <= attempted);
+        CHECK(CheckPending(&journal, count, padding));
+        CHECK(LogNumbered(&journal, count, true, padding));
+    }
+
+    Journal journal;
+    CHECK(journal.Initialize(path));
+    CHECK(CheckPending(&journal, count + 1, padding));
+    return true;
+}
+
+// Work done while the power fails, on a journal holding base
+// transactions; returns how many it holds by the work's own account
+typedef int (*CrashWork)(Journal* journal, int base);
+
+// Runs work once to count the bytes it writes, then once with the power
+// failing at every one of them, each time on a copy of the same journal
+bool RunAtEveryByte(CrashWork work, int base, int attempted, DWORD padding)
+{
+    TestJournal original;
+    {
+        Journal journal;
+        CHECK(journal.Initialize(original.path));
+        for (int n = 0; n < base; n++) {
+            CHECK(LogNumbered(&journal, n, false, padding));
+        }
+    }
+
+    ULONGLONG total = 0;
+    {
+        TestJournal dir;
+        CHECK(HostCopyJournalDir(original.nativePath, dir.nativePath));
+        Journal journal;
+        CHECK(journal.Initialize(dir.path));
+        HostResetCounters();
+        CHECK(work(&journal, base) == attempted);
+        total = HostGetBytesWritten();
+    }
+    CHECK(total > 0);
+
+    for (long budget = 0; budget <= (long)total; budget++) {
+        TestJournal dir;
+        CHECK(HostCopyJournalDir(original.nativePath, dir.nativePath));
+
+        int confirmed = 0;
+        {
+            Journal journal;
+            CHECK(journal.Initialize(dir.path));
+            HostSetWriteBudget(budget);
+            confirmed = work(&journal, base);
+        }
+        HostSetWriteBudget(-1);
+
+        if (!CheckRecovery(dir.path, confirmed, attempted, padding)) {
+            printf("    power lost after %ld of %lu bytes\n", budget, (unsigned long)total);
+            return false;
+        }
+    }
+    return true;
+}
+
+int AppendDurable(Journal* journal, int base)
+{
+    int confirmed = base;
+    for (int n = base; n < base + TORN_TRANSACTIONS; n++) {
+        if (LogNumbered(journal, n, true) && confirmed == n) {
+            confirmed = n + 1;
+        }
+    }
+    return confirmed;
+}
+
+int WriteCheckpoint(Journal* journal, int base)
+{
+    journal->Checkpoint();
+    return base;
+}
+
+int FlushGroupCommit(Journal* journal, int base)
+{
+    // Batched in memory, then written with one flush
+    journal->SetGroupCommit(60000, 64);
+    for (int n = base; n < base + TORN_TRANSACTIONS; n++) {
+        LogNumbered(journal, n, false);
+    }
+    return journal->Flush() ? base + TORN_TRANSACTIONS : base;
+}
+
+int AppendAcrossRoll(Journal* journal, int base)
+{
+    return LogNumbered(journal, base, true, ROLL_PADDING) ? base + 1 : base;
+}
+
+bool TestTornDurableAppend()
+{
+    return RunAtEveryByte(AppendDurable, BASE_TRANSACTIONS, BASE_TRANSACTIONS + TORN_TRANSACTIONS, 0);
+}
+
+bool TestTornCheckpoint()
+{
+    return RunAtEveryByte(WriteCheckpoint, BASE_TRANSACTIONS, BASE_TRANSACTIONS, 0);
+}
+
+bool TestTornGroupCommit()
+{
+    return RunAtEveryByte(FlushGroupCommit, BASE_TRANSACTIONS, BASE_TRANSACTIONS + TORN_TRANSACTIONS, 0);
+}
+
+bool TestTornSegmentRoll()
+{
+    // The append has to start the second segment for this to test anything
+    TestJournal dir;
+    {
+        Journal journal;
+        CHECK(journal.Initialize(dir.path));
+        for (int n = 0; n < ROLL_BASE; n++) {
+            CHECK(LogNumbered(&journal, n, false, ROLL_PADDING));
+        }
+        TCHAR segment[MAX_PATH + 16];
+        wsprintf(segment, TEXT("%s.%08lx"), dir.path, 2UL);
+        CHECK(GetFileAttributes(segment) == 0xFFFFFFFF);
+        CHECK(AppendAcrossRoll(&journal, ROLL_BASE) == ROLL_BASE + 1);
+        CHECK(GetFileAttributes(segment) != 0xFFFFFFFF);
+    }
+
+    return RunAtEveryByte(AppendAcrossRoll, ROLL_BASE, ROLL_BASE + 1, ROLL_PADDING);
+}
+
+bool TestRecoveryIsLogged()
+{
+    TestJournal dir;
+    {
+        Journal journal;
+        CHECK(journal.Initialize(dir.path));
+        CHECK(AppendDurable(&journal, 0) == TORN_TRANSACTIONS);
+
+        // Part of the next record reaches the file
+        HostSetWriteBudget(20);
+        CHECK(!LogNumbered(&journal, TORN_TRANSACTIONS, true));
+    }
+    HostSetWriteBudget(-1);
+
+    {
+        Journal journal;
+        CHECK(journal.Initialize(dir.path));
+        CHECK(CheckPending(&journal, TORN_TRANSACTIONS));
+    }
+
+    char diagPath[MAX_PATH + 8];
+    snprintf(diagPath, sizeof(diagPath), "%s.diag", dir.nativePath);
+    FILE* diag = fopen(diagPath, "rb");
+    CHECK(diag != NULL);
+
+    static char contents[64 * 1024];
+    size_t length = fread(contents, 1, sizeof(contents), diag);
+    fclose(diag);
+
+    const char* entry = "[JOURNAL_RECOVERY] Journal recovered after unclean shutdown";
+    CHECK(memmem(contents, length, entry, strlen(entry)) != NULL);
+    return true;
+}
+
+// Writes history transactions, syncs all but the last pending of them,
+// writes a checkpoint and appends tail more
+bool FillHistory(Journal* journal, const TCHAR* path, int history, int pending, int tail)
+{
+    CHECK(journal->Initialize(path));
+
+    // Batched as a busy stocktake would be
+    CHECK(journal->SetGroupCommit(20, 256));
+    for (int n = 0; n < history; n++) {
+        CHECK(LogNumbered(journal, n, false));
+    }
+    CHECK(journal->Flush());
+
+    ULONGLONG ids[STARTUP_PENDING];
+    int synced = 0;
+    while (synced < history - pending) {
+        Journal::PendingCursor cursor(journal);
+        int count = 0;
+        while (count < STARTUP_PENDING && synced + count < history - pending && cursor.Next()) {
+            ids[count++] = cursor.GetId();
+        }
+        CHECK(count > 0);
+        CHECK(journal->AcknowledgeSynced(ids, count));
+        synced += count;
+    }
+    CHECK(journal->Checkpoint());
+
+    for (int n = history; n < history + tail; n++) {
+        CHECK(LogNumbered(journal, n, true));
+    }
+    return true;
+}
+
+// A device that has been in use for a while and then lost its battery
+bool BuildHistory(const TCHAR* path, int history, int pending, int tail)
+{
+    {
+        Journal journal;
+        CHECK(FillHistory(&journal, path, history, pending, tail));
+        HostSetWriteBudget(0);
+    }
+    HostSetWriteBudget(-1);
+    return true;
+}
+
+// Opens the journal and reports the time and bytes it took
+bool MeasureStartup(const TCHAR* path, int expected, double* ms, ULONGLONG* bytesRead)
+{
+    HostResetCounters();
+    double start = HostNowUs();
+
+    Journal journal;
+    CHECK(journal.Initialize(path));
+
+    *ms = (HostNowUs() - start) / 1000.0;
+    *bytesRead = HostGetBytesRead();
+    CHECK(journal.GetTransactionCount() == expected);
+    return true;
+}
+
+bool TestStartupAfterCrash()
+{
+    TestJournal small;
+    TestJournal large;
+    CHECK(BuildHistory(small.path, STARTUP_SMALL_HISTORY, STARTUP_PENDING, STARTUP_TAIL));
+    CHECK(BuildHistory(large.path, STARTUP_LARGE_HISTORY, STARTUP_PENDING, STARTUP_TAIL));
+
+    double smallMs = 0.0;
+    double largeMs = 0.0;
+    ULONGLONG smallRead = 0;
+    ULONGLONG largeRead = 0;
+    CHECK(MeasureStartup(small.path, STARTUP_PENDING + STARTUP_TAIL, &smallMs, &smallRead));
+    CHECK(MeasureStartup(large.path, STARTUP_PENDING + STARTUP_TAIL, &largeMs, &largeRead));
+
+    ULONGLONG largeBytes = HostJournalBytes(large.nativePath);
+    printf("\n    %d records: %.1f ms, %lu bytes read\n", STARTUP_SMALL_HISTORY, smallMs, (unsigned long)smallRead);
+    printf("    %d records: %.1f ms, %lu bytes read of %lu\n    ", STARTUP_LARGE_HISTORY, largeMs,
+           (unsigned long)largeRead, (unsigned long)largeBytes);
+
+    // A hundred times the history, but the same pending transactions and
+    // tail: what is read may grow with the segment list, not the records
+    CHECK(largeBytes > 0);
+    CHECK(largeRead < largeBytes / 20);
+    CHECK(largeRead < smallRead * 2);
+    CHECK(largeMs < STARTUP_BUDGET_MS);
+    return true;
+}
+
+// Pending after TestCompaction acknowledges the rest: none of the first
+// segment, one in eight of the second, all after that
+bool StaysPendingInCompaction(int n)
+{
+    return (n >= ROLL_BASE * 2) || (n >= ROLL_BASE && n % 8 == 0);
+}
+
+bool CheckCompacted(Journal* journal)
+{
+    TCHAR* expected = new TCHAR[ROLL_PADDING + 64];
+    Journal::PendingCursor cursor(journal);
+    bool intact = true;
+    for (int n = 0; n < COMPACT_TRANSACTIONS && intact; n++) {
+        if (StaysPendingInCompaction(n)) {
+            NumberedDetails(n, ROLL_PADDING, expected);
+            const TCHAR* text = cursor.Next();
+            intact = (text && lstrcmp(text, expected) == 0);
+        }
+    }
+    intact = intact && cursor.Next() == NULL;
+    delete[] expected;
+    CHECK(intact);
+    return true;
+}
+
+bool TestCompaction()
+{
+    TestJournal dir;
+    {
+        Journal journal;
+        CHECK(journal.Initialize(dir.path));
+        CHECK(journal.SetGroupCommit(20, 64));
+        for (int n = 0; n < COMPACT_TRANSACTIONS; n++) {
+            CHECK(LogNumbered(&journal, n, false, ROLL_PADDING));
+        }
+        CHECK(journal.Flush());
+
+        ULONGLONG ids[COMPACT_TRANSACTIONS];
+        int count = 0;
+        Journal::PendingCursor cursor(&journal);
+        for (int n = 0; n < COMPACT_TRANSACTIONS && cursor.Next(); n++) {
+            if (!StaysPendingInCompaction(n)) {
+                ids[count++] = cursor.GetId();
+            }
+        }
+        CHECK(journal.AcknowledgeSynced(ids, count));
+
+        // The fully synced segment goes, the mostly synced one is
+        // rewritten, and the pending ones stay as they are
+        Journal::CompactionStats stats;
+        CHECK(journal.Compact());
+        journal.GetCompactionStats(&stats);
+        printf("(%lu dropped, %lu rewritten) ", (unsigned long)stats.segmentsDropped,
+               (unsigned long)stats.segmentsRewritten);
+        CHECK(stats.segmentsDropped == 1);
+        CHECK(stats.segmentsRewritten == 1);
+        CHECK(CheckCompacted(&journal));
+
+        // The rewritten segment is all pending now, so there is no more
+        CHECK(journal.Compact());
+        journal.GetCompactionStats(&stats);
+        CHECK(stats.segmentsDropped == 1 && stats.segmentsRewritten == 1);
+    }
+
+    // Counted again on opening, to the same result
+    Journal journal;
+    CHECK(journal.Initialize(dir.path));
+    CHECK(CheckCompacted(&journal));
+    CHECK(journal.Compact());
+    Journal::CompactionStats stats;
+    journal.GetCompactionStats(&stats);
+    CHECK(stats.segmentsDropped == 0 && stats.segmentsRewritten == 0);
+    return true;
+}
+
+// Transactions from first to count - 1 are pending, in order
+bool CheckPendingFrom(Journal* journal, int first, int count, DWORD padding)
+{
+    TCHAR* expected = new TCHAR[padding + 64];
+    Journal::PendingCursor cursor(journal);
+    bool intact = true;
+    for (int n = first; n < count && intact; n++) {
+        NumberedDetails(n, padding, expected);
+        const TCHAR* text = cursor.Next();
+        intact = (text && lstrcmp(text, expected) == 0);
+    }
+    intact = intact && cursor.Next() == NULL;
+    delete[] expected;
+    CHECK(intact);
+    return true;
+}
+
+bool TestRetentionOverBudget()
+{
+    TestJournal dir;
+    int total = COMPACT_TRANSACTIONS;
+    DWORD dropped = 0;
+    {
+        Journal journal;
+        CHECK(journal.Initialize(dir.path));
+        CHECK(journal.SetGroupCommit(20, 64));
+        for (int n = 0; n < total; n++) {
+            CHECK(LogNumbered(&journal, n, false, ROLL_PADDING));
+        }
+        CHECK(journal.Flush());
+
+        // Nothing synced, so only dropping pending transactions helps;
+        // each commit past the check interval takes a step
+        journal.SetRetention(RETENTION_MAX_BYTES, 0, RETENTION_FLOOR_BYTES);
+        for (int step = 0; step < 16; step++, total++) {
+            CHECK(LogNumbered(&journal, total, true, ROLL_PADDING));
+        }
+
+        Journal::RetentionStats stats;
+        journal.GetRetentionStats(&stats);
+        dropped = stats.transactionsDropped;
+        printf("(%lu dropped, %lu KB used, %lu KB pending) ", (unsigned long)dropped,
+               (unsigned long)(stats.bytesUsed / 1024), (unsigned long)(stats.pendingBytes / 1024));
+
+        // Whole segments of the oldest went; the newest stay, above the floor
+        CHECK(dropped > 0 && dropped % ROLL_BASE == 0);
+        CHECK(stats.bytesUsed <= RETENTION_MAX_BYTES + 256 * 1024);
+        CHECK(stats.pendingBytes >= RETENTION_FLOOR_BYTES);
+        CHECK(CheckPendingFrom(&journal, (int)dropped, total, ROLL_PADDING));
+    }
+
+    Journal journal;
+    CHECK(journal.Initialize(dir.path));
+    CHECK(CheckPendingFrom(&journal, (int)dropped, total, ROLL_PADDING));
+    return true;
+}
+
+// What TestPendingCursor's walk returns: every third transaction was
+// synced before it, and two just ahead of it while it was at
+// CURSOR_CHANGE_AT, itself acknowledged then too
+bool ReturnedByCursor(int n)
+{
+    return n % 3 != 0 && n != CURSOR_CHANGE_AT + 1 && n != CURSOR_CHANGE_AT + 3;
+}
+
+bool TestPendingCursor()
+{
+    TestJournal dir;
+    Journal journal;
+    CHECK(journal.Initialize(dir.path));
+    for (int n = 0; n < CURSOR_TRANSACTIONS; n++) {
+        CHECK(LogNumbered(&journal, n, true));
+    }
+
+    // Journal IDs, in the order logged
+    ULONGLONG ids[CURSOR_TRANSACTIONS + 2];
+    {
+        Journal::PendingCursor cursor(&journal);
+        CHECK(cursor.GetRemaining() == CURSOR_TRANSACTIONS);
+        for (int n = 0; n < CURSOR_TRANSACTIONS; n++) {
+            CHECK(cursor.Next() != NULL);
+            ids[n] = cursor.GetId();
+            CHECK(n == 0 || ids[n] > ids[n - 1]);
+        }
+        CHECK(cursor.Next() == NULL && cursor.GetRemaining() == 0);
+    }
+    for (int n = 0; n < CURSOR_TRANSACTIONS; n += 3) {
+        CHECK(journal.MarkTransactionSynced(ids[n]));
+    }
+
+    TCHAR expected[64];
+    Journal::PendingCursor cursor(&journal);
+    int total = CURSOR_TRANSACTIONS;
+    bool intact = true;
+    for (int n = 0; n < total + 2 && intact; n++) {
+        if (!ReturnedByCursor(n)) {
+            continue;
+        }
+        NumberedDetails(n, 0, expected);
+        const TCHAR* text = cursor.Next();
+        intact = (text && lstrcmp(text, expected) == 0);
+        if (!intact) {
+            printf("    expected transaction %d, got %ls\n", n, text ? text : TEXT("nothing"));
+            break;
+        }
+
+        // The one just returned and two ahead of it synced, two more
+        // transactions appended, all under the open cursor
+        if (n == CURSOR_CHANGE_AT) {
+            intact = journal.MarkTransactionSynced(cursor.GetId()) &&
+                     journal.MarkTransactionSynced(ids[CURSOR_CHANGE_AT + 1]) &&
+                     journal.MarkTransactionSynced(ids[CURSOR_CHANGE_AT + 3]) &&
+                     LogNumbered(&journal, total, true) && LogNumbered(&journal, total + 1, true);
+            int remaining = 0;
+            for (int k = n + 1; k < total + 2; k++) {
+                remaining += ReturnedByCursor(k) ? 1 : 0;
+            }
+            intact = intact && cursor.GetRemaining() == remaining;
+        }
+    }
+    CHECK(intact);
+    CHECK(cursor.Next() == NULL);
+
+    // Appended after it ran out, it still finds them
+    CHECK(LogNumbered(&journal, total + 2, true));
+    NumberedDetails(total + 2, 0, expected);
+    const TCHAR* text = cursor.Next();
+    CHECK(text && lstrcmp(text, expected) == 0);
+    CHECK(cursor.Next() == NULL);
+    return true;
+}
+
+// The pending transactions' numbers, in order, as a string
+void PendingNumbers(Journal* journal, char* numbers, int size)
+{
+    int length = 0;
+    numbers[0] = '\0';
+    Journal::PendingCursor cursor(journal);
+    const TCHAR* text;
+    while ((text = cursor.Next()) != NULL && length < size - 8) {
+        int n = -1;
+        swscanf(text, TEXT("{\"n\":%d"), &n);
+        length += snprintf(numbers + length, size - length, "%s%d", length ? "," : "", n);
+    }
+}
+
+bool TestAckById()
+{
+    TestJournal dir;
+    const int order[] = { 0, 1, 2, 1, 3, 4 };
+    const int count = sizeof(order) / sizeof(order[0]);
+    ULONGLONG ids[count];
+    char numbers[64];
+    {
+        Journal journal;
+        CHECK(journal.Initialize(dir.path));
+
+        // Transaction 1 twice, as a scan repeated to the same text
+        for (int i = 0; i < count; i++) {
+            CHECK(LogNumbered(&journal, order[i], true));
+        }
+        Journal::PendingCursor cursor(&journal);
+        for (int i = 0; i < count; i++) {
+            CHECK(cursor.Next() != NULL);
+            ids[i] = cursor.GetId();
+        }
+
+        // By ID the second copy goes, where by text it would be the first
+        CHECK(journal.MarkTransactionSynced(ids[3]));
+        CHECK(journal.MarkTransactionSynced(ids[0]));
+        PendingNumbers(&journal, numbers, sizeof(numbers));
+        CHECK(strcmp(numbers, "1,2,3,4") == 0);
+        CHECK(journal.GetTransactionCount() == 4);
+
+        // Already synced, or never logged: refused, and nothing changes
+        CHECK(!journal.MarkTransactionSynced(ids[3]));
+        CHECK(!journal.MarkTransactionSynced(ids[count - 1] + 1));
+        CHECK(!journal.MarkTransactionSynced((ULONGLONG)0));
+        CHECK(journal.GetTransactionCount() == 4);
+
+        // Synced by text, the ID is refused after
+        TCHAR text[64];
+        NumberedDetails(4, 0, text);
+        CHECK(journal.MarkTransactionSynced(text));
+        CHECK(!journal.MarkTransactionSynced(ids[5]));
+        CHECK(journal.GetTransactionCount() == 3);
+    }
+
+    // The acknowledgements stand after a restart, and so do the refusals
+    Journal journal;
+    CHECK(journal.Initialize(dir.path));
+    PendingNumbers(&journal, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "1,2,3") == 0);
+    CHECK(!journal.MarkTransactionSynced(ids[3]) && !journal.MarkTransactionSynced(ids[5]));
+    CHECK(journal.MarkTransactionSynced(ids[1]));
+    CHECK(!journal.MarkTransactionSynced(ids[1]));
+    CHECK(journal.GetTransactionCount() == 2);
+    return true;
+}
+
+// Transaction n of TestQueryCursor: every third a move, the odd ones of
+// item B2 and the even ones of A1
+const TCHAR* QueryType(int n)
+{
+    return (n % 3 == 2) ? TEXT("ITEM_MOVE") : TEXT("ITEM_SCAN");
+}
+
+const TCHAR* QueryItem(int n)
+{
+    return (n % 2) ? TEXT("B2") : TEXT("A1");
+}
+
+// The numbers of the transactions a query returns, in order, as a
+// string; "error" if one does not fit the filter or comes out of order
+void QueryNumbers(Journal* journal, const TCHAR* type, const TCHAR* item, ULONGLONG fromTime, ULONGLONG toTime,
+                  char* numbers, int size)
+{
+    Journal::QueryFilter filter;
+    filter.transactionType = type;
+    filter.itemId = item;
+    filter.fromTime = fromTime;
+    filter.toTime = toTime;
+
+    int length = 0;
+    numbers[0] = '\0';
+    ULONGLONG lastId = 0;
+    Journal::QueryCursor cursor(journal, filter);
+    const TCHAR* text;
+    while ((text = cursor.Next()) != NULL && length < size - 8) {
+        int n = -1;
+        swscanf(text, TEXT("{\"n\":%d"), &n);
+        bool fits = n >= 0 && cursor.GetId() > lastId &&
+                    lstrcmp(cursor.GetTransactionType(), QueryType(n)) == 0 &&
+                    lstrcmp(cursor.GetItemId(), QueryItem(n)) == 0 &&
+                    cursor.GetTimestamp() >= fromTime && (toTime == 0 || cursor.GetTimestamp() < toTime);
+        if (!fits) {
+            snprintf(numbers, size, "error");
+            return;
+        }
+        lastId = cursor.GetId();
+        length += snprintf(numbers + length, size - length, "%s%d", length ? "," : "", n);
+    }
+}
+
+bool TestQueryCursor()
+{
+    TestJournal dir;
+    Journal journal;
+    CHECK(journal.Initialize(dir.path));
+
+    TCHAR text[64];
+    for (int n = 0; n < QUERY_TRANSACTIONS; n++) {
+        NumberedDetails(n, 0, text);
+        CHECK(journal.LogTransaction(QueryType(n), QueryItem(n), text, true));
+        Sleep(2);
+    }
+
+    // Times and IDs as stored, read back through the pending cursor
+    ULONGLONG times[QUERY_TRANSACTIONS];
+    ULONGLONG ids[QUERY_TRANSACTIONS];
+    Journal::PendingCursor pending(&journal);
+    for (int n = 0; n < QUERY_TRANSACTIONS; n++) {
+        CHECK(pending.Next() != NULL);
+        times[n] = pending.GetTimestamp();
+        ids[n] = pending.GetId();
+        CHECK(n == 0 || times[n] > times[n - 1]);
+    }
+
+    // By type and item, synced transactions too
+    for (int n = 0; n < 6; n++) {
+        CHECK(journal.MarkTransactionSynced(ids[n]));
+    }
+    char numbers[64];
+    QueryNumbers(&journal, NULL, NULL, 0, 0, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "0,1,2,3,4,5,6,7,8,9,10,11") == 0);
+    QueryNumbers(&journal, TEXT("ITEM_MOVE"), NULL, 0, 0, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "2,5,8,11") == 0);
+    QueryNumbers(&journal, NULL, TEXT("B2"), 0, 0, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "1,3,5,7,9,11") == 0);
+    QueryNumbers(&journal, TEXT("ITEM_MOVE"), TEXT("B2"), 0, 0, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "5,11") == 0);
+    QueryNumbers(&journal, TEXT(""), TEXT(""), 0, 0, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "0,1,2,3,4,5,6,7,8,9,10,11") == 0);
+
+    // Tags are compared whole
+    QueryNumbers(&journal, NULL, TEXT("B"), 0, 0, numbers, sizeof(numbers));
+    CHECK(numbers[0] == '\0');
+    QueryNumbers(&journal, TEXT("ITEM"), NULL, 0, 0, numbers, sizeof(numbers));
+    CHECK(numbers[0] == '\0');
+
+    // From the first time given up to, and not including, the second;
+    // 0 leaves that end open
+    QueryNumbers(&journal, NULL, NULL, times[3], times[7], numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "3,4,5,6") == 0);
+    QueryNumbers(&journal, NULL, NULL, times[3] + 1, times[7] + 1, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "4,5,6,7") == 0);
+    QueryNumbers(&journal, NULL, NULL, times[9], 0, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "9,10,11") == 0);
+    QueryNumbers(&journal, NULL, NULL, 0, times[2], numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "0,1") == 0);
+    QueryNumbers(&journal, NULL, NULL, times[4], times[4], numbers, sizeof(numbers));
+    CHECK(numbers[0] == '\0');
+    QueryNumbers(&journal, NULL, NULL, times[11] + 1, 0, numbers, sizeof(numbers));
+    CHECK(numbers[0] == '\0');
+
+    // An item in a window
+    QueryNumbers(&journal, NULL, TEXT("A1"), times[3], times[9], numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "4,6,8") == 0);
+    QueryNumbers(&journal, TEXT("ITEM_SCAN"), TEXT("A1"), times[3], 0, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "4,6,10") == 0);
+
+    // Appended after the first query, it is found too
+    NumberedDetails(QUERY_TRANSACTIONS, 0, text);
+    CHECK(journal.LogTransaction(QueryType(QUERY_TRANSACTIONS), QueryItem(QUERY_TRANSACTIONS), text, true));
+    QueryNumbers(&journal, NULL, TEXT("A1"), times[9], 0, numbers, sizeof(numbers));
+    CHECK(strcmp(numbers, "10,12") == 0);
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    RUN_TEST(TestTornDurableAppend);
+    RUN_TEST(TestTornCheckpoint);
+    RUN_TEST(TestTornGroupCommit);
+    RUN_TEST(TestTornSegmentRoll);
+    RUN_TEST(TestRecoveryIsLogged);
+    RUN_TEST(TestStartupAfterCrash);
+    RUN_TEST(TestCompaction);
+    RUN_TEST(TestRetentionOverBudget);
+    RUN_TEST(TestPendingCursor);
+    RUN_TEST(TestAckById);
+    RUN_TEST(TestQueryCursor);
+    return HostTestResult();
+}
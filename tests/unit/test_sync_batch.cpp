@@ -0,0 +1,241 @@
+/**
+ * SyncBatch tests
+ * A batch is the body of one POST /api/v1/sync, built from coalesced
+ * operations, and the results in the answer are matched back to them by
+ * transaction ID. The body must carry each operation as the server takes
+ * it. A result must reach its own operation however the server orders
+ * the results; an operation the answer leaves out, or reports on past
+ * the point where the answer stops making sense, must stay failed so it
+ * is sent again.
+ */
+
+#include "../../include/SyncBatch.hpp"
+#include "../../include/TransactionCoalescer.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+
+namespace {
+
+// Transaction n is queued n seconds after 2025-11-15 14:30:15 UTC
+const ULONGLONG BASE_TIME_MS = 1763217015000ULL;
+
+const TCHAR* const CREATE_JSON = TEXT("{\"barcode\":\"4006381333933\",\"name\":\"Drill\",\"quantity\":2}");
+
+bool AddTransaction(TransactionCoalescer& coalescer, ULONGLONG id, const TCHAR* type, const TCHAR* data)
+{
+    TCHAR transaction[512];
+    wsprintf(transaction, TEXT("[%lu] %s: %s"), (unsigned long)id, type, data);
+    return coalescer.Add(id, BASE_TIME_MS + id * 1000, 0, transaction);
+}
+
+// Two scans of one item, a move, a create, an update, which the sync
+// endpoint does not take, and a barcode that needs escaping
+bool FillWindow(TransactionCoalescer& coalescer)
+{
+    return AddTransaction(coalescer, 1, TEXT("ITEM_SCAN"), TEXT("SCAN:4006381333931")) &&
+           AddTransaction(coalescer, 2, TEXT("ITEM_MOVE"), TEXT("MOVE:4006381333932:LOC-7")) &&
+           AddTransaction(coalescer, 3, TEXT("ITEM_SCAN"), TEXT("SCAN:4006381333931")) &&
+           AddTransaction(coalescer, 4, TEXT("ITEM_CREATE"), CREATE_JSON) &&
+           AddTransaction(coalescer, 5, TEXT("ITEM_UPDATE"),
+                          TEXT("{\"id\":\"4006381333934\",\"barcode\":\"4006381333934\",\"name\":\"Saw\"}")) &&
+           AddTransaction(coalescer, 6, TEXT("ITEM_SCAN"), TEXT("SCAN:40063\"8"));
+}
+
+// The window's batchable operations, as a lane adds them
+int FillBatch(SyncBatch& batch, const TransactionCoalescer& coalescer)
+{
+    batch.Clear();
+    for (int i = 0; i < coalescer.GetOperationCount(); i++) {
+        const TransactionCoalescer::Operation& operation = coalescer.GetOperation(i);
+        if (SyncBatch::CanBatch(operation)) {
+            batch.Add(i, operation, coalescer.GetMemberId(operation.firstMember));
+        }
+    }
+    return batch.GetCount();
+}
+
+// Whether the batch's operations (in the order of FillWindow's, leaving
+// out the update) came back as expected, "1" for applied
+bool ResultsAre(const SyncBatch& batch, const char* expected)
+{
+    for (int i = 0; i < batch.GetCount(); i++) {
+        if (batch.Succeeded(i) != (expected[i] == '1')) {
+            printf("    operation %d %s\n", i, batch.Succeeded(i) ? "applied" : "failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TestRequestBody()
+{
+    TransactionCoalescer coalescer;
+    CHECK(FillWindow(coalescer));
+    CHECK(coalescer.GetOperationCount() == 5);
+
+    SyncBatch batch;
+    batch.SetSessionId(77);
+    CHECK(FillBatch(batch, coalescer) == 4);
+    CHECK(batch.GetTag(2) == 2 && batch.GetTag(3) == 4);
+
+    // Merged scans go out under the first ID with their count and the
+    // time of the latest; the item JSON as it was queued
+    TCHAR expected[2048];
+    wsprintf(expected,
+             TEXT("{\"deviceId\":\"hbx\\\"1\",\"sessionId\":\"77\",\"transactions\":[")
+             TEXT("{\"transactionId\":\"1\",\"type\":\"SCAN\",\"barcode\":\"4006381333931\",\"count\":2,")
+             TEXT("\"timestamp\":\"2025-11-15T14:30:18.000Z\"},")
+             TEXT("{\"transactionId\":\"2\",\"type\":\"UPDATE_LOCATION\",\"barcode\":\"4006381333932\",")
+             TEXT("\"locationId\":\"LOC-7\",\"timestamp\":\"2025-11-15T14:30:17.000Z\"},")
+             TEXT("{\"transactionId\":\"4\",\"type\":\"CREATE_ITEM\",\"item\":%s,")
+             TEXT("\"timestamp\":\"2025-11-15T14:30:19.000Z\"},")
+             TEXT("{\"transactionId\":\"6\",\"type\":\"SCAN\",\"barcode\":\"40063\\\"8\",")
+             TEXT("\"timestamp\":\"2025-11-15T14:30:21.000Z\"}]}"),
+             CREATE_JSON);
+    TCHAR* request = batch.BuildRequest(TEXT("hbx\"1"));
+    bool matches = (lstrcmp(request, expected) == 0);
+    if (!matches) {
+        printf("    got %ls\n", request);
+    }
+    delete[] request;
+    CHECK(matches);
+
+    // The session stays for the next batch; without one it is left out
+    batch.Clear();
+    request = batch.BuildRequest(NULL);
+    matches = (lstrcmp(request, TEXT("{\"deviceId\":\"\",\"sessionId\":\"77\",\"transactions\":[]}")) == 0);
+    delete[] request;
+    CHECK(matches);
+
+    batch.SetSessionId(0);
+    request = batch.BuildRequest(TEXT("hbx1"));
+    matches = (lstrcmp(request, TEXT("{\"deviceId\":\"hbx1\",\"transactions\":[]}")) == 0);
+    delete[] request;
+    CHECK(matches);
+    return true;
+}
+
+bool TestResultsMatched()
+{
+    TransactionCoalescer coalescer;
+    CHECK(FillWindow(coalescer));
+    SyncBatch batch;
+
+    // In request order, as the server normally answers
+    FillBatch(batch, coalescer);
+    batch.ParseResponse(TEXT("{\"syncedCount\":3,\"failedCount\":1,\"results\":[")
+                        TEXT("{\"transactionId\":\"1\",\"status\":\"success\"},")
+                        TEXT("{\"transactionId\":\"2\",\"status\":\"success\"},")
+                        TEXT("{\"transactionId\":\"4\",\"status\":\"failed\",\"error\":\"Item not found\"},")
+                        TEXT("{\"transactionId\":\"6\",\"status\":\"success\"}]}"));
+    CHECK(ResultsAre(batch, "1101"));
+
+    // Out of order, spaced out, with a numeric ID and values that look
+    // like the end of a result or of the list
+    FillBatch(batch, coalescer);
+    batch.ParseResponse(TEXT("{ \"results\" : [ { \"transactionId\" : 6, \"status\" : \"success\" } ,\n")
+                        TEXT("{\"status\":\"failed\",\"transactionId\":\"4\",")
+                        TEXT("\"error\":{\"code\":\"NOT_FOUND\",\"ids\":[4,\"}]\"]}},")
+                        TEXT("{\"transactionId\":\"2\",\"detail\":\"a \\\"quoted\\\" }]\",\"status\":\"success\"},")
+                        TEXT("{\"transactionId\":\"1\",\"status\":\"failed\"}],\"syncedCount\":2}"));
+    CHECK(ResultsAre(batch, "0101"));
+    return true;
+}
+
+bool TestMissingResults()
+{
+    TransactionCoalescer coalescer;
+    CHECK(FillWindow(coalescer));
+    SyncBatch batch;
+
+    // Left out, or reported under an ID the batch does not have
+    FillBatch(batch, coalescer);
+    batch.ParseResponse(TEXT("{\"results\":[{\"transactionId\":\"99\",\"status\":\"success\"},")
+                        TEXT("{\"transactionId\":\"2\",\"status\":\"success\"},")
+                        TEXT("{\"status\":\"success\"},")
+                        TEXT("{\"transactionId\":\"5\",\"status\":\"success\"}]}"));
+    CHECK(ResultsAre(batch, "0100"));
+
+    // Cut off: what came before the cut stands
+    FillBatch(batch, coalescer);
+    batch.ParseResponse(TEXT("{\"results\":[{\"transactionId\":\"1\",\"status\":\"success\"},")
+                        TEXT("{\"transactionId\":\"2\",\"status\":\"succ"));
+    CHECK(ResultsAre(batch, "1000"));
+
+    // Not a list of results at all
+    const TCHAR* const unreadable[] = {
+        TEXT(""),
+        TEXT("{\"error\":\"Service unavailable\"}"),
+        TEXT("{\"results\":\"pending\"}"),
+        TEXT("{\"results\":[\"1\",\"2\"]}"),
+        NULL
+    };
+    for (int i = 0; unreadable[i]; i++) {
+        FillBatch(batch, coalescer);
+        batch.ParseResponse(unreadable[i]);
+        CHECK(ResultsAre(batch, "0000"));
+    }
+    FillBatch(batch, coalescer);
+    batch.ParseResponse(NULL);
+    CHECK(ResultsAre(batch, "0000"));
+
+    // Results from an earlier answer do not carry over
+    FillBatch(batch, coalescer);
+    batch.ParseResponse(TEXT("{\"results\":[{\"transactionId\":\"1\",\"status\":\"success\"}]}"));
+    FillBatch(batch, coalescer);
+    CHECK(ResultsAre(batch, "0000"));
+    return true;
+}
+
+bool TestBatchLimits()
+{
+    TransactionCoalescer coalescer;
+    CHECK(AddTransaction(coalescer, 1, TEXT("ITEM_SCAN"), TEXT("SCAN:4006381333931")));
+    CHECK(AddTransaction(coalescer, 2, TEXT("ITEM_MOVE"), TEXT("MOVE:4006381333931:LOC-7")));
+    CHECK(AddTransaction(coalescer, 3, TEXT("ITEM_SCAN"), TEXT("SCAN:4006381333932")));
+    CHECK(AddTransaction(coalescer, 4, TEXT("ITEM_CREATE"), CREATE_JSON));
+    CHECK(AddTransaction(coalescer, 5, TEXT("ITEM_MOVE"), TEXT("MOVE:4006381333935")));
+    CHECK(coalescer.GetOperationCount() == 5);
+
+    // One operation per item, so a failed one is not overtaken
+    SyncBatch batch;
+    CHECK(batch.Add(0, coalescer.GetOperation(0), 1));
+    CHECK(batch.HoldsItem(coalescer.GetOperation(1)));
+    CHECK(!batch.HoldsItem(coalescer.GetOperation(2)));
+    CHECK(!batch.Add(1, coalescer.GetOperation(1), 2));
+    CHECK(batch.Add(2, coalescer.GetOperation(2), 3));
+    CHECK(batch.GetCount() == 2);
+
+    // Unparsed, it is never batched
+    CHECK(!SyncBatch::CanBatch(coalescer.GetOperation(4)));
+    CHECK(!batch.Add(4, coalescer.GetOperation(4), 5));
+
+    // Full by count
+    batch.SetLimits(2, SyncBatch::DEFAULT_MAX_BYTES);
+    CHECK(batch.GetCount() == 0);
+    CHECK(batch.Add(0, coalescer.GetOperation(0), 1));
+    CHECK(batch.Add(2, coalescer.GetOperation(2), 3));
+    CHECK(!batch.Add(3, coalescer.GetOperation(3), 4));
+
+    // Full by size, but an operation larger than the limit still goes,
+    // on its own
+    batch.SetLimits(SyncBatch::DEFAULT_MAX_OPERATIONS, 64);
+    CHECK(batch.Add(3, coalescer.GetOperation(3), 4));
+    CHECK(!batch.Add(0, coalescer.GetOperation(0), 1));
+    batch.Clear();
+    CHECK(batch.Add(0, coalescer.GetOperation(0), 1));
+    CHECK(!batch.Add(2, coalescer.GetOperation(2), 3));
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    RUN_TEST(TestRequestBody);
+    RUN_TEST(TestResultsMatched);
+    RUN_TEST(TestMissingResults);
+    RUN_TEST(TestBatchLimits);
+    return HostTestResult();
+}
@@ -0,0 +1,269 @@
+/**
+ * TransactionRing tests
+ * The ring is only correct if the one producer and the one consumer can
+ * run flat out side by side: every slot must come out once, in order,
+ * with the contents it was pushed with. The stress test pushes and pops
+ * a million transactions across two threads, through every wraparound
+ * of the ring, and the writer test does the same through the journal's
+ * EnqueueTransaction and writer thread. Texts too long for a slot, as an
+ * item's JSON is, must go through the ring like the rest.
+ */
+
+#include "../../include/Journal.hpp"
+#include "../../include/TransactionRing.hpp"
+#include "../host/host_test.hpp"
+
+using namespace HBX;
+
+namespace {
+
+const DWORD STRESS_TRANSACTIONS = 1000000;
+const DWORD WRITER_TRANSACTIONS = 5000;
+const int LONG_TEXT_CHARS = 1024;       // About an item's JSON
+
+// What is pushed as ticket n; the lengths vary so slots are reused with
+// shorter contents than they held before
+void StressText(DWORD n, TCHAR* text)
+{
+    int length = wsprintf(text, TEXT("{\"ticket\":%lu,\"pad\":\""), n);
+    for (DWORD i = 0; i < n % 97; i++) {
+        text[length++] = (TCHAR)('a' + i % 26);
+    }
+    lstrcpy(text + length, TEXT("\"}"));
+}
+
+// Every 50th is too long for a slot
+void WriterText(DWORD n, TCHAR* text)
+{
+    StressText(n, text);
+    if (n % 50 == 0) {
+        int length = lstrlen(text) - 2;
+        while (length < LONG_TEXT_CHARS - 3) {
+            text[length++] = 'x';
+        }
+        lstrcpy(text + length, TEXT("\"}"));
+    }
+}
+
+void StressItem(DWORD n, TCHAR* item)
+{
+    wsprintf(item, TEXT("%013lu"), n * 7919UL);
+}
+
+struct StressState {
+    TransactionRing* ring;
+    DWORD count;
+    DWORD fullCount;            // Pushes turned away by a full ring
+};
+
+DWORD WINAPI ProducerThread(LPVOID param)
+{
+    StressState* state = (StressState*)param;
+    TCHAR text[TransactionRing::SLOT_CHARS];
+    TCHAR item[32];
+
+    DWORD full = 0;
+    for (DWORD n = 1; n <= state->count; n++) {
+        StressText(n, text);
+        StressItem(n, item);
+        const TCHAR* type = (n % 3 == 0) ? TEXT("ITEM_MOVE") : TEXT("ITEM_SCAN");
+        while (!state->ring->Push(type, item, text, (BYTE)n, n)) {
+            full++;
+            Sleep(0);
+        }
+    }
+    state->fullCount = full;
+    return 0;
+}
+
+bool TestFifoAndCapacity()
+{
+    TransactionRing ring;
+    CHECK(ring.Peek() == NULL);
+    CHECK(ring.GetCount() == 0);
+
+    // Three times round, so the indexes wrap past the end of the slots
+    TCHAR text[TransactionRing::SLOT_CHARS];
+    DWORD next = 1;
+    for (int round = 0; round < 3; round++) {
+        DWORD first = next;
+        while (ring.Push(TEXT("ITEM_SCAN"), TEXT("1"), TEXT("{}"), 0, next)) {
+            next++;
+        }
+        CHECK(next - first == TransactionRing::SLOT_COUNT);
+        CHECK(ring.GetCount() == TransactionRing::SLOT_COUNT);
+
+        for (DWORD n = first; n < next; n++) {
+            const TransactionRing::Slot* slot = ring.Peek();
+            CHECK(slot && slot->ticket == n);
+            ring.Pop();
+        }
+        CHECK(ring.Peek() == NULL);
+    }
+
+    // Pop on an empty ring changes nothing
+    ring.Pop();
+    CHECK(ring.GetCount() == 0);
+
+    // Long tags are cut; a text that fills the slot stays in it
+    for (int i = 0; i < TransactionRing::SLOT_CHARS; i++) {
+        text[i] = 'x';
+    }
+    text[TransactionRing::SLOT_CHARS - 1] = '\0';
+    CHECK(ring.Push(text, text, text, 0, 1));
+    const TransactionRing::Slot* slot = ring.Peek();
+    CHECK(slot && lstrlen(slot->type) == TransactionRing::TAG_CHARS - 1);
+    CHECK(slot->text == slot->buffer && lstrlen(slot->text) == TransactionRing::SLOT_CHARS - 1);
+    ring.Pop();
+
+    // A longer one is kept on the heap until it is popped
+    TCHAR longText[LONG_TEXT_CHARS];
+    for (int i = 0; i < LONG_TEXT_CHARS - 1; i++) {
+        longText[i] = (TCHAR)('a' + i % 26);
+    }
+    longText[LONG_TEXT_CHARS - 1] = '\0';
+    CHECK(ring.Push(NULL, NULL, longText, 0, 2));
+    CHECK(ring.Push(NULL, NULL, TEXT("{}"), 0, 3));
+    slot = ring.Peek();
+    CHECK(slot && slot->text != slot->buffer && lstrcmp(slot->text, longText) == 0);
+    ring.Pop();
+    slot = ring.Peek();
+    CHECK(slot && slot->ticket == 3 && lstrcmp(slot->text, TEXT("{}")) == 0);
+    ring.Pop();
+    CHECK(!ring.Push(NULL, NULL, NULL, 0, 4));
+
+    // A NULL type or item is stored as empty
+    CHECK(ring.Push(NULL, NULL, TEXT("{}"), 0, 2));
+    slot = ring.Peek();
+    CHECK(slot && slot->type[0] == '\0' && slot->item[0] == '\0');
+
+    // One still in the ring is freed with it
+    CHECK(ring.Push(NULL, NULL, longText, 0, 5));
+    return true;
+}
+
+bool TestProducerConsumerStress()
+{
+    TransactionRing ring;
+    StressState state;
+    state.ring = &ring;
+    state.count = STRESS_TRANSACTIONS;
+    state.fullCount = 0;
+
+    HANDLE producer = CreateThread(NULL, 0, ProducerThread, &state, 0, NULL);
+    CHECK(producer != NULL);
+
+    TCHAR text[TransactionRing::SLOT_CHARS];
+    TCHAR item[32];
+    DWORD empty = 0;
+    DWORD expected = 1;
+    bool intact = true;
+    while (expected <= STRESS_TRANSACTIONS && intact) {
+        const TransactionRing::Slot* slot = ring.Peek();
+        if (!slot) {
+            empty++;
+            Sleep(0);
+            continue;
+        }
+
+        StressText(expected, text);
+        StressItem(expected, item);
+        const TCHAR* type = (expected % 3 == 0) ? TEXT("ITEM_MOVE") : TEXT("ITEM_SCAN");
+        intact = (slot->ticket == expected && slot->opcode == (BYTE)expected && lstrcmp(slot->text, text) == 0 &&
+                  lstrcmp(slot->item, item) == 0 && lstrcmp(slot->type, type) == 0);
+        if (!intact) {
+            printf("    expected ticket %lu, got %lu\n", (unsigned long)expected, (unsigned long)slot->ticket);
+        }
+        ring.Pop();
+        expected++;
+    }
+
+    WaitForSingleObject(producer, INFINITE);
+    CloseHandle(producer);
+
+    CHECK(intact);
+    CHECK(ring.Peek() == NULL);
+    CHECK(ring.GetCount() == 0);
+
+    // Read after the thread has finished. Both sides had to wait on the
+    // other at times, or the test proved little.
+    printf("(%lu full, %lu empty) ", (unsigned long)state.fullCount, (unsigned long)empty);
+    CHECK(state.fullCount > 0 && empty > 0);
+    return true;
+}
+
+struct CommitLog {
+    LONG volatile lastTicket;
+    LONG volatile failures;
+    LONG volatile outOfOrder;
+    LONG volatile callbacks;
+};
+
+void RecordCommit(DWORD ticket, bool success, void* userData)
+{
+    // Only the writer thread calls back, so plain reads of its own
+    // fields are safe; the stores are for the test thread
+    CommitLog* log = (CommitLog*)userData;
+    if ((LONG)ticket <= log->lastTicket) {
+        InterlockedExchange(&log->outOfOrder, log->outOfOrder + 1);
+    }
+    if (!success) {
+        InterlockedExchange(&log->failures, log->failures + 1);
+    }
+    InterlockedExchange(&log->lastTicket, (LONG)ticket);
+    InterlockedExchange(&log->callbacks, log->callbacks + 1);
+}
+
+bool TestEnqueueThroughWriter()
+{
+    char nativePath[MAX_PATH];
+    TCHAR path[MAX_PATH];
+    CHECK(HostMakeJournalPath(nativePath, sizeof(nativePath), path));
+
+    CommitLog log;
+    memset(&log, 0, sizeof(log));
+
+    TCHAR text[LONG_TEXT_CHARS];
+    TCHAR item[32];
+    bool passed = true;
+    {
+        Journal journal;
+        passed = journal.Initialize(path) && journal.StartWriter(RecordCommit, &log);
+
+        DWORD lastTicket = 0;
+        for (DWORD n = 1; n <= WRITER_TRANSACTIONS && passed; n++) {
+            WriterText(n, text);
+            StressItem(n, item);
+            DWORD ticket = 0;
+            passed = journal.EnqueueTransaction(TEXT("ITEM_SCAN"), item, text, &ticket) && ticket == lastTicket + 1;
+            lastTicket = ticket;
+        }
+        journal.StopWriter();
+
+        // Batched by the writer, but every ticket committed, in order
+        passed = passed && log.lastTicket == (LONG)WRITER_TRANSACTIONS && log.failures == 0 && log.outOfOrder == 0;
+        printf("(%ld commits) ", (long)log.callbacks);
+
+        Journal::PendingCursor cursor(&journal);
+        for (DWORD n = 1; n <= WRITER_TRANSACTIONS && passed; n++) {
+            WriterText(n, text);
+            const TCHAR* pending = cursor.Next();
+            passed = (pending && lstrcmp(pending, text) == 0);
+        }
+        passed = passed && cursor.Next() == NULL;
+    }
+
+    HostRemoveJournalDir(nativePath);
+    CHECK(passed);
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    RUN_TEST(TestFifoAndCapacity);
+    RUN_TEST(TestProducerConsumerStress);
+    RUN_TEST(TestEnqueueThroughWriter);
+    return HostTestResult();
+}
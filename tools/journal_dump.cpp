@@ -0,0 +1,428 @@
+/**
+ * journal_dump - host-side dump of an hbx.journal pulled from a device
+ *
+ * Usage: journal_dump <journal path | segment file>
+ *        journal_dump <journal path> [-t type] [-i item] [-f from] [-u until]
+ *
+ * Prints one line per record:
+ *   <sequence> <UTC timestamp> <TYPE> <payload>
+ * Given the journal path, the segments named by the newest valid
+ * manifest (<path>.mf0 / <path>.mf1) are dumped in order. Single-file
+ * and text journals from older builds are dumped as they are. The
+ * diagnostic log (<path>.diag) is dumped oldest entry first.
+ *
+ * With a filter, only the transactions still held in a segmented journal
+ * (pending or synced) of that type, item id and time window are printed,
+ * looked up through Journal::QueryCursor as the device would. Times are
+ * UTC, "YYYY-MM-DD[ HH:MM[:SS[.mmm]]]" or ms since 1970; until is
+ * exclusive. The journal is opened as the device opens it, so a torn
+ * append is recovered and a checkpoint written: query a copy to keep the
+ * pulled files as they were.
+ */
+
+#include "../include/Journal.hpp"
+#include "../include/JournalFormat.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace HBX;
+
+static const unsigned int kBufferSize = 16384;
+
+static int DumpText(FILE* file)
+{
+    char line[2048];
+    while (fgets(line, sizeof(line), file)) {
+        fputs(line, stdout);
+    }
+    return 0;
+}
+
+static void PrintRecord(const JournalFormat::RecordHeader& header, const unsigned char* payload)
+{
+    char timestamp[32];
+    JournalFormat::FormatTimestamp(header.timestamp, timestamp, sizeof(timestamp));
+
+    // ACKs name the synced transaction by its sequence number
+    JournalU64 sequence;
+    if (header.type == JournalFormat::REC_ACK &&
+        JournalFormat::DecodeAckPayload(payload, header.length, &sequence)) {
+        printf("%10llu %s %-6s #%llu\n",
+               (unsigned long long)header.sequence,
+               timestamp,
+               JournalFormat::RecordTypeName(header.type),
+               (unsigned long long)sequence);
+        return;
+    }
+
+    // Sync session progress
+    JournalFormat::SessionState session;
+    if (header.type == JournalFormat::REC_SESSION &&
+        JournalFormat::DecodeSessionPayload(payload, header.length, &session)) {
+        printf("%10llu %s %-6s #%llu: %u acknowledged, up to #%llu%s\n",
+               (unsigned long long)header.sequence,
+               timestamp,
+               JournalFormat::RecordTypeName(header.type),
+               (unsigned long long)session.id,
+               session.acknowledged,
+               (unsigned long long)session.highWater,
+               (session.flags & JournalFormat::SESSION_CLOSED) ? ", closed" : "");
+        return;
+    }
+
+    // Tagged transactions show their type and item id ahead of the text
+    JournalFormat::PayloadTags tags;
+    if (JournalFormat::DecodeTags(payload, header.length, header.flags, &tags)) {
+        printf("%10llu %s %-6s [%.*s|%.*s] %.*s\n",
+               (unsigned long long)header.sequence,
+               timestamp,
+               JournalFormat::RecordTypeName(header.type),
+               (int)tags.typeLength,
+               (const char*)payload + tags.typeOffset,
+               (int)tags.itemLength,
+               (const char*)payload + tags.itemOffset,
+               (int)(header.length - tags.textOffset),
+               (const char*)payload + tags.textOffset);
+        return;
+    }
+
+    printf("%10llu %s %-6s %.*s\n",
+           (unsigned long long)header.sequence,
+           timestamp,
+           JournalFormat::RecordTypeName(header.type),
+           (int)header.length,
+           (const char*)payload);
+}
+
+static int DumpRecords(FILE* file)
+{
+    static unsigned char buffer[kBufferSize];
+    unsigned int length = 0;
+    unsigned int position = 0;
+    unsigned long offset = JournalFormat::FILE_HEADER_SIZE;
+    unsigned long records = 0;
+    bool eof = false;
+
+    for (;;) {
+        JournalFormat::RecordHeader header;
+        JournalFormat::DecodeResult result =
+            JournalFormat::DecodeRecord(buffer + position, length - position, &header);
+
+        if (result == JournalFormat::DECODE_NEED_MORE) {
+            if (eof) {
+                if (length > position) {
+                    fprintf(stderr, "torn record at offset %lu (%u trailing bytes)\n",
+                            offset, length - position);
+                    return 2;
+                }
+                break;
+            }
+
+            memmove(buffer, buffer + position, length - position);
+            length -= position;
+            position = 0;
+
+            size_t n = fread(buffer + length, 1, kBufferSize - length, file);
+            if (n == 0) {
+                eof = true;
+            }
+            length += (unsigned int)n;
+            continue;
+        }
+
+        if (result != JournalFormat::DECODE_OK) {
+            fprintf(stderr, "corrupt record at offset %lu (%s)\n", offset,
+                    result == JournalFormat::DECODE_BAD_CRC ? "checksum mismatch" :
+                    result == JournalFormat::DECODE_BAD_LENGTH ? "bad length" : "bad magic");
+            return 2;
+        }
+
+        PrintRecord(header, buffer + position + JournalFormat::RECORD_HEADER_SIZE);
+
+        unsigned int recordSize = JournalFormat::RECORD_HEADER_SIZE + header.length;
+        position += recordSize;
+        offset += recordSize;
+        records++;
+    }
+
+    fprintf(stderr, "%lu records\n", records);
+    return 0;
+}
+
+static int DumpDiag(FILE* file)
+{
+    // Read every slot, then start after the newest one: that is where
+    // the ring wraps, so the oldest surviving entry comes first
+    unsigned char* slots = NULL;
+    unsigned int count = 0;
+    unsigned char slot[JournalFormat::DIAG_SLOT_SIZE];
+    while (fread(slot, 1, sizeof(slot), file) == sizeof(slot)) {
+        unsigned char* grown = (unsigned char*)realloc(slots, (count + 1) * sizeof(slot));
+        if (!grown) {
+            free(slots);
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        slots = grown;
+        memcpy(slots + count * sizeof(slot), slot, sizeof(slot));
+        count++;
+    }
+
+    unsigned int start = 0;
+    JournalU64 newest = 0;
+    JournalFormat::RecordHeader header;
+    for (unsigned int i = 0; i < count; i++) {
+        if (JournalFormat::DecodeRecord(slots + i * sizeof(slot), sizeof(slot), &header) == JournalFormat::DECODE_OK &&
+            header.sequence >= newest) {
+            newest = header.sequence;
+            start = (i + 1) % count;
+        }
+    }
+
+    unsigned long records = 0;
+    for (unsigned int n = 0; n < count; n++) {
+        const unsigned char* data = slots + ((start + n) % count) * sizeof(slot);
+        if (JournalFormat::DecodeRecord(data, sizeof(slot), &header) == JournalFormat::DECODE_OK) {
+            PrintRecord(header, data + JournalFormat::RECORD_HEADER_SIZE);
+            records++;
+        }
+    }
+
+    free(slots);
+    fprintf(stderr, "%lu of %u diagnostic slots in use\n", records, count);
+    return 0;
+}
+
+// Reads a whole manifest slot and checks its CRC; returns the file
+// contents (caller frees) or NULL
+static unsigned char* LoadManifest(const char* path, JournalFormat::ManifestHeader* header)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    unsigned char* data = (size > 0) ? (unsigned char*)malloc(size) : NULL;
+    bool valid = (data && fread(data, 1, size, file) == (size_t)size &&
+                  JournalFormat::DecodeManifestHeader(data, (unsigned int)size, header));
+    fclose(file);
+
+    if (valid) {
+        unsigned long bodySize =
+            header->segmentCount * (unsigned long)JournalFormat::MANIFEST_SEGMENT_SIZE +
+            header->pendingCount * (unsigned long)JournalFormat::GetManifestPendingSize(header->version);
+        valid = ((unsigned long)size >= JournalFormat::MANIFEST_HEADER_SIZE + bodySize);
+
+        if (valid) {
+            // The CRC covers the header but its own field, then the body
+            unsigned int crc = JournalFormat::GetManifestHeaderCrc(data, header->version);
+            crc = JournalFormat::Crc32(data + JournalFormat::MANIFEST_HEADER_SIZE, (unsigned int)bodySize, crc);
+            valid = (crc == header->crc);
+        }
+    }
+
+    if (!valid) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static int DumpFile(const char* path);
+
+// A time for -f or -u: ms since 1970, or a UTC date and time as the
+// dump prints them
+static bool ParseTime(const char* text, ULONGLONG* ms)
+{
+    char* end = NULL;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end != text && *end == '\0') {
+        *ms = value;
+        return true;
+    }
+
+    int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0, millis = 0;
+    int fields = sscanf(text, "%d-%d-%d%*[ T]%d:%d:%d.%d", &year, &month, &day, &hour, &minute, &second, &millis);
+    if (fields < 3 || fields == 4 || month < 1 || month > 12 || day < 1 || day > 31) {
+        return false;
+    }
+    *ms = JournalFormat::MakeTimestamp(year, month, day, hour, minute, second, millis);
+    return true;
+}
+
+static void PrintText(const TCHAR* text, char* buffer, int size)
+{
+    if (WideCharToMultiByte(CP_UTF8, 0, text, -1, buffer, size, NULL, NULL) <= 0) {
+        buffer[0] = '\0';
+    }
+}
+
+static int QueryJournal(const char* path, const Journal::QueryFilter& filter)
+{
+    TCHAR journalPath[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, journalPath, MAX_PATH);
+
+    Journal journal;
+    if (!journal.Initialize(journalPath)) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    static char text[JournalFormat::MAX_PAYLOAD_SIZE * 3 + 1];
+    char type[JournalFormat::MAX_TAG_SIZE * 3 + 1];
+    char item[JournalFormat::MAX_TAG_SIZE * 3 + 1];
+    char timestamp[32];
+    unsigned long matches = 0;
+    Journal::QueryCursor cursor(&journal, filter);
+    const TCHAR* transaction;
+    while ((transaction = cursor.Next()) != NULL) {
+        JournalFormat::FormatTimestamp(cursor.GetTimestamp(), timestamp, sizeof(timestamp));
+        PrintText(cursor.GetTransactionType(), type, sizeof(type));
+        PrintText(cursor.GetItemId(), item, sizeof(item));
+        PrintText(transaction, text, sizeof(text));
+        printf("%10llu %s %-6s [%s|%s] %s\n",
+               (unsigned long long)cursor.GetId(),
+               timestamp,
+               JournalFormat::RecordTypeName(JournalFormat::REC_TRANS),
+               type,
+               item,
+               text);
+        matches++;
+    }
+
+    fprintf(stderr, "%lu matching transactions\n", matches);
+    return 0;
+}
+
+static int DumpSegmented(const char* basePath, unsigned char* manifest, const JournalFormat::ManifestHeader& header)
+{
+    fprintf(stderr, "manifest generation %llu, epoch %08x: %u segments, %u pending\n",
+            (unsigned long long)header.generation, header.epoch, header.segmentCount, header.pendingCount);
+
+    int result = 0;
+    for (unsigned int i = 0; i < header.segmentCount; i++) {
+        JournalFormat::ManifestSegment segment;
+        JournalFormat::DecodeManifestSegment(
+            manifest + JournalFormat::MANIFEST_HEADER_SIZE + i * JournalFormat::MANIFEST_SEGMENT_SIZE, &segment);
+
+        char segmentPath[1024];
+        snprintf(segmentPath, sizeof(segmentPath), "%s.%08x", basePath, segment.id);
+        fprintf(stderr, "segment %08x%s\n", segment.id,
+                (i == header.segmentCount - 1) ? " (active)" : "");
+
+        int segmentResult = DumpFile(segmentPath);
+        if (segmentResult > result) {
+            result = segmentResult;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    // Filter options, each with a value, after the path
+    TCHAR type[JournalFormat::MAX_TAG_SIZE + 1] = { 0 };
+    TCHAR item[JournalFormat::MAX_TAG_SIZE + 1] = { 0 };
+    Journal::QueryFilter filter;
+    filter.transactionType = NULL;
+    filter.itemId = NULL;
+    filter.fromTime = 0;
+    filter.toTime = 0;
+    bool query = false;
+    bool valid = (argc >= 2 && argc % 2 == 0);
+    for (int i = 2; i + 1 < argc && valid; i += 2) {
+        query = true;
+        if (strcmp(argv[i], "-t") == 0) {
+            MultiByteToWideChar(CP_UTF8, 0, argv[i + 1], -1, type, JournalFormat::MAX_TAG_SIZE + 1);
+            filter.transactionType = type;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            MultiByteToWideChar(CP_UTF8, 0, argv[i + 1], -1, item, JournalFormat::MAX_TAG_SIZE + 1);
+            filter.itemId = item;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            valid = ParseTime(argv[i + 1], &filter.fromTime);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            valid = ParseTime(argv[i + 1], &filter.toTime);
+        } else {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "usage: %s <journal path | segment file>\n"
+                        "       %s <journal path> [-t type] [-i item] [-f from] [-u until]\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    // Segmented journal: use the newer of the two manifest slots
+    unsigned char* manifest = NULL;
+    JournalFormat::ManifestHeader header;
+    memset(&header, 0, sizeof(header));
+    for (int slot = 0; slot < 2; slot++) {
+        char slotPath[1024];
+        snprintf(slotPath, sizeof(slotPath), "%s.mf%d", argv[1], slot);
+
+        JournalFormat::ManifestHeader slotHeader;
+        unsigned char* data = LoadManifest(slotPath, &slotHeader);
+        if (data && (!manifest || slotHeader.generation > header.generation)) {
+            free(manifest);
+            manifest = data;
+            header = slotHeader;
+        } else {
+            free(data);
+        }
+    }
+
+    // Queries open the journal itself, which would start a new one
+    // where there is none
+    if (query) {
+        free(manifest);
+        if (!manifest) {
+            fprintf(stderr, "%s is not a segmented journal\n", argv[1]);
+            return 1;
+        }
+        return QueryJournal(argv[1], filter);
+    }
+
+    if (manifest) {
+        int result = DumpSegmented(argv[1], manifest, header);
+        free(manifest);
+        return result;
+    }
+
+    return DumpFile(argv[1]);
+}
+
+static int DumpFile(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    unsigned char fileHeader[JournalFormat::FILE_HEADER_SIZE];
+    size_t n = fread(fileHeader, 1, sizeof(fileHeader), file);
+
+    int result;
+    JournalU64 baseSequence = 0;
+    size_t pathLen = strlen(path);
+    bool diag = (pathLen > 5 && strcmp(path + pathLen - 5, ".diag") == 0);
+
+    if (JournalFormat::DecodeFileHeader(fileHeader, (unsigned int)n, &baseSequence)) {
+        result = diag ? DumpDiag(file) : DumpRecords(file);
+    } else if (JournalFormat::IsLegacyText(fileHeader, (unsigned int)n)) {
+        rewind(file);
+        result = DumpText(file);
+    } else {
+        fprintf(stderr, "%s is not a journal file\n", path);
+        result = 1;
+    }
+
+    fclose(file);
+    return result;
+}
@@ -0,0 +1,2401 @@
+/**
+ * journal_replay - replay an hbx.journal against a server, synthesize one,
+ * or stand in for the server
+ *
+ * Usage:
+ *   journal_replay replay <journal path> <server url> [options]
+ *     -s <factor>   pace requests by the recorded timestamps, <factor>
+ *                   times faster (1 = original timing); by default they
+ *                   are sent back to back, as the device does on reconnect
+ *     -t <token>    bearer token for the Authorization header
+ *     -n <count>    stop after <count> transactions
+ *     -w <seconds>  socket timeout per request (default 10)
+ *     -a            replay every transaction, not only the unsynced ones
+ *     -u            send every transaction on its own instead of coalescing
+ *     -b <count>    operations per /api/v1/sync batch (default 64); 0 sends
+ *                   one request per operation, as older firmware did
+ *     -k <KB>       size limit of a batch's transactions (default 32)
+ *     -p <lanes>    requests in flight (default 1), as syncPipelineDepth
+ *
+ *   journal_replay synth <journal path> [options]
+ *     -n <scans>    number of scans (default 40000)
+ *     -d <days>     days the scans are spread over (default 3)
+ *     -k <items>    size of the barcode catalogue (default 5000)
+ *     -b <date>     first day as YYYY-MM-DD (default: <days> days ago)
+ *     -r <seed>     random seed (default 1)
+ *
+ *   journal_replay serve <port> [options]
+ *     -l <ms>       delay before each response, standing in for the
+ *                   round trip of a cellular link
+ *     -f <percent>  operations answered as failed (default 0)
+ *     -d <percent>  changes applied but left unanswered (default 0)
+ *
+ *   journal_replay storm <server url> [options]
+ *     -n <count>    operations (default 300): creates, moves and sync
+ *                   requests of 5 transactions, a third each
+ *     -c <copies>   times each is sent, side by side (default 4)
+ *     -p <threads>  requests in flight (default 8)
+ *     -t <token>    bearer token for the Authorization header
+ *     -w <seconds>  socket timeout per request (default 10)
+ *
+ * Replay opens the journal with the device's own Journal, on the Win32
+ * stand-in in tests/host, and syncs its pending transactions (with -a,
+ * every one it still holds) the way SyncEngine does: a window at a time
+ * through the device's TransactionCoalescer, whose handlers parse and
+ * merge them, with the batchable operations packed into SyncBatch
+ * requests and the answers read back by SyncBatch. An operation a batch
+ * response does not report as applied, or a change refused, holds back
+ * its item as on the device. Only the sockets are the tool's own, so it
+ * can count the bytes on the wire: each lane keeps one connection alive
+ * like HttpClient, and an operation sent on its own makes the request
+ * HbClient makes for it, a change under the Idempotency-Key
+ * ReplayCache::FormatKey gives it. With -p, each window's operations are
+ * spread over lanes by item, as SyncEngine does, and the lanes send side
+ * by side on threads of their own. With -u a window ends before an item's
+ * second transaction, so none are merged. An ITEM_UPDATE refused as
+ * stale is counted rather than rebased and sent again as on the device.
+ * One without the server's id is cleared on the device without a request
+ * and unknown types stay pending there, so both are only counted. The
+ * journal is recovered as the device would on opening it, so replay a
+ * copy to keep the pulled files untouched. At the end it prints
+ * throughput, bytes on the wire and latency percentiles.
+ *
+ * Synth writes a journal the device can open: for every scan the SCAN
+ * audit record and the queued ITEM_SCAN, all unsynced, in 256 KB segments
+ * with a manifest. Scans follow two warehouse shifts a day, barcodes are
+ * drawn with a Zipf distribution over the catalogue, and some are
+ * scanned twice in a row.
+ *
+ * Serve is a minimal HomeBox on 127.0.0.1 for replay, and the device's own
+ * sync code in the host tests, to run against: any device logs in, item
+ * lookups, moves and creates succeed, and a sync batch gets a result for
+ * every transaction in it. Each connection is served on a thread of its
+ * own, so requests in flight overlap their delays like a real server's,
+ * and kept open for the client's next request until it has been idle
+ * for 5 s.
+ * It keeps the server's side of the idempotency contract: a change with
+ * an Idempotency-Key seen before gets the first answer again without
+ * taking effect, the key on a different request gets 422, and a sync
+ * transaction ID applied before is reported applied and skipped. With
+ * -d, changes are applied and then the connection is closed unanswered.
+ * Items have a version, sent with them in the body and as the ETag, that
+ * each update moves on; an update whose If-Match names another gets 412
+ * and the current item. GET /api/v1/mock/stats returns what has taken
+ * effect so far, and the connections accepted.
+ *
+ * Storm checks that contract under load: every change is sent several
+ * times at once, each copy retried until it is answered, and the
+ * server's counts before and after must show each confirmed change
+ * applied exactly once. It exits 1 if not; run it against serve -d.
+ */
+
+#include "../include/Journal.hpp"
+#include "../include/JournalFormat.hpp"
+#include "../include/ReplayCache.hpp"
+#include "../include/SyncBatch.hpp"
+#include "../include/TransactionCoalescer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+using namespace HBX;
+
+static const unsigned int kSegmentSizeLimit = 256 * 1024;   // As in Journal
+static const unsigned int kResponseHeaderSize = 8192;
+static const unsigned int kResponseBodySize = 32768;        // As HttpClient reads
+
+// ---------------------------------------------------------------------------
+// Requests
+
+enum Action {
+    ACTION_REQUEST,         // Sent to the server
+    ACTION_LOCAL,           // Cleared on the device without a request
+    ACTION_UNSUPPORTED      // Left pending on the device
+};
+
+// The request HbClient makes for an operation sent on its own
+struct Request {
+    const char* method;
+    char path[512];
+    char* body;                 // NULL for none
+    char* version;              // ITEM_UPDATE: sent as If-Match; NULL for none
+};
+
+static const TCHAR kDeviceId[] = TEXT("journal_replay");
+
+// A copy of wide text in UTF-8, as HttpClient sends it (caller frees);
+// NULL for none
+static char* ToUtf8(const TCHAR* text)
+{
+    if (!text) {
+        return NULL;
+    }
+    int size = WideCharToMultiByte(CP_UTF8, 0, text, -1, NULL, 0, NULL, NULL);
+    char* copy = (char*)malloc(size);
+    if (copy) {
+        WideCharToMultiByte(CP_UTF8, 0, text, -1, copy, size, NULL, NULL);
+    }
+    return copy;
+}
+
+// What the device does with a coalesced operation, by its handler
+static Action GetAction(const TransactionCoalescer::Operation& operation)
+{
+    if (!operation.handler) {
+        return ACTION_UNSUPPORTED;
+    }
+    // SendUpdate has nothing to address without the server's id
+    if (operation.handler->opcode == JournalFormat::OP_ITEM_UPDATE && !operation.payload.item->GetId()) {
+        return ACTION_LOCAL;
+    }
+    return ACTION_REQUEST;
+}
+
+// The request for an operation GetAction sends; false if HbClient would
+// not get as far as sending one
+static bool DescribeRequest(const TransactionCoalescer::Operation& operation, Request* request)
+{
+    request->method = "GET";
+    request->path[0] = '\0';
+    request->body = NULL;
+    request->version = NULL;
+
+    const TransactionPayload& payload = operation.payload;
+    JournalFormat::TransactionOpcode opcode = operation.handler->opcode;
+    char* barcode = ToUtf8(payload.barcode);
+    if (!barcode) {
+        return false;
+    }
+
+    bool described = true;
+    if (opcode == JournalFormat::OP_ITEM_SCAN) {
+        snprintf(request->path, sizeof(request->path), "/api/v1/items/%s", barcode);
+    } else if (opcode == JournalFormat::OP_ITEM_MOVE) {
+        char* location = ToUtf8(payload.locationId);
+        size_t size = (location ? strlen(location) : 0) + 20;
+        request->body = location ? (char*)malloc(size) : NULL;
+        if (request->body) {
+            snprintf(request->body, size, "{\"locationId\":\"%s\"}", location);
+        }
+        snprintf(request->path, sizeof(request->path), "/api/v1/items/%s/location", barcode);
+        request->method = "PUT";
+        described = (request->body != NULL);
+        free(location);
+    } else if (opcode == JournalFormat::OP_ITEM_CREATE || opcode == JournalFormat::OP_ITEM_UPDATE) {
+        // The item serialized again; an update goes by the server's id, on
+        // condition the server is still at the version it was edited from
+        TCHAR* json = payload.item->ToJson();
+        request->body = ToUtf8(json);
+        delete[] json;
+        described = (request->body != NULL);
+
+        if (opcode == JournalFormat::OP_ITEM_CREATE) {
+            snprintf(request->path, sizeof(request->path), "/api/v1/items");
+            request->method = "POST";
+        } else {
+            char* id = ToUtf8(payload.item->GetId());
+            snprintf(request->path, sizeof(request->path), "/api/v1/items/%s", id ? id : "");
+            request->method = "PUT";
+            request->version = ToUtf8(payload.item->GetVersion());
+            described = described && id;
+            free(id);
+        }
+    } else {
+        described = false;
+    }
+
+    free(barcode);
+    return described;
+}
+
+static void FreeRequest(Request* request)
+{
+    free(request->body);
+    free(request->version);
+}
+
+struct Endpoint {
+    char host[256];
+    char prefix[512];           // Path of the base URL, without trailing '/'
+    struct addrinfo* address;
+};
+
+static bool ParseUrl(const char* url, Endpoint* endpoint)
+{
+    if (strncmp(url, "http://", 7) != 0) {
+        fprintf(stderr, "only http:// URLs are supported\n");
+        return false;
+    }
+    url += 7;
+
+    const char* hostEnd = url + strcspn(url, ":/");
+    const char* pathStart = url + strcspn(url, "/");
+    if (hostEnd == url || (size_t)(hostEnd - url) >= sizeof(endpoint->host)) {
+        fprintf(stderr, "bad host in URL\n");
+        return false;
+    }
+    memcpy(endpoint->host, url, hostEnd - url);
+    endpoint->host[hostEnd - url] = '\0';
+
+    char port[16] = "80";
+    if (*hostEnd == ':') {
+        size_t portLen = pathStart - hostEnd - 1;
+        if (portLen == 0 || portLen >= sizeof(port)) {
+            fprintf(stderr, "bad port in URL\n");
+            return false;
+        }
+        memcpy(port, hostEnd + 1, portLen);
+        port[portLen] = '\0';
+    }
+
+    snprintf(endpoint->prefix, sizeof(endpoint->prefix), "%s", pathStart);
+    size_t prefixLen = strlen(endpoint->prefix);
+    while (prefixLen > 0 && endpoint->prefix[prefixLen - 1] == '/') {
+        endpoint->prefix[--prefixLen] = '\0';
+    }
+
+    // Resolved once, so the figures are not skewed by the host's resolver
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(endpoint->host, port, &hints, &endpoint->address);
+    if (error != 0) {
+        fprintf(stderr, "cannot resolve %s: %s\n", endpoint->host, gai_strerror(error));
+        return false;
+    }
+    return true;
+}
+
+struct RequestResult {
+    int status;                 // 0 if no response was read
+    unsigned long bytesSent;
+    unsigned long bytesReceived;
+    unsigned int connections;   // Opened for it
+};
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int Connect(const Endpoint& endpoint, int timeoutSeconds)
+{
+    for (struct addrinfo* address = endpoint.address; address; address = address->ai_next) {
+        int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = timeoutSeconds;
+        timeout.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+// Appends what fits of a piece of response body, keeping it terminated
+static void Capture(char* capture, unsigned int size, unsigned int* used, const char* data, unsigned long length)
+{
+    if (!capture || *used + 1 >= size) {
+        return;
+    }
+    if (length > size - 1 - *used) {
+        length = size - 1 - *used;
+    }
+    memcpy(capture + *used, data, length);
+    *used += (unsigned int)length;
+    capture[*used] = '\0';
+}
+
+// Reads one response, framed by Content-Length, chunked encoding or the
+// server closing the connection. With a capture buffer the start of the
+// body is kept (chunk headers included). reusable is set when the
+// response was framed and the server keeps the connection open
+static bool ReadResponse(int fd, RequestResult* result, char* capture, unsigned int captureSize, bool* reusable)
+{
+    *reusable = false;
+    unsigned int captured = 0;
+    if (capture && captureSize > 0) {
+        capture[0] = '\0';
+    }
+
+    char header[kResponseHeaderSize];
+    unsigned int headerUsed = 0;
+    char* headerEnd = NULL;
+
+    while (!headerEnd) {
+        if (headerUsed == sizeof(header) - 1) {
+            return false;
+        }
+        ssize_t n = recv(fd, header + headerUsed, sizeof(header) - 1 - headerUsed, 0);
+        if (n <= 0) {
+            return false;
+        }
+        headerUsed += (unsigned int)n;
+        result->bytesReceived += (unsigned long)n;
+        header[headerUsed] = '\0';
+        headerEnd = strstr(header, "\r\n\r\n");
+    }
+
+    if (strncmp(header, "HTTP/1.", 7) != 0 || headerUsed < 12) {
+        return false;
+    }
+    result->status = atoi(header + 9);
+
+    *headerEnd = '\0';
+    unsigned long bodyRead = headerUsed - (unsigned int)(headerEnd + 4 - header);
+    long contentLength = -1;
+    bool chunked = false;
+    bool keepAlive = (strncmp(header, "HTTP/1.1", 8) == 0);
+    for (char* line = strstr(header, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            contentLength = atol(line + 15);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked")) {
+            chunked = true;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char* value = line + 11;
+            while (*value == ' ') {
+                value++;
+            }
+            keepAlive = (strncasecmp(value, "close", 5) != 0);
+        }
+    }
+
+    // Chunked bodies end with an empty chunk; keep the last bytes seen
+    static const char kLastChunk[] = "\r\n0\r\n\r\n";
+    const unsigned int tailSize = sizeof(kLastChunk) - 1;
+    char tail[sizeof(kLastChunk)] = "\r\n";
+    unsigned int tailUsed = 2;
+
+    const char* body = headerEnd + 4;
+    char buffer[16384];
+    unsigned long length = bodyRead;
+    for (;;) {
+        Capture(capture, captureSize, &captured, body, length);
+        if (chunked) {
+            for (unsigned long i = 0; i < length; i++) {
+                if (tailUsed == tailSize) {
+                    memmove(tail, tail + 1, tailSize - 1);
+                    tailUsed--;
+                }
+                tail[tailUsed++] = body[i];
+            }
+            if (tailUsed == tailSize && memcmp(tail, kLastChunk, tailSize) == 0) {
+                *reusable = keepAlive;
+                return true;
+            }
+        } else if (contentLength >= 0 && bodyRead >= (unsigned long)contentLength) {
+            // More than the body leaves the connection out of step
+            *reusable = keepAlive && bodyRead == (unsigned long)contentLength;
+            return true;
+        }
+
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            // Without a length the end of the connection is the end of the body
+            return (n == 0 && !chunked && contentLength < 0);
+        }
+        body = buffer;
+        length = (unsigned long)n;
+        bodyRead += length;
+        result->bytesReceived += length;
+    }
+}
+
+static bool SendAll(int fd, const char* data, size_t length, RequestResult* result)
+{
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= (size_t)n;
+        result->bytesSent += (unsigned long)n;
+    }
+    return true;
+}
+
+// The request HbClient::MakeApiRequest makes; the response body is kept
+// when a buffer is given. With a connection (-1 for none yet) it goes out
+// on that one and leaves it open as HttpClient does, and one the server
+// has closed meanwhile is replaced; without, on a connection of its own
+static bool SendRequest(const Endpoint& endpoint, int* connection, const char* method, const char* path,
+                        const char* body, const char* token, const char* key, const char* ifMatch,
+                        int timeoutSeconds, RequestResult* result, char* response, unsigned int responseSize)
+{
+    result->status = 0;
+    result->bytesSent = 0;
+    result->bytesReceived = 0;
+    result->connections = 0;
+
+    char authorization[512] = "";
+    if (token) {
+        snprintf(authorization, sizeof(authorization), "Authorization: Bearer %s\r\n", token);
+    }
+    char idempotency[256] = "";
+    if (key) {
+        snprintf(idempotency, sizeof(idempotency), "Idempotency-Key: %s\r\n", key);
+    }
+    char precondition[96] = "";
+    if (ifMatch && ifMatch[0] != '\0') {
+        snprintf(precondition, sizeof(precondition), "If-Match: \"%.64s\"\r\n", ifMatch);
+    }
+
+    // HttpClient adds its own connection, length and type headers after
+    // the others, and sends the body separately
+    char bodyHeaders[96] = "";
+    size_t bodyLength = strlen(body);
+    if (bodyLength > 0) {
+        snprintf(bodyHeaders, sizeof(bodyHeaders),
+                 "Content-Length: %u\r\nContent-Type: application/json\r\n", (unsigned int)bodyLength);
+    }
+
+    char request[4096];
+    int length = snprintf(request, sizeof(request),
+                          "%s %s%s HTTP/1.1\r\n"
+                          "Host: %s\r\n"
+                          "Content-Type: application/json\r\n"
+                          "Accept: application/json\r\n"
+                          "%s%s%s"
+                          "Connection: %s\r\n"
+                          "%s\r\n",
+                          method, endpoint.prefix, path, endpoint.host, authorization, idempotency, precondition,
+                          connection ? "keep-alive" : "close", bodyHeaders);
+    if (length <= 0 || length >= (int)sizeof(request)) {
+        return false;
+    }
+
+    // A reused connection the server closed fails before any response
+    int fd = connection ? *connection : -1;
+    bool reused = (fd >= 0);
+    bool success = false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (fd < 0) {
+            fd = Connect(endpoint, timeoutSeconds);
+            if (fd < 0) {
+                break;
+            }
+            result->connections++;
+        }
+
+        unsigned long received = result->bytesReceived;
+        bool reusable = false;
+        success = SendAll(fd, request, (size_t)length, result) && SendAll(fd, body, bodyLength, result) &&
+                  ReadResponse(fd, result, response, responseSize, &reusable);
+        if (!success || !reusable || !connection) {
+            close(fd);
+            fd = -1;
+        }
+        if (success || !reused || result->bytesReceived != received) {
+            break;
+        }
+        reused = false;
+    }
+
+    if (connection) {
+        *connection = fd;
+    }
+    return success;
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+
+static int CompareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static double Percentile(const double* sorted, unsigned int count, double fraction)
+{
+    if (count == 0) {
+        return 0.0;
+    }
+    unsigned int index = (unsigned int)(fraction * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static void PrintBytes(const char* label, unsigned long long bytes, unsigned long requests)
+{
+    printf("  %-10s %llu bytes (%.1f KB), %.0f per request\n", label, bytes, bytes / 1024.0,
+           requests ? (double)bytes / requests : 0.0);
+}
+
+struct ReplayStats {
+    unsigned long replayed;
+    unsigned long local;
+    unsigned long unsupported;
+    unsigned long heldBack;
+    unsigned long ok;
+    unsigned long rejected;
+    unsigned long failed;
+    unsigned long batches;
+    unsigned long batchedOperations;
+    unsigned long operationsFailed;     // In a batch, not reported applied
+    unsigned long long bytesSent;
+    unsigned long long bytesReceived;
+    unsigned long connections;
+    double* latencies;
+    unsigned int latencyCount;
+    unsigned int latencyCapacity;
+};
+
+static void AddLatency(ReplayStats* stats, double latency)
+{
+    if (stats->latencyCount == stats->latencyCapacity) {
+        unsigned int capacity = stats->latencyCapacity ? stats->latencyCapacity * 2 : 1024;
+        double* grown = (double*)realloc(stats->latencies, capacity * sizeof(double));
+        if (!grown) {
+            return;
+        }
+        stats->latencies = grown;
+        stats->latencyCapacity = capacity;
+    }
+    stats->latencies[stats->latencyCount++] = latency;
+}
+
+// Next transaction to replay: a pending one, as sync reads them, or with
+// held every one the journal still has. The opcode is 0 when the cursor
+// does not give it, and the handler is looked up by type
+static const TCHAR* NextTransaction(Journal::PendingCursor* pending, Journal::QueryCursor* held,
+                                    ULONGLONG* id, ULONGLONG* timestamp, unsigned int* opcode)
+{
+    const TCHAR* transaction = NULL;
+    if (held) {
+        transaction = held->Next();
+        *id = held->GetId();
+        *timestamp = held->GetTimestamp();
+        *opcode = 0;
+    } else {
+        transaction = pending->Next();
+        *id = pending->GetId();
+        *timestamp = pending->GetTimestamp();
+        *opcode = pending->GetOpcode();
+    }
+    return transaction;
+}
+
+// Whether the window already has an operation on the transaction's item;
+// the transaction is parsed on its own in probe to find out
+static bool WindowHoldsItem(const TransactionCoalescer& window, TransactionCoalescer* probe, ULONGLONG id,
+                            ULONGLONG timestamp, unsigned int opcode, const TCHAR* transaction)
+{
+    probe->ClearWindow();
+    if (!probe->Add(id, timestamp, opcode, transaction)) {
+        return false;
+    }
+
+    const TransactionCoalescer::Operation& parsed = probe->GetOperation(0);
+    if (!parsed.payload.barcode) {
+        return false;
+    }
+    for (int i = 0; i < window.GetOperationCount(); i++) {
+        const TransactionCoalescer::Operation& operation = window.GetOperation(i);
+        if (operation.itemKey == parsed.itemKey && operation.payload.barcode &&
+            lstrcmp(operation.payload.barcode, parsed.payload.barcode) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// ---------------------------------------------------------------------------
+// Lanes
+
+static const unsigned int kLaneLimit = 8;          // As SyncEngine::MAX_PIPELINE_DEPTH
+
+// A share of a window's operations, sent in order. Operations on one item
+// share a lane, so the items a lane holds back are its own
+struct Lane {
+    const Endpoint* endpoint;
+    const char* token;
+    int timeoutSeconds;
+    TransactionCoalescer* window;       // Shared by the lanes
+    pthread_mutex_t* blockLock;         // Over the window's blocked items
+    DWORD epoch;
+    bool batching;
+    int* positions;
+    int count;
+    SyncBatch* batch;
+    char* response;
+    TCHAR* wideResponse;
+    int connection;             // Kept open between requests; -1 for none
+    ReplayStats stats;
+    double speed;               // Pacing; only with a single lane
+    bool paced;
+    double start;
+    ULONGLONG firstTimestamp;
+};
+
+static bool IsItemBlocked(Lane* lane, int position)
+{
+    pthread_mutex_lock(lane->blockLock);
+    bool blocked = lane->window->IsBlocked(position);
+    pthread_mutex_unlock(lane->blockLock);
+    return blocked;
+}
+
+static void BlockItem(Lane* lane, int position)
+{
+    pthread_mutex_lock(lane->blockLock);
+    lane->window->Block(position);
+    pthread_mutex_unlock(lane->blockLock);
+}
+
+// Posts the batch as HbClient::SyncPendingTransactions does; operations
+// the response does not report as applied hold back their item
+static void SendBatch(Lane* lane)
+{
+    SyncBatch& batch = *lane->batch;
+    ReplayStats& stats = lane->stats;
+
+    TCHAR* request = batch.BuildRequest(kDeviceId);
+    char* body = ToUtf8(request);
+    delete[] request;
+
+    RequestResult result;
+    memset(&result, 0, sizeof(result));
+    double sentAt = Now();
+    bool answered = body && SendRequest(*lane->endpoint, &lane->connection, "POST", "/api/v1/sync", body,
+                                        lane->token, NULL, NULL, lane->timeoutSeconds, &result, lane->response,
+                                        kResponseBodySize);
+    double latency = (Now() - sentAt) * 1000.0;
+    free(body);
+    stats.connections += result.connections;
+
+    stats.batches++;
+    stats.batchedOperations += batch.GetCount();
+    stats.bytesSent += result.bytesSent;
+    stats.bytesReceived += result.bytesReceived;
+
+    bool accepted = false;
+    if (!answered) {
+        stats.failed++;
+    } else {
+        AddLatency(&stats, latency);
+        accepted = (result.status >= 200 && result.status < 300);
+        if (accepted) {
+            stats.ok++;
+        } else {
+            stats.rejected++;
+        }
+    }
+
+    if (accepted) {
+        MultiByteToWideChar(CP_UTF8, 0, lane->response, -1, lane->wideResponse, kResponseBodySize);
+        batch.ParseResponse(lane->wideResponse);
+    }
+    for (int i = 0; i < batch.GetCount(); i++) {
+        if (!accepted || !batch.Succeeded(i)) {
+            stats.operationsFailed++;
+            BlockItem(lane, batch.GetTag(i));
+        }
+    }
+    batch.Clear();
+}
+
+static void ReplayLane(Lane* lane)
+{
+    ReplayStats& stats = lane->stats;
+    const TransactionCoalescer& window = *lane->window;
+
+    for (int n = 0; n < lane->count; n++) {
+        int i = lane->positions[n];
+        const TransactionCoalescer::Operation& operation = window.GetOperation(i);
+        Action action = GetAction(operation);
+        if (action == ACTION_LOCAL) {
+            stats.local += operation.count;
+            continue;
+        }
+        if (action == ACTION_UNSUPPORTED) {
+            stats.unsupported += operation.count;
+            continue;
+        }
+        if (IsItemBlocked(lane, i)) {
+            stats.heldBack += operation.count;
+            continue;
+        }
+
+        // Requests share a POST to the sync endpoint until the batch
+        // is full or already holds the item
+        ULONGLONG firstId = window.GetMemberId(operation.firstMember);
+        if (lane->batching && SyncBatch::CanBatch(operation)) {
+            if (!lane->batch->Add(i, operation, firstId)) {
+                SendBatch(lane);
+                if (IsItemBlocked(lane, i)) {
+                    stats.heldBack += operation.count;
+                    continue;
+                }
+                lane->batch->Add(i, operation, firstId);
+            }
+            continue;
+        }
+
+        // One sent on its own goes after the batch holding an earlier
+        // change to the item, and not at all if that change failed
+        if (lane->batch->HoldsItem(operation)) {
+            SendBatch(lane);
+            if (IsItemBlocked(lane, i)) {
+                stats.heldBack += operation.count;
+                continue;
+            }
+        }
+
+        // Keep the recorded gaps, scaled; a late start is not caught up
+        if (lane->speed > 0.0) {
+            ULONGLONG timestamp = window.GetMemberTimestamp(operation.firstMember);
+            if (!lane->paced) {
+                lane->firstTimestamp = timestamp;
+                lane->start = Now();
+                lane->paced = true;
+            }
+            double due = lane->start + (timestamp - lane->firstTimestamp) / 1000.0 / lane->speed;
+            double wait = due - Now();
+            if (wait > 0.0) {
+                struct timespec delay;
+                delay.tv_sec = (time_t)wait;
+                delay.tv_nsec = (long)((wait - delay.tv_sec) * 1e9);
+                nanosleep(&delay, NULL);
+            }
+        }
+
+        Request request;
+        if (!DescribeRequest(operation, &request)) {
+            FreeRequest(&request);
+            stats.failed++;
+            BlockItem(lane, i);
+            continue;
+        }
+
+        // Changes carry the key the device would give them, after its ID
+        // as HbClient puts it
+        TCHAR key[ReplayCache::KEY_CHARS];
+        ReplayCache::FormatKey(lane->epoch, firstId, window.GetMemberId(operation.lastMember), key);
+        TCHAR deviceKey[ReplayCache::KEY_CHARS + 16];
+        wsprintf(deviceKey, TEXT("%s-%s"), kDeviceId, key);
+        char* keyHeader = ToUtf8(deviceKey);
+
+        RequestResult result;
+        double sentAt = Now();
+        bool answered = SendRequest(*lane->endpoint, &lane->connection, request.method, request.path,
+                                    request.body ? request.body : "", lane->token,
+                                    strcmp(request.method, "GET") != 0 ? keyHeader : NULL, request.version,
+                                    lane->timeoutSeconds, &result, NULL, 0);
+        double latency = (Now() - sentAt) * 1000.0;
+        FreeRequest(&request);
+        free(keyHeader);
+        stats.connections += result.connections;
+
+        stats.bytesSent += result.bytesSent;
+        stats.bytesReceived += result.bytesReceived;
+        if (!answered) {
+            stats.failed++;
+            BlockItem(lane, i);
+            continue;
+        }
+
+        AddLatency(&stats, latency);
+        if (result.status >= 200 && result.status < 300) {
+            stats.ok++;
+        } else {
+            stats.rejected++;
+            BlockItem(lane, i);
+        }
+    }
+
+    if (lane->batch->GetCount() > 0) {
+        SendBatch(lane);
+    }
+}
+
+static void* LaneThread(void* param)
+{
+    ReplayLane((Lane*)param);
+    return NULL;
+}
+
+static void FreeLanes(Lane* lanes, unsigned int count)
+{
+    for (unsigned int l = 0; l < count; l++) {
+        if (lanes[l].connection >= 0) {
+            close(lanes[l].connection);
+        }
+        free(lanes[l].positions);
+        delete lanes[l].batch;
+        free(lanes[l].response);
+        free(lanes[l].wideResponse);
+        free(lanes[l].stats.latencies);
+    }
+    free(lanes);
+}
+
+static int Replay(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: journal_replay replay <journal path> <server url> [options]\n");
+        return 1;
+    }
+
+    double speed = 0.0;
+    const char* token = NULL;
+    unsigned long limit = 0;
+    int timeoutSeconds = 10;
+    bool all = false;
+    bool coalesce = true;
+    int batchOperations = SyncBatch::DEFAULT_MAX_OPERATIONS;
+    DWORD batchBytes = SyncBatch::DEFAULT_MAX_BYTES;
+    unsigned int laneCount = 1;
+    for (int i = 2; i < argc; i++) {
+        bool hasValue = (i + 1 < argc);
+        if (strcmp(argv[i], "-s") == 0 && hasValue) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && hasValue) {
+            token = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && hasValue) {
+            limit = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-w") == 0 && hasValue) {
+            timeoutSeconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0) {
+            all = true;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            coalesce = false;
+        } else if (strcmp(argv[i], "-b") == 0 && hasValue) {
+            batchOperations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && hasValue) {
+            batchBytes = (DWORD)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if (strcmp(argv[i], "-p") == 0 && hasValue) {
+            laneCount = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Paced replay stands for a device that is online, which syncs each
+    // transaction as it comes rather than a backlog
+    if (speed > 0.0) {
+        coalesce = false;
+        batchOperations = 0;
+        laneCount = 1;
+    }
+    if (laneCount < 1) {
+        laneCount = 1;
+    } else if (laneCount > kLaneLimit) {
+        laneCount = kLaneLimit;
+    }
+    if (batchBytes == 0) {
+        batchBytes = 1024;
+    }
+
+    // Opening a path that holds no journal would create one
+    char slotPath[1024];
+    bool found = (access(argv[0], F_OK) == 0);
+    for (int slot = 0; slot < 2 && !found; slot++) {
+        snprintf(slotPath, sizeof(slotPath), "%s.mf%d", argv[0], slot);
+        found = (access(slotPath, F_OK) == 0);
+    }
+    TCHAR journalPath[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, 0, argv[0], -1, journalPath, MAX_PATH);
+    Journal journal;
+    if (!found || !journal.Initialize(journalPath)) {
+        fprintf(stderr, "cannot open %s\n", argv[0]);
+        return 1;
+    }
+    int pendingCount = journal.GetTransactionCount();
+
+    Endpoint endpoint;
+    if (!ParseUrl(argv[1], &endpoint)) {
+        return 1;
+    }
+
+    TransactionCoalescer window;
+    TransactionCoalescer probe;
+    pthread_mutex_t blockLock = PTHREAD_MUTEX_INITIALIZER;
+    Lane* lanes = (Lane*)calloc(laneCount, sizeof(Lane));
+    for (unsigned int l = 0; lanes && l < laneCount; l++) {
+        lanes[l].connection = -1;
+    }
+    bool allocated = (lanes != NULL);
+    for (unsigned int l = 0; allocated && l < laneCount; l++) {
+        Lane& lane = lanes[l];
+        lane.endpoint = &endpoint;
+        lane.token = token;
+        lane.timeoutSeconds = timeoutSeconds;
+        lane.window = &window;
+        lane.blockLock = &blockLock;
+        lane.epoch = journal.GetEpoch();
+        lane.batching = (batchOperations > 0);
+        lane.positions = (int*)malloc(TransactionCoalescer::WINDOW_SIZE * sizeof(int));
+        lane.batch = new SyncBatch();
+        lane.response = (char*)malloc(kResponseBodySize);
+        lane.wideResponse = (TCHAR*)malloc(kResponseBodySize * sizeof(TCHAR));
+        lane.speed = speed;
+        allocated = (lane.positions && lane.response && lane.wideResponse);
+        if (lane.batching) {
+            lane.batch->SetLimits(batchOperations, batchBytes);
+        }
+    }
+    if (!allocated) {
+        fprintf(stderr, "out of memory\n");
+        if (lanes) {
+            FreeLanes(lanes, laneCount);
+        }
+        freeaddrinfo(endpoint.address);
+        return 1;
+    }
+
+    Journal::PendingCursor* pending = NULL;
+    Journal::QueryCursor* held = NULL;
+    if (all) {
+        Journal::QueryFilter everything;
+        memset(&everything, 0, sizeof(everything));
+        held = new Journal::QueryCursor(&journal, everything);
+    } else {
+        pending = new Journal::PendingCursor(&journal);
+    }
+
+    ReplayStats stats;
+    memset(&stats, 0, sizeof(stats));
+    double start = Now();
+
+    ULONGLONG id = 0;
+    ULONGLONG timestamp = 0;
+    unsigned int opcode = 0;
+    const TCHAR* transaction = NextTransaction(pending, held, &id, &timestamp, &opcode);
+
+    while (transaction && (limit == 0 || stats.replayed < limit)) {
+        // Collapse a window of transactions per item, as Sync does; left
+        // uncoalesced, a window ends before an item's second transaction
+        window.ClearWindow();
+        while (transaction && (limit == 0 || stats.replayed < limit)) {
+            if (!coalesce && WindowHoldsItem(window, &probe, id, timestamp, opcode, transaction)) {
+                break;
+            }
+            if (!window.Add(id, timestamp, opcode, transaction)) {
+                break;
+            }
+            stats.replayed++;
+            transaction = NextTransaction(pending, held, &id, &timestamp, &opcode);
+        }
+
+        // By item key, as the device does, so each item's operations stay
+        // in order within a lane
+        for (unsigned int l = 0; l < laneCount; l++) {
+            lanes[l].count = 0;
+        }
+        for (int i = 0; i < window.GetOperationCount(); i++) {
+            const TransactionCoalescer::Operation& operation = window.GetOperation(i);
+            DWORD key = operation.payload.barcode ? operation.itemKey : (DWORD)i;
+            Lane& lane = lanes[key % laneCount];
+            lane.positions[lane.count++] = i;
+        }
+
+        pthread_t threads[kLaneLimit];
+        bool started[kLaneLimit];
+        for (unsigned int l = 1; l < laneCount; l++) {
+            started[l] = (pthread_create(&threads[l], NULL, LaneThread, &lanes[l]) == 0);
+        }
+        ReplayLane(&lanes[0]);
+        for (unsigned int l = 1; l < laneCount; l++) {
+            if (started[l]) {
+                pthread_join(threads[l], NULL);
+            } else {
+                ReplayLane(&lanes[l]);
+            }
+        }
+    }
+    window.ClearWindow();
+
+    for (unsigned int l = 0; l < laneCount; l++) {
+        const ReplayStats& laneStats = lanes[l].stats;
+        stats.local += laneStats.local;
+        stats.unsupported += laneStats.unsupported;
+        stats.heldBack += laneStats.heldBack;
+        stats.ok += laneStats.ok;
+        stats.rejected += laneStats.rejected;
+        stats.failed += laneStats.failed;
+        stats.batches += laneStats.batches;
+        stats.batchedOperations += laneStats.batchedOperations;
+        stats.operationsFailed += laneStats.operationsFailed;
+        stats.bytesSent += laneStats.bytesSent;
+        stats.bytesReceived += laneStats.bytesReceived;
+        stats.connections += laneStats.connections;
+        for (unsigned int n = 0; n < laneStats.latencyCount; n++) {
+            AddLatency(&stats, laneStats.latencies[n]);
+        }
+    }
+
+    double elapsed = Now() - start;
+    unsigned long requests = stats.ok + stats.rejected + stats.failed;
+
+    printf("journal        %d pending transactions, epoch %08lx\n", pendingCount, (unsigned long)journal.GetEpoch());
+    printf("replayed       %lu transactions: %lu requests%s, %lu cleared locally, %lu left pending, "
+           "%lu held back\n", stats.replayed, requests, coalesce ? " (coalesced)" : "",
+           stats.local, stats.unsupported, stats.heldBack);
+    if (laneCount > 1) {
+        printf("lanes          %u in flight\n", laneCount);
+    }
+    printf("responses      %lu ok, %lu rejected (non-2xx), %lu failed (no response)\n",
+           stats.ok, stats.rejected, stats.failed);
+    if (stats.batches > 0) {
+        printf("batches        %lu carrying %lu operations (%.1f each), %lu not applied\n",
+               stats.batches, stats.batchedOperations, (double)stats.batchedOperations / stats.batches,
+               stats.operationsFailed);
+    }
+    printf("elapsed        %.3f s, %.1f transactions/s, %.1f requests/s\n", elapsed,
+           elapsed > 0.0 ? stats.replayed / elapsed : 0.0, elapsed > 0.0 ? requests / elapsed : 0.0);
+    printf("connections    %lu opened, %.1f requests each\n", stats.connections,
+           stats.connections > 0 ? (double)requests / stats.connections : 0.0);
+    printf("wire\n");
+    PrintBytes("sent", stats.bytesSent, requests);
+    PrintBytes("received", stats.bytesReceived, requests);
+
+    qsort(stats.latencies, stats.latencyCount, sizeof(double), CompareDoubles);
+    printf("latency ms     p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+           Percentile(stats.latencies, stats.latencyCount, 0.50),
+           Percentile(stats.latencies, stats.latencyCount, 0.90),
+           Percentile(stats.latencies, stats.latencyCount, 0.99),
+           stats.latencyCount ? stats.latencies[stats.latencyCount - 1] : 0.0);
+
+    delete pending;
+    delete held;
+    free(stats.latencies);
+    FreeLanes(lanes, laneCount);
+    freeaddrinfo(endpoint.address);
+    return (stats.failed > 0) ? 2 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Synthesis
+
+// xorshift64*; the same sequence on every host for a given seed
+static JournalU64 g_random = 1;
+
+static double RandomUnit()
+{
+    g_random ^= g_random >> 12;
+    g_random ^= g_random << 25;
+    g_random ^= g_random >> 27;
+    JournalU64 value = g_random * 2685821657736338717ULL;
+    return (value >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Index into a table of increasing cumulative weights
+static unsigned int Pick(const double* cumulative, unsigned int count)
+{
+    double target = RandomUnit() * cumulative[count - 1];
+    unsigned int low = 0;
+    unsigned int high = count - 1;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (cumulative[mid] <= target) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// EAN-13 for the item of the given popularity rank; ranks are scattered
+// so popular items do not get neighbouring numbers
+static void MakeBarcode(unsigned int rank, char* barcode)
+{
+    unsigned long long code = ((unsigned long long)(rank + 1) * 2654435761ULL) % 1000000000ULL;
+    snprintf(barcode, 14, "400%09llu", code);
+
+    int sum = 0;
+    for (int i = 0; i < 12; i++) {
+        sum += (barcode[i] - '0') * ((i % 2) ? 3 : 1);
+    }
+    barcode[12] = (char)('0' + (10 - sum % 10) % 10);
+    barcode[13] = '\0';
+}
+
+static int CompareTimestamps(const void* a, const void* b)
+{
+    JournalU64 x = *(const JournalU64*)a;
+    JournalU64 y = *(const JournalU64*)b;
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+struct SynthWriter {
+    const char* basePath;
+    FILE* segment;
+    JournalFormat::ManifestSegment* segments;
+    unsigned int segmentCount;
+    JournalFormat::ManifestPending* pending;
+    unsigned int pendingCount;
+    JournalU64 nextSequence;
+    JournalU64 lastTimestamp;
+    unsigned int nextSegmentId;
+};
+
+static bool OpenSegment(SynthWriter* writer)
+{
+    if (writer->segment && fclose(writer->segment) != 0) {
+        writer->segment = NULL;
+        return false;
+    }
+
+    JournalFormat::ManifestSegment* grown = (JournalFormat::ManifestSegment*)realloc(
+        writer->segments, (writer->segmentCount + 1) * sizeof(JournalFormat::ManifestSegment));
+    if (!grown) {
+        return false;
+    }
+    writer->segments = grown;
+
+    JournalFormat::ManifestSegment& segment = writer->segments[writer->segmentCount++];
+    segment.id = writer->nextSegmentId++;
+    segment.size = JournalFormat::FILE_HEADER_SIZE;
+    segment.records = 0;
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.%08x", writer->basePath, segment.id);
+    writer->segment = fopen(path, "wb");
+    if (!writer->segment) {
+        fprintf(stderr, "cannot create %s\n", path);
+        return false;
+    }
+
+    unsigned char header[JournalFormat::FILE_HEADER_SIZE];
+    JournalFormat::EncodeFileHeader(header, writer->nextSequence);
+    return fwrite(header, 1, sizeof(header), writer->segment) == sizeof(header);
+}
+
+// Appends an unsynced transaction the way Journal::LogTransaction does
+static bool WriteTransaction(SynthWriter* writer, JournalU64 timestamp, unsigned int opcode,
+                             const char* type, const char* item, const char* text)
+{
+    unsigned char record[JournalFormat::MAX_RECORD_SIZE];
+    unsigned char* payload = record + JournalFormat::RECORD_HEADER_SIZE;
+    unsigned int textOffset = JournalFormat::EncodeTags(payload, (const unsigned char*)type, (unsigned int)strlen(type),
+                                                        (const unsigned char*)item, (unsigned int)strlen(item));
+    unsigned int textLength = (unsigned int)strlen(text);
+    memcpy(payload + textOffset, text, textLength);
+
+    JournalFormat::RecordHeader header;
+    header.sequence = writer->nextSequence;
+    header.timestamp = timestamp;
+    header.type = JournalFormat::REC_TRANS;
+    header.flags = (unsigned short)(JournalFormat::FLAG_TAGGED | JournalFormat::OpcodeFlags(opcode));
+    header.length = textOffset + textLength;
+    JournalFormat::EncodeRecord(record, &header);
+
+    unsigned int recordSize = JournalFormat::RECORD_HEADER_SIZE + header.length;
+    JournalFormat::ManifestSegment* active = &writer->segments[writer->segmentCount - 1];
+    if (active->size > JournalFormat::FILE_HEADER_SIZE && active->size + recordSize > kSegmentSizeLimit) {
+        if (!OpenSegment(writer)) {
+            return false;
+        }
+        active = &writer->segments[writer->segmentCount - 1];
+    }
+
+    if (fwrite(record, 1, recordSize, writer->segment) != recordSize) {
+        return false;
+    }
+
+    if ((writer->pendingCount & 1023) == 0) {
+        JournalFormat::ManifestPending* grown = (JournalFormat::ManifestPending*)realloc(
+            writer->pending, (writer->pendingCount + 1024) * sizeof(JournalFormat::ManifestPending));
+        if (!grown) {
+            return false;
+        }
+        writer->pending = grown;
+    }
+
+    // Pending entries are keyed on the text, as the journal matches them,
+    // and tagged with the key of the type, as its cursors filter them
+    JournalFormat::ManifestPending& entry = writer->pending[writer->pendingCount++];
+    entry.sequence = header.sequence;
+    entry.segment = active->id;
+    entry.offset = active->size;
+    entry.key = JournalFormat::Crc32(payload + textOffset, textLength, 0);
+    entry.tag = JournalFormat::Crc32((const unsigned char*)type, (unsigned int)strlen(type), 0);
+    entry.timestamp = timestamp;
+
+    active->size += recordSize;
+    active->records++;
+    writer->nextSequence++;
+    writer->lastTimestamp = timestamp;
+    return true;
+}
+
+static bool WriteManifest(SynthWriter* writer)
+{
+    if (fclose(writer->segment) != 0) {
+        writer->segment = NULL;
+        return false;
+    }
+    writer->segment = NULL;
+
+    JournalFormat::ManifestHeader header;
+    header.generation = 1;
+    header.nextSequence = writer->nextSequence;
+    header.lastTimestamp = writer->lastTimestamp;
+    header.nextSegmentId = writer->nextSegmentId;
+    header.segmentCount = writer->segmentCount;
+    header.pendingCount = writer->pendingCount;
+    header.scanOffset = writer->segments[writer->segmentCount - 1].size;
+    header.crc = 0;
+
+    // Not from the seed: two journals synthesized alike are still two
+    // journals to a server that keeps their keys
+    header.epoch = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+    if (header.epoch == 0) {
+        header.epoch = 1;
+    }
+
+    unsigned long bodySize = writer->segmentCount * (unsigned long)JournalFormat::MANIFEST_SEGMENT_SIZE +
+                             writer->pendingCount * (unsigned long)JournalFormat::MANIFEST_PENDING_SIZE;
+    unsigned char* data = (unsigned char*)malloc(JournalFormat::MANIFEST_HEADER_SIZE + bodySize);
+    if (!data) {
+        return false;
+    }
+
+    unsigned char* body = data + JournalFormat::MANIFEST_HEADER_SIZE;
+    for (unsigned int i = 0; i < writer->segmentCount; i++) {
+        JournalFormat::EncodeManifestSegment(body + i * JournalFormat::MANIFEST_SEGMENT_SIZE, &writer->segments[i]);
+    }
+    body += writer->segmentCount * JournalFormat::MANIFEST_SEGMENT_SIZE;
+    for (unsigned int i = 0; i < writer->pendingCount; i++) {
+        JournalFormat::EncodeManifestPending(body + i * JournalFormat::MANIFEST_PENDING_SIZE, &writer->pending[i]);
+    }
+
+    JournalFormat::EncodeManifestHeader(data, &header);
+    header.crc = JournalFormat::GetManifestHeaderCrc(data, JournalFormat::MANIFEST_VERSION);
+    header.crc = JournalFormat::Crc32(data + JournalFormat::MANIFEST_HEADER_SIZE, (unsigned int)bodySize, header.crc);
+    JournalFormat::EncodeManifestHeader(data, &header);
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.mf0", writer->basePath);
+    FILE* file = fopen(path, "wb");
+    bool success = (file && fwrite(data, 1, JournalFormat::MANIFEST_HEADER_SIZE + bodySize, file) ==
+                            JournalFormat::MANIFEST_HEADER_SIZE + bodySize);
+    if (file && fclose(file) != 0) {
+        success = false;
+    }
+
+    free(data);
+    return success;
+}
+
+static bool FileExists(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file) {
+        fclose(file);
+        return true;
+    }
+    return false;
+}
+
+static int Synthesize(int argc, char* argv[])
+{
+    if (argc < 1) {
+        fprintf(stderr, "usage: journal_replay synth <journal path> [options]\n");
+        return 1;
+    }
+
+    unsigned long scans = 40000;
+    int days = 3;
+    unsigned int catalogue = 5000;
+    const char* firstDay = NULL;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = (i + 1 < argc);
+        if (strcmp(argv[i], "-n") == 0 && hasValue) {
+            scans = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-d") == 0 && hasValue) {
+            days = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && hasValue) {
+            catalogue = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-b") == 0 && hasValue) {
+            firstDay = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && hasValue) {
+            g_random = strtoull(argv[++i], NULL, 10) * 0x9E3779B97F4A7C15ULL + 1;
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (scans == 0 || days <= 0 || catalogue == 0) {
+        fprintf(stderr, "scans, days and items must be positive\n");
+        return 1;
+    }
+
+    // Never mix with the files of an existing journal
+    char slotPath[1024];
+    for (int slot = 0; slot < 2; slot++) {
+        snprintf(slotPath, sizeof(slotPath), "%s.mf%d", argv[0], slot);
+        if (FileExists(slotPath)) {
+            fprintf(stderr, "%s already exists\n", slotPath);
+            return 1;
+        }
+    }
+
+    JournalU64 start;
+    int year, month, day;
+    if (firstDay) {
+        if (sscanf(firstDay, "%d-%d-%d", &year, &month, &day) != 3) {
+            fprintf(stderr, "bad date %s\n", firstDay);
+            return 1;
+        }
+        start = JournalFormat::MakeTimestamp(year, month, day, 0, 0, 0, 0);
+    } else {
+        JournalU64 now = (JournalU64)time(NULL) * 1000;
+        start = (now / 86400000 - days) * 86400000;
+    }
+
+    // Two shifts, 06:00-14:00 and 14:00-22:00, slower around breaks
+    static const double kHourWeights[24] = {
+        0, 0, 0, 0, 0, 0, 4, 9, 10, 10, 6, 9, 8, 9,
+        5, 9, 10, 10, 6, 9, 8, 6, 0, 0
+    };
+    double hours[24];
+    double total = 0.0;
+    for (int h = 0; h < 24; h++) {
+        total += kHourWeights[h];
+        hours[h] = total;
+    }
+
+    // Zipf with exponent 1: a few fast movers, a long tail of slow ones
+    double* popularity = (double*)malloc(catalogue * sizeof(double));
+    JournalU64* times = (JournalU64*)malloc(scans * sizeof(JournalU64));
+    if (!popularity || !times) {
+        fprintf(stderr, "out of memory\n");
+        free(popularity);
+        free(times);
+        return 1;
+    }
+    total = 0.0;
+    for (unsigned int r = 0; r < catalogue; r++) {
+        total += 1.0 / (r + 1);
+        popularity[r] = total;
+    }
+
+    for (unsigned long i = 0; i < scans; i++) {
+        JournalU64 dayStart = start + (JournalU64)(RandomUnit() * days) * 86400000;
+        unsigned int hour = Pick(hours, 24);
+        times[i] = dayStart + hour * 3600000ULL + (JournalU64)(RandomUnit() * 3600000.0);
+    }
+    qsort(times, scans, sizeof(JournalU64), CompareTimestamps);
+
+    SynthWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.basePath = argv[0];
+    writer.nextSequence = 1;
+    writer.nextSegmentId = 1;
+
+    bool success = OpenSegment(&writer);
+    unsigned int rank = 0;
+    for (unsigned long i = 0; success && i < scans; i++) {
+        // One scan in twelve repeats the last barcode, as when a label
+        // does not read cleanly the first time
+        if (i == 0 || RandomUnit() >= 1.0 / 12) {
+            rank = Pick(popularity, catalogue);
+        }
+
+        char barcode[14];
+        MakeBarcode(rank, barcode);
+
+        // The device's tick count, which is what SyncEngine stamps
+        char text[128];
+        snprintf(text, sizeof(text), "[%lu] ITEM_SCAN: SCAN:%s",
+                 (unsigned long)((times[i] - start) & 0xFFFFFFFFUL), barcode);
+
+        success = WriteTransaction(&writer, times[i], JournalFormat::OP_NONE, "SCAN", barcode, "Barcode scanned") &&
+                  WriteTransaction(&writer, times[i] + 40, JournalFormat::OP_ITEM_SCAN, "ITEM_SCAN", barcode, text);
+    }
+
+    if (success) {
+        success = WriteManifest(&writer);
+    } else if (writer.segment) {
+        fclose(writer.segment);
+    }
+
+    if (success) {
+        char first[32];
+        char last[32];
+        JournalFormat::FormatTimestamp(times[0], first, sizeof(first));
+        JournalFormat::FormatTimestamp(writer.lastTimestamp, last, sizeof(last));
+        printf("%lu scans, %u records in %u segments, %s to %s\n", scans, writer.pendingCount,
+               writer.segmentCount, first, last);
+    } else {
+        fprintf(stderr, "cannot write journal %s\n", argv[0]);
+    }
+
+    free(popularity);
+    free(times);
+    free(writer.segments);
+    free(writer.pending);
+    return success ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+// Mock server
+
+static const unsigned int kRequestSizeLimit = 1024 * 1024;
+static const unsigned int kKeyTableSize = 65536;            // Powers of two
+static const unsigned int kAppliedTableSize = 1024 * 1024;
+static const unsigned int kVersionTableSize = 65536;
+static const int kServeIdleSeconds = 5;         // Keep-alive connections left idle
+
+static const char* SkipSpace(const char* p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+// The answer given to a change sent with an Idempotency-Key
+struct KeyEntry {
+    char key[128];              // Empty if the slot is free
+    unsigned int requestCrc;    // Of the method, path and body
+    int status;
+};
+
+// Effects of the requests served, as GET /api/v1/mock/stats reports them
+struct ServeCounts {
+    unsigned long creates;
+    unsigned long moves;
+    unsigned long updates;
+    unsigned long syncApplied;      // Sync transactions applied
+    unsigned long replayed;         // Keyed changes answered from the table
+    unsigned long duplicates;       // Sync transactions applied before
+    unsigned long conflicts;        // A key reused for another request
+    unsigned long stale;            // Updates refused for an old If-Match
+    unsigned long dropped;          // Connections closed without an answer
+    unsigned long connections;      // Accepted
+};
+
+// Shared by the connection threads
+struct ServeState {
+    int latencyMs;
+    double failRate;
+    double dropRate;
+    pthread_mutex_t lock;       // Guards everything below and the random sequence
+    unsigned long requests;
+    unsigned long operations;
+    ServeCounts counts;
+    KeyEntry* keys;
+    unsigned int keyCount;
+    JournalU64* applied;        // Sync transaction IDs; 0 marks a free slot
+    unsigned int appliedCount;
+    unsigned int* versions;     // Updates applied per item, by hash; items that
+                                // share a slot share a version
+};
+
+struct Connection {
+    int fd;
+    ServeState* state;
+};
+
+// Callers hold the lock
+static bool ServeFails(ServeState* state)
+{
+    return RandomUnit() < state->failRate;
+}
+
+// The key's slot, or the free slot it would take; NULL when the table
+// is too full to take it. Callers hold the lock
+static KeyEntry* FindKey(ServeState* state, const char* key)
+{
+    unsigned int slot = JournalFormat::Crc32((const unsigned char*)key, (unsigned int)strlen(key), 0);
+    for (unsigned int probe = 0; probe < kKeyTableSize; probe++) {
+        KeyEntry* entry = &state->keys[(slot + probe) & (kKeyTableSize - 1)];
+        if (entry->key[0] == '\0') {
+            return (state->keyCount < kKeyTableSize / 4 * 3) ? entry : NULL;
+        }
+        if (strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// The version of the item at the end of the path, "/api/v1/items/<id>";
+// items are addressed by barcode and id alike, which the mock's items
+// share. Callers hold the lock
+static unsigned int* FindVersion(ServeState* state, const char* path)
+{
+    const char* item = strstr(path, "/items/") + 7;
+    unsigned int length = (unsigned int)strcspn(item, "/");
+    unsigned int slot = JournalFormat::Crc32((const unsigned char*)item, length, 0);
+    return &state->versions[slot & (kVersionTableSize - 1)];
+}
+
+// The mock's copy of an item, with its version
+static void FormatItem(const char* path, unsigned int version, char* item, unsigned int size)
+{
+    const char* barcode = strstr(path, "/items/") + 7;
+    int length = (int)strcspn(barcode, "/");
+    if (length > 64) {
+        length = 64;
+    }
+    snprintf(item, size, "{\"id\":\"%.*s\",\"barcode\":\"%.*s\",\"name\":\"Mock item\",\"quantity\":1,\"version\":\"%u\"}",
+             length, barcode, length, barcode, version);
+}
+
+// False if the sync transaction was applied before, or the table is too
+// full to tell. Callers hold the lock
+static bool MarkApplied(ServeState* state, JournalU64 id, bool* full)
+{
+    *full = false;
+    unsigned int slot = JournalFormat::Crc32((const unsigned char*)&id, sizeof(id), 0);
+    for (unsigned int probe = 0; probe < kAppliedTableSize; probe++) {
+        JournalU64* entry = &state->applied[(slot + probe) & (kAppliedTableSize - 1)];
+        if (*entry == id) {
+            return false;
+        }
+        if (*entry == 0) {
+            if (state->appliedCount >= kAppliedTableSize / 4 * 3) {
+                *full = true;
+                return false;
+            }
+            *entry = id;
+            state->appliedCount++;
+            return true;
+        }
+    }
+    *full = true;
+    return false;
+}
+
+// Reads a request with a Content-Length body; the method, path, body,
+// Idempotency-Key and unquoted If-Match (NULL without them) point into
+// the buffer. keepAlive is false if the client means to close the
+// connection after it. Clients send one request at a time
+static bool ReadRequest(int fd, char* buffer, unsigned int size, char** method, char** path, char** body,
+                        char** key, char** ifMatch, bool* keepAlive)
+{
+    unsigned int used = 0;
+    char* headerEnd = NULL;
+    while (!headerEnd) {
+        if (used == size - 1) {
+            return false;
+        }
+        ssize_t n = recv(fd, buffer + used, size - 1 - used, 0);
+        if (n <= 0) {
+            return false;
+        }
+        used += (unsigned int)n;
+        buffer[used] = '\0';
+        headerEnd = strstr(buffer, "\r\n\r\n");
+    }
+
+    *headerEnd = '\0';
+    unsigned long contentLength = 0;
+    *key = NULL;
+    *ifMatch = NULL;
+    *keepAlive = (strstr(buffer, " HTTP/1.1\r\n") != NULL);
+    for (char* line = strstr(buffer, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            contentLength = strtoul(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Idempotency-Key:", 16) == 0) {
+            *key = (char*)SkipSpace(line + 16);
+        } else if (strncasecmp(line, "If-Match:", 9) == 0) {
+            *ifMatch = (char*)SkipSpace(line + 9);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char* value = SkipSpace(line + 11);
+            if (strncasecmp(value, "close", 5) == 0) {
+                *keepAlive = false;
+            } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+                *keepAlive = true;
+            }
+        }
+    }
+
+    // Only now, so the header lines stay intact for the search above
+    if (*key) {
+        (*key)[strcspn(*key, "\r")] = '\0';
+        if ((*key)[0] == '\0' || strlen(*key) >= sizeof(((KeyEntry*)0)->key)) {
+            return false;
+        }
+    }
+    if (*ifMatch) {
+        if (**ifMatch == '"') {
+            (*ifMatch)++;
+        }
+        (*ifMatch)[strcspn(*ifMatch, "\"\r")] = '\0';
+    }
+
+    *body = headerEnd + 4;
+    unsigned int headerSize = (unsigned int)(*body - buffer);
+    if (contentLength > size - 1 - headerSize) {
+        return false;
+    }
+    while (used < headerSize + contentLength) {
+        ssize_t n = recv(fd, buffer + used, headerSize + contentLength - used, 0);
+        if (n <= 0) {
+            return false;
+        }
+        used += (unsigned int)n;
+    }
+    (*body)[contentLength] = '\0';
+
+    // "METHOD /path HTTP/1.1"
+    *method = buffer;
+    *path = strchr(buffer, ' ');
+    if (!*path) {
+        return false;
+    }
+    *(*path)++ = '\0';
+    char* pathEnd = strchr(*path, ' ');
+    if (pathEnd) {
+        *pathEnd = '\0';
+    }
+    return true;
+}
+
+static const char* StatusReason(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 207: return "Multi-Status";
+    case 404: return "Not Found";
+    case 412: return "Precondition Failed";
+    case 422: return "Unprocessable Entity";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+// A change answered from the key table says so in a header; an item
+// comes with its version as the ETag (0 for none)
+static void Respond(int fd, int status, const char* body, bool replayed, unsigned int etag, bool keepAlive)
+{
+    char connection[64];
+    if (keepAlive) {
+        snprintf(connection, sizeof(connection), "Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n",
+                 kServeIdleSeconds);
+    } else {
+        snprintf(connection, sizeof(connection), "Connection: close\r\n");
+    }
+
+    char etagHeader[32] = "";
+    if (etag) {
+        snprintf(etagHeader, sizeof(etagHeader), "ETag: \"%u\"\r\n", etag);
+    }
+
+    char header[384];
+    int length = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %d %s\r\n"
+                          "Content-Type: application/json\r\n"
+                          "Content-Length: %u\r\n"
+                          "%s%s%s\r\n",
+                          status, StatusReason(status), (unsigned int)strlen(body),
+                          replayed ? "Idempotent-Replayed: true\r\n" : "", etagHeader, connection);
+
+    RequestResult ignored;
+    ignored.bytesSent = 0;
+    if (SendAll(fd, header, (size_t)length, &ignored)) {
+        SendAll(fd, body, strlen(body), &ignored);
+    }
+}
+
+// A result for each transaction ID in a sync request. Transactions
+// applied before are reported applied without applying them again, so a
+// batch sent twice has the effect of one. Returns the status and the
+// body, which the caller frees
+static int ApplySync(const char* body, ServeState* state, char** response)
+{
+    unsigned int count = 0;
+    for (const char* key = strstr(body, "\"transactionId\""); key; key = strstr(key + 1, "\"transactionId\"")) {
+        count++;
+    }
+
+    size_t size = 128 + count * 96;
+    *response = (char*)malloc(size);
+    if (!*response) {
+        return 500;
+    }
+
+    unsigned int failed = 0;
+    size_t used = (size_t)snprintf(*response, size, "{\"results\":[");
+    pthread_mutex_lock(&state->lock);
+    for (const char* key = strstr(body, "\"transactionId\""); key; key = strstr(key + 1, "\"transactionId\"")) {
+        const char* value = SkipSpace(key + 15);
+        value = SkipSpace(*value == ':' ? value + 1 : value);
+        if (*value == '"') {
+            value++;
+        }
+        int idLength = (int)strspn(value, "0123456789");
+        if (idLength > 20) {
+            idLength = 20;
+        }
+
+        // Failed ones are not recorded, so a retry may still apply them
+        JournalU64 id = strtoull(value, NULL, 10);
+        bool full = false;
+        bool success = true;
+        if (id == 0 || ServeFails(state)) {
+            success = false;
+        } else if (MarkApplied(state, id, &full)) {
+            state->counts.syncApplied++;
+        } else if (full) {
+            success = false;
+        } else {
+            state->counts.duplicates++;
+        }
+        if (!success) {
+            failed++;
+        }
+        used += (size_t)snprintf(*response + used, size - used, "%s{\"transactionId\":\"%.*s\",\"status\":\"%s\"%s}",
+                                 used > 12 ? "," : "", idLength, value, success ? "success" : "failed",
+                                 success ? "" : ",\"error\":\"Item not found\"");
+    }
+    state->operations += count;
+    pthread_mutex_unlock(&state->lock);
+    snprintf(*response + used, size - used, "],\"syncedCount\":%u,\"failedCount\":%u}", count - failed, failed);
+
+    // 207 Multi-Status when only some were applied
+    return (failed == 0) ? 200 : 207;
+}
+
+// Creates, moves and updates. With a key the first request is applied
+// and its status kept; a repeat gets that status back without effect,
+// and the key on another request is refused. An update with an If-Match
+// other than the item's version is refused with 412, and version gets
+// the item's version then; an update applied moves the version on
+static int ApplyChange(const char* method, const char* path, const char* body, const char* key,
+                       const char* ifMatch, ServeState* state, bool* replayed, unsigned int* version)
+{
+    bool create = (strcmp(method, "POST") == 0);
+    unsigned int crc = JournalFormat::Crc32((const unsigned char*)method, (unsigned int)strlen(method), 0);
+    crc = JournalFormat::Crc32((const unsigned char*)path, (unsigned int)strlen(path), crc);
+    crc = JournalFormat::Crc32((const unsigned char*)body, (unsigned int)strlen(body), crc);
+
+    pthread_mutex_lock(&state->lock);
+    state->operations++;
+    KeyEntry* entry = key ? FindKey(state, key) : NULL;
+    int status;
+    if (key && !entry) {
+        status = 503;
+    } else if (entry && entry->key[0] != '\0') {
+        if (entry->requestCrc != crc) {
+            state->counts.conflicts++;
+            status = 422;
+        } else {
+            state->counts.replayed++;
+            *replayed = true;
+            status = entry->status;
+        }
+    } else {
+        size_t pathLength = strlen(path);
+        bool move = (pathLength >= 9 && strcmp(path + pathLength - 9, "/location") == 0);
+        unsigned int* current = (!create && !move && strstr(path, "/items/")) ? FindVersion(state, path) : NULL;
+        if (current && ifMatch && strtoul(ifMatch, NULL, 10) != *current + 1) {
+            state->counts.stale++;
+            *version = *current + 1;
+            status = 412;
+        } else {
+            status = ServeFails(state) ? 404 : create ? 201 : 200;
+        }
+        if (status != 404 && status != 412) {
+            if (create) {
+                state->counts.creates++;
+            } else if (move) {
+                state->counts.moves++;
+            } else {
+                state->counts.updates++;
+                if (current) {
+                    (*current)++;
+                }
+            }
+        }
+        if (entry) {
+            snprintf(entry->key, sizeof(entry->key), "%s", key);
+            entry->requestCrc = crc;
+            entry->status = status;
+            state->keyCount++;
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return status;
+}
+
+static char* FormatCounts(ServeState* state)
+{
+    char* text = (char*)malloc(512);
+    if (!text) {
+        return NULL;
+    }
+    pthread_mutex_lock(&state->lock);
+    const ServeCounts& counts = state->counts;
+    snprintf(text, 512,
+             "{\"requests\":%lu,\"creates\":%lu,\"moves\":%lu,\"updates\":%lu,\"syncApplied\":%lu,"
+             "\"replayed\":%lu,\"duplicates\":%lu,\"conflicts\":%lu,\"stale\":%lu,\"dropped\":%lu,"
+             "\"connections\":%lu}",
+             state->requests, counts.creates, counts.moves, counts.updates, counts.syncApplied,
+             counts.replayed, counts.duplicates, counts.conflicts, counts.stale, counts.dropped,
+             counts.connections);
+    pthread_mutex_unlock(&state->lock);
+    return text;
+}
+
+// Reads and answers one request on the connection; false once it is to
+// be closed
+static bool ServeRequest(int fd, ServeState* state, char* buffer)
+{
+    char* method;
+    char* path;
+    char* body;
+    char* key;
+    char* ifMatch;
+    bool keepAlive;
+    if (!ReadRequest(fd, buffer, kRequestSizeLimit, &method, &path, &body, &key, &ifMatch, &keepAlive)) {
+        return false;
+    }
+
+    // The round trip a batch saves; concurrent requests wait side by side
+    if (state->latencyMs > 0) {
+        struct timespec delay;
+        delay.tv_sec = state->latencyMs / 1000;
+        delay.tv_nsec = (long)(state->latencyMs % 1000) * 1000000L;
+        nanosleep(&delay, NULL);
+    }
+
+    char item[256];
+    char* allocated = NULL;
+    const char* response = "{\"success\":true}";
+    int status = 404;
+    unsigned int version = 0;
+    bool replayed = false;
+    bool change = false;
+    size_t pathLength = strlen(path);
+    if (strcmp(method, "POST") == 0 && pathLength >= 5 && strcmp(path + pathLength - 5, "/sync") == 0) {
+        status = ApplySync(body, state, &allocated);
+        change = true;
+    } else if (strcmp(method, "GET") == 0 && pathLength >= 11 && strcmp(path + pathLength - 11, "/mock/stats") == 0) {
+        allocated = FormatCounts(state);
+        status = allocated ? 200 : 500;
+    } else if (strcmp(method, "POST") == 0 && pathLength >= 12 && strcmp(path + pathLength - 12, "/auth/device") == 0) {
+        response = "{\"token\":\"mock-device-token\"}";
+        status = 200;
+    } else if (strcmp(method, "GET") == 0 && strstr(path, "/items/")) {
+        pthread_mutex_lock(&state->lock);
+        state->operations++;
+        bool fails = ServeFails(state);
+        unsigned int current = *FindVersion(state, path) + 1;
+        pthread_mutex_unlock(&state->lock);
+        if (!fails) {
+            version = current;
+            FormatItem(path, version, item, sizeof(item));
+            response = item;
+            status = 200;
+        }
+    } else if (strcmp(method, "PUT") == 0 || strcmp(method, "POST") == 0) {
+        status = ApplyChange(method, path, body, key, ifMatch, state, &replayed, &version);
+        change = true;
+    }
+    if (allocated) {
+        response = allocated;
+    } else if (status == 412) {
+        // The current copy, for the device to merge its edit onto
+        FormatItem(path, version, item, sizeof(item));
+        response = item;
+    } else if (status == 404) {
+        response = "{\"error\":\"Item not found\"}";
+    } else if (status >= 400) {
+        response = "{\"error\":\"Request refused\"}";
+    }
+
+    // Applied, but the answer is lost on the way, as over a failing link
+    pthread_mutex_lock(&state->lock);
+    bool drop = change && RandomUnit() < state->dropRate;
+    if (drop) {
+        state->counts.dropped++;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    if (!drop) {
+        Respond(fd, status, response, replayed, version, keepAlive);
+    }
+    free(allocated);
+
+    pthread_mutex_lock(&state->lock);
+    unsigned long requests = ++state->requests;
+    unsigned long total = state->operations;
+    pthread_mutex_unlock(&state->lock);
+
+    if (requests % 1000 == 0) {
+        printf("%lu requests, %lu operations\n", requests, total);
+        fflush(stdout);
+    }
+    return keepAlive && !drop;
+}
+
+// Serves requests on the connection, one after another, until the client
+// closes it, asks to, or leaves it idle too long
+static void* ServeConnection(void* param)
+{
+    Connection* connection = (Connection*)param;
+    int fd = connection->fd;
+    ServeState* state = connection->state;
+    free(connection);
+
+    pthread_mutex_lock(&state->lock);
+    state->counts.connections++;
+    pthread_mutex_unlock(&state->lock);
+
+    struct timeval idle;
+    idle.tv_sec = kServeIdleSeconds;
+    idle.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+    char* buffer = (char*)malloc(kRequestSizeLimit);
+    while (buffer && ServeRequest(fd, state, buffer)) {
+    }
+    close(fd);
+    free(buffer);
+    return NULL;
+}
+
+static int Serve(int argc, char* argv[])
+{
+    if (argc < 1) {
+        fprintf(stderr, "usage: journal_replay serve <port> [options]\n");
+        return 1;
+    }
+
+    int port = atoi(argv[0]);
+    ServeState state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = (i + 1 < argc);
+        if (strcmp(argv[i], "-l") == 0 && hasValue) {
+            state.latencyMs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && hasValue) {
+            state.failRate = atof(argv[++i]) / 100.0;
+        } else if (strcmp(argv[i], "-d") == 0 && hasValue) {
+            state.dropRate = atof(argv[++i]) / 100.0;
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    state.keys = (KeyEntry*)calloc(kKeyTableSize, sizeof(KeyEntry));
+    state.applied = (JournalU64*)calloc(kAppliedTableSize, sizeof(JournalU64));
+    state.versions = (unsigned int*)calloc(kVersionTableSize, sizeof(unsigned int));
+    if (!state.keys || !state.applied || !state.versions) {
+        fprintf(stderr, "out of memory\n");
+        free(state.keys);
+        free(state.applied);
+        free(state.versions);
+        return 1;
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Loopback only; this is a test double, not a server
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        fprintf(stderr, "cannot listen on port %d\n", port);
+        if (listener >= 0) {
+            close(listener);
+        }
+        free(state.keys);
+        free(state.applied);
+        free(state.versions);
+        return 1;
+    }
+
+    printf("serving on 127.0.0.1:%d, %d ms per request, %.0f%% failing, %.0f%% of changes unanswered\n",
+           port, state.latencyMs, state.failRate * 100.0, state.dropRate * 100.0);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        Connection* connection = (Connection*)malloc(sizeof(Connection));
+        pthread_t thread;
+        if (!connection) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->state = &state;
+        if (pthread_create(&thread, NULL, ServeConnection, connection) != 0) {
+            close(fd);
+            free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Retry storm
+
+static const unsigned int kStormBatchSize = 5;          // Transactions per sync request
+static const unsigned int kStormAttemptLimit = 50;      // Per copy, while unanswered
+
+// A change sent several times side by side, each copy retried until it
+// is answered, as a device would after lost responses
+struct StormOperation {
+    const char* method;
+    char path[128];
+    char body[1024];
+    char key[96];               // Empty for a sync request; its transaction IDs are its keys
+    JournalU64 firstId;         // Sync: kStormBatchSize transaction IDs from here
+    SyncBatch* batch;           // Sync: the request as the device builds it, to read answers into
+    int status;                 // First answer, 0 until there is one
+    bool consistent;            // Every copy got the same answer
+    bool applied[kStormBatchSize];  // Sync: reported applied to some copy
+};
+
+struct StormState {
+    const Endpoint* endpoint;
+    const char* token;
+    int timeoutSeconds;
+    StormOperation* operations;
+    unsigned int count;
+    unsigned int copies;
+    pthread_mutex_t lock;       // Guards everything below and the operations
+    unsigned int next;          // Copy to send next; the copies of an operation are adjacent
+    unsigned long requests;
+    unsigned long retries;
+    unsigned long unanswered;
+};
+
+static void* StormThread(void* param)
+{
+    StormState* state = (StormState*)param;
+    char response[4096];
+    TCHAR wideResponse[4096];
+
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        unsigned int job = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (job >= state->count * state->copies) {
+            break;
+        }
+
+        StormOperation& operation = state->operations[job / state->copies];
+        RequestResult result;
+        bool answered = false;
+        for (unsigned int attempt = 0; attempt < kStormAttemptLimit; attempt++) {
+            answered = SendRequest(*state->endpoint, NULL, operation.method, operation.path, operation.body, state->token,
+                                   operation.key[0] ? operation.key : NULL, NULL, state->timeoutSeconds, &result,
+                                   response, sizeof(response));
+            bool settled = answered && result.status < 500;
+
+            pthread_mutex_lock(&state->lock);
+            state->requests++;
+            if (!settled) {
+                state->retries++;
+            }
+            pthread_mutex_unlock(&state->lock);
+            if (settled) {
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&state->lock);
+        if (!answered || result.status >= 500) {
+            state->unanswered++;
+        } else {
+            if (operation.status == 0) {
+                operation.status = result.status;
+            } else if (operation.status != result.status && operation.key[0]) {
+                operation.consistent = false;
+            }
+            if (!operation.key[0] && result.status >= 200 && result.status < 300) {
+                MultiByteToWideChar(CP_UTF8, 0, response, -1, wideResponse, 4096);
+                operation.batch->ParseResponse(wideResponse);
+                for (int t = 0; t < operation.batch->GetCount(); t++) {
+                    if (operation.batch->Succeeded(t)) {
+                        operation.applied[operation.batch->GetTag(t)] = true;
+                    }
+                }
+            }
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return NULL;
+}
+
+static bool FetchCounts(const Endpoint& endpoint, const char* token, int timeoutSeconds, char* counts, unsigned int size)
+{
+    RequestResult result;
+    return SendRequest(endpoint, NULL, "GET", "/api/v1/mock/stats", "", token, NULL, NULL, timeoutSeconds, &result, counts, size) &&
+           result.status == 200;
+}
+
+static void FreeStorm(StormOperation* operations, unsigned int count, TransactionCoalescer* windows)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        delete operations[i].batch;
+    }
+    free(operations);
+    delete[] windows;
+}
+
+static unsigned long CountValue(const char* counts, const char* name)
+{
+    char member[64];
+    snprintf(member, sizeof(member), "\"%s\":", name);
+    const char* value = strstr(counts, member);
+    return value ? strtoul(value + strlen(member), NULL, 10) : 0;
+}
+
+static int Storm(int argc, char* argv[])
+{
+    if (argc < 1) {
+        fprintf(stderr, "usage: journal_replay storm <server url> [options]\n");
+        return 1;
+    }
+
+    unsigned int count = 300;
+    unsigned int copies = 4;
+    unsigned int threadCount = 8;
+    const char* token = NULL;
+    int timeoutSeconds = 10;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = (i + 1 < argc);
+        if (strcmp(argv[i], "-n") == 0 && hasValue) {
+            count = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-c") == 0 && hasValue) {
+            copies = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-p") == 0 && hasValue) {
+            threadCount = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-t") == 0 && hasValue) {
+            token = argv[++i];
+        } else if (strcmp(argv[i], "-w") == 0 && hasValue) {
+            timeoutSeconds = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    if (copies < 1) {
+        copies = 1;
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    } else if (threadCount > 64) {
+        threadCount = 64;
+    }
+
+    Endpoint endpoint;
+    if (!ParseUrl(argv[0], &endpoint)) {
+        return 1;
+    }
+
+    char before[1024];
+    if (!FetchCounts(endpoint, token, timeoutSeconds, before, sizeof(before))) {
+        fprintf(stderr, "no counts from the server; storm needs journal_replay serve\n");
+        freeaddrinfo(endpoint.address);
+        return 1;
+    }
+
+    StormOperation* operations = (StormOperation*)calloc(count, sizeof(StormOperation));
+    if (!operations) {
+        fprintf(stderr, "out of memory\n");
+        freeaddrinfo(endpoint.address);
+        return 1;
+    }
+
+    // Keys, barcodes and transaction IDs of their own, so runs against
+    // the same server do not meet
+    JournalU64 run = ((JournalU64)time(NULL) % 1000000000ULL) * 100000ULL + (JournalU64)(getpid() % 100000);
+    unsigned int createCount = 0;
+    unsigned int moveCount = 0;
+    unsigned int syncCount = 0;
+
+    // Sync requests are built from scans the way the device builds them,
+    // in coalescer windows that stay open while their batches are in use
+    const unsigned int syncPerWindow = TransactionCoalescer::WINDOW_SIZE / kStormBatchSize;
+    TransactionCoalescer* windows = new TransactionCoalescer[count / 3 / syncPerWindow + 1];
+    JournalU64 scanTime = JournalFormat::MakeTimestamp(2024, 1, 1, 0, 0, 0, 0);
+    for (unsigned int i = 0; i < count; i++) {
+        StormOperation& operation = operations[i];
+        operation.consistent = true;
+        if (i % 3 == 0) {
+            operation.method = "POST";
+            snprintf(operation.path, sizeof(operation.path), "/api/v1/items");
+            snprintf(operation.body, sizeof(operation.body),
+                     "{\"barcode\":\"STORM%llu-%u\",\"name\":\"Storm item\",\"quantity\":1}",
+                     (unsigned long long)run, i);
+            snprintf(operation.key, sizeof(operation.key), "journal_replay-storm-%llu-%u", (unsigned long long)run, i);
+            createCount++;
+        } else if (i % 3 == 1) {
+            operation.method = "PUT";
+            snprintf(operation.path, sizeof(operation.path), "/api/v1/items/STORM%llu-%u/location",
+                     (unsigned long long)run, i - 1);
+            snprintf(operation.body, sizeof(operation.body), "{\"locationId\":\"LOC-%u\"}", i % 7);
+            snprintf(operation.key, sizeof(operation.key), "journal_replay-storm-%llu-%u", (unsigned long long)run, i);
+            moveCount++;
+        } else {
+            operation.method = "POST";
+            snprintf(operation.path, sizeof(operation.path), "/api/v1/sync");
+            operation.firstId = run * 100000ULL + (JournalU64)i * kStormBatchSize + 1;
+            operation.batch = new SyncBatch();
+
+            // A barcode each, as a batch takes one operation per item
+            TransactionCoalescer& window = windows[syncCount / syncPerWindow];
+            for (unsigned int t = 0; t < kStormBatchSize; t++) {
+                TCHAR scan[96];
+                swprintf(scan, 96, TEXT("[0] ITEM_SCAN: SCAN:STORM%llu-%u-%u"), (unsigned long long)run, i, t);
+                window.Add(operation.firstId + t, scanTime, JournalFormat::OP_ITEM_SCAN, scan);
+                operation.batch->Add((int)t, window.GetOperation(window.GetOperationCount() - 1),
+                                     operation.firstId + t);
+            }
+
+            TCHAR* request = operation.batch->BuildRequest(kDeviceId);
+            char* body = ToUtf8(request);
+            snprintf(operation.body, sizeof(operation.body), "%s", body ? body : "");
+            free(body);
+            delete[] request;
+            syncCount++;
+        }
+    }
+
+    StormState state;
+    memset(&state, 0, sizeof(state));
+    state.endpoint = &endpoint;
+    state.token = token;
+    state.timeoutSeconds = timeoutSeconds;
+    state.operations = operations;
+    state.count = count;
+    state.copies = copies;
+    pthread_mutex_init(&state.lock, NULL);
+
+    double start = Now();
+    pthread_t threads[64];
+    bool started[64];
+    for (unsigned int t = 1; t < threadCount; t++) {
+        started[t] = (pthread_create(&threads[t], NULL, StormThread, &state) == 0);
+    }
+    StormThread(&state);
+    for (unsigned int t = 1; t < threadCount; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    double elapsed = Now() - start;
+
+    char after[1024];
+    if (!FetchCounts(endpoint, token, timeoutSeconds, after, sizeof(after))) {
+        fprintf(stderr, "no counts from the server after the storm\n");
+        FreeStorm(operations, count, windows);
+        freeaddrinfo(endpoint.address);
+        return 1;
+    }
+
+    // Each change the server confirmed must have taken effect once, and
+    // every copy of it must have been told the same
+    unsigned long expectedCreates = 0;
+    unsigned long expectedMoves = 0;
+    unsigned long expectedSync = 0;
+    unsigned long inconsistent = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        const StormOperation& operation = operations[i];
+        if (!operation.consistent) {
+            inconsistent++;
+        }
+        if (!operation.key[0]) {
+            for (unsigned int t = 0; t < kStormBatchSize; t++) {
+                expectedSync += operation.applied[t] ? 1 : 0;
+            }
+        } else if (operation.status == 201) {
+            expectedCreates++;
+        } else if (operation.status == 200) {
+            expectedMoves++;
+        }
+    }
+
+    unsigned long creates = CountValue(after, "creates") - CountValue(before, "creates");
+    unsigned long moves = CountValue(after, "moves") - CountValue(before, "moves");
+    unsigned long syncApplied = CountValue(after, "syncApplied") - CountValue(before, "syncApplied");
+    unsigned long conflicts = CountValue(after, "conflicts") - CountValue(before, "conflicts");
+
+    printf("storm          %u operations (%u creates, %u moves, %u sync requests of %u), %u copies each, "
+           "%u threads\n", count, createCount, moveCount, syncCount, kStormBatchSize, copies, threadCount);
+    printf("requests       %lu in %.3f s, %lu without an answer and retried, %lu never answered\n",
+           state.requests, elapsed, state.retries, state.unanswered);
+    printf("server         %lu creates, %lu moves, %lu sync transactions applied; %lu replayed, "
+           "%lu duplicates skipped, %lu conflicts, %lu dropped\n", creates, moves, syncApplied,
+           CountValue(after, "replayed") - CountValue(before, "replayed"),
+           CountValue(after, "duplicates") - CountValue(before, "duplicates"), conflicts,
+           CountValue(after, "dropped") - CountValue(before, "dropped"));
+    printf("confirmed      %lu creates, %lu moves, %lu sync transactions\n",
+           expectedCreates, expectedMoves, expectedSync);
+
+    bool pass = (creates == expectedCreates && moves == expectedMoves && syncApplied == expectedSync &&
+                 conflicts == 0 && inconsistent == 0 && state.unanswered == 0);
+    if (pass) {
+        printf("PASS           every change took effect exactly once\n");
+    } else {
+        printf("FAIL           %lu conflicts, %lu operations answered inconsistently, %lu never answered\n",
+               conflicts, inconsistent, state.unanswered);
+    }
+
+    pthread_mutex_destroy(&state.lock);
+    FreeStorm(operations, count, windows);
+    freeaddrinfo(endpoint.address);
+    return pass ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "replay") == 0) {
+        return Replay(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "synth") == 0) {
+        return Synthesize(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+        return Serve(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "storm") == 0) {
+        return Storm(argc - 2, argv + 2);
+    }
+
+    fprintf(stderr, "usage: %s replay <journal path> <server url> [options]\n"
+                    "       %s synth <journal path> [options]\n"
+                    "       %s serve <port> [options]\n"
+                    "       %s storm <server url> [options]\n", argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}